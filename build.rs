@@ -14,6 +14,7 @@ fn main() {
     println!("cargo:rustc-link-lib=udev");
     println!("cargo:rustc-link-lib=keyutils");
     println!("cargo:rustc-link-lib=aio");
+    println!("cargo:rustc-link-lib=rt");
 
     if std::env::var("BCACHEFS_FUSE").is_ok() {
         println!("cargo:rustc-link-lib=fuse3");
@@ -54,6 +54,7 @@ void bcachefs_usage(void)
 	     "Commands for managing a running filesystem:\n"
 	     "  fs usage                 Show disk usage\n"
 	     "  fs top                   Show runtime performance information\n"
+	     "  sysfs                    Show sysfs attributes of a userspace filesystem\n"
 	     "\n"
 	     "Commands for managing devices within a running filesystem:\n"
 	     "  device add               Add a new device to an existing filesystem\n"
@@ -92,6 +93,12 @@ void bcachefs_usage(void)
 	     "  dump                     Dump filesystem metadata to a qcow2 image\n"
 	     "  list                     List filesystem metadata in textual form\n"
 	     "  list_journal             List contents of journal\n"
+	     "  trace                    Read tracepoints from a userspace bcachefs process\n"
+	     "\n"
+	     "Benchmarks:\n"
+	     "  bench checksum           Checksum implementation throughput\n"
+	     "  bench raid               Erasure coding implementation throughput\n"
+	     "  bench btree              Btree and transaction throughput and latency\n"
 	     "\n"
 	     "FUSE:\n"
 	     "  fusemount                Mount a filesystem via FUSE\n"
@@ -169,3 +176,19 @@ int data_cmds(int argc, char *argv[])
 
 	return 0;
 }
+
+int bench_cmds(int argc, char *argv[])
+{
+	char *cmd = pop_cmd(&argc, argv);
+
+	if (argc < 1)
+		return bench_usage();
+	if (!strcmp(cmd, "checksum"))
+		return cmd_bench_checksum(argc, argv);
+	if (!strcmp(cmd, "raid"))
+		return cmd_bench_raid(argc, argv);
+	if (!strcmp(cmd, "btree"))
+		return cmd_bench_btree(argc, argv);
+
+	return 0;
+}
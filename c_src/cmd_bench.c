@@ -0,0 +1,466 @@
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <linux/crc64.h>
+#include <linux/jiffies.h>
+#include <linux/random.h>
+
+#include <raid/raid.h>
+#include <raid/memory.h>
+#include <raid/test.h>
+
+#include "cmds.h"
+#include "libbcachefs.h"
+
+#include "libbcachefs/bcachefs.h"
+#include "libbcachefs/errcode.h"
+#include "libbcachefs/super.h"
+#include "libbcachefs/tests.h"
+
+int bench_usage(void)
+{
+	puts("bcachefs bench - micro-benchmarks\n"
+	     "Usage: bcachefs bench <CMD> [OPTIONS]\n"
+	     "\n"
+	     "Commands:\n"
+	     "  checksum                        Checksum implementation throughput\n"
+	     "  raid                            Erasure coding implementation throughput\n"
+	     "  btree                           Btree and transaction throughput and latency\n"
+	     "\n"
+	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
+	return 0;
+}
+
+static void bench_checksum_usage(void)
+{
+	puts("bcachefs bench checksum - checksum implementation throughput\n"
+	     "Usage: bcachefs bench checksum [OPTION]...\n"
+	     "\n"
+	     "Verifies every checksum implementation this CPU supports against the\n"
+	     "generic one, then reports throughput at a range of buffer sizes\n"
+	     "\n"
+	     "Options:\n"
+	     "  -t, --time=ms                   Time to run each test for, default 200\n"
+	     "  -h, --help                      Display this help and exit\n"
+	     "\n"
+	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
+}
+
+static const size_t bench_checksum_sizes[] = {
+	64, 512, 4096, 64 << 10, 1 << 20,
+};
+
+struct bench_csum {
+	char		*name;
+	u64		(*crc64)(u64, const void *, size_t);
+	u32		(*crc32c)(u32, const void *, size_t);
+};
+
+static inline u64 bench_csum(const struct bench_csum *c, u64 seed,
+			     const void *p, size_t len)
+{
+	return c->crc64
+		? c->crc64(seed, p, len)
+		: c->crc32c(seed, p, len);
+}
+
+static void bench_checksum_verify(const struct bench_csum *c,
+				  const struct bench_csum *ref,
+				  const u8 *buf, size_t buf_size)
+{
+	for (unsigned i = 0; i < 2048; i++) {
+		size_t offset	= i % 64;
+		size_t len	= i < 1024 ? i : get_random_u32_below(i % 64
+						? 64 << 10
+						: buf_size - offset);
+		u64 seed	= (u64) get_random_u32() << 32 | get_random_u32();
+
+		if (bench_csum(c, seed, buf + offset, len) !=
+		    bench_csum(ref, seed, buf + offset, len))
+			die("%s: mismatch with generic implementation, len %zu offset %zu",
+			    c->name, len, offset);
+	}
+}
+
+/* Results are accumulated here so the compiler can't drop the work: */
+static u64 bench_checksum_sink;
+
+static void bench_checksum_run(const struct bench_csum *c,
+			       const u8 *buf, u64 time_ns)
+{
+	printf("%-20s", c->name);
+
+	for (unsigned i = 0; i < ARRAY_SIZE(bench_checksum_sizes); i++) {
+		size_t size = bench_checksum_sizes[i];
+		u64 start = ktime_get_ns(), elapsed, bytes = 0, crc = 0;
+
+		do {
+			for (unsigned j = 0; j < 64; j++)
+				crc = bench_csum(c, crc, buf, size);
+			bytes += size * 64;
+			elapsed = ktime_get_ns() - start;
+		} while (elapsed < time_ns);
+
+		bench_checksum_sink ^= crc;
+		printf("%10llu", div64_u64((bytes >> 10) * NSEC_PER_SEC, elapsed) >> 10);
+	}
+
+	printf("\n");
+}
+
+static void bench_checksum_one(const struct bench_csum *c,
+			       const struct bench_csum *ref,
+			       const u8 *buf, size_t buf_size, u64 time_ns)
+{
+	bench_checksum_verify(c, ref, buf, buf_size);
+	bench_checksum_run(c, buf, time_ns);
+	free(c->name);
+}
+
+int cmd_bench_checksum(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{ "time",		required_argument,	NULL, 't' },
+		{ "help",		no_argument,		NULL, 'h' },
+		{ NULL }
+	};
+	u64 time_ms = 200;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "t:h", longopts, NULL)) != -1)
+		switch (opt) {
+		case 't':
+			if (kstrtoull(optarg, 10, &time_ms))
+				die("invalid time %s", optarg);
+			break;
+		case 'h':
+			bench_checksum_usage();
+			exit(EXIT_SUCCESS);
+		}
+
+	size_t buf_size = bench_checksum_sizes[ARRAY_SIZE(bench_checksum_sizes) - 1] + 64;
+	u8 *buf = xmalloc(buf_size);
+	get_random_bytes(buf, buf_size);
+
+	printf("%-20s", "MiB/sec");
+	for (unsigned i = 0; i < ARRAY_SIZE(bench_checksum_sizes); i++)
+		printf("%10zu", bench_checksum_sizes[i]);
+	printf("\n");
+
+	u64 time_ns = time_ms * NSEC_PER_MSEC;
+
+	struct bench_csum crc32c_ref = { .crc32c = crc32c_impls[0].fn };
+	for (const struct crc32c_impl *i = crc32c_impls; i->name; i++)
+		if (crc32c_impl_supported(i))
+			bench_checksum_one(&(struct bench_csum) {
+					   .name	= mprintf("crc32c/%s", i->name),
+					   .crc32c	= i->fn,
+					   }, &crc32c_ref, buf, buf_size, time_ns);
+
+	struct bench_csum crc64_ref = { .crc64 = crc64_be_impls[0].fn };
+	for (const struct crc64_impl *i = crc64_be_impls; i->name; i++)
+		if (crc64_be_impl_supported(i))
+			bench_checksum_one(&(struct bench_csum) {
+					   .name	= mprintf("crc64/%s", i->name),
+					   .crc64	= i->fn,
+					   }, &crc64_ref, buf, buf_size, time_ns);
+
+	free(buf);
+	return 0;
+}
+
+static void bench_raid_usage(void)
+{
+	puts("bcachefs bench raid - erasure coding implementation throughput\n"
+	     "Usage: bcachefs bench raid [OPTION]...\n"
+	     "\n"
+	     "Verifies every parity generation and recovery implementation this CPU\n"
+	     "supports against the reference one, then reports throughput of the ones\n"
+	     "in use at a range of stripe block sizes\n"
+	     "\n"
+	     "Options:\n"
+	     "  -d, --data=nr                   Number of data blocks, default 8\n"
+	     "  -t, --time=ms                   Time to run each test for, default 200\n"
+	     "  -h, --help                      Display this help and exit\n"
+	     "\n"
+	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
+}
+
+static const size_t bench_raid_sizes[] = {
+	4096, 64 << 10, 256 << 10, 1 << 20,
+};
+
+static const char *bench_raid_gen_tag(unsigned np)
+{
+	switch (np) {
+	case 1:		return raid_gen1_tag();
+	case 2:		return raid_gen2_tag();
+	case 3:		return raid_gen3_tag();
+	case 4:		return raid_gen4_tag();
+	case 5:		return raid_gen5_tag();
+	default:	return raid_gen6_tag();
+	}
+}
+
+static const char *bench_raid_rec_tag(unsigned nr)
+{
+	switch (nr) {
+	case 1:		return raid_rec1_tag();
+	case 2:		return raid_rec2_tag();
+	default:	return raid_recX_tag();
+	}
+}
+
+/*
+ * Throughput is of the data blocks, as with checksums: stripe creation reads
+ * nd blocks, and reconstruct reads nd - nr blocks plus nr parity blocks
+ */
+static void bench_raid_run(unsigned nd, unsigned np, unsigned nr, u64 time_ns)
+{
+	int id[RAID_PARITY_MAX], ip[RAID_PARITY_MAX];
+
+	for (unsigned i = 0; i < nr; i++) {
+		id[i] = i;
+		ip[i] = i;
+	}
+
+	printf("%s%u/%-15s", nr ? "rec" : "gen", nr ?: np,
+	       nr ? bench_raid_rec_tag(nr) : bench_raid_gen_tag(np));
+
+	for (unsigned i = 0; i < ARRAY_SIZE(bench_raid_sizes); i++) {
+		size_t size = bench_raid_sizes[i];
+		void *v_alloc;
+		void **v = raid_malloc_vector(nd, nd + np, size, &v_alloc);
+		if (!v)
+			die("error allocating buffers");
+
+		raid_mrand_vector(i, nd + np, size, v);
+		raid_gen(nd, np, size, v);
+
+		u64 start = ktime_get_ns(), elapsed, bytes = 0;
+
+		do {
+			for (unsigned j = 0; j < 16; j++)
+				if (nr)
+					raid_data(nr, id, ip, nd, size, v);
+				else
+					raid_gen(nd, np, size, v);
+			bytes += size * nd * 16;
+			elapsed = ktime_get_ns() - start;
+		} while (elapsed < time_ns);
+
+		printf("%10llu", div64_u64((bytes >> 10) * NSEC_PER_SEC, elapsed) >> 10);
+
+		free(v_alloc);
+		free(v);
+	}
+
+	printf("\n");
+}
+
+int cmd_bench_raid(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{ "data",		required_argument,	NULL, 'd' },
+		{ "time",		required_argument,	NULL, 't' },
+		{ "help",		no_argument,		NULL, 'h' },
+		{ NULL }
+	};
+	unsigned nd = 8;
+	u64 time_ms = 200;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "d:t:h", longopts, NULL)) != -1)
+		switch (opt) {
+		case 'd':
+			if (kstrtouint(optarg, 10, &nd) ||
+			    nd < 1 || nd > RAID_DATA_MAX)
+				die("invalid number of data blocks %s", optarg);
+			break;
+		case 't':
+			if (kstrtoull(optarg, 10, &time_ms))
+				die("invalid time %s", optarg);
+			break;
+		case 'h':
+			bench_raid_usage();
+			exit(EXIT_SUCCESS);
+		}
+
+	/*
+	 * These check every implementation the CPU supports, not just the
+	 * ones in use; recovery is checked with every combination of failed
+	 * blocks, so keep it to a small stripe:
+	 */
+	if (raid_selftest() ||
+	    raid_test_par(RAID_MODE_CAUCHY, nd, 4096) ||
+	    raid_test_rec(RAID_MODE_CAUCHY, 8, 256))
+		die("erasure coding self test failed");
+
+	printf("%-20s", "MiB/sec");
+	for (unsigned i = 0; i < ARRAY_SIZE(bench_raid_sizes); i++)
+		printf("%10zu", bench_raid_sizes[i]);
+	printf("\n");
+
+	u64 time_ns = time_ms * NSEC_PER_MSEC;
+
+	for (unsigned np = 1; np <= RAID_PARITY_MAX; np++)
+		bench_raid_run(nd, np, 0, time_ns);
+	for (unsigned nr = 1; nr <= min(nd, RAID_PARITY_MAX); nr++)
+		bench_raid_run(nd, RAID_PARITY_MAX, nr, time_ns);
+
+	return 0;
+}
+
+static void bench_btree_usage(void)
+{
+	puts("bcachefs bench btree - btree and transaction throughput and latency\n"
+	     "Usage: bcachefs bench btree [OPTION]... [TEST]...\n"
+	     "\n"
+	     "Formats a scratch filesystem in a sparse file, runs each test on it in\n"
+	     "order and reports its throughput and the latency of each operation\n"
+	     "\n"
+	     "Tests:\n"
+	     "  rand_insert rand_insert_multi rand_lookup rand_mixed rand_delete\n"
+	     "  seq_insert seq_lookup seq_overwrite seq_delete\n"
+	     "The default is all of them, in that order; the unit tests from\n"
+	     "libbcachefs/tests.c may also be given\n"
+	     "\n"
+	     "Options:\n"
+	     "  -n, --nr=nr                     Number of operations per test, default 1M\n"
+	     "  -j, --threads=nr                Number of threads, default 1\n"
+	     "  -d, --dir=path                  Directory for the scratch file, default $TMPDIR\n"
+	     "  -s, --size=size                 Size of the scratch filesystem, default 16G\n"
+	     "  -h, --help                      Display this help and exit\n"
+	     "\n"
+	     "Format options may also be given, as with bcachefs format\n"
+	     "\n"
+	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
+}
+
+static const char * const bench_btree_tests[] = {
+	"rand_insert",
+	"rand_insert_multi",
+	"rand_lookup",
+	"rand_mixed",
+	"rand_delete",
+	"seq_insert",
+	"seq_lookup",
+	"seq_overwrite",
+	"seq_delete",
+};
+
+static void bench_btree_run(struct bch_fs *c, const char *test,
+			    u64 nr, unsigned nr_threads)
+{
+	struct bch2_time_stats_quantiles stats;
+	bch2_time_stats_quantiles_init(&stats);
+
+	int ret = bch2_btree_perf_test(c, test, nr, nr_threads, &stats.stats);
+	if (ret)
+		die("%s: %s", test, bch2_err_str(ret));
+
+	if (stats.stats.duration_stats.n) {
+		struct printbuf buf = PRINTBUF;
+
+		printbuf_indent_add(&buf, 2);
+		bch2_time_stats_to_text(&buf, &stats.stats);
+		printbuf_indent_sub(&buf, 2);
+		printf("%s\n", buf.buf);
+		printbuf_exit(&buf);
+	}
+
+	bch2_time_stats_quantiles_exit(&stats);
+}
+
+int cmd_bench_btree(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{ "nr",			required_argument,	NULL, 'n' },
+		{ "threads",		required_argument,	NULL, 'j' },
+		{ "dir",		required_argument,	NULL, 'd' },
+		{ "size",		required_argument,	NULL, 's' },
+		{ "help",		no_argument,		NULL, 'h' },
+		{ NULL }
+	};
+	u64 nr = 1 << 20, size = 16ULL << 30;
+	unsigned nr_threads = 1;
+	const char *dir = getenv("TMPDIR") ?: "/tmp";
+	int opt;
+
+	struct bch_opt_strs fs_opt_strs =
+		bch2_cmdline_opts_get(&argc, argv, OPT_FORMAT);
+	struct bch_opts fs_opts = bch2_parse_opts(fs_opt_strs);
+
+	while ((opt = getopt_long(argc, argv, "n:j:d:s:h", longopts, NULL)) != -1)
+		switch (opt) {
+		case 'n':
+			if (bch2_strtoull_h(optarg, &nr) || !nr)
+				die("invalid number of operations %s", optarg);
+			break;
+		case 'j':
+			if (kstrtouint(optarg, 10, &nr_threads) || !nr_threads)
+				die("invalid number of threads %s", optarg);
+			break;
+		case 'd':
+			dir = optarg;
+			break;
+		case 's':
+			if (bch2_strtoull_h(optarg, &size))
+				die("invalid size %s", optarg);
+			break;
+		case 'h':
+			bench_btree_usage();
+			exit(EXIT_SUCCESS);
+		default:
+			bench_btree_usage();
+			exit(EXIT_FAILURE);
+		}
+	args_shift(optind);
+
+	char *path = mprintf("%s/bcachefs-bench-XXXXXX", dir);
+	int fd = mkstemp(path);
+	if (fd < 0)
+		die("error creating scratch file in %s: %m", dir);
+
+	/*
+	 * die() doesn't run atexit handlers: unlink the scratch file now, and
+	 * keep it around with an open fd for as long as we need it:
+	 */
+	unlink(path);
+	free(path);
+	path = mprintf("/proc/self/fd/%d", fd);
+
+	if (ftruncate(fd, size))
+		die("error sizing scratch file: %m");
+
+	struct dev_opts dev = dev_opts_default();
+
+	dev.path = path;
+	dev.file = bdev_file_open_by_path(dev.path, BLK_OPEN_READ|BLK_OPEN_WRITE, &dev, NULL);
+	int ret = PTR_ERR_OR_ZERO(dev.file);
+	if (ret < 0)
+		die("error opening %s: %s", dev.path, strerror(-ret));
+	dev.bdev = file_bdev(dev.file);
+
+	free(bch2_format(fs_opt_strs, fs_opts, format_opts_default(), &dev, 1));
+	bch2_opt_strs_free(&fs_opt_strs);
+
+	struct bch_fs *c = bch2_fs_open(&path, 1, bch2_opts_empty());
+	if (IS_ERR(c))
+		die("error opening %s: %s", path, bch2_err_str(PTR_ERR(c)));
+
+	if (argc)
+		for (unsigned i = 0; i < argc; i++)
+			bench_btree_run(c, argv[i], nr, nr_threads);
+	else
+		for (unsigned i = 0; i < ARRAY_SIZE(bench_btree_tests); i++)
+			bench_btree_run(c, bench_btree_tests[i], nr, nr_threads);
+
+	bch2_fs_stop(c);
+	close(fd);
+	free(path);
+	return 0;
+}
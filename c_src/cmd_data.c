@@ -2,10 +2,16 @@
 #include <getopt.h>
 #include <stdio.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#include <linux/kthread.h>
 
 #include "libbcachefs/bcachefs_ioctl.h"
 #include "libbcachefs/btree_cache.h"
+#include "libbcachefs/buckets.h"
+#include "libbcachefs/errcode.h"
 #include "libbcachefs/move.h"
+#include "libbcachefs/super.h"
 
 #include "cmds.h"
 #include "libbcachefs.h"
@@ -67,87 +73,134 @@ int cmd_data_rereplicate(int argc, char *argv[])
 static void data_scrub_usage(void)
 {
 	puts("bcachefs data scrub\n"
-	     "Usage: bcachefs data scrub [filesystem|device]\n"
+	     "Usage: bcachefs data scrub [filesystem|device]...\n"
 	     "\n"
 	     "Check data for errors, fix from another replica if possible\n"
 	     "\n"
+	     "Given a mounted filesystem, or one of its devices, the scrub is done by the\n"
+	     "kernel. Given the device(s) of an unmounted filesystem, it is opened here\n"
+	     "and every device is scrubbed in parallel; extents read with errors are\n"
+	     "listed (as inode:offset) when it's done\n"
+	     "\n"
 	     "Options:\n"
 	     "  -m, --metadata              check metadata only\n"
+	     "  -o, --options=opts          mount options, for unmounted filesystems\n"
 	     "  -h, --help                  display this help and exit\n"
 	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
 	exit(EXIT_SUCCESS);
 }
 
-int cmd_data_scrub(int argc, char *argv[])
+struct scrub_error {
+	struct bpos		pos;
+	u64			sectors;
+	bool			corrected;
+};
+
+/* Scrub of an unmounted filesystem, one thread per device: */
+struct scrub_offline {
+	struct bch_fs		*c;
+	struct bch_ioctl_data	arg;
+	struct bch_move_stats	stats;
+	struct task_struct	*thread;
+	int			ret;
+
+	struct mutex		errors_lock;
+	DARRAY(struct scrub_error) errors;
+};
+
+struct scrub_device {
+	const char	*name;
+	int		progress_fd;
+	struct scrub_offline *offline;
+	bool		running;
+	u64		done, corrected, uncorrected, total;
+	u64		start, end;
+	enum bch_ioctl_data_event_ret	ret;
+};
+
+typedef DARRAY(struct scrub_device) scrub_devices;
+
+static void scrub_offline_read_error(struct bch_move_stats *stats, struct bkey_s_c k,
+				     int dev, u64 sectors, bool corrected)
 {
-	static const struct option longopts[] = {
-		{ "metadata",		no_argument,		NULL, 'm' },
-		{ "help",		no_argument,		NULL, 'h' },
-		{ NULL }
+	struct scrub_offline *s = container_of(stats, struct scrub_offline, stats);
+	struct scrub_error e = {
+		.pos		= bkey_start_pos(k.k),
+		.sectors	= sectors,
+		.corrected	= corrected,
 	};
-	struct bch_ioctl_data cmd = {
-		.op			= BCH_DATA_OP_scrub,
-		.scrub.data_types	= ~0,
-	};
-	int opt;
 
-	while ((opt = getopt_long(argc, argv, "hm", longopts, NULL)) != -1)
-		switch (opt) {
-		case 'm':
-			cmd.scrub.data_types = BIT(BCH_DATA_btree);
-			break;
-		case 'h':
-			data_scrub_usage();
-			break;
-		}
-	args_shift(optind);
+	mutex_lock(&s->errors_lock);
+	darray_push(&s->errors, e);
+	mutex_unlock(&s->errors_lock);
+}
 
-	char *path = arg_pop();
-	if (!path)
-		die("Please supply a filesystem");
+static int scrub_offline_thread(void *arg)
+{
+	struct scrub_offline *s = arg;
 
-	if (argc)
-		die("too many arguments");
+	s->ret = bch2_data_job(s->c, &s->stats, s->arg);
+	smp_store_release(&s->stats.ret,
+			  s->ret == -BCH_ERR_device_offline
+			  ? BCH_IOCTL_DATA_EVENT_RET_device_offline
+			  : BCH_IOCTL_DATA_EVENT_RET_done);
+	return 0;
+}
 
-	printf("Starting scrub on");
+/* Same progress event the kernel's data job file returns on read: */
+static void scrub_offline_progress(struct scrub_offline *s,
+				   struct bch_ioctl_data_event *e)
+{
+	struct bch_fs *c = s->c;
+
+	*e = (struct bch_ioctl_data_event) {
+		.type				= BCH_DATA_EVENT_PROGRESS,
+		.ret				= smp_load_acquire(&s->stats.ret),
+		.p.sectors_done			= atomic64_read(&s->stats.sectors_seen),
+		.p.sectors_error_corrected	= atomic64_read(&s->stats.sectors_error_corrected),
+		.p.sectors_error_uncorrected	= atomic64_read(&s->stats.sectors_error_uncorrected),
+	};
 
-	struct bchfs_handle fs = bcache_fs_open(path);
-	dev_names dev_names = bchu_fs_get_devices(fs);
+	struct bch_dev *ca = bch2_dev_tryget(c, s->arg.scrub.dev);
+	if (ca) {
+		struct bch_dev_usage u;
+		bch2_dev_usage_read_fast(ca, &u);
+		for (unsigned i = BCH_DATA_btree; i < ARRAY_SIZE(u.d); i++)
+			if (s->arg.scrub.data_types & BIT(i))
+				e->p.sectors_total += u.d[i].sectors;
+		bch2_dev_put(ca);
+	}
+}
 
-	struct scrub_device {
-		const char	*name;
-		int		progress_fd;
-		u64		done, corrected, uncorrected, total;
-		enum bch_ioctl_data_event_ret	ret;
-	};
-	DARRAY(struct scrub_device) scrub_devs = {};
+static bool scrub_device_read(struct scrub_device *dev, struct bch_ioctl_data_event *e)
+{
+	if (dev->offline) {
+		scrub_offline_progress(dev->offline, e);
+		return true;
+	}
 
-	if (fs.dev_idx >= 0) {
-		cmd.scrub.dev = fs.dev_idx;
-		struct scrub_device d = {
-			.name		= dev_idx_to_name(&dev_names, fs.dev_idx)->dev,
-			.progress_fd	= xioctl(fs.ioctl_fd, BCH_IOCTL_DATA, &cmd),
-		};
-		darray_push(&scrub_devs, d);
-	} else {
-		/* Scrubbing every device */
-		darray_for_each(dev_names, dev) {
-			cmd.scrub.dev = dev->idx;
-			struct scrub_device d = {
-				.name		= dev->dev,
-				.progress_fd	= xioctl(fs.ioctl_fd, BCH_IOCTL_DATA, &cmd),
-			};
-			darray_push(&scrub_devs, d);
-		}
+	return read(dev->progress_fd, e, sizeof(*e)) == sizeof(*e);
+}
+
+static void scrub_device_stop(struct scrub_device *dev, u64 now)
+{
+	if (dev->progress_fd >= 0) {
+		close(dev->progress_fd);
+		dev->progress_fd = -1;
 	}
 
-	printf(" %zu devices: ", scrub_devs.nr);
-	darray_for_each(scrub_devs, dev)
-		printf(" %s", dev->name);
-	printf("\n");
+	dev->running	= false;
+	dev->end	= now;
+}
+
+static void scrub_progress(scrub_devices *scrub_devs)
+{
+	struct timespec ts;
+	u64 now, last = 0;
 
-	struct timespec now, last;
-	bool first = true;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	darray_for_each(*scrub_devs, dev)
+		dev->start = timespec_to_ns(&ts);
 
 	struct printbuf buf = PRINTBUF;
 	printbuf_tabstop_push(&buf, 16);
@@ -169,24 +222,20 @@ int cmd_data_scrub(int argc, char *argv[])
 
 		printbuf_reset_keep_tabstops(&buf);
 
-		clock_gettime(CLOCK_MONOTONIC, &now);
-		u64 ns_since_last = 0;
-		if (!first)
-			ns_since_last = (now.tv_sec - last.tv_sec) * NSEC_PER_SEC +
-				now.tv_nsec - last.tv_nsec;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		now = timespec_to_ns(&ts);
+		u64 ns_since_last = last ? now - last : 0;
 
-		darray_for_each(scrub_devs, dev) {
+		darray_for_each(*scrub_devs, dev) {
 			struct bch_ioctl_data_event e;
 
-			if (dev->progress_fd >= 0 &&
-			    read(dev->progress_fd, &e, sizeof(e)) != sizeof(e)) {
-				close(dev->progress_fd);
-				dev->progress_fd = -1;
-			}
+			if (dev->running &&
+			    !scrub_device_read(dev, &e))
+				scrub_device_stop(dev, now);
 
 			u64 rate = 0;
 
-			if (dev->progress_fd >= 0) {
+			if (dev->running) {
 				if (ns_since_last)
 					rate = ((e.p.sectors_done - dev->done) << 9)
 						* NSEC_PER_SEC
@@ -198,13 +247,12 @@ int cmd_data_scrub(int argc, char *argv[])
 				dev->total	= e.p.sectors_total;
 			}
 
-			if (dev->progress_fd >= 0 && e.ret) {
-				close(dev->progress_fd);
-				dev->progress_fd = -1;
+			if (dev->running && e.ret) {
+				scrub_device_stop(dev, now);
 				dev->ret = e.ret;
 			}
 
-			if (dev->progress_fd >= 0)
+			if (dev->running)
 				done = false;
 
 			prt_printf(&buf, "%s\t", dev->name ?: "(offline)");
@@ -229,16 +277,21 @@ int cmd_data_scrub(int argc, char *argv[])
 
 			prt_str(&buf, "  ");
 
-			if (dev->progress_fd >= 0) {
+			if (dev->running) {
 				prt_human_readable_u64(&buf, rate);
 				prt_str(&buf, "/sec");
 			} else if (dev->ret == BCH_IOCTL_DATA_EVENT_RET_device_offline) {
 				prt_str(&buf, "offline");
 			} else {
-				prt_str(&buf, "complete");
+				prt_str(&buf, "complete, ");
+				prt_human_readable_u64(&buf, dev->end > dev->start
+						       ? (dev->done << 9) * NSEC_PER_SEC /
+						         (dev->end - dev->start)
+						       : 0);
+				prt_str(&buf, "/sec");
 			}
 
-			if (dev != &darray_last(scrub_devs))
+			if (dev != &darray_last(*scrub_devs))
 				prt_newline(&buf);
 		}
 
@@ -249,10 +302,9 @@ int cmd_data_scrub(int argc, char *argv[])
 			break;
 
 		last = now;
-		first = false;
 		sleep(1);
 
-		for (unsigned i = 0; i < scrub_devs.nr; i++) {
+		for (unsigned i = 0; i < scrub_devs->nr; i++) {
 			if (i)
 				printf("\033[1A");
 			printf("\33[2K\r");
@@ -261,10 +313,183 @@ int cmd_data_scrub(int argc, char *argv[])
 
 	fputs("\n", stdout);
 	printbuf_exit(&buf);
+}
+
+static int data_scrub_online(const char *path, struct bch_ioctl_data cmd)
+{
+	printf("Starting scrub on");
 
+	struct bchfs_handle fs = bcache_fs_open(path);
+	dev_names dev_names = bchu_fs_get_devices(fs);
+	scrub_devices scrub_devs = {};
+
+	if (fs.dev_idx >= 0) {
+		cmd.scrub.dev = fs.dev_idx;
+		struct scrub_device d = {
+			.name		= dev_idx_to_name(&dev_names, fs.dev_idx)->dev,
+			.progress_fd	= xioctl(fs.ioctl_fd, BCH_IOCTL_DATA, &cmd),
+			.running	= true,
+		};
+		darray_push(&scrub_devs, d);
+	} else {
+		/* Scrubbing every device */
+		darray_for_each(dev_names, dev) {
+			cmd.scrub.dev = dev->idx;
+			struct scrub_device d = {
+				.name		= dev->dev,
+				.progress_fd	= xioctl(fs.ioctl_fd, BCH_IOCTL_DATA, &cmd),
+				.running	= true,
+			};
+			darray_push(&scrub_devs, d);
+		}
+	}
+
+	printf(" %zu devices: ", scrub_devs.nr);
+	darray_for_each(scrub_devs, dev)
+		printf(" %s", dev->name);
+	printf("\n");
+
+	scrub_progress(&scrub_devs);
 	return 0;
 }
 
+static int data_scrub_offline(darray_str devs, const char *opts_str,
+			      struct bch_ioctl_data cmd)
+{
+	struct bch_opts opts = bch2_opts_empty();
+	struct printbuf parse_later = PRINTBUF;
+
+	/*
+	 * Nothing else is using the devices, so keep many more reads in flight
+	 * than the defaults, which are sized for not disturbing foreground IO:
+	 */
+	opt_set(opts, move_bytes_in_flight, 16U << 20);
+	opt_set(opts, move_ios_in_flight, 256);
+
+	int ret = bch2_parse_mount_opts(NULL, &opts, &parse_later, (char *) opts_str);
+	if (ret)
+		die("error parsing options: %s", bch2_err_str(ret));
+
+	struct bch_fs *c = bch2_fs_open(devs.data, devs.nr, opts);
+	if (IS_ERR(c))
+		die("error opening %s: %s", devs.data[0], bch2_err_str(PTR_ERR(c)));
+
+	/* Some options can't be parsed until after the fs is started: */
+	opts = bch2_opts_empty();
+	ret = bch2_parse_mount_opts(c, &opts, NULL, parse_later.buf);
+	if (ret)
+		die("error parsing options: %s", bch2_err_str(ret));
+	bch2_opts_apply(&c->opts, opts);
+
+	scrub_devices scrub_devs = {};
+
+	for_each_online_member(c, ca) {
+		struct scrub_offline *s = calloc(1, sizeof(*s));
+		s->c			= c;
+		s->arg			= cmd;
+		s->arg.scrub.dev	= ca->dev_idx;
+		s->stats.read_error	= scrub_offline_read_error;
+		mutex_init(&s->errors_lock);
+
+		struct scrub_device d = {
+			.name		= ca->disk_sb.sb_name,
+			.progress_fd	= -1,
+			.offline	= s,
+			.running	= true,
+		};
+		darray_push(&scrub_devs, d);
+	}
+
+	printf("Starting offline scrub on %zu devices: ", scrub_devs.nr);
+	darray_for_each(scrub_devs, dev)
+		printf(" %s", dev->name);
+	printf("\n");
+
+	darray_for_each(scrub_devs, dev) {
+		struct scrub_offline *s = dev->offline;
+
+		s->thread = kthread_create(scrub_offline_thread, s, "bch-scrub/%u",
+					   s->arg.scrub.dev);
+		if (IS_ERR(s->thread))
+			die("error starting scrub thread: %s",
+			    bch2_err_str(PTR_ERR(s->thread)));
+		get_task_struct(s->thread);
+		wake_up_process(s->thread);
+	}
+
+	scrub_progress(&scrub_devs);
+
+	ret = 0;
+	darray_for_each(scrub_devs, dev) {
+		struct scrub_offline *s = dev->offline;
+
+		kthread_stop(s->thread);
+		put_task_struct(s->thread);
+
+		if (s->ret && s->ret != -BCH_ERR_device_offline) {
+			fprintf(stderr, "%s: error scrubbing: %s\n",
+				dev->name, bch2_err_str(s->ret));
+			ret = 1;
+		}
+		if (dev->uncorrected)
+			ret = 1;
+
+		darray_for_each(s->errors, e)
+			printf("%s: %s error at %llu:%llu, %llu sectors\n",
+			       dev->name, e->corrected ? "corrected" : "uncorrected",
+			       e->pos.inode, e->pos.offset, e->sectors);
+		darray_exit(&s->errors);
+		free(s);
+	}
+
+	darray_exit(&scrub_devs);
+	bch2_fs_stop(c);
+	printbuf_exit(&parse_later);
+	return ret;
+}
+
+int cmd_data_scrub(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{ "metadata",		no_argument,		NULL, 'm' },
+		{ "options",		required_argument,	NULL, 'o' },
+		{ "help",		no_argument,		NULL, 'h' },
+		{ NULL }
+	};
+	struct bch_ioctl_data cmd = {
+		.op			= BCH_DATA_OP_scrub,
+		.scrub.data_types	= ~0,
+	};
+	const char *opts_str = NULL;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "hmo:", longopts, NULL)) != -1)
+		switch (opt) {
+		case 'm':
+			cmd.scrub.data_types = BIT(BCH_DATA_btree);
+			break;
+		case 'o':
+			opts_str = optarg;
+			break;
+		case 'h':
+			data_scrub_usage();
+			break;
+		}
+	args_shift(optind);
+
+	if (!argc)
+		die("Please supply a filesystem");
+
+	struct stat st;
+	if (argc == 1 &&
+	    ((!stat(argv[0], &st) && S_ISDIR(st.st_mode)) ||
+	     dev_mounted(argv[0])))
+		return data_scrub_online(argv[0], cmd);
+
+	return data_scrub_offline(get_or_split_cmdline_devs(argc, argv),
+				  opts_str, cmd);
+}
+
 static void data_job_usage(void)
 {
 	puts("bcachefs data job\n"
@@ -1,5 +1,6 @@
 #include <fcntl.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -23,36 +24,46 @@ static void dump_usage(void)
 	     "Usage: bcachefs dump [OPTION]... <devices>\n"
 	     "\n"
 	     "Options:\n"
-	     "  -o output     Output qcow2 image(s)\n"
-	     "  -f, --force   Force; overwrite when needed\n"
-	     "  --nojournal   Don't dump entire journal, just dirty entries\n"
-	     "  -h, --help    Display this help and exit\n"
+	     "  -o output         Output qcow2 image(s)\n"
+	     "  -f, --force       Force; overwrite when needed\n"
+	     "  -z, --compress    Compress image(s) with zstd (qcow2 v3)\n"
+	     "  --nojournal       Don't dump entire journal, just dirty entries\n"
+	     "  -h, --help        Display this help and exit\n"
 	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
 }
 
-static void dump_node(struct bch_fs *c, struct bch_dev *ca, struct bkey_s_c k, ranges *data)
+struct dump_dev {
+	struct bch_dev		*ca;
+	int			fd;
+	unsigned		block_size;
+	bool			compress;
+	ranges			data;
+	pthread_t		thread;
+};
+
+static void dump_node(struct bch_fs *c, struct dump_dev *devs, struct bkey_s_c k)
 {
 	struct bkey_ptrs_c ptrs = bch2_bkey_ptrs_c(k);
 
 	bkey_for_each_ptr(ptrs, ptr)
-		if (ptr->dev == ca->dev_idx)
-			range_add(data, ptr->offset << 9, c->opts.btree_node_size);
+		if (ptr->dev < c->sb.nr_devices && devs[ptr->dev].ca)
+			range_add(&devs[ptr->dev].data, ptr->offset << 9,
+				  c->opts.btree_node_size);
 }
 
-static void dump_one_device(struct bch_fs *c, struct bch_dev *ca, int fd,
+static void dump_dev_ranges(struct bch_fs *c, struct dump_dev *d,
 			    bool entire_journal)
 {
+	struct bch_dev *ca = d->ca;
 	struct bch_sb *sb = ca->disk_sb.sb;
-	ranges data = { 0 };
 	unsigned i;
-	int ret;
 
 	/* Superblock: */
-	range_add(&data, BCH_SB_LAYOUT_SECTOR << 9,
+	range_add(&d->data, BCH_SB_LAYOUT_SECTOR << 9,
 		  sizeof(struct bch_sb_layout));
 
 	for (i = 0; i < sb->layout.nr_superblocks; i++)
-		range_add(&data,
+		range_add(&d->data,
 			  le64_to_cpu(sb->layout.sb_offset[i]) << 9,
 			  vstruct_bytes(sb));
 
@@ -62,12 +73,18 @@ static void dump_one_device(struct bch_fs *c, struct bch_dev *ca, int fd,
 		    ca->journal.bucket_seq[i] >= c->journal.last_seq_ondisk) {
 			u64 bucket = ca->journal.buckets[i];
 
-			range_add(&data,
+			range_add(&d->data,
 				  bucket_bytes(ca) * bucket,
 				  bucket_bytes(ca));
 		}
+}
+
+/* Btree nodes for all devices are collected in a single walk: */
+static void dump_btree_ranges(struct bch_fs *c, struct dump_dev *devs)
+{
+	unsigned i;
+	int ret;
 
-	/* Btree: */
 	for (i = 0; i < BTREE_ID_NR; i++) {
 		struct btree_trans *trans = bch2_trans_get(c);
 
@@ -77,7 +94,7 @@ static void dump_one_device(struct bch_fs *c, struct bch_dev *ca, int fd,
 			struct bkey_s_c k;
 
 			for_each_btree_node_key_unpack(b, k, &iter, &u)
-				dump_node(c, ca, k, &data);
+				dump_node(c, devs, k);
 			0;
 		}));
 
@@ -86,20 +103,45 @@ static void dump_one_device(struct bch_fs *c, struct bch_dev *ca, int fd,
 
 		struct btree *b = bch2_btree_id_root(c, i)->b;
 		if (!btree_node_fake(b))
-			dump_node(c, ca, bkey_i_to_s_c(&b->key), &data);
+			dump_node(c, devs, bkey_i_to_s_c(&b->key));
 
 		bch2_trans_put(trans);
 	}
+}
+
+static atomic64_t dump_bytes_done;
 
-	qcow2_write_image(ca->disk_sb.bdev->bd_fd, fd, &data,
-			  max_t(unsigned, c->opts.btree_node_size / 8, block_bytes(c)));
-	darray_exit(&data);
+static void *dump_one_device(void *arg)
+{
+	struct dump_dev *d = arg;
+
+	qcow2_write_image(d->ca->disk_sb.bdev->bd_fd, d->fd, &d->data,
+			  d->block_size, d->compress, &dump_bytes_done);
+	return NULL;
+}
+
+static void dump_progress(u64 done, u64 total, u64 start, bool final)
+{
+	u64 elapsed = max_t(u64, ktime_get_ns() - start, 1);
+	struct printbuf buf = PRINTBUF;
+
+	bch2_prt_units_u64(&buf, done);
+	prt_str(&buf, "/");
+	bch2_prt_units_u64(&buf, total);
+	prt_printf(&buf, " (%llu%%), ", total ? done * 100 / total : 100);
+	bch2_prt_units_u64(&buf, div64_u64(done * NSEC_PER_SEC, elapsed));
+	prt_str(&buf, "/sec");
+
+	printf("\33[2K\r%s%s", buf.buf, final ? "\n" : "");
+	fflush(stdout);
+	printbuf_exit(&buf);
 }
 
 int cmd_dump(int argc, char *argv[])
 {
 	static const struct option longopts[] = {
 		{ "force",		no_argument,		NULL, 'f' },
+		{ "compress",		no_argument,		NULL, 'z' },
 		{ "nojournal",		no_argument,		NULL, 'j' },
 		{ "verbose",		no_argument,		NULL, 'v' },
 		{ "help",		no_argument,		NULL, 'h' },
@@ -108,8 +150,8 @@ int cmd_dump(int argc, char *argv[])
 	struct bch_opts opts = bch2_opts_empty();
 	char *out = NULL;
 	unsigned nr_devices = 0;
-	bool force = false, entire_journal = true;
-	int fd, opt;
+	bool force = false, compress = false, entire_journal = true;
+	int opt;
 
 	opt_set(opts, direct_io,	false);
 	opt_set(opts, noexcl,		true);
@@ -121,7 +163,7 @@ int cmd_dump(int argc, char *argv[])
 	opt_set(opts, errors,		BCH_ON_ERROR_continue);
 	opt_set(opts, fix_errors,	FSCK_FIX_no);
 
-	while ((opt = getopt_long(argc, argv, "o:fvh",
+	while ((opt = getopt_long(argc, argv, "o:fzvh",
 				  longopts, NULL)) != -1)
 		switch (opt) {
 		case 'o':
@@ -130,6 +172,9 @@ int cmd_dump(int argc, char *argv[])
 		case 'f':
 			force = true;
 			break;
+		case 'z':
+			compress = true;
+			break;
 		case 'j':
 			entire_journal = false;
 			break;
@@ -154,27 +199,81 @@ int cmd_dump(int argc, char *argv[])
 
 	down_read(&c->state_lock);
 
-	for_each_online_member(c, ca)
+	struct dump_dev *devs = xcalloc(c->sb.nr_devices, sizeof(*devs));
+
+	for_each_online_member(c, ca) {
+		devs[ca->dev_idx].ca = ca;
 		nr_devices++;
+	}
 
 	BUG_ON(!nr_devices);
 
-	for_each_online_member(c, ca) {
+	dump_btree_ranges(c, devs);
+
+	u64 total = 0, start = ktime_get_ns();
+
+	for (struct dump_dev *d = devs; d < devs + c->sb.nr_devices; d++) {
+		if (!d->ca)
+			continue;
+
 		int flags = O_WRONLY|O_CREAT|O_TRUNC;
 
 		if (!force)
 			flags |= O_EXCL;
 
 		char *path = nr_devices > 1
-			? mprintf("%s.%u.qcow2", out, ca->dev_idx)
+			? mprintf("%s.%u.qcow2", out, d->ca->dev_idx)
 			: mprintf("%s.qcow2", out);
-		fd = xopen(path, flags, 0600);
+		d->fd = xopen(path, flags, 0600);
 		free(path);
 
-		dump_one_device(c, ca, fd, entire_journal);
-		close(fd);
+		d->block_size = max_t(unsigned, c->opts.btree_node_size / 8, block_bytes(c));
+		d->compress = compress;
+
+		dump_dev_ranges(c, d, entire_journal);
+		ranges_roundup(&d->data, d->block_size);
+		ranges_sort_merge(&d->data);
+
+		darray_for_each(d->data, r)
+			total += r->end - r->start;
 	}
 
+	/* Each device is written out by its own thread: */
+	for (struct dump_dev *d = devs; d < devs + c->sb.nr_devices; d++)
+		if (d->ca) {
+			int ret = pthread_create(&d->thread, NULL, dump_one_device, d);
+			if (ret)
+				die("error creating thread: %s", strerror(ret));
+		}
+
+	bool progress = isatty(STDOUT_FILENO);
+	u64 done;
+
+	while ((done = atomic64_read(&dump_bytes_done)) < total) {
+		if (progress)
+			dump_progress(done, total, start, false);
+		sleep(1);
+	}
+
+	u64 image_bytes = 0;
+
+	for (struct dump_dev *d = devs; d < devs + c->sb.nr_devices; d++)
+		if (d->ca) {
+			pthread_join(d->thread, NULL);
+			image_bytes += xfstat(d->fd).st_blocks << 9;
+			close(d->fd);
+			darray_exit(&d->data);
+		}
+
+	dump_progress(atomic64_read(&dump_bytes_done), total, start, true);
+
+	struct printbuf buf = PRINTBUF;
+	prt_str(&buf, "image size ");
+	bch2_prt_units_u64(&buf, image_bytes);
+	printf("%s\n", buf.buf);
+	printbuf_exit(&buf);
+	free(devs);
+
 	up_read(&c->state_lock);
 
 	bch2_fs_stop(c);
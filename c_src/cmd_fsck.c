@@ -22,6 +22,8 @@ static void fsck_usage(void)
 	     "  -f                      Force checking even if filesystem is marked clean\n"
 	     "  -r, --ratelimit_errors  Don't display more than 10 errors of a given type\n"
 	     "  -R, --reconstruct_alloc Reconstruct the alloc btree\n"
+	     "  -j, --threads=nr        Check inodes, extents, dirents and xattrs with nr\n"
+	     "                          threads (userspace fsck with -n or -y only)\n"
 	     "  -k, --kernel            Use the in-kernel fsck implementation\n"
 	     "  -v                      Be verbose\n"
 	     "  -h, --help              Display this help and exit\n"
@@ -206,12 +208,14 @@ int cmd_fsck(int argc, char *argv[])
 	static const struct option longopts[] = {
 		{ "ratelimit_errors",	no_argument,		NULL, 'r' },
 		{ "reconstruct_alloc",	no_argument,		NULL, 'R' },
+		{ "threads",		required_argument,	NULL, 'j' },
 		{ "kernel",		no_argument,		NULL, 'k' },
 		{ "no-kernel",		no_argument,		NULL, 'K' },
 		{ "help",		no_argument,		NULL, 'h' },
 		{ NULL }
 	};
 	int kernel = -1; /* unset */
+	u64 nr_threads = 0;
 	int opt, ret = 0;
 	struct printbuf opts_str = PRINTBUF;
 
@@ -224,7 +228,7 @@ int cmd_fsck(int argc, char *argv[])
 	append_opt(&opts_str, "read_only");
 
 	while ((opt = getopt_long(argc, argv,
-				  "apynfo:rRkKvh",
+				  "apynfo:rRj:kKvh",
 				  longopts, NULL)) != -1)
 		switch (opt) {
 		case 'a':
@@ -251,6 +255,14 @@ int cmd_fsck(int argc, char *argv[])
 		case 'R':
 			append_opt(&opts_str, "reconstruct_alloc");
 			break;
+		case 'j': {
+			struct printbuf err = PRINTBUF;
+			if (bch2_opt_parse(NULL, &bch2_opt_table[Opt_fsck_threads],
+					   optarg, &nr_threads, &err))
+				die("invalid number of threads: %s", err.buf);
+			printbuf_exit(&err);
+			break;
+		}
 		case 'k':
 			kernel = true;
 			break;
@@ -330,6 +342,12 @@ userland_fsck:
 		if (ret)
 			return ret;
 
+		/* Not a kernel option, so not passed in opts_str: */
+		if (nr_threads)
+			opt_set(opts, fsck_threads, nr_threads);
+
+		sysfs_server_enable();
+
 		struct bch_fs *c = bch2_fs_open(devs.data, devs.nr, opts);
 		if (IS_ERR(c))
 			exit(8);
@@ -3,6 +3,7 @@
 #include <errno.h>
 #include <float.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <sys/statvfs.h>
 
@@ -23,13 +24,19 @@
 #include "libbcachefs/inode.h"
 #include "libbcachefs/io_read.h"
 #include "libbcachefs/io_write.h"
+#include "libbcachefs/journal.h"
 #include "libbcachefs/opts.h"
+#include "libbcachefs/str_hash.h"
+#include "libbcachefs/subvolume.h"
 #include "libbcachefs/super.h"
 
 /* mode_to_type(): */
 #include "libbcachefs/fs.h"
 
 #include <linux/dcache.h>
+#include <linux/hash.h>
+#include <linux/shrinker.h>
+#include <linux/sort.h>
 
 /* used by write_aligned function for waiting on bch2_write closure */
 struct write_aligned_op_t {
@@ -40,6 +47,39 @@ struct write_aligned_op_t {
 };
 
 
+/*
+ * Requests may be handled by libfuse's worker threads, which need a
+ * task_struct before calling into bcachefs:
+ */
+static struct bch_fs *fuse_req_fs(fuse_req_t req)
+{
+	current_task_init();
+	return fuse_req_userdata(req);
+}
+
+/*
+ * Writes that don't cover whole blocks have to read in and rewrite the
+ * partial blocks at either end: they must not race with other writes to the
+ * same inode. Block aligned writes only need to exclude those, so they take
+ * the lock shared.
+ */
+#define FUSE_WRITE_LOCKS	64
+
+static pthread_rwlock_t fuse_write_locks[FUSE_WRITE_LOCKS] = {
+	[0 ... FUSE_WRITE_LOCKS - 1] = PTHREAD_RWLOCK_INITIALIZER,
+};
+
+static pthread_rwlock_t *fuse_write_lock(subvol_inum inum, bool partial)
+{
+	pthread_rwlock_t *lock = &fuse_write_locks[hash_64(inum.inum, ilog2(FUSE_WRITE_LOCKS))];
+
+	if (partial)
+		pthread_rwlock_wrlock(lock);
+	else
+		pthread_rwlock_rdlock(lock);
+	return lock;
+}
+
 static inline subvol_inum map_root_ino(u64 ino)
 {
 	return (subvol_inum) { 1, ino == 1 ? 4096 : ino };
@@ -81,8 +121,325 @@ static struct fuse_entry_param inode_to_entry(struct bch_fs *c,
 	};
 }
 
+/*
+ * Inode cache:
+ *
+ * Unpacked inodes, with their io options and hash info, so that the read and
+ * write paths don't look up the inode for every request. Entries are dropped
+ * when anything else updates the inode.
+ *
+ * Writes update the cached i_size and i_sectors - which the write path has
+ * already updated in the btree - and mark the timestamps dirty: like the
+ * kernel's dirty inodes, those are written back on flush, fsync, release and
+ * when the entry is dropped, instead of with a transaction per write.
+ *
+ * Lookups that miss read the inode without the cache lock held: @seq is
+ * bumped by every update, so that they don't insert a stale inode.
+ */
+#define FUSE_INODE_HASH_BITS	12
+
+struct fuse_inode_state {
+	struct bch_inode_unpacked bi;
+	struct bch_io_opts	io_opts;
+	struct bch_hash_info	hash_info;
+};
+
+struct fuse_inode {
+	struct hlist_node	hash;
+	struct list_head	lru;
+	subvol_inum		inum;
+	bool			times_dirty;
+	struct fuse_inode_state	s;
+};
+
+static struct fuse_inode_cache {
+	pthread_mutex_t		lock;
+	u64			seq;
+	unsigned long		nr;
+	struct list_head	lru;
+	struct hlist_head	table[1U << FUSE_INODE_HASH_BITS];
+	struct shrinker		*shrink;
+} fuse_inodes = {
+	.lock	= PTHREAD_MUTEX_INITIALIZER,
+	.lru	= LIST_HEAD_INIT(fuse_inodes.lru),
+};
+
+static struct hlist_head *fuse_inode_bucket(subvol_inum inum)
+{
+	return &fuse_inodes.table[hash_64(inum.inum ^ ((u64) inum.subvol << 32),
+					  FUSE_INODE_HASH_BITS)];
+}
+
+static struct fuse_inode *fuse_inode_find(subvol_inum inum)
+{
+	struct fuse_inode *i;
+
+	hlist_for_each_entry(i, fuse_inode_bucket(inum), hash)
+		if (i->inum.subvol == inum.subvol && i->inum.inum == inum.inum)
+			return i;
+	return NULL;
+}
+
+static void fuse_inode_state_init(struct bch_fs *c, struct fuse_inode_state *s)
+{
+	bch2_inode_opts_get(&s->io_opts, c, &s->bi);
+	s->hash_info = bch2_hash_info_init(c, &s->bi);
+}
+
+static int fuse_inode_get(struct bch_fs *c, subvol_inum inum,
+			  struct fuse_inode_state *s)
+{
+	struct fuse_inode *i;
+
+	pthread_mutex_lock(&fuse_inodes.lock);
+	i = fuse_inode_find(inum);
+	if (i) {
+		*s = i->s;
+		list_move_tail(&i->lru, &fuse_inodes.lru);
+	}
+	u64 seq = fuse_inodes.seq;
+	pthread_mutex_unlock(&fuse_inodes.lock);
+
+	if (i)
+		return 0;
+
+	int ret = bch2_inode_find_by_inum(c, inum, &s->bi);
+	if (ret)
+		return ret;
+
+	fuse_inode_state_init(c, s);
+
+	i = malloc(sizeof(*i));
+	if (!i)
+		return 0;
+
+	i->inum		= inum;
+	i->times_dirty	= false;
+	i->s		= *s;
+
+	pthread_mutex_lock(&fuse_inodes.lock);
+	if (seq == fuse_inodes.seq && !fuse_inode_find(inum)) {
+		hlist_add_head(&i->hash, fuse_inode_bucket(inum));
+		list_add_tail(&i->lru, &fuse_inodes.lru);
+		fuse_inodes.nr++;
+		i = NULL;
+	}
+	pthread_mutex_unlock(&fuse_inodes.lock);
+
+	free(i);
+	return 0;
+}
+
+/*
+ * For inodes read by other paths: the cached version, if any, has the current
+ * i_size, i_sectors and timestamps:
+ */
+static void fuse_inode_get_cached(subvol_inum inum, struct bch_inode_unpacked *bi)
+{
+	struct fuse_inode *i;
+
+	pthread_mutex_lock(&fuse_inodes.lock);
+	i = fuse_inode_find(inum);
+	if (i)
+		*bi = i->s.bi;
+	pthread_mutex_unlock(&fuse_inodes.lock);
+}
+
+static int fuse_inode_write_times_trans(struct btree_trans *trans, subvol_inum inum,
+					u64 mtime, u64 ctime)
+{
+	struct btree_iter iter;
+	struct bch_inode_unpacked u;
+
+	/*
+	 * mtime may have been set explicitly to any time, but ctime only ever
+	 * goes forwards - a setattr that raced with the write may have set a
+	 * newer one:
+	 */
+	int ret = bch2_inode_peek(trans, &iter, &u, inum, BTREE_ITER_intent) ?: ({
+		u.bi_mtime = mtime;
+		u.bi_ctime = max(u.bi_ctime, ctime);
+		bch2_inode_write(trans, &iter, &u);
+	});
+	bch2_trans_iter_exit(trans, &iter);
+	return ret;
+}
+
+static int fuse_inode_write_times(struct bch_fs *c, subvol_inum inum,
+				  u64 mtime, u64 ctime)
+{
+	int ret = bch2_trans_commit_do(c, NULL, NULL, BCH_TRANS_COMMIT_no_enospc,
+		fuse_inode_write_times_trans(trans, inum, mtime, ctime));
+
+	/* raced with unlink: */
+	return bch2_err_matches(ret, ENOENT) ? 0 : ret;
+}
+
+/* Writes back dirty timestamps, if any: */
+static int fuse_inode_flush_times(struct bch_fs *c, subvol_inum inum)
+{
+	struct fuse_inode *i;
+	bool dirty = false;
+	u64 mtime = 0, ctime = 0;
+
+	pthread_mutex_lock(&fuse_inodes.lock);
+	i = fuse_inode_find(inum);
+	if (i && i->times_dirty) {
+		dirty		= true;
+		mtime		= i->s.bi.bi_mtime;
+		ctime		= i->s.bi.bi_ctime;
+		i->times_dirty	= false;
+	}
+	pthread_mutex_unlock(&fuse_inodes.lock);
+
+	return dirty ? fuse_inode_write_times(c, inum, mtime, ctime) : 0;
+}
+
+static void fuse_inode_free(struct bch_fs *c, struct fuse_inode *i)
+{
+	if (i->times_dirty)
+		fuse_inode_write_times(c, i->inum, i->s.bi.bi_mtime, i->s.bi.bi_ctime);
+	free(i);
+}
+
+/*
+ * Timestamps set explicitly by setattr override those dirtied by writes that
+ * raced with it:
+ */
+static void fuse_inode_discard_times(subvol_inum inum)
+{
+	struct fuse_inode *i;
+
+	pthread_mutex_lock(&fuse_inodes.lock);
+	i = fuse_inode_find(inum);
+	if (i)
+		i->times_dirty = false;
+	pthread_mutex_unlock(&fuse_inodes.lock);
+}
+
+/* Called after updating an inode by any path other than a write: */
+static void fuse_inode_invalidate(struct bch_fs *c, subvol_inum inum)
+{
+	struct fuse_inode *i;
+
+	pthread_mutex_lock(&fuse_inodes.lock);
+	fuse_inodes.seq++;
+	i = fuse_inode_find(inum);
+	if (i) {
+		hlist_del(&i->hash);
+		list_del(&i->lru);
+		fuse_inodes.nr--;
+	}
+	pthread_mutex_unlock(&fuse_inodes.lock);
+
+	if (i)
+		fuse_inode_free(c, i);
+}
+
+/*
+ * After a write: returns false if the inode isn't cached, and the caller has
+ * to update the timestamps itself.
+ */
+static bool fuse_inode_written(subvol_inum inum, u64 new_i_size,
+			       s64 i_sectors_delta, u64 now)
+{
+	struct fuse_inode *i;
+
+	pthread_mutex_lock(&fuse_inodes.lock);
+	fuse_inodes.seq++;
+	i = fuse_inode_find(inum);
+	if (i) {
+		struct bch_inode_unpacked *bi = &i->s.bi;
+
+		if (!(bi->bi_flags & BCH_INODE_i_size_dirty) &&
+		    new_i_size > bi->bi_size)
+			bi->bi_size = new_i_size;
+		bi->bi_sectors	+= i_sectors_delta;
+		bi->bi_mtime	= now;
+		bi->bi_ctime	= now;
+		i->times_dirty	= true;
+	}
+	pthread_mutex_unlock(&fuse_inodes.lock);
+
+	return i != NULL;
+}
+
+static unsigned long fuse_inode_cache_count(struct shrinker *shrink,
+					    struct shrink_control *sc)
+{
+	return READ_ONCE(fuse_inodes.nr);
+}
+
+/* Only clean entries are freed here, the shrinker can't do btree updates: */
+static unsigned long fuse_inode_cache_scan(struct shrinker *shrink,
+					   struct shrink_control *sc)
+{
+	struct fuse_inode *i, *n;
+	unsigned long freed = 0;
+
+	pthread_mutex_lock(&fuse_inodes.lock);
+	list_for_each_entry_safe(i, n, &fuse_inodes.lru, lru) {
+		if (freed >= sc->nr_to_scan)
+			break;
+		if (i->times_dirty)
+			continue;
+
+		hlist_del(&i->hash);
+		list_del(&i->lru);
+		fuse_inodes.nr--;
+		free(i);
+		freed++;
+	}
+	pthread_mutex_unlock(&fuse_inodes.lock);
+
+	return freed;
+}
+
+static void fuse_inode_cache_init(struct bch_fs *c)
+{
+	fuse_inodes.shrink = shrinker_alloc(0, "%s-fuse_inode_cache", c->name);
+	if (!fuse_inodes.shrink)
+		die("error allocating shrinker");
+
+	fuse_inodes.shrink->count_objects	= fuse_inode_cache_count;
+	fuse_inodes.shrink->scan_objects	= fuse_inode_cache_scan;
+	fuse_inodes.shrink->seeks		= 1;
+	shrinker_register(fuse_inodes.shrink);
+}
+
+/* Writes back dirty timestamps and empties the cache: */
+static void fuse_inode_cache_exit(struct bch_fs *c)
+{
+	struct fuse_inode *i, *n;
+
+	if (fuse_inodes.shrink)
+		shrinker_free(fuse_inodes.shrink);
+	fuse_inodes.shrink = NULL;
+
+	list_for_each_entry_safe(i, n, &fuse_inodes.lru, lru) {
+		hlist_del(&i->hash);
+		list_del(&i->lru);
+		fuse_inode_free(c, i);
+	}
+	fuse_inodes.nr = 0;
+}
+
+struct fuse_file;
+static struct fuse_file *fuse_file_get(subvol_inum, bool);
+static struct fuse_file *fuse_file_lock(struct bch_fs *, subvol_inum, int *);
+static void fuse_file_unlock(struct bch_fs *, struct fuse_file *);
+static void fuse_files_exit(struct bch_fs *);
+static void fuse_ra_invalidate(struct fuse_file *, u64, u64);
+
 static void bcachefs_fuse_init(void *arg, struct fuse_conn_info *conn)
 {
+	/*
+	 * Let libfuse splice write data in from /dev/fuse, so that
+	 * bcachefs_fuse_write_buf() copies it once, straight into the buffer
+	 * we submit - and splice read data out:
+	 */
+	conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ|FUSE_CAP_SPLICE_WRITE);
+
 	if (conn->capable & FUSE_CAP_WRITEBACK_CACHE) {
 		fuse_log(FUSE_LOG_DEBUG, "fuse_init: activating writeback\n");
 		conn->want |= FUSE_CAP_WRITEBACK_CACHE;
@@ -96,6 +453,10 @@ static void bcachefs_fuse_destroy(void *arg)
 {
 	struct bch_fs *c = arg;
 
+	current_task_init();
+
+	fuse_files_exit(c);
+	fuse_inode_cache_exit(c);
 	bch2_fs_stop(c);
 }
 
@@ -103,8 +464,8 @@ static void bcachefs_fuse_lookup(fuse_req_t req, fuse_ino_t dir_ino,
 				 const char *name)
 {
 	subvol_inum dir = map_root_ino(dir_ino);
-	struct bch_fs *c = fuse_req_userdata(req);
-	struct bch_inode_unpacked bi;
+	struct bch_fs *c = fuse_req_fs(req);
+	struct fuse_inode_state s;
 	struct qstr qstr = QSTR(name);
 	subvol_inum inum;
 	int ret;
@@ -112,15 +473,13 @@ static void bcachefs_fuse_lookup(fuse_req_t req, fuse_ino_t dir_ino,
 	fuse_log(FUSE_LOG_DEBUG, "fuse_lookup(dir=%llu name=%s)\n",
 		 dir.inum, name);
 
-	ret = bch2_inode_find_by_inum(c, dir, &bi);
+	ret = fuse_inode_get(c, dir, &s);
 	if (ret) {
 		fuse_reply_err(req, -ret);
 		return;
 	}
 
-	struct bch_hash_info hash_info = bch2_hash_info_init(c, &bi);
-
-	ret = bch2_dirent_lookup(c, dir, &hash_info, &qstr, &inum);
+	ret = bch2_dirent_lookup(c, dir, &s.hash_info, &qstr, &inum);
 	if (ret) {
 		struct fuse_entry_param e = {
 			.attr_timeout	= DBL_MAX,
@@ -130,14 +489,14 @@ static void bcachefs_fuse_lookup(fuse_req_t req, fuse_ino_t dir_ino,
 		return;
 	}
 
-	ret = bch2_inode_find_by_inum(c, inum, &bi);
+	ret = fuse_inode_get(c, inum, &s);
 	if (ret)
 		goto err;
 
 	fuse_log(FUSE_LOG_DEBUG, "fuse_lookup ret(inum=%llu)\n",
-		 bi.bi_inum);
+		 s.bi.bi_inum);
 
-	struct fuse_entry_param e = inode_to_entry(c, &bi);
+	struct fuse_entry_param e = inode_to_entry(c, &s.bi);
 	fuse_reply_entry(req, &e);
 	return;
 err:
@@ -149,13 +508,18 @@ static void bcachefs_fuse_getattr(fuse_req_t req, fuse_ino_t ino,
 				  struct fuse_file_info *fi)
 {
 	subvol_inum inum = map_root_ino(ino);
-	struct bch_fs *c = fuse_req_userdata(req);
-	struct bch_inode_unpacked bi;
+	struct bch_fs *c = fuse_req_fs(req);
+	struct fuse_inode_state s;
 	struct stat attr;
 
 	fuse_log(FUSE_LOG_DEBUG, "fuse_getattr(inum=%llu)\n", inum.inum);
 
-	int ret = bch2_inode_find_by_inum(c, inum, &bi);
+	/* Buffered writes may change i_size: */
+	int ret;
+	fuse_file_unlock(c, fuse_file_lock(c, inum, &ret));
+
+	if (!ret)
+		ret = fuse_inode_get(c, inum, &s);
 	if (ret) {
 		fuse_log(FUSE_LOG_DEBUG, "fuse_getattr error %i\n", ret);
 		fuse_reply_err(req, -ret);
@@ -164,7 +528,7 @@ static void bcachefs_fuse_getattr(fuse_req_t req, fuse_ino_t ino,
 
 	fuse_log(FUSE_LOG_DEBUG, "fuse_getattr success\n");
 
-	attr = inode_to_stat(c, &bi);
+	attr = inode_to_stat(c, &s.bi);
 	fuse_reply_attr(req, &attr, DBL_MAX);
 }
 
@@ -172,7 +536,7 @@ static void bcachefs_fuse_setattr(fuse_req_t req, fuse_ino_t ino,
 				  struct stat *attr, int to_set,
 				  struct fuse_file_info *fi)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = fuse_req_fs(req);
 	struct bch_inode_unpacked inode_u;
 	struct btree_trans *trans;
 	struct btree_iter iter;
@@ -183,6 +547,19 @@ static void bcachefs_fuse_setattr(fuse_req_t req, fuse_ino_t ino,
 
 	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_setattr(%llu, %x)\n", inum.inum, to_set);
 
+	/*
+	 * Buffered writes go first, and so that timestamps being set here
+	 * aren't overwritten by dirty ones, so do dirty timestamps:
+	 */
+	struct fuse_file *f = fuse_file_lock(c, inum, &ret);
+	if (!ret)
+		ret = fuse_inode_flush_times(c, inum);
+	if (ret) {
+		fuse_file_unlock(c, f);
+		fuse_reply_err(req, -ret);
+		return;
+	}
+
 	trans = bch2_trans_get(c);
 retry:
 	bch2_trans_begin(trans);
@@ -220,6 +597,14 @@ err:
 
 	bch2_trans_put(trans);
 
+	if (!ret && (to_set & (FUSE_SET_ATTR_MTIME|FUSE_SET_ATTR_MTIME_NOW)))
+		fuse_inode_discard_times(inum);
+	fuse_inode_invalidate(c, inum);
+
+	if (f && (to_set & FUSE_SET_ATTR_SIZE))
+		fuse_ra_invalidate(f, 0, U64_MAX);
+	fuse_file_unlock(c, f);
+
 	if (!ret) {
 		*attr = inode_to_stat(c, &inode_u);
 		fuse_reply_attr(req, attr, DBL_MAX);
@@ -252,7 +637,7 @@ static void bcachefs_fuse_mknod(fuse_req_t req, fuse_ino_t dir_ino,
 				dev_t rdev)
 {
 	subvol_inum dir = map_root_ino(dir_ino);
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = fuse_req_fs(req);
 	struct bch_inode_unpacked new_inode;
 	int ret;
 
@@ -260,6 +645,7 @@ static void bcachefs_fuse_mknod(fuse_req_t req, fuse_ino_t dir_ino,
 		 dir.inum, name, mode, rdev);
 
 	ret = do_create(c, dir, name, mode, rdev, &new_inode);
+	fuse_inode_invalidate(c, dir);
 	if (ret)
 		goto err;
 
@@ -285,7 +671,7 @@ static void bcachefs_fuse_mkdir(fuse_req_t req, fuse_ino_t dir,
 static void bcachefs_fuse_unlink(fuse_req_t req, fuse_ino_t dir_ino,
 				 const char *name)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = fuse_req_fs(req);
 	struct bch_inode_unpacked dir_u, inode_u;
 	struct qstr qstr = QSTR(name);
 	subvol_inum dir = map_root_ino(dir_ino);
@@ -297,6 +683,10 @@ static void bcachefs_fuse_unlink(fuse_req_t req, fuse_ino_t dir_ino,
 			    bch2_unlink_trans(trans, dir, &dir_u,
 					      &inode_u, &qstr, false));
 
+	fuse_inode_invalidate(c, dir);
+	if (!ret)
+		fuse_inode_invalidate(c, (subvol_inum) { dir.subvol, inode_u.bi_inum });
+
 	fuse_reply_err(req, -ret);
 }
 
@@ -313,9 +703,9 @@ static void bcachefs_fuse_rename(fuse_req_t req,
 				 fuse_ino_t dst_dir_ino, const char *dstname,
 				 unsigned flags)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = fuse_req_fs(req);
 	struct bch_inode_unpacked dst_dir_u, src_dir_u;
-	struct bch_inode_unpacked src_inode_u, dst_inode_u;
+	struct bch_inode_unpacked src_inode_u, dst_inode_u = {};
 	struct qstr dst_name = QSTR(srcname);
 	struct qstr src_name = QSTR(dstname);
 	subvol_inum src_dir = map_root_ino(src_dir_ino);
@@ -335,13 +725,21 @@ static void bcachefs_fuse_rename(fuse_req_t req,
 				  &src_name, &dst_name,
 				  BCH_RENAME));
 
+	fuse_inode_invalidate(c, src_dir);
+	fuse_inode_invalidate(c, dst_dir);
+	if (!ret) {
+		fuse_inode_invalidate(c, (subvol_inum) { src_dir.subvol, src_inode_u.bi_inum });
+		if (dst_inode_u.bi_inum)
+			fuse_inode_invalidate(c, (subvol_inum) { dst_dir.subvol, dst_inode_u.bi_inum });
+	}
+
 	fuse_reply_err(req, -ret);
 }
 
 static void bcachefs_fuse_link(fuse_req_t req, fuse_ino_t ino,
 			       fuse_ino_t newparent_ino, const char *newname)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = fuse_req_fs(req);
 	struct bch_inode_unpacked dir_u, inode_u;
 	struct qstr qstr = QSTR(newname);
 	subvol_inum newparent	= map_root_ino(newparent_ino);
@@ -355,6 +753,9 @@ static void bcachefs_fuse_link(fuse_req_t req, fuse_ino_t ino,
 			    bch2_link_trans(trans, newparent, &dir_u,
 					    inum, &inode_u, &qstr));
 
+	fuse_inode_invalidate(c, newparent);
+	fuse_inode_invalidate(c, inum);
+
 	if (!ret) {
 		struct fuse_entry_param e = inode_to_entry(c, &inode_u);
 		fuse_reply_entry(req, &e);
@@ -366,6 +767,8 @@ static void bcachefs_fuse_link(fuse_req_t req, fuse_ino_t ino,
 static void bcachefs_fuse_open(fuse_req_t req, fuse_ino_t inum,
 			       struct fuse_file_info *fi)
 {
+	/* Without a struct fuse_file, I/O just isn't buffered: */
+	fi->fh			= (unsigned long) fuse_file_get(map_root_ino(inum), true);
 	fi->direct_io		= false;
 	fi->keep_cache		= true;
 	fi->cache_readdir	= true;
@@ -385,11 +788,11 @@ static void userbio_init(struct bio *bio, struct bio_vec *bv,
 
 static int get_inode_io_opts(struct bch_fs *c, subvol_inum inum, struct bch_io_opts *opts)
 {
-	struct bch_inode_unpacked inode;
-	if (bch2_inode_find_by_inum(c, inum, &inode))
+	struct fuse_inode_state s;
+	if (fuse_inode_get(c, inum, &s))
 		return -EINVAL;
 
-	bch2_inode_opts_get(opts, c, &inode);
+	*opts = s.io_opts;
 	return 0;
 }
 
@@ -406,6 +809,51 @@ static void bcachefs_fuse_write_endio(struct bch_write_op *op)
 }
 
 
+/*
+ * Page aligned buffers for data being read or written, reused across
+ * requests: requests bigger than FUSE_IO_BUF_SIZE get their own allocation.
+ */
+#define FUSE_IO_BUF_SIZE	(1U << 20)
+#define FUSE_IO_BUFS_CACHED	32
+
+static pthread_mutex_t	fuse_io_bufs_lock = PTHREAD_MUTEX_INITIALIZER;
+static void		*fuse_io_bufs;
+static unsigned		fuse_io_bufs_nr;
+
+static void *fuse_io_buf_alloc(size_t size)
+{
+	void *buf = NULL;
+
+	if (size > FUSE_IO_BUF_SIZE)
+		return aligned_alloc(PAGE_SIZE, size);
+
+	pthread_mutex_lock(&fuse_io_bufs_lock);
+	if (fuse_io_bufs) {
+		buf = fuse_io_bufs;
+		fuse_io_bufs = *((void **) buf);
+		fuse_io_bufs_nr--;
+	}
+	pthread_mutex_unlock(&fuse_io_bufs_lock);
+
+	return buf ?: aligned_alloc(PAGE_SIZE, FUSE_IO_BUF_SIZE);
+}
+
+static void fuse_io_buf_free(void *buf, size_t size)
+{
+	if (buf && size <= FUSE_IO_BUF_SIZE) {
+		pthread_mutex_lock(&fuse_io_bufs_lock);
+		if (fuse_io_bufs_nr < FUSE_IO_BUFS_CACHED) {
+			*((void **) buf) = fuse_io_bufs;
+			fuse_io_bufs = buf;
+			fuse_io_bufs_nr++;
+			buf = NULL;
+		}
+		pthread_mutex_unlock(&fuse_io_bufs_lock);
+	}
+
+	free(buf);
+}
+
 struct fuse_align_io {
 	off_t		start;
 	size_t		pad_start;
@@ -484,49 +932,6 @@ static int read_aligned(struct bch_fs *c, subvol_inum inum, size_t aligned_size,
 	return -blk_status_to_errno(rbio.bio.bi_status);
 }
 
-static void bcachefs_fuse_read(fuse_req_t req, fuse_ino_t ino,
-			       size_t size, off_t offset,
-			       struct fuse_file_info *fi)
-{
-	subvol_inum inum = map_root_ino(ino);
-	struct bch_fs *c = fuse_req_userdata(req);
-
-	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_read(%llu, %zd, %lld)\n",
-		 inum, size, offset);
-
-	/* Check inode size. */
-	struct bch_inode_unpacked bi;
-	int ret = bch2_inode_find_by_inum(c, inum, &bi);
-	if (ret) {
-		fuse_reply_err(req, -ret);
-		return;
-	}
-
-	off_t end = min_t(u64, bi.bi_size, offset + size);
-	if (end <= offset) {
-		fuse_reply_buf(req, NULL, 0);
-		return;
-	}
-	size = end - offset;
-
-	struct fuse_align_io align = align_io(c, size, offset);
-
-	void *buf = aligned_alloc(PAGE_SIZE, align.size);
-	if (!buf) {
-		fuse_reply_err(req, ENOMEM);
-		return;
-	}
-
-	ret = read_aligned(c, inum, align.size, align.start, buf);
-
-	if (likely(!ret))
-		fuse_reply_buf(req, buf + align.pad_start, size);
-	else
-		fuse_reply_err(req, -ret);
-
-	free(buf);
-}
-
 static int inode_update_times(struct bch_fs *c, subvol_inum inum)
 {
 	struct btree_trans *trans;
@@ -562,148 +967,681 @@ err:
 	return ret;
 }
 
-static int write_aligned(struct bch_fs *c, subvol_inum inum,
-			 struct bch_io_opts io_opts, void *buf,
-			 size_t aligned_size, off_t aligned_offset,
-			 off_t new_i_size, size_t *written_out)
+static int write_aligned(struct bch_fs *c, subvol_inum inum,
+			 struct bch_io_opts io_opts, void *buf,
+			 size_t aligned_size, off_t aligned_offset,
+			 off_t new_i_size, size_t *written_out,
+			 s64 *i_sectors_delta)
+{
+
+	struct write_aligned_op_t w = { 0 }
+;
+	struct bch_write_op	*op = &w.op;
+	struct bio_vec		bv;
+
+	BUG_ON(aligned_size & (block_bytes(c) - 1));
+	BUG_ON(aligned_offset & (block_bytes(c) - 1));
+
+	*written_out = 0;
+	*i_sectors_delta = 0;
+
+	closure_init_stack(&w.cl);
+
+	bch2_write_op_init(op, c, io_opts); /* XXX reads from op?! */
+	op->write_point	= writepoint_hashed(0);
+	op->nr_replicas	= io_opts.data_replicas;
+	op->target	= io_opts.foreground_target;
+	op->subvol	= inum.subvol;
+	op->pos		= POS(inum.inum, aligned_offset >> 9);
+	op->new_i_size	= new_i_size;
+	op->end_io = bcachefs_fuse_write_endio;
+
+	userbio_init(&op->wbio.bio, &bv, buf, aligned_size);
+	bio_set_op_attrs(&op->wbio.bio, REQ_OP_WRITE, REQ_SYNC);
+
+	if (bch2_disk_reservation_get(c, &op->res, aligned_size >> 9,
+				      op->nr_replicas, 0)) {
+		/* XXX: use check_range_allocated like dio write path */
+		return -ENOSPC;
+	}
+
+	closure_get(&w.cl);
+
+	closure_call(&op->cl, bch2_write, NULL, NULL);
+
+	closure_sync(&w.cl);
+
+	if (!op->error)
+		*written_out = op->written << 9;
+	*i_sectors_delta = op->i_sectors_delta;
+
+	return op->error;
+}
+
+/*
+ * @bufv may be in memory, or in a pipe libfuse spliced the request into: it's
+ * copied directly into the buffer that's submitted to bch2_write().
+ */
+static int fuse_write_direct(struct bch_fs *c, subvol_inum inum,
+			     struct fuse_bufvec *bufv, off_t offset,
+			     size_t *written_out)
+{
+	struct bch_io_opts	io_opts;
+	size_t			size = fuse_buf_size(bufv);
+	size_t			aligned_written;
+	int			ret = 0;
+
+	struct fuse_align_io align = align_io(c, size, offset);
+	void *aligned_buf = fuse_io_buf_alloc(align.size);
+	BUG_ON(!aligned_buf);
+
+	pthread_rwlock_t *lock = fuse_write_lock(inum, align.pad_start || align.pad_end);
+
+	if (get_inode_io_opts(c, inum, &io_opts)) {
+		ret = -ENOENT;
+		goto err;
+	}
+
+	/* Realign the data and read in start and end, if needed */
+
+	/* Read partial start data. */
+	if (align.pad_start) {
+		memset(aligned_buf, 0, block_bytes(c));
+
+		ret = read_aligned(c, inum, block_bytes(c), align.start,
+				   aligned_buf);
+		if (ret)
+			goto err;
+	}
+
+	/*
+	 * Read partial end data. If the whole write fits in one block, the
+	 * start data and the end data are the same so this isn't needed.
+	 */
+	if (align.pad_end &&
+	    !(align.pad_start && align.size == block_bytes(c))) {
+		off_t partial_end_start = align.end - block_bytes(c);
+		size_t buf_offset = align.size - block_bytes(c);
+
+		memset(aligned_buf + buf_offset, 0, block_bytes(c));
+
+		ret = read_aligned(c, inum, block_bytes(c), partial_end_start,
+				   aligned_buf + buf_offset);
+		if (ret)
+			goto err;
+	}
+
+	/* Overlay what we want to write. */
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+	dst.buf[0].mem = aligned_buf + align.pad_start;
+
+	ssize_t copied = fuse_buf_copy(&dst, bufv, 0);
+	if (copied != size) {
+		ret = copied < 0 ? copied : -EIO;
+		goto err;
+	}
+
+	/* Actually write. */
+	s64 i_sectors_delta;
+	ret = write_aligned(c, inum, io_opts, aligned_buf,
+			    align.size, align.start,
+			    offset + size, &aligned_written,
+			    &i_sectors_delta);
+
+	/* Figure out how many unaligned bytes were written. */
+	size_t written = align_fix_up_bytes(&align, aligned_written);
+	BUG_ON(written > size);
+
+	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_write: wrote %zd bytes\n",
+		 written);
+
+	if (written > 0)
+		ret = 0;
+
+	/*
+	 * Update inode times: normally just in the inode cache, they're
+	 * written back later:
+	 */
+	if (!ret &&
+	    !fuse_inode_written(inum, offset + written, i_sectors_delta,
+				bch2_current_time(c)))
+		ret = inode_update_times(c, inum);
+
+	if (!ret) {
+		BUG_ON(written == 0);
+		*written_out = written;
+	}
+err:
+	pthread_rwlock_unlock(lock);
+	fuse_io_buf_free(aligned_buf, align.size);
+	return ret;
+}
+
+/*
+ * Open files:
+ *
+ * Every inode that's open has a struct fuse_file, shared by all its file
+ * handles, with a small page cache in front of the read and write paths:
+ *
+ * - Small writes are copied into a write-back buffer covering a single, block
+ *   aligned range, and merged with the writes before them when they overlap
+ *   or are contiguous with what's buffered. The buffer is written out with a
+ *   single bch2_write() when a write doesn't fit, and on flush, fsync,
+ *   release, getattr, setattr and overlapping reads: so the partial head
+ *   block is read in once when the buffer is started, and the partial tail
+ *   block once when it's written out, instead of on every write. Like the
+ *   kernel's page cache, errors from writing out buffered data are returned
+ *   by whatever triggered it.
+ *
+ * - A read that starts where the previous one ended starts an asynchronous
+ *   read of the next FUSE_RA_SIZE bytes into one of two readahead windows,
+ *   which later reads are then served from.
+ *
+ * @lock serializes I/O to the file; writes invalidate overlapping readahead
+ * windows.
+ */
+#define FUSE_FILE_HASH_BITS	8
+#define FUSE_WB_BUF_SIZE	FUSE_IO_BUF_SIZE
+#define FUSE_RA_SIZE		FUSE_IO_BUF_SIZE
+#define FUSE_RA_WINDOWS		2
+
+struct fuse_ra_window {
+	u64			start;
+	u64			len;
+	bool			in_flight;
+	int			error;
+	void			*buf;
+	struct closure		cl;
+	struct bch_read_bio	rbio;
+	struct bio_vec		bv;
+};
+
+struct fuse_file {
+	struct hlist_node	hash;
+	subvol_inum		inum;
+	unsigned		ref;
+
+	pthread_mutex_t		lock;
+
+	/* Buffered writes: data for [wb_start, wb_end), wb_start is aligned */
+	void			*wb_buf;
+	u64			wb_start;
+	u64			wb_end;
+
+	/* End of the previous read, for detecting sequential reads: */
+	u64			ra_next;
+	struct fuse_ra_window	ra[FUSE_RA_WINDOWS];
+};
+
+static struct {
+	pthread_mutex_t		lock;
+	struct hlist_head	table[1U << FUSE_FILE_HASH_BITS];
+} fuse_files = {
+	.lock	= PTHREAD_MUTEX_INITIALIZER,
+};
+
+static struct hlist_head *fuse_file_bucket(subvol_inum inum)
+{
+	return &fuse_files.table[hash_64(inum.inum ^ ((u64) inum.subvol << 32),
+					 FUSE_FILE_HASH_BITS)];
+}
+
+static struct fuse_file *fuse_file_find(subvol_inum inum)
+{
+	struct fuse_file *f;
+
+	hlist_for_each_entry(f, fuse_file_bucket(inum), hash)
+		if (f->inum.subvol == inum.subvol && f->inum.inum == inum.inum)
+			return f;
+	return NULL;
+}
+
+/* With @create false, only returns a file that's already open: */
+static struct fuse_file *fuse_file_get(subvol_inum inum, bool create)
+{
+	struct fuse_file *f;
+
+	pthread_mutex_lock(&fuse_files.lock);
+	f = fuse_file_find(inum);
+	if (f) {
+		f->ref++;
+	} else if (create && (f = calloc(1, sizeof(*f)))) {
+		f->inum	= inum;
+		f->ref	= 1;
+		pthread_mutex_init(&f->lock, NULL);
+		hlist_add_head(&f->hash, fuse_file_bucket(inum));
+	}
+	pthread_mutex_unlock(&fuse_files.lock);
+
+	return f;
+}
+
+static struct fuse_file *fuse_file_from_fi(struct fuse_file_info *fi)
+{
+	return fi ? (struct fuse_file *) (unsigned long) fi->fh : NULL;
+}
+
+static void fuse_ra_endio(struct bio *bio)
+{
+	struct fuse_ra_window *w =
+		container_of(bio, struct fuse_ra_window, rbio.bio);
+
+	w->error = -blk_status_to_errno(bio->bi_status);
+	closure_put(&w->cl);
+}
+
+static void fuse_ra_wait(struct fuse_ra_window *w)
+{
+	if (w->in_flight) {
+		closure_sync(&w->cl);
+		w->in_flight = false;
+	}
+}
+
+/* Returns the window [start, end) can be read from, if any: */
+static struct fuse_ra_window *fuse_ra_find(struct fuse_file *f,
+					   u64 start, u64 end)
+{
+	for (unsigned i = 0; i < FUSE_RA_WINDOWS; i++) {
+		struct fuse_ra_window *w = &f->ra[i];
+
+		if (w->len &&
+		    start >= w->start &&
+		    end <= w->start + w->len) {
+			fuse_ra_wait(w);
+			if (w->error) {
+				w->len = 0;
+				return NULL;
+			}
+			return w;
+		}
+	}
+
+	return NULL;
+}
+
+static void fuse_ra_invalidate(struct fuse_file *f, u64 start, u64 end)
+{
+	for (unsigned i = 0; i < FUSE_RA_WINDOWS; i++) {
+		struct fuse_ra_window *w = &f->ra[i];
+
+		if (w->len &&
+		    start < w->start + w->len &&
+		    end > w->start) {
+			fuse_ra_wait(w);
+			w->len = 0;
+		}
+	}
+}
+
+/*
+ * Start reading [start, start + FUSE_RA_SIZE) into whichever window isn't
+ * @cur, unless a window already has it:
+ */
+static void fuse_ra_start(struct bch_fs *c, struct fuse_file *f,
+			  struct fuse_ra_window *cur, u64 start, u64 i_size)
+{
+	struct fuse_ra_window *w = NULL;
+	struct bch_io_opts io_opts;
+	u64 end = min_t(u64, start + FUSE_RA_SIZE,
+			round_up(i_size, block_bytes(c)));
+
+	if (start >= end)
+		return;
+
+	for (unsigned i = 0; i < FUSE_RA_WINDOWS; i++) {
+		if (f->ra[i].len && f->ra[i].start == start)
+			return;
+		if (&f->ra[i] != cur)
+			w = &f->ra[i];
+	}
+
+	if (get_inode_io_opts(c, f->inum, &io_opts))
+		return;
+
+	fuse_ra_wait(w);
+	w->len = 0;
+
+	if (!w->buf)
+		w->buf = fuse_io_buf_alloc(FUSE_RA_SIZE);
+	if (!w->buf)
+		return;
+
+	w->start	= start;
+	w->len		= end - start;
+	w->error	= 0;
+	w->in_flight	= true;
+
+	userbio_init(&w->rbio.bio, &w->bv, w->buf, w->len);
+	bio_set_op_attrs(&w->rbio.bio, REQ_OP_READ, REQ_RAHEAD);
+	w->rbio.bio.bi_iter.bi_sector = start >> 9;
+
+	closure_init_stack(&w->cl);
+	closure_get(&w->cl);
+
+	bch2_read(c, rbio_init(&w->rbio.bio, c, io_opts, fuse_ra_endio), f->inum);
+}
+
+/* Write out buffered writes, if any: */
+static int fuse_file_flush(struct bch_fs *c, struct fuse_file *f)
+{
+	struct fuse_inode_state s;
+	unsigned bs = block_bytes(c);
+	size_t written;
+	s64 i_sectors_delta;
+
+	if (f->wb_end == f->wb_start)
+		return 0;
+
+	u64 aligned_end = round_up(f->wb_end, bs);
+	int ret = fuse_inode_get(c, f->inum, &s);
+	if (ret)
+		goto out;
+
+	/* Read-modify-write of the tail block must exclude other writes: */
+	pthread_rwlock_t *lock = fuse_write_lock(f->inum, aligned_end != f->wb_end);
+
+	/* Partial tail block: */
+	if (aligned_end != f->wb_end) {
+		void *tail = f->wb_buf + f->wb_end - f->wb_start;
+		size_t tail_bytes = aligned_end - f->wb_end;
+
+		memset(tail, 0, tail_bytes);
+
+		if (s.bi.bi_size > f->wb_end) {
+			void *buf = fuse_io_buf_alloc(bs);
+			if (!buf) {
+				ret = -ENOMEM;
+				goto unlock;
+			}
+
+			ret = read_aligned(c, f->inum, bs, aligned_end - bs, buf);
+			if (!ret)
+				memcpy(tail, buf + bs - tail_bytes, tail_bytes);
+			fuse_io_buf_free(buf, bs);
+			if (ret)
+				goto unlock;
+		}
+	}
+
+	ret = write_aligned(c, f->inum, s.io_opts, f->wb_buf,
+			    aligned_end - f->wb_start, f->wb_start,
+			    f->wb_end, &written, &i_sectors_delta);
+unlock:
+	pthread_rwlock_unlock(lock);
+	if (ret)
+		goto out;
+
+	if (!fuse_inode_written(f->inum, f->wb_end, i_sectors_delta,
+				bch2_current_time(c)))
+		ret = inode_update_times(c, f->inum);
+out:
+	f->wb_start = f->wb_end = 0;
+	fuse_io_buf_free(f->wb_buf, FUSE_WB_BUF_SIZE);
+	f->wb_buf = NULL;
+	return ret;
+}
+
+static int fuse_file_write_buffered(struct bch_fs *c, struct fuse_file *f,
+				    struct fuse_bufvec *bufv, off_t offset)
+{
+	size_t size = fuse_buf_size(bufv);
+	u64 end = offset + size;
+	int ret;
+
+	if (f->wb_end != f->wb_start &&
+	    (offset < f->wb_start ||
+	     offset > f->wb_end ||
+	     end - f->wb_start > FUSE_WB_BUF_SIZE)) {
+		ret = fuse_file_flush(c, f);
+		if (ret)
+			return ret;
+	}
+
+	if (f->wb_end == f->wb_start) {
+		f->wb_buf = fuse_io_buf_alloc(FUSE_WB_BUF_SIZE);
+		if (!f->wb_buf)
+			return -ENOMEM;
+
+		f->wb_start = f->wb_end = round_down(offset, block_bytes(c));
+
+		/* Partial head block: */
+		if (offset != f->wb_start) {
+			pthread_rwlock_t *lock = fuse_write_lock(f->inum, true);
+			ret = read_aligned(c, f->inum, block_bytes(c),
+					   f->wb_start, f->wb_buf);
+			pthread_rwlock_unlock(lock);
+			if (ret) {
+				fuse_io_buf_free(f->wb_buf, FUSE_WB_BUF_SIZE);
+				f->wb_buf = NULL;
+				f->wb_end = f->wb_start = 0;
+				return ret;
+			}
+			f->wb_end = offset;
+		}
+	}
+
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+	dst.buf[0].mem = f->wb_buf + offset - f->wb_start;
+
+	ssize_t copied = fuse_buf_copy(&dst, bufv, 0);
+	if (copied != size)
+		return copied < 0 ? copied : -EIO;
+
+	f->wb_end = max(f->wb_end, end);
+	return 0;
+}
+
+static void fuse_file_put(struct bch_fs *c, struct fuse_file *f)
 {
+	bool last;
 
-	struct write_aligned_op_t w = { 0 }
-;
-	struct bch_write_op	*op = &w.op;
-	struct bio_vec		bv;
+	pthread_mutex_lock(&fuse_files.lock);
+	last = !--f->ref;
+	if (last)
+		hlist_del(&f->hash);
+	pthread_mutex_unlock(&fuse_files.lock);
 
-	BUG_ON(aligned_size & (block_bytes(c) - 1));
-	BUG_ON(aligned_offset & (block_bytes(c) - 1));
+	if (!last)
+		return;
 
-	*written_out = 0;
+	fuse_file_flush(c, f);
 
-	closure_init_stack(&w.cl);
+	for (unsigned i = 0; i < FUSE_RA_WINDOWS; i++) {
+		fuse_ra_wait(&f->ra[i]);
+		fuse_io_buf_free(f->ra[i].buf, FUSE_RA_SIZE);
+	}
 
-	bch2_write_op_init(op, c, io_opts); /* XXX reads from op?! */
-	op->write_point	= writepoint_hashed(0);
-	op->nr_replicas	= io_opts.data_replicas;
-	op->target	= io_opts.foreground_target;
-	op->subvol	= inum.subvol;
-	op->pos		= POS(inum.inum, aligned_offset >> 9);
-	op->new_i_size	= new_i_size;
-	op->end_io = bcachefs_fuse_write_endio;
+	pthread_mutex_destroy(&f->lock);
+	free(f);
+}
 
-	userbio_init(&op->wbio.bio, &bv, buf, aligned_size);
-	bio_set_op_attrs(&op->wbio.bio, REQ_OP_WRITE, REQ_SYNC);
+/*
+ * Returns @inum's open file, if it's open, locked and with buffered writes
+ * written out:
+ */
+static struct fuse_file *fuse_file_lock(struct bch_fs *c, subvol_inum inum,
+					int *ret)
+{
+	struct fuse_file *f = fuse_file_get(inum, false);
 
-	if (bch2_disk_reservation_get(c, &op->res, aligned_size >> 9,
-				      op->nr_replicas, 0)) {
-		/* XXX: use check_range_allocated like dio write path */
-		return -ENOSPC;
+	*ret = 0;
+	if (f) {
+		pthread_mutex_lock(&f->lock);
+		*ret = fuse_file_flush(c, f);
 	}
+	return f;
+}
 
-	closure_get(&w.cl);
-
-	closure_call(&op->cl, bch2_write, NULL, NULL);
-
-	closure_sync(&w.cl);
+static void fuse_file_unlock(struct bch_fs *c, struct fuse_file *f)
+{
+	if (f) {
+		pthread_mutex_unlock(&f->lock);
+		fuse_file_put(c, f);
+	}
+}
 
-	if (!op->error)
-		*written_out = op->written << 9;
+/* Writes out buffered writes of files still open: */
+static void fuse_files_exit(struct bch_fs *c)
+{
+	for (unsigned i = 0; i < ARRAY_SIZE(fuse_files.table); i++) {
+		struct fuse_file *f;
 
-	return op->error;
+		while ((f = hlist_entry_safe(fuse_files.table[i].next,
+					     struct fuse_file, hash))) {
+			f->ref = 1;
+			fuse_file_put(c, f);
+		}
+	}
 }
 
-static void bcachefs_fuse_write(fuse_req_t req, fuse_ino_t ino,
-				const char *buf, size_t size,
-				off_t offset,
-				struct fuse_file_info *fi)
+static void do_fuse_write(fuse_req_t req, fuse_ino_t ino,
+			  struct fuse_bufvec *bufv, off_t offset,
+			  struct fuse_file_info *fi)
 {
 	subvol_inum inum = map_root_ino(ino);
-	struct bch_fs *c	= fuse_req_userdata(req);
-	struct bch_io_opts	io_opts;
-	size_t			aligned_written;
-	int			ret = 0;
+	struct bch_fs *c	= fuse_req_fs(req);
+	struct fuse_file *f	= fuse_file_from_fi(fi);
+	size_t			size = fuse_buf_size(bufv);
+	size_t			written = size;
+	int			ret;
 
 	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_write(%llu, %zd, %lld)\n",
 		 inum, size, offset);
 
-	struct fuse_align_io align = align_io(c, size, offset);
-	void *aligned_buf = aligned_alloc(PAGE_SIZE, align.size);
-	BUG_ON(!aligned_buf);
-
-	if (get_inode_io_opts(c, inum, &io_opts)) {
-		ret = -ENOENT;
-		goto err;
+	if (!f) {
+		ret = fuse_write_direct(c, inum, bufv, offset, &written);
+		goto out;
 	}
 
-	/* Realign the data and read in start and end, if needed */
+	pthread_mutex_lock(&f->lock);
+	fuse_ra_invalidate(f, offset, offset + size);
 
-	/* Read partial start data. */
-	if (align.pad_start) {
-		memset(aligned_buf, 0, block_bytes(c));
+	/* Big writes don't need merging, and go straight to bch2_write(): */
+	ret = size < FUSE_WB_BUF_SIZE / 2
+		? fuse_file_write_buffered(c, f, bufv, offset)
+		: fuse_file_flush(c, f) ?:
+		  fuse_write_direct(c, inum, bufv, offset, &written);
+	pthread_mutex_unlock(&f->lock);
+out:
+	if (!ret)
+		fuse_reply_write(req, written);
+	else
+		fuse_reply_err(req, -ret);
+}
 
-		ret = read_aligned(c, inum, block_bytes(c), align.start,
-				   aligned_buf);
-		if (ret)
-			goto err;
-	}
+static void bcachefs_fuse_read(fuse_req_t req, fuse_ino_t ino,
+			       size_t size, off_t offset,
+			       struct fuse_file_info *fi)
+{
+	subvol_inum inum = map_root_ino(ino);
+	struct bch_fs *c = fuse_req_fs(req);
+	struct fuse_file *f = fuse_file_from_fi(fi);
+	struct fuse_ra_window *w = NULL;
+	int ret = 0;
 
-	/*
-	 * Read partial end data. If the whole write fits in one block, the
-	 * start data and the end data are the same so this isn't needed.
-	 */
-	if (align.pad_end &&
-	    !(align.pad_start && align.size == block_bytes(c))) {
-		off_t partial_end_start = align.end - block_bytes(c);
-		size_t buf_offset = align.size - block_bytes(c);
+	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_read(%llu, %zd, %lld)\n",
+		 inum.inum, size, offset);
 
-		memset(aligned_buf + buf_offset, 0, block_bytes(c));
+	if (f) {
+		pthread_mutex_lock(&f->lock);
 
-		ret = read_aligned(c, inum, block_bytes(c), partial_end_start,
-				   aligned_buf + buf_offset);
-		if (ret)
-			goto err;
+		/* Reads have to see buffered writes: */
+		if (f->wb_end != f->wb_start &&
+		    offset < f->wb_end &&
+		    offset + size > f->wb_start)
+			ret = fuse_file_flush(c, f);
 	}
 
-	/* Overlay what we want to write. */
-	memcpy(aligned_buf + align.pad_start, buf, size);
+	/* Check inode size. */
+	struct fuse_inode_state s;
+	ret = ret ?: fuse_inode_get(c, inum, &s);
+	if (ret) {
+		fuse_reply_err(req, -ret);
+		goto out;
+	}
 
-	/* Actually write. */
-	ret = write_aligned(c, inum, io_opts, aligned_buf,
-			    align.size, align.start,
-			    offset + size, &aligned_written);
+	off_t end = min_t(u64, s.bi.bi_size, offset + size);
+	if (end <= offset) {
+		fuse_reply_buf(req, NULL, 0);
+		goto out;
+	}
+	size = end - offset;
 
-	/* Figure out how many unaligned bytes were written. */
-	size_t written = align_fix_up_bytes(&align, aligned_written);
-	BUG_ON(written > size);
+	bool sequential = f && offset == f->ra_next;
+	if (f) {
+		f->ra_next = end;
+		w = fuse_ra_find(f, offset, end);
+	}
 
-	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_write: wrote %zd bytes\n",
-		 written);
+	if (w) {
+		struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(size);
 
-	if (written > 0)
-		ret = 0;
+		bufv.buf[0].mem = w->buf + offset - w->start;
+		fuse_reply_data(req, &bufv, 0);
+	} else {
+		struct fuse_align_io align = align_io(c, size, offset);
+
+		/*
+		 * f->lock covers the write buffer and readahead windows, not
+		 * uncached reads:
+		 */
+		if (f)
+			pthread_mutex_unlock(&f->lock);
+
+		void *buf = fuse_io_buf_alloc(align.size);
+		ret = buf
+			? read_aligned(c, inum, align.size, align.start, buf)
+			: -ENOMEM;
+
+		if (likely(!ret)) {
+			struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(size);
+
+			bufv.buf[0].mem = buf + align.pad_start;
+			fuse_reply_data(req, &bufv, 0);
+		} else {
+			fuse_reply_err(req, -ret);
+		}
 
-	/*
-	 * Update inode times.
-	 * TODO: Integrate with bch2_extent_update()
-	 */
-	if (!ret)
-		ret = inode_update_times(c, inum);
+		fuse_io_buf_free(buf, align.size);
 
-	if (!ret) {
-		BUG_ON(written == 0);
-		fuse_reply_write(req, written);
-		free(aligned_buf);
-		return;
+		if (f)
+			pthread_mutex_lock(&f->lock);
 	}
 
-err:
-	fuse_reply_err(req, -ret);
-	free(aligned_buf);
+	/* After replying, so that readahead doesn't delay this read: */
+	if (sequential && !ret)
+		fuse_ra_start(c, f, w,
+			      w ? w->start + w->len : round_down(end, block_bytes(c)),
+			      s.bi.bi_size);
+out:
+	if (f)
+		pthread_mutex_unlock(&f->lock);
+}
+
+static void bcachefs_fuse_write(fuse_req_t req, fuse_ino_t ino,
+				const char *buf, size_t size,
+				off_t offset,
+				struct fuse_file_info *fi)
+{
+	struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(size);
+
+	bufv.buf[0].mem = (void *) buf;
+	do_fuse_write(req, ino, &bufv, offset, fi);
+}
+
+static void bcachefs_fuse_write_buf(fuse_req_t req, fuse_ino_t ino,
+				    struct fuse_bufvec *bufv, off_t offset,
+				    struct fuse_file_info *fi)
+{
+	do_fuse_write(req, ino, bufv, offset, fi);
 }
 
 static void bcachefs_fuse_symlink(fuse_req_t req, const char *link,
 				  fuse_ino_t dir_ino, const char *name)
 {
 	subvol_inum dir = map_root_ino(dir_ino);
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = fuse_req_fs(req);
 	struct bch_inode_unpacked new_inode;
 	size_t link_len = strlen(link);
 	int ret;
@@ -712,6 +1650,7 @@ static void bcachefs_fuse_symlink(fuse_req_t req, const char *link,
 		 link, dir.inum, name);
 
 	ret = do_create(c, dir, name, S_IFLNK|S_IRWXUGO, 0, &new_inode);
+	fuse_inode_invalidate(c, dir);
 	if (ret)
 		goto err;
 
@@ -731,9 +1670,10 @@ static void bcachefs_fuse_symlink(fuse_req_t req, const char *link,
 	subvol_inum inum = (subvol_inum) { dir.subvol, new_inode.bi_inum };
 
 	size_t aligned_written;
+	s64 i_sectors_delta;
 	ret = write_aligned(c, inum, io_opts, aligned_buf,
 			    align.size, align.start, link_len + 1,
-			    &aligned_written);
+			    &aligned_written, &i_sectors_delta);
 	free(aligned_buf);
 
 	if (ret)
@@ -743,6 +1683,7 @@ static void bcachefs_fuse_symlink(fuse_req_t req, const char *link,
 	BUG_ON(written != link_len + 1); // TODO: handle short
 
 	ret = inode_update_times(c, inum);
+	fuse_inode_invalidate(c, inum);
 	if (ret)
 		goto err;
 
@@ -759,17 +1700,17 @@ err:
 static void bcachefs_fuse_readlink(fuse_req_t req, fuse_ino_t ino)
 {
 	subvol_inum inum = map_root_ino(ino);
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = fuse_req_fs(req);
 	char *buf = NULL;
 
 	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_readlink(%llu)\n", inum.inum);
 
-	struct bch_inode_unpacked bi;
-	int ret = bch2_inode_find_by_inum(c, inum, &bi);
+	struct fuse_inode_state s;
+	int ret = fuse_inode_get(c, inum, &s);
 	if (ret)
 		goto err;
 
-	struct fuse_align_io align = align_io(c, bi.bi_size, 0);
+	struct fuse_align_io align = align_io(c, s.bi.bi_size, 0);
 
 	ret = -ENOMEM;
 	buf = aligned_alloc(PAGE_SIZE, align.size);
@@ -791,36 +1732,66 @@ err:
 	free(buf);
 }
 
-#if 0
 /*
  * FUSE flush is essentially the close() call, however it is not guaranteed
  * that one flush happens per open/create.
  *
- * It doesn't have to do anything, and is mostly relevant for NFS-style
- * filesystems where close has some relationship to caching.
+ * It's mostly relevant for NFS-style filesystems where close has some
+ * relationship to caching - we write back timestamps from the inode cache.
  */
-static void bcachefs_fuse_flush(fuse_req_t req, fuse_ino_t inum,
+static int fuse_file_sync(struct bch_fs *c, fuse_ino_t ino,
+			  struct fuse_file_info *fi)
+{
+	struct fuse_file *f = fuse_file_from_fi(fi);
+	int ret = 0;
+
+	if (f) {
+		pthread_mutex_lock(&f->lock);
+		ret = fuse_file_flush(c, f);
+		pthread_mutex_unlock(&f->lock);
+	}
+
+	return ret ?: fuse_inode_flush_times(c, map_root_ino(ino));
+}
+
+static void bcachefs_fuse_flush(fuse_req_t req, fuse_ino_t ino,
 				struct fuse_file_info *fi)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = fuse_req_fs(req);
+
+	fuse_reply_err(req, -fuse_file_sync(c, ino, fi));
 }
 
-static void bcachefs_fuse_release(fuse_req_t req, fuse_ino_t inum,
+static void bcachefs_fuse_release(fuse_req_t req, fuse_ino_t ino,
 				  struct fuse_file_info *fi)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = fuse_req_fs(req);
+	struct fuse_file *f = fuse_file_from_fi(fi);
+
+	int ret = fuse_file_sync(c, ino, fi);
+
+	if (f)
+		fuse_file_put(c, f);
+
+	fuse_reply_err(req, -ret);
 }
 
-static void bcachefs_fuse_fsync(fuse_req_t req, fuse_ino_t inum, int datasync,
+static void bcachefs_fuse_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
 				struct fuse_file_info *fi)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = fuse_req_fs(req);
+
+	int ret = fuse_file_sync(c, ino, fi) ?:
+		bch2_journal_flush(&c->journal);
+
+	fuse_reply_err(req, -ret);
 }
 
+#if 0
 static void bcachefs_fuse_opendir(fuse_req_t req, fuse_ino_t inum,
 				  struct fuse_file_info *fi)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = fuse_req_fs(req);
 }
 #endif
 
@@ -895,7 +1866,14 @@ static int fuse_filldir(struct dir_context *_ctx,
 	return 0;
 }
 
-static bool handle_dots(struct fuse_dir_context *ctx, fuse_ino_t dir)
+/* For "..": the root has no dirent pointing to it, and is its own parent */
+static u64 fuse_dir_parent(struct bch_inode_unpacked *dir)
+{
+	return dir->bi_dir ?: dir->bi_inum;
+}
+
+static bool handle_dots(struct fuse_dir_context *ctx, fuse_ino_t dir,
+			fuse_ino_t parent)
 {
 	if (ctx->ctx.pos == 0) {
 		if (fuse_filldir(&ctx->ctx, ".", 1, ctx->ctx.pos,
@@ -906,7 +1884,7 @@ static bool handle_dots(struct fuse_dir_context *ctx, fuse_ino_t dir)
 
 	if (ctx->ctx.pos == 1) {
 		if (fuse_filldir(&ctx->ctx, "..", 2, ctx->ctx.pos,
-				 /*TODO: parent*/ 1, DT_DIR) < 0)
+				 parent, DT_DIR) < 0)
 			return false;
 		ctx->ctx.pos = 2;
 	}
@@ -919,7 +1897,7 @@ static void bcachefs_fuse_readdir(fuse_req_t req, fuse_ino_t dir_ino,
 				  struct fuse_file_info *fi)
 {
 	subvol_inum dir = map_root_ino(dir_ino);
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = fuse_req_fs(req);
 	struct bch_inode_unpacked bi;
 	char *buf = calloc(size, 1);
 	struct fuse_dir_context ctx = {
@@ -943,7 +1921,7 @@ static void bcachefs_fuse_readdir(fuse_req_t req, fuse_ino_t dir_ino,
 		goto reply;
 	}
 
-	if (!handle_dots(&ctx, dir.inum))
+	if (!handle_dots(&ctx, dir.inum, fuse_dir_parent(&bi)))
 		goto reply;
 
 	ret = bch2_readdir(c, dir, &ctx.ctx);
@@ -959,30 +1937,251 @@ reply:
 	free(buf);
 }
 
-#if 0
-static void bcachefs_fuse_readdirplus(fuse_req_t req, fuse_ino_t dir,
+/*
+ * readdirplus: rather than a lookup per entry, dirents are read a reply's
+ * worth at a time and then the inodes they point to are looked up in inode
+ * number order, with a single prefetching iterator, in the same transaction.
+ */
+struct fuse_direntplus {
+	u64			pos;
+	subvol_inum		target;
+	bool			found;
+	struct bch_inode_unpacked inode;
+	char			name[BCH_NAME_MAX + 1];
+};
+
+typedef DARRAY(struct fuse_direntplus) fuse_direntplus_list;
+
+static int fuse_readdirplus_read_dirents(struct btree_trans *trans, fuse_req_t req,
+					 subvol_inum dir, u64 pos, size_t size,
+					 fuse_direntplus_list *entries)
+{
+	int ret = for_each_btree_key_in_subvolume_max(trans, iter, BTREE_ID_dirents,
+				POS(dir.inum, pos),
+				POS(dir.inum, U64_MAX),
+				dir.subvol, 0, k, ({
+		if (k.k->type != KEY_TYPE_dirent)
+			continue;
+
+		struct bkey_s_c_dirent d = bkey_s_c_to_dirent(k);
+		subvol_inum target;
+		int ret2 = bch2_dirent_read_target(trans, dir, d, &target);
+		if (ret2 > 0)
+			continue;
+
+		ret2 ?: ({
+			struct qstr name = bch2_dirent_get_name(d);
+			struct fuse_direntplus *e;
+
+			ret2 = darray_push(entries, ((struct fuse_direntplus) {
+				.pos	= d.k->p.offset,
+				.target	= target,
+			}));
+			if (!ret2) {
+				e = &darray_last(*entries);
+				memcpy(e->name, name.name, name.len);
+				e->name[name.len] = '\0';
+
+				size_t len = fuse_add_direntry_plus(req, NULL, 0, e->name, NULL, 0);
+				if (len > size) {
+					entries->nr--;
+					ret2 = 1;
+				} else {
+					size -= len;
+				}
+			}
+			ret2;
+		});
+	}));
+
+	return ret < 0 ? ret : 0;
+}
+
+static int fuse_direntplus_inum_cmp(const void *_l, const void *_r)
+{
+	const struct fuse_direntplus * const *l = _l, * const *r = _r;
+
+	return cmp_int((*l)->target.inum, (*r)->target.inum);
+}
+
+static int fuse_readdirplus_lookup_inodes(struct btree_trans *trans, subvol_inum dir,
+					  struct fuse_direntplus **sorted, size_t nr)
+{
+	struct btree_iter iter;
+	u32 snapshot;
+	int ret = bch2_subvolume_get_snapshot(trans, dir.subvol, &snapshot);
+	if (ret)
+		return ret;
+
+	bch2_trans_iter_init(trans, &iter, BTREE_ID_inodes, SPOS(0, 0, snapshot),
+			     BTREE_ITER_prefetch);
+
+	for (size_t i = 0; i < nr && !ret; i++) {
+		struct fuse_direntplus *e = sorted[i];
+
+		if (e->target.subvol != dir.subvol) {
+			/* subvolume root: */
+			ret = bch2_inode_find_by_inum_trans(trans, e->target, &e->inode);
+		} else {
+			bch2_btree_iter_set_pos(&iter, SPOS(0, e->target.inum, snapshot));
+
+			struct bkey_s_c k = bch2_btree_iter_peek_slot(&iter);
+			ret = bkey_err(k) ?:
+				(bkey_is_inode(k.k)
+				 ? bch2_inode_unpack(k, &e->inode)
+				 : -BCH_ERR_ENOENT_inode);
+		}
+
+		/* raced with an unlink: */
+		e->found = !ret;
+		if (bch2_err_matches(ret, ENOENT))
+			ret = 0;
+	}
+
+	bch2_trans_iter_exit(trans, &iter);
+	return ret;
+}
+
+static size_t fuse_readdirplus_dots(fuse_req_t req, struct bch_fs *c,
+				    struct bch_inode_unpacked *dir,
+				    char *buf, size_t size, off_t *off)
+{
+	size_t len, used = 0;
+
+	if (*off == 0) {
+		struct fuse_entry_param e = { .attr = inode_to_stat(c, dir) };
+
+		len = fuse_add_direntry_plus(req, buf, size, ".", &e, 1);
+		if (len > size)
+			return used;
+		used += len;
+		*off = 1;
+	}
+
+	if (*off == 1) {
+		struct fuse_entry_param e = {
+			.attr.st_ino	= unmap_root_ino(fuse_dir_parent(dir)),
+			.attr.st_mode	= S_IFDIR,
+		};
+
+		len = fuse_add_direntry_plus(req, buf + used, size - used, "..", &e, 2);
+		if (len > size - used)
+			return used;
+		used += len;
+		*off = 2;
+	}
+
+	return used;
+}
+
+static void bcachefs_fuse_readdirplus(fuse_req_t req, fuse_ino_t dir_ino,
 				      size_t size, off_t off,
 				      struct fuse_file_info *fi)
 {
+	subvol_inum dir = map_root_ino(dir_ino);
+	struct bch_fs *c = fuse_req_fs(req);
+	struct bch_inode_unpacked bi;
+	fuse_direntplus_list entries = {};
+	struct fuse_direntplus **sorted = NULL;
+	char *buf = calloc(size, 1);
+	size_t used = 0;
+	int ret;
+
+	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_readdirplus(dir=%llu, size=%zu, "
+		 "off=%lld)\n", dir.inum, size, off);
+
+	ret = bch2_inode_find_by_inum(c, dir, &bi);
+	if (ret)
+		goto reply;
+
+	if (!S_ISDIR(bi.bi_mode)) {
+		ret = -ENOTDIR;
+		goto reply;
+	}
+
+	fuse_inode_get_cached(dir, &bi);
+
+	used = fuse_readdirplus_dots(req, c, &bi, buf, size, &off);
+	if (off < 2)
+		goto reply;
 
+	struct btree_trans *trans = bch2_trans_get(c);
+	u64 pos = off;
+
+	/*
+	 * An empty reply ends the listing: if every entry in a batch raced
+	 * with an unlink, go on to the next batch:
+	 */
+	do {
+		entries.nr = 0;
+		ret = fuse_readdirplus_read_dirents(trans, req, dir, pos, size - used, &entries);
+		if (ret || !entries.nr)
+			break;
+
+		pos = darray_last(entries).pos + 1;
+
+		kfree(sorted);
+		sorted = kmalloc_array(entries.nr, sizeof(sorted[0]), GFP_KERNEL);
+		if (!sorted) {
+			ret = -ENOMEM;
+			break;
+		}
+
+		for (size_t i = 0; i < entries.nr; i++)
+			sorted[i] = &entries.data[i];
+		sort(sorted, entries.nr, sizeof(sorted[0]), fuse_direntplus_inum_cmp, NULL);
+
+		ret = lockrestart_do(trans,
+			fuse_readdirplus_lookup_inodes(trans, dir, sorted, entries.nr));
+		if (ret)
+			break;
+
+		darray_for_each(entries, e) {
+			if (!e->found)
+				continue;
+
+			fuse_inode_get_cached(e->target, &e->inode);
+
+			struct fuse_entry_param ep = inode_to_entry(c, &e->inode);
+			size_t len = fuse_add_direntry_plus(req, buf + used, size - used,
+							    e->name, &ep, e->pos + 1);
+			if (len > size - used)
+				break;
+			used += len;
+		}
+	} while (!used);
+
+	bch2_trans_put(trans);
+reply:
+	if (!ret) {
+		fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_readdirplus reply %zd\n", used);
+		fuse_reply_buf(req, buf, used);
+	} else {
+		fuse_reply_err(req, -ret);
+	}
+
+	kfree(sorted);
+	darray_exit(&entries);
+	free(buf);
 }
 
+#if 0
 static void bcachefs_fuse_releasedir(fuse_req_t req, fuse_ino_t inum,
 				     struct fuse_file_info *fi)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = fuse_req_fs(req);
 }
 
 static void bcachefs_fuse_fsyncdir(fuse_req_t req, fuse_ino_t inum, int datasync,
 				   struct fuse_file_info *fi)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = fuse_req_fs(req);
 }
 #endif
 
 static void bcachefs_fuse_statfs(fuse_req_t req, fuse_ino_t inum)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = fuse_req_fs(req);
 	struct bch_fs_usage_short usage = bch2_fs_usage_read_short(c);
 	unsigned shift = c->block_bits;
 	struct statvfs statbuf = {
@@ -1004,26 +2203,26 @@ static void bcachefs_fuse_setxattr(fuse_req_t req, fuse_ino_t inum,
 				   const char *name, const char *value,
 				   size_t size, int flags)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = fuse_req_fs(req);
 }
 
 static void bcachefs_fuse_getxattr(fuse_req_t req, fuse_ino_t inum,
 				   const char *name, size_t size)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = fuse_req_fs(req);
 
 	fuse_reply_xattr(req, );
 }
 
 static void bcachefs_fuse_listxattr(fuse_req_t req, fuse_ino_t inum, size_t size)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = fuse_req_fs(req);
 }
 
 static void bcachefs_fuse_removexattr(fuse_req_t req, fuse_ino_t inum,
 				      const char *name)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = fuse_req_fs(req);
 }
 #endif
 
@@ -1032,7 +2231,7 @@ static void bcachefs_fuse_create(fuse_req_t req, fuse_ino_t dir_ino,
 				 struct fuse_file_info *fi)
 {
 	subvol_inum dir = map_root_ino(dir_ino);
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = fuse_req_fs(req);
 	struct bch_inode_unpacked new_inode;
 	int ret;
 
@@ -1040,10 +2239,12 @@ static void bcachefs_fuse_create(fuse_req_t req, fuse_ino_t dir_ino,
 		 dir.inum, name, mode);
 
 	ret = do_create(c, dir, name, mode, 0, &new_inode);
+	fuse_inode_invalidate(c, dir);
 	if (ret)
 		goto err;
 
 	struct fuse_entry_param e = inode_to_entry(c, &new_inode);
+	fi->fh = (unsigned long) fuse_file_get(map_root_ino(e.ino), true);
 	fuse_reply_create(req, &e, fi);
 	return;
 err:
@@ -1051,18 +2252,11 @@ err:
 }
 
 #if 0
-static void bcachefs_fuse_write_buf(fuse_req_t req, fuse_ino_t inum,
-				    struct fuse_bufvec *bufv, off_t off,
-				    struct fuse_file_info *fi)
-{
-	struct bch_fs *c = fuse_req_userdata(req);
-}
-
 static void bcachefs_fuse_fallocate(fuse_req_t req, fuse_ino_t inum, int mode,
 				    off_t offset, off_t length,
 				    struct fuse_file_info *fi)
 {
-	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_fs *c = fuse_req_fs(req);
 }
 #endif
 
@@ -1083,12 +2277,12 @@ static const struct fuse_lowlevel_ops bcachefs_fuse_ops = {
 	.open		= bcachefs_fuse_open,
 	.read		= bcachefs_fuse_read,
 	.write		= bcachefs_fuse_write,
-	//.flush	= bcachefs_fuse_flush,
-	//.release	= bcachefs_fuse_release,
-	//.fsync	= bcachefs_fuse_fsync,
+	.flush		= bcachefs_fuse_flush,
+	.release	= bcachefs_fuse_release,
+	.fsync		= bcachefs_fuse_fsync,
 	//.opendir	= bcachefs_fuse_opendir,
 	.readdir	= bcachefs_fuse_readdir,
-	//.readdirplus	= bcachefs_fuse_readdirplus,
+	.readdirplus	= bcachefs_fuse_readdirplus,
 	//.releasedir	= bcachefs_fuse_releasedir,
 	//.fsyncdir	= bcachefs_fuse_fsyncdir,
 	.statfs		= bcachefs_fuse_statfs,
@@ -1103,7 +2297,7 @@ static const struct fuse_lowlevel_ops bcachefs_fuse_ops = {
 	.getlk		= bcachefs_fuse_getlk,
 	.setlk		= bcachefs_fuse_setlk,
 #endif
-	//.write_buf	= bcachefs_fuse_write_buf,
+	.write_buf	= bcachefs_fuse_write_buf,
 	//.fallocate	= bcachefs_fuse_fallocate,
 
 };
@@ -1191,6 +2385,10 @@ static void usage(char *argv[])
 	printf("Usage: %s fusemount [options] <dev>[:dev2:...] <mountpoint>\n",
 	       argv[0]);
 	printf("\n");
+	printf("Requests are handled by a pool of worker threads; use -s to\n"
+	       "handle them on a single thread, -o max_idle_threads=N to size\n"
+	       "the pool and -o clone_fd to give each thread its own /dev/fuse fd\n");
+	printf("\n");
 }
 
 int cmd_fusemount(int argc, char *argv[])
@@ -1254,11 +2452,15 @@ int cmd_fusemount(int argc, char *argv[])
 	for (i = 0; i < ctx.nr_devices; ++i)
                 printf("\t%s\n", ctx.devices[i]);
 
+	sysfs_server_enable();
+
 	c = bch2_fs_open(ctx.devices, ctx.nr_devices, bch_opts);
 	if (IS_ERR(c))
 		die("error opening %s: %s", ctx.devices_str,
 		    bch2_err_str(PTR_ERR(c)));
 
+	fuse_inode_cache_init(c);
+
 	/* Fuse */
 	se = fuse_session_new(&args, &bcachefs_fuse_ops,
 				sizeof(bcachefs_fuse_ops), c);
@@ -1287,7 +2489,16 @@ int cmd_fusemount(int argc, char *argv[])
 
 	fuse_daemonize(fuse_opts.foreground);
 
-	ret = fuse_session_loop(se);
+	if (fuse_opts.singlethread) {
+		ret = fuse_session_loop(se);
+	} else {
+		struct fuse_loop_config loop_config = {
+			.clone_fd		= fuse_opts.clone_fd,
+			.max_idle_threads	= fuse_opts.max_idle_threads,
+		};
+
+		ret = fuse_session_loop_mt(se, &loop_config);
+	}
 
 out:
 	if (se) {
@@ -1303,6 +2514,7 @@ out:
 	return ret ? 1 : 0;
 
 err:
+	fuse_inode_cache_exit(c);
 	bch2_fs_stop(c);
 	goto out;
 }
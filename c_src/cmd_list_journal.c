@@ -9,13 +9,19 @@
 #include "tools-util.h"
 
 #include "libbcachefs/bcachefs.h"
+#include "libbcachefs/btree_cache.h"
 #include "libbcachefs/btree_iter.h"
+#include "libbcachefs/buckets.h"
+#include "libbcachefs/checksum.h"
 #include "libbcachefs/errcode.h"
 #include "libbcachefs/error.h"
 #include "libbcachefs/journal_io.h"
 #include "libbcachefs/journal_seq_blacklist.h"
 #include "libbcachefs/super.h"
 
+#include <linux/sort.h>
+#include <linux/string_choices.h>
+
 static const char *NORMAL	= "\x1B[0m";
 static const char *RED		= "\x1B[31m";
 
@@ -30,6 +36,9 @@ static void list_journal_usage(void)
 	     "  -t, --transaction-filter=bbpos    Filter transactions not updating <bbpos>\n"
 	     "                                    Or entries not matching the range <bbpos-bbpos>\n"
 	     "  -k, --key-filter=btree            Filter keys not updating btree\n"
+	     "  -s, --stream                      Decode the journal bucket by bucket, straight from\n"
+	     "                                    the devices, instead of reading it all in first\n"
+	     "  -j, --json                        Print one JSON object per journal entry\n"
 	     "  -v, --verbose                     Verbose mode\n"
 	     "  -h, --help                        Display this help and exit\n"
 	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
@@ -126,9 +135,17 @@ static bool should_print_entry(struct jset_entry *entry, d_btree_id filter)
 	return false;
 }
 
-static void journal_entry_header_to_text(struct printbuf *out,
-					 struct bch_fs *c,
-					 struct journal_replay *p, bool blacklisted)
+struct list_journal_filter {
+	u64			seq_min;
+	darray_str		transaction_msg_filter;
+	d_bbpos_range		transaction_key_filter;
+	d_btree_id		key_filter;
+	bool			json;
+};
+
+static void journal_entry_header_to_text(struct printbuf *out, struct jset *j,
+					 struct journal_ptr *ptrs, unsigned nr_ptrs,
+					 bool blacklisted)
 {
 	if (blacklisted)
 		prt_str(out, "blacklisted ");
@@ -139,36 +156,168 @@ static void journal_entry_header_to_text(struct printbuf *out,
 		   "  last seq        %llu\n"
 		   "  flush           %u\n"
 		   "  written at      ",
-		   le64_to_cpu(p->j.seq),
-		   le32_to_cpu(p->j.version),
-		   le64_to_cpu(p->j.last_seq),
-		   !JSET_NO_FLUSH(&p->j));
-	bch2_journal_ptrs_to_text(out, c, p);
+		   le64_to_cpu(j->seq),
+		   le32_to_cpu(j->version),
+		   le64_to_cpu(j->last_seq),
+		   !JSET_NO_FLUSH(j));
+	bch2_journal_ptrs_raw_to_text(out, ptrs, nr_ptrs);
 
 	if (blacklisted)
 		star_start_of_lines(out->buf);
 }
 
-static void journal_entry_header_print(struct bch_fs *c, struct journal_replay *p, bool blacklisted)
+static void journal_entry_header_print(struct jset *j,
+				       struct journal_ptr *ptrs, unsigned nr_ptrs,
+				       bool blacklisted)
 {
 	struct printbuf buf = PRINTBUF;
-	journal_entry_header_to_text(&buf, c, p, blacklisted);
+	journal_entry_header_to_text(&buf, j, ptrs, nr_ptrs, blacklisted);
 	printf("%s\n", buf.buf);
 	printbuf_exit(&buf);
 }
 
+static void journal_entry_header_to_json(struct printbuf *out, struct jset *j,
+					 struct journal_ptr *ptrs, unsigned nr_ptrs,
+					 bool blacklisted)
+{
+	prt_printf(out,
+		   "{\"seq\":%llu,\"version\":%u,\"last_seq\":%llu,"
+		   "\"flush\":%s,\"blacklisted\":%s,\"ptrs\":[",
+		   le64_to_cpu(j->seq),
+		   le32_to_cpu(j->version),
+		   le64_to_cpu(j->last_seq),
+		   str_true_false(!JSET_NO_FLUSH(j)),
+		   str_true_false(blacklisted));
+
+	for (unsigned i = 0; i < nr_ptrs; i++)
+		prt_printf(out, "%s{\"dev\":%u,\"bucket\":%u,\"offset\":%u,\"sector\":%llu}",
+			   i ? "," : "",
+			   ptrs[i].dev, ptrs[i].bucket,
+			   ptrs[i].bucket_offset, ptrs[i].sector);
+
+	prt_str(out, "],\"entries\":[");
+}
+
+static void journal_entry_to_json(struct printbuf *out, struct bch_fs *c,
+				  struct jset_entry *entry, bool first,
+				  bool highlight)
+{
+	struct printbuf buf = PRINTBUF;
+
+	prt_str(out, first ? "{\"type\":" : ",{\"type\":");
+	bch2_prt_jset_entry_type(&buf, entry->type);
+	prt_json_str(out, buf.buf);
+
+	if (entry->type == BCH_JSET_ENTRY_btree_root ||
+	    entry->type == BCH_JSET_ENTRY_btree_keys ||
+	    entry->type == BCH_JSET_ENTRY_overwrite) {
+		printbuf_reset(&buf);
+		bch2_btree_id_to_text(&buf, entry->btree_id);
+		prt_str(out, ",\"btree\":");
+		prt_json_str(out, buf.buf);
+		prt_printf(out, ",\"level\":%u", entry->level);
+	}
+
+	if (highlight)
+		prt_str(out, ",\"match\":true");
+
+	printbuf_reset(&buf);
+	bch2_journal_entry_to_text(&buf, c, entry);
+	prt_str(out, ",\"text\":");
+	prt_json_str(out, buf.buf);
+	prt_char(out, '}');
+
+	printbuf_exit(&buf);
+}
+
+static void journal_jset_print(struct bch_fs *c, struct list_journal_filter *f,
+			       struct jset *j,
+			       struct journal_ptr *ptrs, unsigned nr_ptrs,
+			       bool blacklisted)
+{
+	struct printbuf buf = PRINTBUF, json = PRINTBUF;
+	bool printed_header = false;
+	unsigned nr_printed = 0;
+
+	if (f->json)
+		journal_entry_header_to_json(&json, j, ptrs, nr_ptrs, blacklisted);
+
+	if (!f->transaction_msg_filter.nr &&
+	    !f->transaction_key_filter.nr) {
+		if (!f->json)
+			journal_entry_header_print(j, ptrs, nr_ptrs, blacklisted);
+		printed_header = true;
+	}
+
+	struct jset_entry *entry = j->start;
+	struct jset_entry *end = vstruct_last(j);
+	while (entry != end) {
+
+		/*
+		 * log entries denote the start of a new transaction
+		 * commit:
+		 */
+		if (entry_is_transaction_start(entry)) {
+			if (!should_print_transaction(entry, end,
+						      f->transaction_msg_filter,
+						      f->transaction_key_filter)) {
+				do {
+					entry = vstruct_next(entry);
+				} while (entry != end && !entry_is_transaction_start(entry));
+
+				continue;
+			}
+
+			if (!f->json)
+				prt_newline(&buf);
+		}
+
+		if (!should_print_entry(entry, f->key_filter))
+			goto next;
+
+		if (!printed_header && !f->json)
+			journal_entry_header_print(j, ptrs, nr_ptrs, blacklisted);
+		printed_header = true;
+
+		bool highlight = entry_matches_transaction_filter(entry, f->transaction_key_filter);
+
+		if (f->json) {
+			journal_entry_to_json(&json, c, entry, !nr_printed, highlight);
+			nr_printed++;
+			goto next;
+		}
+
+		if (highlight)
+			fputs(RED, stdout);
+
+		printbuf_indent_add(&buf, 4);
+		bch2_journal_entry_to_text(&buf, c, entry);
+
+		if (blacklisted)
+			star_start_of_lines(buf.buf);
+		printf("%s\n", buf.buf);
+		printbuf_reset(&buf);
+
+		if (highlight)
+			fputs(NORMAL, stdout);
+next:
+		entry = vstruct_next(entry);
+	}
+
+	if (f->json && printed_header)
+		printf("%s]}\n", json.buf);
+
+	printbuf_exit(&json);
+	printbuf_exit(&buf);
+}
+
 static void journal_entries_print(struct bch_fs *c, unsigned nr_entries,
-				  darray_str transaction_msg_filter,
-				  d_bbpos_range transaction_key_filter,
-				  d_btree_id key_filter)
+				  struct list_journal_filter *f)
 {
 	struct journal_replay *p, **_p;
 	struct genradix_iter iter;
-	struct printbuf buf = PRINTBUF;
 
 	genradix_for_each(&c->journal_entries, iter, _p) {
-		bool printed_header = false;
-
 		p = *_p;
 		if (!p)
 			continue;
@@ -180,61 +329,265 @@ static void journal_entries_print(struct bch_fs *c, unsigned nr_entries,
 			bch2_journal_seq_is_blacklisted(c,
 					le64_to_cpu(p->j.seq), false);
 
-		if (!transaction_msg_filter.nr &&
-		    !transaction_key_filter.nr) {
-			journal_entry_header_print(c, p, blacklisted);
-			printed_header = true;
+		journal_jset_print(c, f, &p->j, p->ptrs.data, p->ptrs.nr, blacklisted);
+	}
+}
+
+/*
+ * Streaming mode:
+ *
+ * Instead of having bch2_journal_read() read the whole journal into memory
+ * before we print anything, journal buckets are read and decoded one at a
+ * time, straight from the devices. The first block of every bucket is read
+ * up front, to get the sequence number it starts with: buckets are then
+ * decoded in that order, so entries come out roughly sorted by sequence
+ * number. Entries written to more than one device are printed once, from
+ * the first bucket they're found in; a bitmap of the sequence numbers
+ * printed so far is all that's kept in memory.
+ */
+struct journal_stream_bucket {
+	struct bch_dev		*ca;
+	unsigned		bucket;
+	u64			seq;
+	bool			skip;
+};
+
+typedef DARRAY(struct journal_stream_bucket) journal_stream_buckets;
+
+struct journal_stream {
+	struct bch_fs		*c;
+	struct list_journal_filter *f;
+	void			*buf;
+	u64			max_seq;
+	/* Oldest entry still dirty, as of the newest entry seen: */
+	u64			last_seq;
+
+	u64			seen_base;
+	GENRADIX(unsigned long)	seen;
+};
+
+static u64 journal_bucket_offset(struct bch_dev *ca, unsigned bucket)
+{
+	return bucket_to_sector(ca, ca->journal.buckets[bucket]);
+}
+
+static bool journal_stream_test_and_set_seen(struct journal_stream *s, u64 seq)
+{
+	if (seq < s->seen_base)
+		return false;
+
+	u64 idx = seq - s->seen_base;
+	unsigned long *p = genradix_ptr_alloc(&s->seen, idx / BITS_PER_LONG, GFP_KERNEL);
+	if (!p)
+		die("insufficient memory");
+
+	unsigned long mask = 1UL << (idx % BITS_PER_LONG);
+	bool ret = *p & mask;
+	*p |= mask;
+	return ret;
+}
+
+static int journal_stream_jset_decode(struct bch_fs *c, struct jset *j)
+{
+	struct bkey_validate_context from = {
+		.from		= BKEY_VALIDATE_journal,
+		.journal_seq	= le64_to_cpu(j->seq),
+	};
+	unsigned version = le32_to_cpu(j->version);
+
+	int ret = bch2_encrypt(c, JSET_CSUM_TYPE(j), journal_nonce(j),
+			       j->encrypted_start,
+			       vstruct_end(j) - (void *) j->encrypted_start);
+	if (ret)
+		return ret;
+
+	vstruct_for_each(j, entry) {
+		from.journal_offset = (u64 *) entry - j->_data;
+
+		if (vstruct_next(entry) > vstruct_last(j)) {
+			j->u64s = cpu_to_le32((u64 *) entry - j->_data);
+			break;
 		}
 
-		struct jset_entry *entry = p->j.start;
-		struct jset_entry *end = vstruct_last(&p->j);
-		while (entry != end) {
+		ret = bch2_journal_entry_validate(c, j, entry, version,
+						  JSET_BIG_ENDIAN(j), from);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Decode the jsets in one bucket: if @print is false, just note the highest
+ * sequence number seen:
+ */
+static void journal_stream_bucket(struct journal_stream *s,
+				  struct journal_stream_bucket *b, bool print)
+{
+	struct bch_fs *c = s->c;
+	struct bch_dev *ca = b->ca;
+	u64 bucket_offset = journal_bucket_offset(ca, b->bucket);
+	u64 offset = 0, prev_seq = 0;
 
+	xpread(ca->disk_sb.bdev->bd_fd, s->buf,
+	       ca->mi.bucket_size << 9, bucket_offset << 9);
+
+	while (offset < ca->mi.bucket_size) {
+		struct jset *j = s->buf + (offset << 9);
+		unsigned sectors;
+
+		if (le64_to_cpu(j->magic) != jset_magic(c) ||
+		    !bch2_version_compatible(le32_to_cpu(j->version)) ||
+		    vstruct_bytes(j) > (ca->mi.bucket_size - offset) << 9)
+			break;
+
+		u64 seq = le64_to_cpu(j->seq);
+
+		/* Older entries left from before the bucket was last reused: */
+		if (seq < prev_seq)
+			break;
+		prev_seq = seq;
+
+		struct journal_ptr ptr = {
+			.dev		= ca->dev_idx,
+			.bucket		= b->bucket,
+			.bucket_offset	= offset,
+			.sector		= bucket_offset + offset,
+		};
+
+		ptr.csum_good = bch2_checksum_type_valid(c, JSET_CSUM_TYPE(j)) &&
+			!bch2_crc_cmp(j->csum,
+				      csum_vstruct(c, JSET_CSUM_TYPE(j), journal_nonce(j), j));
+		if (!ptr.csum_good) {
 			/*
-			 * log entries denote the start of a new transaction
-			 * commit:
+			 * Don't trust the size field of a jset with a bad
+			 * checksum: try again at the next block:
 			 */
-			if (entry_is_transaction_start(entry)) {
-				if (!should_print_transaction(entry, end,
-							      transaction_msg_filter,
-							      transaction_key_filter)) {
-					do {
-						entry = vstruct_next(entry);
-					} while (entry != end && !entry_is_transaction_start(entry));
+			if (print)
+				fprintf(stderr, "%s: bad checksum on journal entry %llu at sector %llu\n",
+					ca->name, seq, ptr.sector);
+			sectors = block_sectors(c);
+			goto next;
+		}
 
-					continue;
-				}
+		sectors = vstruct_sectors(j, c->block_bits);
+		s->max_seq = max(s->max_seq, seq);
+		s->last_seq = max(s->last_seq, le64_to_cpu(j->last_seq));
 
-				prt_newline(&buf);
-			}
+		if (!print ||
+		    seq < s->f->seq_min ||
+		    journal_stream_test_and_set_seen(s, seq))
+			goto next;
 
-			if (!should_print_entry(entry, key_filter))
-				goto next;
+		int ret = journal_stream_jset_decode(c, j);
+		if (ret) {
+			fprintf(stderr, "%s: error decoding journal entry %llu at sector %llu: %s\n",
+				ca->name, seq, ptr.sector, bch2_err_str(ret));
+			goto next;
+		}
 
-			if (!printed_header)
-				journal_entry_header_print(c, p, blacklisted);
-			printed_header = true;
+		journal_jset_print(c, s->f, j, &ptr, 1,
+				   bch2_journal_seq_is_blacklisted(c, seq, false));
+next:
+		offset += sectors;
+	}
+}
 
-			bool highlight = entry_matches_transaction_filter(entry, transaction_key_filter);
-			if (highlight)
-				fputs(RED, stdout);
+static int journal_stream_bucket_cmp(const void *_l, const void *_r)
+{
+	const struct journal_stream_bucket *l = _l, *r = _r;
 
-			printbuf_indent_add(&buf, 4);
-			bch2_journal_entry_to_text(&buf, c, entry);
+	return cmp_int(l->seq, r->seq);
+}
 
-			if (blacklisted)
-				star_start_of_lines(buf.buf);
-			printf("%s\n", buf.buf);
-			printbuf_reset(&buf);
+/*
+ * Like bch2_journal_read(), only prints dirty entries - those from the newest
+ * entry's last_seq on - unless @all or @nr_entries is given:
+ */
+static void journal_stream_print(struct bch_fs *c, unsigned nr_entries,
+				 bool all, struct list_journal_filter *f)
+{
+	struct journal_stream s = { .c = c, .f = f };
+	journal_stream_buckets buckets = {};
+	unsigned max_bucket_size = 0;
 
-			if (highlight)
-				fputs(NORMAL, stdout);
-next:
-			entry = vstruct_next(entry);
+	/* First block of every bucket, for the sequence number it starts with: */
+	void *block = aligned_alloc(PAGE_SIZE, round_up(block_bytes(c), PAGE_SIZE));
+	if (!block)
+		die("insufficient memory");
+
+	for_each_member_device(c, ca) {
+		if (!ca->disk_sb.bdev || !ca->journal.nr)
+			continue;
+
+		max_bucket_size = max(max_bucket_size, ca->mi.bucket_size);
+
+		for (unsigned i = 0; i < ca->journal.nr; i++) {
+			struct jset *j = block;
+
+			xpread(ca->disk_sb.bdev->bd_fd, block, block_bytes(c),
+			       journal_bucket_offset(ca, i) << 9);
+
+			if (le64_to_cpu(j->magic) == jset_magic(c))
+				darray_push(&buckets, ((struct journal_stream_bucket) {
+					.ca	= ca,
+					.bucket	= i,
+					.seq	= le64_to_cpu(j->seq),
+				}));
 		}
 	}
+	free(block);
 
-	printbuf_exit(&buf);
+	if (!buckets.nr)
+		goto out;
+
+	sort(buckets.data, buckets.nr, sizeof(buckets.data[0]),
+	     journal_stream_bucket_cmp, NULL);
+
+	s.seen_base = buckets.data[0].seq;
+	s.buf = aligned_alloc(PAGE_SIZE, (size_t) max_bucket_size << 9);
+	if (!s.buf)
+		die("insufficient memory");
+
+	if (nr_entries != U32_MAX || !all) {
+		u64 dev_next_seq[BCH_SB_MEMBERS_MAX];
+
+		for (unsigned i = 0; i < ARRAY_SIZE(dev_next_seq); i++)
+			dev_next_seq[i] = U64_MAX;
+
+		/* The newest entry is in the newest bucket of some device: */
+		darray_for_each_reverse(buckets, b)
+			if (dev_next_seq[b->ca->dev_idx] == U64_MAX) {
+				journal_stream_bucket(&s, b, false);
+				dev_next_seq[b->ca->dev_idx] = 0;
+			}
+
+		f->seq_min = nr_entries != U32_MAX
+			? (s.max_seq >= nr_entries ? s.max_seq - nr_entries + 1 : 0)
+			: s.last_seq;
+
+		/*
+		 * Entries in a bucket are older than the first entry in the
+		 * device's next bucket:
+		 */
+		for (unsigned i = 0; i < ARRAY_SIZE(dev_next_seq); i++)
+			dev_next_seq[i] = U64_MAX;
+
+		darray_for_each_reverse(buckets, b) {
+			b->skip = dev_next_seq[b->ca->dev_idx] <= f->seq_min;
+			dev_next_seq[b->ca->dev_idx] = b->seq;
+		}
+	}
+
+	darray_for_each(buckets, b)
+		if (!b->skip)
+			journal_stream_bucket(&s, b, true);
+
+	free(s.buf);
+	genradix_free(&s.seen);
+out:
+	darray_exit(&buckets);
 }
 
 int cmd_list_journal(int argc, char *argv[])
@@ -243,15 +596,16 @@ int cmd_list_journal(int argc, char *argv[])
 		{ "nr-entries",		required_argument,	NULL, 'n' },
 		{ "transaction-filter",	required_argument,	NULL, 't' },
 		{ "key-filter",		required_argument,	NULL, 'k' },
+		{ "stream",		no_argument,		NULL, 's' },
+		{ "json",		no_argument,		NULL, 'j' },
 		{ "verbose",		no_argument,		NULL, 'v' },
 		{ "help",		no_argument,		NULL, 'h' },
 		{ NULL }
 	};
 	struct bch_opts opts = bch2_opts_empty();
 	u32 nr_entries = U32_MAX;
-	darray_str	transaction_msg_filter = {};
-	d_bbpos_range	transaction_key_filter = {};
-	d_btree_id	key_filter = {};
+	struct list_journal_filter f = {};
+	bool stream = false;
 	int opt;
 
 	opt_set(opts, noexcl,		true);
@@ -265,7 +619,7 @@ int cmd_list_journal(int argc, char *argv[])
 	opt_set(opts, retain_recovery_info ,true);
 	opt_set(opts, read_journal_only,true);
 
-	while ((opt = getopt_long(argc, argv, "an:m:t:k:vh",
+	while ((opt = getopt_long(argc, argv, "an:m:t:k:sjvh",
 				  longopts, NULL)) != -1)
 		switch (opt) {
 		case 'a':
@@ -277,13 +631,19 @@ int cmd_list_journal(int argc, char *argv[])
 			opt_set(opts, read_entire_journal, true);
 			break;
 		case 'm':
-			darray_push(&transaction_msg_filter, strdup(optarg));
+			darray_push(&f.transaction_msg_filter, strdup(optarg));
 			break;
 		case 't':
-			darray_push(&transaction_key_filter, bbpos_range_parse(optarg));
+			darray_push(&f.transaction_key_filter, bbpos_range_parse(optarg));
 			break;
 		case 'k':
-			darray_push(&key_filter, read_string_list_or_die(optarg, __bch2_btree_ids, "btree id"));
+			darray_push(&f.key_filter, read_string_list_or_die(optarg, __bch2_btree_ids, "btree id"));
+			break;
+		case 's':
+			stream = true;
+			break;
+		case 'j':
+			f.json = true;
 			break;
 		case 'v':
 			opt_set(opts, verbose, true);
@@ -299,14 +659,23 @@ int cmd_list_journal(int argc, char *argv[])
 
 	darray_str devs = get_or_split_cmdline_devs(argc, argv);
 
+	/* Streaming mode reads the journal itself: */
+	if (stream)
+		opt_set(opts, nostart,	true);
+
 	struct bch_fs *c = bch2_fs_open(devs.data, devs.nr, opts);
 	if (IS_ERR(c))
 		die("error opening %s: %s", argv[0], bch2_err_str(PTR_ERR(c)));
 
-	journal_entries_print(c, nr_entries,
-			      transaction_msg_filter,
-			      transaction_key_filter,
-			      key_filter);
+	if (stream) {
+		int ret = bch2_blacklist_table_initialize(c);
+		if (ret)
+			die("error reading journal seq blacklist: %s", bch2_err_str(ret));
+
+		journal_stream_print(c, nr_entries, opts.read_entire_journal, &f);
+	} else {
+		journal_entries_print(c, nr_entries, &f);
+	}
 	bch2_fs_stop(c);
 	return 0;
 }
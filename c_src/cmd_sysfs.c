@@ -0,0 +1,213 @@
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cmds.h"
+#include "libbcachefs.h"
+#include "sysfs_client.h"
+
+static void sysfs_usage(void)
+{
+	puts("bcachefs sysfs - read sysfs attributes of a userspace bcachefs process\n"
+	     "Usage: bcachefs sysfs\n"
+	     "   or: bcachefs sysfs [OPTION]... <pid> [path]...\n"
+	     "\n"
+	     "Userspace filesystems (fusemount and fsck, or any command run with\n"
+	     "BCACHEFS_SYSFS set) serve the same attributes a kernel mount has in\n"
+	     "/sys/fs/bcachefs, read only; with no pid, lists the processes doing so.\n"
+	     "\n"
+	     "Paths are relative to the filesystem's directory if the process has only\n"
+	     "one filesystem open; attributes are printed, and so is every attribute in\n"
+	     "a directory.\n"
+	     "\n"
+	     "Options:\n"
+	     "  -l, --list                      List directories, instead of printing\n"
+	     "                                  their attributes\n"
+	     "  -w, --watch=seconds             Redraw every interval, like top\n"
+	     "  -h, --help                      Display this help and exit\n"
+	     "\n"
+	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
+}
+
+static void sysfs_read_or_die(pid_t pid, const char *path, bool *dir,
+			      struct printbuf *out)
+{
+	int ret = sysfs_read(pid, path, dir, out);
+
+	if (ret == -ECONNREFUSED)
+		die("process %u not serving sysfs (no filesystem open?)", pid);
+	if (ret)
+		die("error reading %s: %s", path, strerror(-ret));
+}
+
+static void proc_comm(pid_t pid, char *comm, size_t len)
+{
+	char *path = mprintf("/proc/%u/comm", pid);
+	FILE *f = fopen(path, "r");
+
+	strscpy(comm, "?", len);
+	if (f) {
+		if (fgets(comm, len, f))
+			comm[strcspn(comm, "\n")] = '\0';
+		fclose(f);
+	}
+	free(path);
+}
+
+static int sysfs_list_instances(void)
+{
+	darray_pid pids = sysfs_instances();
+	struct printbuf buf = PRINTBUF;
+
+	darray_for_each(pids, pid) {
+		char comm[32];
+		bool dir;
+
+		printbuf_reset(&buf);
+		if (sysfs_read(*pid, "", &dir, &buf))
+			continue;
+
+		proc_comm(*pid, comm, sizeof(comm));
+
+		printf("%-8u %-16s", *pid, comm);
+		for (char *p = buf.buf, *fs; (fs = strsep(&p, "\n"));)
+			if (*fs)
+				printf(" %.*s", (int) strcspn(fs, "/"), fs);
+		printf("\n");
+	}
+
+	printbuf_exit(&buf);
+	darray_exit(&pids);
+	return 0;
+}
+
+/*
+ * Like /sys/fs/bcachefs/<uuid>, if there's only the one filesystem then paths
+ * can be relative to it:
+ */
+static char *sysfs_resolve_path(pid_t pid, const char *path)
+{
+	struct printbuf root = PRINTBUF;
+	bool dir;
+
+	sysfs_read_or_die(pid, "", &dir, &root);
+
+	char *ret = NULL;
+	char *nl = strchr(root.buf ?: "", '\n');
+	size_t first = strcspn(path, "/");
+
+	if (nl && !nl[1] &&
+	    (nl - root.buf - 1 != first || strncmp(root.buf, path, first)))
+		ret = mprintf("%.*s%s", (int) (nl - root.buf), root.buf, path);
+
+	printbuf_exit(&root);
+	return ret ?: strdup(path);
+}
+
+static void sysfs_print_attr(struct printbuf *out, pid_t pid, const char *path,
+			     const char *name)
+{
+	struct printbuf buf = PRINTBUF;
+	bool dir;
+
+	sysfs_read_or_die(pid, path, &dir, &buf);
+	bch2_printbuf_strip_trailing_newline(&buf);
+
+	prt_printf(out, "%s:", name);
+	printbuf_indent_add(out, 2);
+	prt_newline(out);
+	prt_str_indented(out, buf.buf ?: "");
+	printbuf_indent_sub(out, 2);
+	prt_newline(out);
+	printbuf_exit(&buf);
+}
+
+static void sysfs_print(struct printbuf *out, pid_t pid, const char *_path, bool list)
+{
+	char *path = sysfs_resolve_path(pid, _path);
+	struct printbuf buf = PRINTBUF;
+	bool dir;
+
+	sysfs_read_or_die(pid, path, &dir, &buf);
+
+	if (!dir || list) {
+		prt_str(out, buf.buf ?: "");
+		goto out;
+	}
+
+	for (char *p = buf.buf, *name; (name = strsep(&p, "\n"));) {
+		if (!*name || name[strlen(name) - 1] == '/')
+			continue;
+
+		char *attr = mprintf("%s/%s", path, name);
+		sysfs_print_attr(out, pid, attr, name);
+		free(attr);
+	}
+out:
+	printbuf_exit(&buf);
+	free(path);
+}
+
+int cmd_sysfs(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{ "list",		no_argument,		NULL, 'l' },
+		{ "watch",		required_argument,	NULL, 'w' },
+		{ "help",		no_argument,		NULL, 'h' },
+		{ NULL }
+	};
+	unsigned watch = 0;
+	bool list = false;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "lw:h", longopts, NULL)) != -1)
+		switch (opt) {
+		case 'l':
+			list = true;
+			break;
+		case 'w':
+			if (kstrtouint(optarg, 10, &watch) || !watch)
+				die("invalid interval %s", optarg);
+			break;
+		case 'h':
+			sysfs_usage();
+			exit(EXIT_SUCCESS);
+		default:
+			sysfs_usage();
+			exit(EXIT_FAILURE);
+		}
+	args_shift(optind);
+
+	char *pid_str = arg_pop();
+	if (!pid_str)
+		return sysfs_list_instances();
+
+	unsigned pid;
+	if (kstrtouint(pid_str, 10, &pid))
+		die("invalid pid %s", pid_str);
+
+	struct printbuf buf = PRINTBUF;
+	while (1) {
+		printbuf_reset(&buf);
+
+		if (!argc)
+			sysfs_print(&buf, pid, "", true);
+		for (unsigned i = 0; i < argc; i++)
+			sysfs_print(&buf, pid, argv[i], list);
+
+		if (watch)
+			printf("\033[2J\033[H");
+		fputs(buf.buf ?: "", stdout);
+		fflush(stdout);
+
+		if (!watch)
+			break;
+		sleep(watch);
+	}
+
+	printbuf_exit(&buf);
+	return 0;
+}
@@ -1,13 +1,31 @@
 #include <dirent.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/sort.h>
 
 #include "cmds.h"
 #include "libbcachefs.h"
+#include "sysfs_client.h"
+#include "libbcachefs/bcachefs.h"
 #include "libbcachefs/sb-counters.h"
+#include "libbcachefs/varint.h"
+
+/*
+ * bcachefs fs top: samples counters, time stats and per device IO from a
+ * source - a mounted filesystem, a userspace instance (via the sysfs socket,
+ * see include/linux/sysfs.h) or a recording - and shows rates over the last
+ * 1, 10 and 60 seconds.
+ *
+ * Time stats and device IO come from the *_raw sysfs attributes, so older
+ * kernels only get counters.
+ */
 
 static const u8 counters_to_stable_map[] = {
 #define x(n, id, ...)	[BCH_COUNTER_##n] = BCH_COUNTER_STABLE_##n,
@@ -15,54 +33,1021 @@ static const u8 counters_to_stable_map[] = {
 #undef x
 };
 
-static struct bch_ioctl_query_counters *read_counters(struct bchfs_handle fs)
+static const u8 counter_flags[] = {
+#define x(n, id, f)	[BCH_COUNTER_##n] = f,
+	BCH_PERSISTENT_COUNTERS()
+#undef x
+};
+
+static const char * const time_stat_names[] = {
+#define x(n)	#n,
+	BCH_TIME_STATS()
+#undef x
+	NULL
+};
+
+struct top_time_stat {
+	u64			count;
+	u64			total_ns;
+	u64			max_ns;
+};
+
+struct top_dev {
+	unsigned		idx;
+	u64			bytes[2];
+	struct top_time_stat	latency[2];
+	unsigned		nr_quantiles;
+	u64			quantiles[2][NR_QUANTILES];
+};
+
+struct top_sample {
+	u64			time;		/* CLOCK_REALTIME */
+	u64			counters[BCH_COUNTER_NR];
+	struct top_time_stat	times[BCH_TIME_STAT_NR];
+	DARRAY(struct top_dev)	devs;
+};
+
+static void top_sample_copy(struct top_sample *dst, struct top_sample *src)
+{
+	memcpy(dst->counters, src->counters, sizeof(src->counters));
+	memcpy(dst->times, src->times, sizeof(src->times));
+	dst->time = src->time;
+	dst->devs.nr = 0;
+	darray_for_each(src->devs, d)
+		darray_push(&dst->devs, *d);
+}
+
+static struct top_dev *top_dev_find(struct top_sample *s, unsigned idx)
+{
+	darray_for_each(s->devs, d)
+		if (d->idx == idx)
+			return d;
+	return NULL;
+}
+
+/* Sources: */
+
+struct top_source {
+	char			*desc;
+
+	/* Live sources; paths are relative to the filesystem's sysfs dir: */
+	int			(*read_attr)(struct top_source *, const char *, struct printbuf *);
+	void			(*read_counters)(struct top_source *, u64 *);
+
+	/* Recordings: returns false at the end */
+	bool			(*replay)(struct top_source *, struct top_sample *);
+	/* Recordings: seconds between samples */
+	unsigned		interval;
+
+	void			(*exit)(struct top_source *);
+};
+
+/* Mounted filesystem: counters via ioctl, the rest from sysfs */
+
+struct top_source_kernel {
+	struct top_source	s;
+	struct bchfs_handle	fs;
+};
+
+static int kernel_read_attr(struct top_source *_s, const char *path, struct printbuf *out)
+{
+	struct top_source_kernel *s = container_of(_s, struct top_source_kernel, s);
+
+	if (!*path) {
+		int fd = openat(s->fs.sysfs_fd, ".", O_RDONLY|O_DIRECTORY);
+		DIR *dir = fd >= 0 ? fdopendir(fd) : NULL;
+		struct dirent *d;
+
+		if (!dir)
+			return -errno;
+
+		while ((d = readdir(dir)))
+			prt_printf(out, "%s\n", d->d_name);
+		closedir(dir);
+		return 0;
+	}
+
+	int fd = openat(s->fs.sysfs_fd, path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+
+	char buf[4096];
+	ssize_t r;
+	while ((r = read(fd, buf, sizeof(buf))) > 0)
+		prt_bytes(out, buf, r);
+	close(fd);
+
+	return r < 0 ? -errno : 0;
+}
+
+static void kernel_read_counters(struct top_source *_s, u64 *counters)
+{
+	struct top_source_kernel *s = container_of(_s, struct top_source_kernel, s);
+	struct bch_ioctl_query_counters *q =
+		kzalloc(sizeof(*q) + sizeof(q->d[0]) * BCH_COUNTER_NR, GFP_KERNEL);
+
+	q->nr = BCH_COUNTER_NR;
+	xioctl(s->fs.ioctl_fd, BCH_IOCTL_QUERY_COUNTERS, q);
+
+	for (unsigned i = 0; i < BCH_COUNTER_NR; i++) {
+		unsigned stable = counters_to_stable_map[i];
+
+		counters[i] = stable < q->nr ? q->d[stable] : 0;
+	}
+
+	kfree(q);
+}
+
+static void kernel_exit(struct top_source *_s)
+{
+	struct top_source_kernel *s = container_of(_s, struct top_source_kernel, s);
+
+	bcache_fs_close(s->fs);
+}
+
+static struct top_source *top_source_kernel(const char *path)
+{
+	struct top_source_kernel *s = xcalloc(1, sizeof(*s));
+
+	s->fs			= bcache_fs_open(path);
+	s->s.desc		= strdup(path);
+	s->s.read_attr		= kernel_read_attr;
+	s->s.read_counters	= kernel_read_counters;
+	s->s.exit		= kernel_exit;
+	return &s->s;
+}
+
+/* Userspace instance, via its sysfs socket: */
+
+struct top_source_user {
+	struct top_source	s;
+	pid_t			pid;
+	char			*fs;
+};
+
+static int user_read_attr(struct top_source *_s, const char *path, struct printbuf *out)
+{
+	struct top_source_user *s = container_of(_s, struct top_source_user, s);
+	char *p = mprintf("%s/%s", s->fs, path);
+	bool dir;
+
+	int ret = sysfs_read(s->pid, p, &dir, out);
+	if (ret == -ECONNREFUSED)
+		die("process %u exited", s->pid);
+
+	free(p);
+	return ret;
+}
+
+static void user_read_counters(struct top_source *s, u64 *counters)
+{
+	struct printbuf buf = PRINTBUF;
+	u8 stable_to_counter[BCH_COUNTER_NR * 2];
+
+	memset(stable_to_counter, U8_MAX, sizeof(stable_to_counter));
+	for (unsigned i = 0; i < BCH_COUNTER_NR; i++)
+		if (counters_to_stable_map[i] < ARRAY_SIZE(stable_to_counter))
+			stable_to_counter[counters_to_stable_map[i]] = i;
+
+	memset(counters, 0, sizeof(u64) * BCH_COUNTER_NR);
+
+	if (!s->read_attr(s, "internal/counters_raw", &buf))
+		for (char *p = buf.buf, *line; (line = strsep(&p, "\n"));) {
+			unsigned stable;
+			u64 v;
+
+			if (sscanf(line, "%u %llu", &stable, &v) == 2 &&
+			    stable < ARRAY_SIZE(stable_to_counter) &&
+			    stable_to_counter[stable] != U8_MAX)
+				counters[stable_to_counter[stable]] = v;
+		}
+
+	printbuf_exit(&buf);
+}
+
+static void user_exit(struct top_source *_s)
+{
+	struct top_source_user *s = container_of(_s, struct top_source_user, s);
+
+	free(s->fs);
+}
+
+static struct top_source *top_source_user(pid_t pid, const char *fs)
+{
+	struct top_source_user *s = xcalloc(1, sizeof(*s));
+	struct printbuf buf = PRINTBUF;
+	bool dir;
+
+	int ret = sysfs_read(pid, "", &dir, &buf);
+	if (ret == -ECONNREFUSED)
+		die("process %u not serving sysfs (no filesystem open?)", pid);
+	if (ret)
+		die("error reading from process %u: %s", pid, strerror(-ret));
+
+	if (!fs) {
+		if (!buf.pos)
+			die("process %u has no filesystem open", pid);
+
+		/* Default to the first filesystem: */
+		s->fs = strndup(buf.buf, strcspn(buf.buf, "/\n"));
+	} else {
+		s->fs = strdup(fs);
+	}
+	printbuf_exit(&buf);
+
+	s->pid			= pid;
+	s->s.desc		= mprintf("pid %u %s", pid, s->fs);
+	s->s.read_attr		= user_read_attr;
+	s->s.read_counters	= user_read_counters;
+	s->s.exit		= user_exit;
+	return &s->s;
+}
+
+/*
+ * Recordings:
+ *
+ * A header with the sample interval and the names of the counters and time
+ * stats, so that recordings can be replayed by other versions, then records,
+ * each prefixed by its length; all integers in records are varints, and all
+ * but device indexes and counts are zigzag encoded deltas from the previous
+ * record:
+ *
+ *   time
+ *   counters[nr_counters]
+ *   time stats[nr_time_stats]: count, total, max
+ *   nr_devs, then for each: idx, bytes[2], latency[2] (as time stats),
+ *     nr_quantiles, quantiles[2][nr_quantiles]
+ */
+
+#define TOP_RECORD_MAGIC	"bchfstop"
+#define TOP_RECORD_VERSION	1
+
+struct top_record_hdr {
+	char			magic[8];
+	__le32			version;
+	__le32			nr_counters;
+	__le32			nr_time_stats;
+	__le32			interval;	/* seconds */
+};
+
+typedef DARRAY(u8) darray_u8;
+
+static inline u64 zigzag(s64 v)
+{
+	return ((u64) v << 1) ^ (v >> 63);
+}
+
+static inline s64 unzigzag(u64 v)
+{
+	return (v >> 1) ^ -(v & 1);
+}
+
+static void put_varint(darray_u8 *out, u64 v)
+{
+	if (darray_make_room(out, 9))
+		die("allocation failure");
+	out->nr += bch2_varint_encode(out->data + out->nr, v);
+}
+
+static void put_delta(darray_u8 *out, u64 v, u64 prev)
+{
+	put_varint(out, zigzag(v - prev));
+}
+
+static void put_time_stat(darray_u8 *out, const struct top_time_stat *t,
+			  const struct top_time_stat *prev)
+{
+	put_delta(out, t->count,	prev->count);
+	put_delta(out, t->total_ns,	prev->total_ns);
+	put_delta(out, t->max_ns,	prev->max_ns);
+}
+
+static void top_record_hdr_write(FILE *f, unsigned interval)
+{
+	struct top_record_hdr hdr = {
+		.version	= cpu_to_le32(TOP_RECORD_VERSION),
+		.nr_counters	= cpu_to_le32(BCH_COUNTER_NR),
+		.nr_time_stats	= cpu_to_le32(BCH_TIME_STAT_NR),
+		.interval	= cpu_to_le32(interval),
+	};
+
+	memcpy(hdr.magic, TOP_RECORD_MAGIC, sizeof(hdr.magic));
+	fwrite(&hdr, sizeof(hdr), 1, f);
+
+	for (unsigned i = 0; i < BCH_COUNTER_NR; i++)
+		fwrite(bch2_counter_names[i], strlen(bch2_counter_names[i]) + 1, 1, f);
+	for (unsigned i = 0; i < BCH_TIME_STAT_NR; i++)
+		fwrite(time_stat_names[i], strlen(time_stat_names[i]) + 1, 1, f);
+}
+
+static void top_record_write(FILE *f, struct top_sample *s, struct top_sample *prev)
+{
+	static const struct top_dev zero_dev;
+	darray_u8 rec = {}, len = {};
+
+	put_delta(&rec, s->time, prev->time);
+
+	for (unsigned i = 0; i < BCH_COUNTER_NR; i++)
+		put_delta(&rec, s->counters[i], prev->counters[i]);
+
+	for (unsigned i = 0; i < BCH_TIME_STAT_NR; i++)
+		put_time_stat(&rec, &s->times[i], &prev->times[i]);
+
+	put_varint(&rec, s->devs.nr);
+	darray_for_each(s->devs, d) {
+		const struct top_dev *p = top_dev_find(prev, d->idx) ?: &zero_dev;
+
+		put_varint(&rec, d->idx);
+		for (unsigned rw = 0; rw < 2; rw++) {
+			put_delta(&rec, d->bytes[rw], p->bytes[rw]);
+			put_time_stat(&rec, &d->latency[rw], &p->latency[rw]);
+		}
+
+		put_varint(&rec, d->nr_quantiles);
+		for (unsigned rw = 0; rw < 2; rw++)
+			for (unsigned i = 0; i < d->nr_quantiles; i++)
+				put_delta(&rec, d->quantiles[rw][i],
+					  p->nr_quantiles ? p->quantiles[rw][i] : 0);
+	}
+
+	put_varint(&len, rec.nr);
+	fwrite(len.data, len.nr, 1, f);
+	fwrite(rec.data, rec.nr, 1, f);
+	fflush(f);
+
+	darray_exit(&len);
+	darray_exit(&rec);
+}
+
+struct top_source_replay {
+	struct top_source	s;
+	u8			*buf;
+	size_t			size;
+	const u8		*pos;
+
+	unsigned		nr_counters;
+	unsigned		nr_time_stats;
+	/* index in the recording -> ours, or -1 */
+	int			*counter_map;
+	int			*time_stat_map;
+
+	struct top_sample	prev;
+};
+
+struct replay_iter {
+	const u8		*pos;
+	const u8		*end;
+	bool			err;
+};
+
+static u64 get_varint(struct replay_iter *i)
+{
+	u64 v = 0;
+	int ret = bch2_varint_decode(i->pos, i->end, &v);
+
+	if (ret < 0) {
+		i->err = true;
+		return 0;
+	}
+
+	i->pos += ret;
+	return v;
+}
+
+static u64 get_delta(struct replay_iter *i, u64 prev)
+{
+	return prev + unzigzag(get_varint(i));
+}
+
+static void get_time_stat(struct replay_iter *i, struct top_time_stat *t,
+			  const struct top_time_stat *prev)
+{
+	t->count	= get_delta(i, prev->count);
+	t->total_ns	= get_delta(i, prev->total_ns);
+	t->max_ns	= get_delta(i, prev->max_ns);
+}
+
+static bool replay_next(struct top_source *_s, struct top_sample *s)
+{
+	struct top_source_replay *r = container_of(_s, struct top_source_replay, s);
+	static const struct top_dev zero_dev;
+	const u8 *end = r->buf + r->size;
+	struct top_sample *prev = &r->prev;
+
+	struct replay_iter i = { .pos = r->pos, .end = end };
+	u64 len = get_varint(&i);
+	if (i.err || len > end - i.pos)
+		return false;
+
+	i.end	= i.pos + len;
+	r->pos	= i.end;
+
+	s->time = get_delta(&i, prev->time);
+
+	memset(s->counters, 0, sizeof(s->counters));
+	for (unsigned j = 0; j < r->nr_counters; j++) {
+		int c = r->counter_map[j];
+		u64 v = get_varint(&i);
+
+		if (c >= 0)
+			s->counters[c] = prev->counters[c] + unzigzag(v);
+	}
+
+	memset(s->times, 0, sizeof(s->times));
+	for (unsigned j = 0; j < r->nr_time_stats; j++) {
+		int t = r->time_stat_map[j];
+		struct top_time_stat v;
+
+		get_time_stat(&i, &v, t >= 0 ? &prev->times[t] : &(struct top_time_stat) {});
+		if (t >= 0)
+			s->times[t] = v;
+	}
+
+	s->devs.nr = 0;
+	u64 nr_devs = get_varint(&i);
+	for (unsigned j = 0; j < nr_devs && !i.err; j++) {
+		struct top_dev d = { .idx = get_varint(&i) };
+		const struct top_dev *p = top_dev_find(prev, d.idx) ?: &zero_dev;
+
+		for (unsigned rw = 0; rw < 2; rw++) {
+			d.bytes[rw] = get_delta(&i, p->bytes[rw]);
+			get_time_stat(&i, &d.latency[rw], &p->latency[rw]);
+		}
+
+		d.nr_quantiles = get_varint(&i);
+		if (d.nr_quantiles > NR_QUANTILES) {
+			i.err = true;
+			break;
+		}
+
+		for (unsigned rw = 0; rw < 2; rw++)
+			for (unsigned q = 0; q < d.nr_quantiles; q++)
+				d.quantiles[rw][q] = get_delta(&i,
+					p->nr_quantiles ? p->quantiles[rw][q] : 0);
+
+		darray_push(&s->devs, d);
+	}
+
+	if (i.err)
+		die("corrupt recording");
+
+	top_sample_copy(prev, s);
+	return true;
+}
+
+static void replay_exit(struct top_source *_s)
 {
-	struct bch_ioctl_query_counters *ret =
-		kzalloc(sizeof(*ret) + sizeof(ret->d[0]) * BCH_COUNTER_NR, GFP_KERNEL);
+	struct top_source_replay *r = container_of(_s, struct top_source_replay, s);
+
+	darray_exit(&r->prev.devs);
+	free(r->time_stat_map);
+	free(r->counter_map);
+	free(r->buf);
+}
 
-	ret->nr = BCH_COUNTER_NR;
+static int replay_name_idx(const char * const *names, unsigned nr, const char *name)
+{
+	for (unsigned i = 0; i < nr; i++)
+		if (!strcmp(names[i], name))
+			return i;
+	return -1;
+}
 
-	xioctl(fs.ioctl_fd, BCH_IOCTL_QUERY_COUNTERS, ret);
+static const char *replay_get_str(struct top_source_replay *r)
+{
+	const u8 *end = r->buf + r->size;
+	const u8 *nul = memchr(r->pos, '\0', end - r->pos);
+
+	if (!nul)
+		die("corrupt recording header");
+
+	const char *ret = (const char *) r->pos;
+	r->pos = nul + 1;
 	return ret;
 }
 
-static void fs_top(const char *path, bool human_readable)
+static struct top_source *top_source_replay(const char *path)
+{
+	struct top_source_replay *r = xcalloc(1, sizeof(*r));
+	int fd = xopen(path, O_RDONLY);
+
+	r->size	= xfstat(fd).st_size;
+	r->buf	= xmalloc(r->size ?: 1);
+	xpread(fd, r->buf, r->size, 0);
+	close(fd);
+
+	struct top_record_hdr *hdr = (void *) r->buf;
+	if (r->size < sizeof(*hdr) ||
+	    memcmp(hdr->magic, TOP_RECORD_MAGIC, sizeof(hdr->magic)))
+		die("%s: not a bcachefs top recording", path);
+	if (le32_to_cpu(hdr->version) != TOP_RECORD_VERSION)
+		die("%s: unsupported version %u", path, le32_to_cpu(hdr->version));
+	if (!hdr->interval)
+		die("%s: invalid sample interval 0", path);
+
+	r->nr_counters		= le32_to_cpu(hdr->nr_counters);
+	r->nr_time_stats	= le32_to_cpu(hdr->nr_time_stats);
+	r->counter_map		= xcalloc(r->nr_counters, sizeof(int));
+	r->time_stat_map	= xcalloc(r->nr_time_stats, sizeof(int));
+	r->pos			= r->buf + sizeof(*hdr);
+
+	for (unsigned i = 0; i < r->nr_counters; i++)
+		r->counter_map[i] = replay_name_idx(bch2_counter_names, BCH_COUNTER_NR,
+						    replay_get_str(r));
+	for (unsigned i = 0; i < r->nr_time_stats; i++)
+		r->time_stat_map[i] = replay_name_idx(time_stat_names, BCH_TIME_STAT_NR,
+						      replay_get_str(r));
+
+	r->s.desc	= mprintf("recording %s", path);
+	r->s.replay	= replay_next;
+	r->s.interval	= le32_to_cpu(hdr->interval);
+	r->s.exit	= replay_exit;
+	return &r->s;
+}
+
+/* Sampling live sources: */
+
+static void parse_time_stat(char **p, struct top_time_stat *t,
+			    u64 *quantiles, unsigned *nr_quantiles)
+{
+	u64 v[4 + NR_QUANTILES];
+	unsigned nr = 0;
+	char *end;
+
+	while (nr < ARRAY_SIZE(v)) {
+		v[nr] = strtoull(*p, &end, 10);
+		if (end == *p)
+			break;
+		*p = end;
+		nr++;
+	}
+
+	if (nr < 4)
+		return;
+
+	t->count	= v[0];
+	t->total_ns	= v[1];
+	t->max_ns	= v[3];
+
+	if (nr_quantiles) {
+		*nr_quantiles = nr == ARRAY_SIZE(v) ? NR_QUANTILES : 0;
+		memcpy(quantiles, v + 4, sizeof(u64) * *nr_quantiles);
+	}
+}
+
+static void top_sample_live(struct top_source *src, struct top_sample *s)
 {
-	struct bchfs_handle fs = bcache_fs_open(path);
+	struct printbuf buf = PRINTBUF;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	s->time = timespec_to_ns(&ts);
+
+	src->read_counters(src, s->counters);
+
+	memset(s->times, 0, sizeof(s->times));
+	if (!src->read_attr(src, "internal/time_stats_raw", &buf))
+		for (char *p = buf.buf, *line; (line = strsep(&p, "\n"));) {
+			char *name = strsep(&line, " ");
+			int t = replay_name_idx(time_stat_names, BCH_TIME_STAT_NR, name);
+
+			if (t >= 0 && line)
+				parse_time_stat(&line, &s->times[t], NULL, NULL);
+		}
 
-	struct bch_ioctl_query_counters *curr, *prev = NULL;
+	printbuf_reset(&buf);
+	s->devs.nr = 0;
+	if (!src->read_attr(src, "", &buf)) {
+		struct printbuf attr = PRINTBUF;
 
-	curr = read_counters(fs);
+		for (char *p = buf.buf, *line; (line = strsep(&p, "\n"));) {
+			struct top_dev d = {};
+
+			if (sscanf(line, "dev-%u", &d.idx) != 1)
+				continue;
+
+			char *path = mprintf("dev-%u/io_stats_raw", d.idx);
+			printbuf_reset(&attr);
+			int ret = src->read_attr(src, path, &attr);
+			free(path);
+			if (ret)
+				continue;
+
+			for (char *q = attr.buf, *l; (l = strsep(&q, "\n"));) {
+				char *rw_str = strsep(&l, " ");
+				int rw = !strcmp(rw_str, "read") ? READ :
+					 !strcmp(rw_str, "write") ? WRITE : -1;
+				char *end;
+
+				if (rw < 0 || !l)
+					continue;
+
+				d.bytes[rw] = strtoull(l, &end, 10);
+				l = end;
+				parse_time_stat(&l, &d.latency[rw], d.quantiles[rw],
+						&d.nr_quantiles);
+			}
+
+			darray_push(&s->devs, d);
+		}
+		printbuf_exit(&attr);
+	}
+
+	printbuf_exit(&buf);
+}
 
-	while (true) {
-		sleep(1);
-		kfree(prev);
-		prev = curr;
-		curr = read_counters(fs);
+static bool top_sample(struct top_source *src, struct top_sample *s)
+{
+	if (src->replay)
+		return src->replay(src, s);
+
+	top_sample_live(src, s);
+	return true;
+}
+
+/* Display: */
+
+static const unsigned top_windows[] = { 1, 10, 60 };
+
+enum top_sort {
+	TOP_SORT_DEFAULT,
+	TOP_SORT_NAME,
+	TOP_SORT_1S,
+	TOP_SORT_10S,
+	TOP_SORT_60S,
+	TOP_SORT_TOTAL,
+};
+
+static const char * const top_sort_strs[] = {
+	"default",
+	"name",
+	"1s",
+	"10s",
+	"60s",
+	"total",
+	NULL
+};
+
+struct top_opts {
+	unsigned		interval;
+	enum top_sort		sort;
+	bool			human_readable;
+	bool			all;
+	bool			batch;
+	unsigned		iterations;
+};
+
+/* Samples, oldest first, enough to cover the longest window: */
+struct top_history {
+	unsigned		nr;
+	unsigned		size;
+	struct top_sample	*s;
+};
+
+static struct top_sample *top_history_get(struct top_history *h, unsigned ago)
+{
+	return &h->s[h->nr - 1 - min(ago, h->nr - 1)];
+}
+
+static struct top_sample *top_history_next(struct top_history *h)
+{
+	if (h->nr == h->size) {
+		struct top_sample tmp = h->s[0];
+
+		memmove(h->s, h->s + 1, sizeof(h->s[0]) * (h->size - 1));
+		h->s[--h->nr] = tmp;
+	}
+
+	return &h->s[h->nr];
+}
+
+struct top_row {
+	unsigned		idx;
+	const char		*name;
+	u64			total;
+	u64			rate[ARRAY_SIZE(top_windows)];
+	/* time stats: */
+	u64			mean[ARRAY_SIZE(top_windows)];
+	bool			sectors;
+};
+
+static u64 per_sec(u64 v, u64 ns)
+{
+	return ns ? div64_u64(v * NSEC_PER_SEC, ns) : 0;
+}
+
+static int top_row_cmp(const void *_l, const void *_r, const void *_sort)
+{
+	const struct top_row *l = _l, *r = _r;
+	enum top_sort sort = *((enum top_sort *) _sort);
+
+	switch (sort) {
+	case TOP_SORT_NAME:
+		return strcmp(l->name, r->name);
+	case TOP_SORT_TOTAL:
+		return cmp_int(r->total, l->total);
+	default:
+		return cmp_int(r->rate[sort - TOP_SORT_1S], l->rate[sort - TOP_SORT_1S]);
+	}
+}
+
+static void top_sort_rows(struct top_row *rows, unsigned nr, enum top_sort sort)
+{
+	/* by default, counters are in the order they're defined, grouped by area: */
+	if (sort != TOP_SORT_DEFAULT)
+		sort_r(rows, nr, sizeof(rows[0]), top_row_cmp, NULL, &sort);
+}
+
+static void prt_count(struct printbuf *out, struct top_opts *opts, u64 v, bool sectors)
+{
+	if (opts->human_readable) {
+		if (sectors)
+			prt_human_readable_u64(out, v << 9);
+		else
+			prt_units_u64(out, v);
+	} else {
+		prt_u64(out, v);
+	}
+}
+
+static void top_print_counters(struct printbuf *out, struct top_opts *opts,
+			       struct top_history *h, unsigned *windows)
+{
+	struct top_sample *cur = top_history_get(h, 0);
+	struct top_row rows[BCH_COUNTER_NR];
+	unsigned nr = 0;
 
-		printf("\033[2J");
-		printf("\033[H");
+	for (unsigned i = 0; i < BCH_COUNTER_NR; i++) {
+		struct top_row *r = &rows[nr];
 
-		for (unsigned i = 0; i < BCH_COUNTER_NR; i++) {
-			unsigned stable = counters_to_stable_map[i];
-			u64 v = stable < curr->nr
-				?  curr->d[stable] - prev->d[stable]
+		memset(r, 0, sizeof(*r));
+		r->idx		= i;
+		r->name		= bch2_counter_names[i];
+		r->total	= cur->counters[i];
+		r->sectors	= counter_flags[i] & TYPE_SECTORS;
+
+		bool active = false;
+		for (unsigned w = 0; w < ARRAY_SIZE(top_windows); w++) {
+			struct top_sample *old = top_history_get(h, windows[w]);
+
+			r->rate[w] = per_sec(cur->counters[i] - old->counters[i],
+					     cur->time - old->time);
+			active |= cur->counters[i] != old->counters[i];
+		}
+
+		if (active || opts->all)
+			nr++;
+	}
+
+	top_sort_rows(rows, nr, opts->sort);
+
+	printbuf_tabstop_push(out, 40);
+	for (unsigned w = 0; w < ARRAY_SIZE(top_windows) + 1; w++)
+		printbuf_tabstop_push(out, 14);
+
+	prt_printf(out, "counter\t");
+	for (unsigned w = 0; w < ARRAY_SIZE(top_windows); w++)
+		prt_printf(out, "%us/sec\r", top_windows[w]);
+	prt_printf(out, "total\r\n");
+
+	for (unsigned i = 0; i < nr; i++) {
+		prt_printf(out, "%s\t", rows[i].name);
+		for (unsigned w = 0; w < ARRAY_SIZE(top_windows); w++) {
+			prt_count(out, opts, rows[i].rate[w], rows[i].sectors);
+			prt_tab_rjust(out);
+		}
+		prt_count(out, opts, rows[i].total, rows[i].sectors);
+		prt_tab_rjust(out);
+		prt_newline(out);
+	}
+
+	printbuf_tabstops_reset(out);
+}
+
+static void top_print_time_stats(struct printbuf *out, struct top_opts *opts,
+				 struct top_history *h, unsigned *windows)
+{
+	struct top_sample *cur = top_history_get(h, 0);
+	struct top_row rows[BCH_TIME_STAT_NR];
+	unsigned nr = 0;
+
+	for (unsigned i = 0; i < BCH_TIME_STAT_NR; i++) {
+		struct top_row *r = &rows[nr];
+
+		memset(r, 0, sizeof(*r));
+		r->idx		= i;
+		r->name		= time_stat_names[i];
+		r->total	= cur->times[i].count;
+
+		bool active = false;
+		for (unsigned w = 0; w < ARRAY_SIZE(top_windows); w++) {
+			struct top_sample *old = top_history_get(h, windows[w]);
+			u64 count = cur->times[i].count - old->times[i].count;
+
+			r->rate[w] = per_sec(count, cur->time - old->time);
+			r->mean[w] = count
+				? div64_u64(cur->times[i].total_ns - old->times[i].total_ns, count)
 				: 0;
-			printf("%-48s %llu\n",
-			       bch2_counter_names[i],
-			       v);
+			active |= count != 0;
+		}
+
+		if (active || opts->all)
+			nr++;
+	}
+
+	if (!nr)
+		return;
+
+	top_sort_rows(rows, nr, opts->sort);
+
+	printbuf_tabstop_push(out, 40);
+	for (unsigned w = 0; w < ARRAY_SIZE(top_windows); w++) {
+		printbuf_tabstop_push(out, 10);
+		printbuf_tabstop_push(out, 10);
+	}
+	printbuf_tabstop_push(out, 10);
+
+	prt_printf(out, "time stats (events/sec, mean duration)\t");
+	for (unsigned w = 0; w < ARRAY_SIZE(top_windows); w++)
+		prt_printf(out, "%us\r\t", top_windows[w]);
+	prt_printf(out, "max\r\n");
+
+	for (unsigned i = 0; i < nr; i++) {
+		prt_printf(out, "%s\t", rows[i].name);
+		for (unsigned w = 0; w < ARRAY_SIZE(top_windows); w++) {
+			prt_count(out, opts, rows[i].rate[w], false);
+			prt_tab_rjust(out);
+			bch2_pr_time_units(out, rows[i].mean[w]);
+			prt_tab_rjust(out);
+		}
+		bch2_pr_time_units(out, cur->times[rows[i].idx].max_ns);
+		prt_tab_rjust(out);
+		prt_newline(out);
+	}
+
+	printbuf_tabstops_reset(out);
+}
+
+static void top_print_devs(struct printbuf *out, struct top_opts *opts,
+			   struct top_history *h, unsigned *windows)
+{
+	struct top_sample *cur = top_history_get(h, 0);
+	struct top_sample *old = top_history_get(h, windows[0]);
+	u64 ns = cur->time - old->time;
+
+	if (!cur->devs.nr)
+		return;
+
+	printbuf_tabstop_push(out, 8);
+	for (unsigned rw = 0; rw < 2; rw++) {
+		printbuf_tabstop_push(out, 12);
+		printbuf_tabstop_push(out, 10);
+		/* quantiles: */
+		printbuf_tabstop_push(out, 10);
+		printbuf_tabstop_push(out, 10);
+		printbuf_tabstop_push(out, 10);
+	}
+
+	prt_printf(out, "device (%us)\t", top_windows[0]);
+	for (unsigned rw = 0; rw < 2; rw++)
+		prt_printf(out, "%s/sec\rmean\rp50\rp75\rp94\r",
+			   rw == READ ? "read" : "write");
+	prt_newline(out);
+
+	darray_for_each(cur->devs, d) {
+		const struct top_dev *p = top_dev_find(old, d->idx) ?: d;
+
+		prt_printf(out, "dev-%u\t", d->idx);
+		for (unsigned rw = 0; rw < 2; rw++) {
+			u64 count = d->latency[rw].count - p->latency[rw].count;
+
+			prt_human_readable_u64(out, per_sec(d->bytes[rw] - p->bytes[rw], ns));
+			prt_tab_rjust(out);
+			bch2_pr_time_units(out, count
+				? div64_u64(d->latency[rw].total_ns - p->latency[rw].total_ns, count)
+				: 0);
+			prt_tab_rjust(out);
+
+			/* quantiles are since mount, they're not windowed: */
+			static const unsigned q[] = { 7, 11, 14 };
+			for (unsigned i = 0; i < ARRAY_SIZE(q); i++) {
+				if (d->nr_quantiles)
+					bch2_pr_time_units(out, d->quantiles[rw][q[i]]);
+				prt_tab_rjust(out);
+			}
 		}
+		prt_newline(out);
 	}
 
-	bcache_fs_close(fs);
+	printbuf_tabstops_reset(out);
+}
+
+static void top_print(struct top_source *src, struct top_opts *opts,
+		      struct top_history *h)
+{
+	struct top_sample *cur = top_history_get(h, 0);
+	struct printbuf out = PRINTBUF;
+	unsigned windows[ARRAY_SIZE(top_windows)];
+
+	/* How many samples back each window starts: */
+	for (unsigned w = 0; w < ARRAY_SIZE(top_windows); w++)
+		windows[w] = max(1U, top_windows[w] / opts->interval);
+
+	time_t t = cur->time / NSEC_PER_SEC;
+	char time_str[64];
+	strftime(time_str, sizeof(time_str), "%F %T", localtime(&t));
+
+	prt_printf(&out, "%s  %s", src->desc, time_str);
+	prt_newline(&out);
+	prt_newline(&out);
+
+	top_print_counters(&out, opts, h, windows);
+	prt_newline(&out);
+	top_print_time_stats(&out, opts, h, windows);
+	prt_newline(&out);
+	top_print_devs(&out, opts, h, windows);
+
+	if (!opts->batch)
+		printf("\033[2J\033[H");
+	fputs(out.buf, stdout);
+	if (opts->batch)
+		putchar('\n');
+	fflush(stdout);
+
+	printbuf_exit(&out);
+}
+
+static void fs_top(struct top_source *src, struct top_opts *opts, const char *record)
+{
+	struct top_history h = { .size = 60 / opts->interval + 2 };
+	FILE *record_f = NULL;
+
+	h.s = xcalloc(h.size, sizeof(h.s[0]));
+
+	if (record) {
+		record_f = fopen(record, "w");
+		if (!record_f)
+			die("error opening %s: %m", record);
+		top_record_hdr_write(record_f, opts->interval);
+	}
+
+	for (unsigned i = 0; !opts->iterations || i < opts->iterations; i++) {
+		struct top_sample *s = top_history_next(&h);
+
+		if (!top_sample(src, s))
+			break;
+
+		if (record_f)
+			top_record_write(record_f, s,
+					 h.nr ? top_history_get(&h, 0) : &(struct top_sample) {});
+		h.nr++;
+
+		/* Need two samples for a rate: */
+		if (h.nr > 1)
+			top_print(src, opts, &h);
+
+		if (src->replay) {
+			if (!opts->batch && h.nr > 1) {
+				struct top_sample *prev = top_history_get(&h, 1);
+
+				usleep(min_t(u64, s->time - prev->time, 60ULL * NSEC_PER_SEC) /
+				       NSEC_PER_USEC);
+			}
+		} else {
+			sleep(opts->interval);
+		}
+	}
+
+	if (record_f)
+		fclose(record_f);
+
+	for (unsigned i = 0; i < h.size; i++)
+		darray_exit(&h.s[i].devs);
+	free(h.s);
 }
 
 static void fs_top_usage(void)
 {
 	puts("bcachefs fs top - display runtime perfomance info\n"
 	     "Usage: bcachefs fs top [OPTION]... <mountpoint>\n"
+	     "   or: bcachefs fs top [OPTION]... -p <pid> [uuid]\n"
+	     "   or: bcachefs fs top [OPTION]... -r <file>\n"
+	     "\n"
+	     "Shows counters, time stats and device IO, as rates over the last 1, 10 and\n"
+	     "60 seconds; only those that changed in the last minute unless --all\n"
 	     "\n"
 	     "Options:\n"
+	     "  -p, --pid=pid                     Userspace filesystem (fusemount, fsck)\n"
+	     "                                    instead of a mounted filesystem\n"
+	     "  -r, --replay=file                 Replay a recording\n"
+	     "  -w, --record=file                 Also record samples to file\n"
+	     "  -i, --interval=seconds            Sample interval (default 1); recordings are\n"
+	     "                                    replayed at the interval they were made at\n"
+	     "  -s, --sort=(name|1s|10s|60s|total) Sort by name, or by a column\n"
+	     "  -a, --all                         Show everything, including idle counters\n"
+	     "  -b, --batch                       Don't redraw the screen; when replaying,\n"
+	     "                                    print every sample without waiting\n"
+	     "  -n, --iterations=nr               Exit after nr samples\n"
 	     "  -h, --human-readable              Human readable units\n"
 	     "  -H, --help                        Display this help and exit\n"
 	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
@@ -71,18 +1056,58 @@ static void fs_top_usage(void)
 int cmd_fs_top(int argc, char *argv[])
 {
 	static const struct option longopts[] = {
+		{ "pid",		required_argument,	NULL, 'p' },
+		{ "replay",		required_argument,	NULL, 'r' },
+		{ "record",		required_argument,	NULL, 'w' },
+		{ "interval",		required_argument,	NULL, 'i' },
+		{ "sort",		required_argument,	NULL, 's' },
+		{ "all",		no_argument,		NULL, 'a' },
+		{ "batch",		no_argument,		NULL, 'b' },
+		{ "iterations",		required_argument,	NULL, 'n' },
 		{ "help",		no_argument,		NULL, 'H' },
 		{ "human-readable",     no_argument,            NULL, 'h' },
 		{ NULL }
 	};
-	bool human_readable = false;
-	int opt;
+	struct top_opts opts = { .interval = 1 };
+	const char *replay = NULL, *record = NULL;
+	unsigned pid = 0;
+	int opt, ret;
 
-	while ((opt = getopt_long(argc, argv, "Hh",
+	while ((opt = getopt_long(argc, argv, "p:r:w:i:s:abn:Hh",
 				  longopts, NULL)) != -1)
 		switch (opt) {
+		case 'p':
+			if (kstrtouint(optarg, 10, &pid) || !pid)
+				die("invalid pid %s", optarg);
+			break;
+		case 'r':
+			replay = optarg;
+			break;
+		case 'w':
+			record = optarg;
+			break;
+		case 'i':
+			if (kstrtouint(optarg, 10, &opts.interval) || !opts.interval)
+				die("invalid interval %s", optarg);
+			break;
+		case 's':
+			ret = match_string(top_sort_strs, -1, optarg);
+			if (ret < 0)
+				die("invalid sort key %s", optarg);
+			opts.sort = ret;
+			break;
+		case 'a':
+			opts.all = true;
+			break;
+		case 'b':
+			opts.batch = true;
+			break;
+		case 'n':
+			if (kstrtouint(optarg, 10, &opts.iterations))
+				die("invalid number of iterations %s", optarg);
+			break;
 		case 'h':
-			human_readable = true;
+			opts.human_readable = true;
 			break;
 		case 'H':
 			fs_top_usage();
@@ -93,6 +1118,24 @@ int cmd_fs_top(int argc, char *argv[])
 		}
 	args_shift(optind);
 
-	fs_top(arg_pop() ?: ".", human_readable) ;
+	if (pid && replay)
+		die("--pid and --replay are mutually exclusive");
+
+	struct top_source *src = replay	? top_source_replay(replay)
+		: pid			? top_source_user(pid, arg_pop())
+		:			  top_source_kernel(arg_pop() ?: ".");
+
+	if (argc)
+		die("too many arguments");
+
+	/* Rates are computed over a number of samples, not by timestamp: */
+	if (src->replay)
+		opts.interval = src->interval;
+
+	fs_top(src, &opts, record);
+
+	src->exit(src);
+	free(src->desc);
+	free(src);
 	return 0;
 }
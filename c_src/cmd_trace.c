@@ -0,0 +1,376 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <linux/sort.h>
+#include <linux/trace_events.h>
+
+#include "cmds.h"
+#include "libbcachefs.h"
+
+static void trace_usage(void)
+{
+	puts("bcachefs trace - read tracepoints from a userspace bcachefs process\n"
+	     "Usage: bcachefs trace [OPTION]... <pid>\n"
+	     "   or: bcachefs trace [OPTION]... -- <command> [ARG]...\n"
+	     "\n"
+	     "A process only has trace buffers if started with BCACHEFS_TRACE set, to the\n"
+	     "list of events to enable from the start (possibly empty); commands started by\n"
+	     "bcachefs trace get this done for them\n"
+	     "\n"
+	     "Options:\n"
+	     "  -e, --events=list               Events to enable, as comma separated globs\n"
+	     "                                  matched against name or system:name\n"
+	     "  -l, --list                      List events, and which are enabled\n"
+	     "  -b, --buffer-size=size          Per thread buffer size, for commands\n"
+	     "  -h, --help                      Display this help and exit\n"
+	     "\n"
+	     "Report bugs to <linux-bcachefs@vger.kernel.org>");
+}
+
+struct trace_reader {
+	struct trace_shm	*shm;
+	size_t			size;
+
+	/* Indexed by event id in the traced process: */
+	struct tracepoint	**events;
+	u8			*enabled_by_us;
+	u64			*lost;
+	u64			lost_no_ring;
+
+	DARRAY(struct trace_entry *) batch;
+	struct printbuf		buf;
+};
+
+static volatile sig_atomic_t trace_stop;
+
+static void trace_stop_handler(int sig)
+{
+	trace_stop = true;
+}
+
+static struct trace_shm *trace_shm_map(const char *name, size_t *size)
+{
+	int fd = shm_open(name, O_RDWR, 0);
+	if (fd < 0)
+		return NULL;
+
+	struct trace_shm *shm = NULL;
+	struct stat st;
+	if (fstat(fd, &st) || st.st_size < sizeof(*shm))
+		goto out;
+
+	shm = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (shm == MAP_FAILED)
+		die("error mapping %s: %m", name);
+
+	/* Magic is written last, once the rest of the header is valid: */
+	if (smp_load_acquire(&shm->magic) != TRACE_SHM_MAGIC) {
+		munmap(shm, st.st_size);
+		shm = NULL;
+		goto out;
+	}
+
+	if (shm->version != TRACE_SHM_VERSION)
+		die("%s: unsupported trace buffer version %u", name, shm->version);
+
+	*size = st.st_size;
+out:
+	close(fd);
+	return shm;
+}
+
+static void trace_reader_init(struct trace_reader *r, const char *events)
+{
+	struct trace_shm *shm = r->shm;
+	struct trace_shm_event *e = trace_shm_events(shm);
+	u8 *enabled = trace_shm_enabled(shm);
+	bool any_enabled = false;
+
+	r->events	 = calloc(shm->nr_events, sizeof(r->events[0]));
+	r->enabled_by_us = calloc(shm->nr_events, sizeof(r->enabled_by_us[0]));
+	r->lost		 = calloc(shm->nr_rings, sizeof(r->lost[0]));
+	r->buf		 = PRINTBUF;
+
+	for (unsigned i = 0; i < shm->nr_events; i++) {
+		/* Don't trust the layout of events from another build: */
+		struct tracepoint *tp = tracepoint_find(e[i].system, e[i].name);
+		if (tp && tp->entry_size == e[i].entry_size)
+			r->events[i] = tp;
+
+		if (events &&
+		    !enabled[i] &&
+		    trace_event_match(e[i].system, e[i].name, events)) {
+			WRITE_ONCE(enabled[i], true);
+			r->enabled_by_us[i] = true;
+		}
+
+		any_enabled |= enabled[i];
+	}
+
+	if (!any_enabled)
+		fprintf(stderr, "No events enabled\n");
+}
+
+static void trace_reader_exit(struct trace_reader *r)
+{
+	u8 *enabled = trace_shm_enabled(r->shm);
+
+	for (unsigned i = 0; i < r->shm->nr_events; i++)
+		if (r->enabled_by_us[i])
+			WRITE_ONCE(enabled[i], false);
+
+	printbuf_exit(&r->buf);
+	darray_exit(&r->batch);
+	free(r->lost);
+	free(r->enabled_by_us);
+	free(r->events);
+	munmap(r->shm, r->size);
+}
+
+static void trace_read_rings(struct trace_reader *r)
+{
+	struct trace_shm *shm = r->shm;
+	u64 mask = shm->ring_size - 1;
+
+	for (unsigned i = 0; i < shm->nr_rings; i++) {
+		struct trace_ring *ring = trace_shm_ring(shm, i);
+		u64 pos = ring->tail;
+		u64 head = smp_load_acquire(&ring->head);
+
+		while (pos < head) {
+			struct trace_entry *e = (void *) ring->data + (pos & mask);
+
+			if (e->size < sizeof(u64) ||
+			    e->size > shm->ring_size ||
+			    (e->type != TRACE_ENTRY_PAD && e->size < sizeof(*e)))
+				die("corrupt trace buffer (ring %u pos %llu)", i, pos);
+
+			if (e->type != TRACE_ENTRY_PAD) {
+				struct trace_entry *n = malloc(e->size);
+				memcpy(n, e, e->size);
+				darray_push(&r->batch, n);
+			}
+
+			pos += e->size;
+		}
+
+		smp_store_release(&ring->tail, pos);
+
+		u64 lost = READ_ONCE(ring->lost);
+		if (lost != r->lost[i]) {
+			fprintf(stderr, "Lost %llu events from thread %u, buffer full\n",
+				lost - r->lost[i], READ_ONCE(ring->pid));
+			r->lost[i] = lost;
+		}
+	}
+
+	u64 lost = atomic64_read(&shm->lost);
+	if (lost != r->lost_no_ring) {
+		fprintf(stderr, "Lost %llu events, out of per thread buffers\n",
+			lost - r->lost_no_ring);
+		r->lost_no_ring = lost;
+	}
+}
+
+static int trace_entry_time_cmp(const void *_l, const void *_r)
+{
+	const struct trace_entry * const *l = _l;
+	const struct trace_entry * const *r = _r;
+
+	return cmp_int((*l)->time, (*r)->time);
+}
+
+static void trace_entry_print(struct trace_reader *r, struct trace_entry *e)
+{
+	struct printbuf *out = &r->buf;
+
+	printbuf_reset(out);
+	prt_printf(out, "%7u %5llu.%06llu ", e->pid,
+		   e->time / NSEC_PER_SEC,
+		   (e->time % NSEC_PER_SEC) / NSEC_PER_USEC);
+
+	if (e->type >= r->shm->nr_events) {
+		prt_printf(out, "(bad event %u)", e->type);
+	} else {
+		prt_printf(out, "%s: ", trace_shm_events(r->shm)[e->type].name);
+
+		struct tracepoint *tp = r->events[e->type];
+		if (tp)
+			tp->output(out, e);
+		else
+			prt_printf(out, "(unknown format, %u bytes)", e->size);
+	}
+
+	puts(out->buf);
+}
+
+static void trace_print_batch(struct trace_reader *r)
+{
+	sort(r->batch.data, r->batch.nr, sizeof(r->batch.data[0]),
+	     trace_entry_time_cmp, NULL);
+
+	darray_for_each(r->batch, e) {
+		trace_entry_print(r, *e);
+		free(*e);
+	}
+	r->batch.nr = 0;
+
+	fflush(stdout);
+}
+
+static int trace_list(const char *name)
+{
+	if (!name) {
+		for_each_tracepoint(tp)
+			printf("%s:%s\n", tp->system, tp->name);
+		return 0;
+	}
+
+	size_t size;
+	struct trace_shm *shm = trace_shm_map(name, &size);
+	if (!shm)
+		die("no trace buffer %s", name);
+
+	struct trace_shm_event *e = trace_shm_events(shm);
+	u8 *enabled = trace_shm_enabled(shm);
+
+	for (unsigned i = 0; i < shm->nr_events; i++)
+		printf("%s:%s%s\n", e[i].system, e[i].name,
+		       enabled[i] ? " [enabled]" : "");
+
+	munmap(shm, size);
+	return 0;
+}
+
+int cmd_trace(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{ "events",		required_argument,	NULL, 'e' },
+		{ "list",		no_argument,		NULL, 'l' },
+		{ "buffer-size",	required_argument,	NULL, 'b' },
+		{ "help",		no_argument,		NULL, 'h' },
+		{ NULL }
+	};
+	const char *events = NULL, *buffer_size = NULL;
+	bool list = false;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "+e:lb:h", longopts, NULL)) != -1)
+		switch (opt) {
+		case 'e':
+			events = optarg;
+			break;
+		case 'l':
+			list = true;
+			break;
+		case 'b':
+			buffer_size = optarg;
+			break;
+		case 'h':
+			trace_usage();
+			exit(EXIT_SUCCESS);
+		default:
+			trace_usage();
+			exit(EXIT_FAILURE);
+		}
+
+	/* getopt stops at, and skips, "--": */
+	bool run_command = optind > 1 && !strcmp(argv[optind - 1], "--");
+	args_shift(optind);
+
+	char *name = NULL;
+	pid_t child = 0;
+
+	if (run_command) {
+		if (!argc)
+			die("Please supply a command to run");
+
+		name = mprintf("/bcachefs-trace.%u", getpid());
+
+		child = fork();
+		if (child < 0)
+			die("fork error: %m");
+
+		if (!child) {
+			setenv("BCACHEFS_TRACE", events ?: "", 1);
+			setenv("BCACHEFS_TRACE_SHM", name, 1);
+			if (buffer_size)
+				setenv("BCACHEFS_TRACE_BUF", buffer_size, 1);
+
+			execvp(argv[0], argv);
+			die("error running %s: %m", argv[0]);
+		}
+
+		/* The command gets ^C too; keep reading until it exits: */
+		signal(SIGINT, SIG_IGN);
+		events = NULL;
+	} else {
+		char *pid = arg_pop();
+
+		if (argc)
+			die("too many arguments");
+
+		if (pid) {
+			unsigned v;
+			if (kstrtouint(pid, 10, &v))
+				die("invalid pid %s", pid);
+			name = mprintf("/bcachefs-trace.%u", v);
+		} else if (!list) {
+			die("Please supply a pid or command");
+		}
+
+		if (list)
+			return trace_list(name);
+
+		signal(SIGINT, trace_stop_handler);
+		signal(SIGTERM, trace_stop_handler);
+	}
+
+	struct trace_reader r = {};
+	bool exited = false;
+	int status = 0;
+
+	while (!(r.shm = trace_shm_map(name, &r.size))) {
+		if (!child)
+			die("no trace buffer for pid %s (not started with BCACHEFS_TRACE set?)",
+			    name + strlen("/bcachefs-trace."));
+		if (exited)
+			goto out;
+
+		exited = waitpid(child, &status, WNOHANG) == child;
+		if (!exited)
+			usleep(10 * 1000);
+	}
+
+	trace_reader_init(&r, events);
+
+	while (1) {
+		bool alive = child
+			? !exited && !(exited = waitpid(child, &status, WNOHANG) == child)
+			: !kill(r.shm->pid, 0) || errno == EPERM;
+
+		trace_read_rings(&r);
+		trace_print_batch(&r);
+
+		if (!alive || trace_stop)
+			break;
+
+		usleep(100 * 1000);
+	}
+
+	trace_reader_exit(&r);
+out:
+	if (child)
+		shm_unlink(name);
+	free(name);
+
+	return child && WIFEXITED(status) ? WEXITSTATUS(status) : 0;
+}
@@ -17,6 +17,7 @@ int cmd_set_option(int argc, char *argv[]);
 
 int cmd_fs_usage(int argc, char *argv[]);
 int cmd_fs_top(int argc, char *argv[]);
+int cmd_sysfs(int argc, char *argv[]);
 
 int device_usage(void);
 int cmd_device_add(int argc, char *argv[]);
@@ -42,6 +43,12 @@ int cmd_fsck(int argc, char *argv[]);
 int cmd_dump(int argc, char *argv[]);
 int cmd_list_journal(int argc, char *argv[]);
 int cmd_kill_btree_node(int argc, char *argv[]);
+int cmd_trace(int argc, char *argv[]);
+
+int bench_usage(void);
+int cmd_bench_checksum(int argc, char *argv[]);
+int cmd_bench_raid(int argc, char *argv[]);
+int cmd_bench_btree(int argc, char *argv[]);
 
 int cmd_migrate(int argc, char *argv[]);
 int cmd_migrate_superblock(int argc, char *argv[]);
@@ -62,5 +69,6 @@ int device_cmds(int argc, char *argv[]);
 int fs_cmds(int argc, char *argv[]);
 int data_cmds(int argc, char *argv[]);
 int subvolume_cmds(int argc, char *argv[]);
+int bench_cmds(int argc, char *argv[]);
 
 #endif /* _CMDS_H */
@@ -1,13 +1,18 @@
 #include <dirent.h>
+#include <pthread.h>
+#include <sys/sysinfo.h>
 #include <sys/xattr.h>
 #include <linux/dcache.h>
+#include <linux/kthread.h>
 #include <linux/xattr.h>
 
 #include "posix_to_bcachefs.h"
 #include "libbcachefs/alloc_foreground.h"
 #include "libbcachefs/buckets.h"
 #include "libbcachefs/fs-common.h"
+#include "libbcachefs/inode.h"
 #include "libbcachefs/io_write.h"
+#include "libbcachefs/keylist.h"
 #include "libbcachefs/str_hash.h"
 #include "libbcachefs/xattr.h"
 
@@ -136,7 +141,58 @@ void copy_xattrs(struct bch_fs *c, struct bch_inode_unpacked *dst,
 	}
 }
 
-#define WRITE_DATA_BUF	(1 << 20)
+#define WRITE_DATA_BUF		(1 << 20)
+
+/*
+ * Regular files are copied asynchronously: copy_dir() walks the source tree,
+ * creating inodes and queueing a copy_job for each regular file, and a pool
+ * of worker threads reads file data into buffers from a bounded pool and
+ * submits them as bch2_write ops without waiting for them to complete - so
+ * that reading the source, checksumming/compressing and writing all overlap.
+ */
+#define COPY_MAX_WORKERS	16
+#define COPY_JOBS_PER_WORKER	16
+#define COPY_BUFS_PER_WORKER	4
+
+struct copy_job {
+	struct copy_job		*next;
+	struct closure		*cl;
+	struct bch_inode_unpacked inode;
+	int			fd;
+	u64			size;
+	char			*path;
+	int			error;
+};
+
+struct copy_buf {
+	struct bch_write_op	op;
+	struct copy_ctx		*ctx;
+	struct copy_job		*job;
+	struct copy_buf		*next;
+	void			*data;
+	struct bio_vec		bv[WRITE_DATA_BUF / PAGE_SIZE];
+};
+
+struct copy_ctx {
+	struct bch_fs		*c;
+	struct copy_fs_state	*s;
+
+	pthread_mutex_t		lock;
+	pthread_cond_t		job_wait;
+	pthread_cond_t		buf_wait;
+
+	struct copy_job		*jobs, **jobs_tail;
+	unsigned		nr_jobs;
+	unsigned		max_jobs;
+	bool			done;
+
+	struct copy_buf		*bufs;
+	struct copy_buf		*free_bufs;
+	unsigned		nr_bufs;
+
+	unsigned		nr_workers;
+	struct task_struct	*workers[COPY_MAX_WORKERS];
+};
 
 static char buf[WRITE_DATA_BUF] __aligned(PAGE_SIZE);
 
@@ -175,23 +231,160 @@ static void write_data(struct bch_fs *c,
 		die("write error: %s", bch2_err_str(op.error));
 }
 
-void copy_data(struct bch_fs *c,
-		      struct bch_inode_unpacked *dst_inode,
-		      int src_fd, u64 start, u64 end)
+static struct copy_buf *copy_buf_get(struct copy_ctx *ctx)
+{
+	pthread_mutex_lock(&ctx->lock);
+	while (!ctx->free_bufs)
+		pthread_cond_wait(&ctx->buf_wait, &ctx->lock);
+
+	struct copy_buf *b = ctx->free_bufs;
+	ctx->free_bufs = b->next;
+	pthread_mutex_unlock(&ctx->lock);
+	return b;
+}
+
+static void copy_buf_put(struct copy_ctx *ctx, struct copy_buf *b)
 {
+	pthread_mutex_lock(&ctx->lock);
+	b->next = ctx->free_bufs;
+	ctx->free_bufs = b;
+	pthread_cond_signal(&ctx->buf_wait);
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+static void copy_write_done(struct bch_write_op *op)
+{
+	struct copy_buf *b = container_of(op, struct copy_buf, op);
+	struct copy_job *job = b->job;
+	struct closure *cl = job->cl;
+
+	if (op->error)
+		WRITE_ONCE(job->error, op->error);
+
+	copy_buf_put(b->ctx, b);
+	closure_put(cl);
+}
+
+static void copy_data(struct copy_ctx *ctx, struct copy_job *job,
+		      u64 start, u64 end)
+{
+	struct bch_fs *c = ctx->c;
+
 	while (start < end) {
-		unsigned len = min_t(u64, end - start, sizeof(buf));
+		struct copy_buf *b = copy_buf_get(ctx);
+		unsigned len = min_t(u64, end - start, WRITE_DATA_BUF);
 		unsigned pad = round_up(len, block_bytes(c)) - len;
 
-		xpread(src_fd, buf, len, start);
-		memset(buf + len, 0, pad);
+		xpread(job->fd, b->data, len, start);
+		memset(b->data + len, 0, pad);
+
+		bio_init(&b->op.wbio.bio, NULL, b->bv, ARRAY_SIZE(b->bv), 0);
+		bch2_bio_map(&b->op.wbio.bio, b->data, len + pad);
+
+		bch2_write_op_init(&b->op, c, bch2_opts_to_inode_opts(c->opts));
+		b->op.write_point	= writepoint_hashed(0);
+		b->op.nr_replicas	= 1;
+		b->op.subvol		= 1;
+		b->op.pos		= SPOS(job->inode.bi_inum, start >> 9, U32_MAX);
+		b->op.new_i_size	= job->size;
+		b->op.end_io		= copy_write_done;
+		b->job			= job;
+
+		int ret = bch2_disk_reservation_get(c, &b->op.res, (len + pad) >> 9,
+						    c->opts.data_replicas, 0);
+		if (ret)
+			die("error reserving space in new filesystem: %s", bch2_err_str(ret));
+
+		/* i_sectors are updated by the write path as each write completes: */
+		closure_get(job->cl);
+		closure_call(&b->op.cl, bch2_write, NULL, NULL);
 
-		write_data(c, dst_inode, start, buf, len + pad);
 		start += len;
 	}
 }
 
-static void link_data(struct bch_fs *c, struct bch_inode_unpacked *dst,
+/*
+ * In-place migrate generates an extent for every bucket-sized piece of every
+ * file: instead of committing each one separately, link_data() accumulates
+ * them and they're inserted LINK_DATA_BATCH at a time, in a single
+ * transaction together with the i_sectors updates for the inodes they belong
+ * to.
+ *
+ * Keys for a given inode are always added contiguously and in order, and
+ * transaction updates are sorted, so each commit touches a small number of
+ * leaf nodes.
+ */
+#define LINK_DATA_BATCH		128
+#define LINK_DATA_KEY_U64s	(BKEY_U64s + sizeof(struct bch_extent_ptr) / sizeof(u64))
+
+struct link_data_batch {
+	struct keylist		keys;
+	unsigned		nr;
+	u64			inline_keys[LINK_DATA_BATCH * LINK_DATA_KEY_U64s];
+};
+
+static void link_data_batch_init(struct link_data_batch *batch)
+{
+	bch2_keylist_init(&batch->keys, batch->inline_keys);
+	batch->nr = 0;
+}
+
+static int link_data_flush_trans(struct btree_trans *trans, struct keylist *keys)
+{
+	struct bkey_i *k = keys->keys;
+	int ret = 0;
+
+	while (k != keys->top) {
+		struct btree_iter iter;
+		struct bch_inode_unpacked u;
+		u64 inum = k->k.p.inode, sectors = 0;
+
+		for (;
+		     k != keys->top && k->k.p.inode == inum;
+		     k = bkey_next(k)) {
+			ret = bch2_btree_insert_trans(trans, BTREE_ID_extents, k, 0);
+			if (ret)
+				return ret;
+			sectors += k->k.size;
+		}
+
+		ret = bch2_inode_peek(trans, &iter, &u, (subvol_inum) { 1, inum },
+				      BTREE_ITER_intent) ?: ({
+			u.bi_sectors += sectors;
+			bch2_inode_write(trans, &iter, &u);
+		});
+		bch2_trans_iter_exit(trans, &iter);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static void link_data_flush(struct bch_fs *c, struct link_data_batch *batch)
+{
+	struct disk_reservation res;
+	int ret;
+
+	if (!batch->nr)
+		return;
+
+	ret = bch2_disk_reservation_get(c, &res, keylist_sectors(&batch->keys), 1,
+					BCH_DISK_RESERVATION_NOFAIL);
+	if (ret)
+		die("error reserving space in new filesystem: %s",
+		    bch2_err_str(ret));
+
+	ret = bch2_trans_commit_do(c, &res, NULL, 0,
+		link_data_flush_trans(trans, &batch->keys));
+	if (ret)
+		die("btree insert error %s", bch2_err_str(ret));
+
+	bch2_disk_reservation_put(c, &res);
+	link_data_batch_init(batch);
+}
+
+static void link_data(struct bch_fs *c, struct link_data_batch *batch, u64 inum,
 		      u64 logical, u64 physical, u64 length)
 {
 	struct bch_dev *ca = c->devs[0];
@@ -208,18 +401,15 @@ static void link_data(struct bch_fs *c, struct bch_inode_unpacked *dst,
 
 	while (length) {
 		struct bkey_i_extent *e;
-		BKEY_PADDED_ONSTACK(k, BKEY_EXTENT_VAL_U64s_MAX) k;
 		u64 b = sector_to_bucket(ca, physical);
-		struct disk_reservation res;
 		unsigned sectors;
-		int ret;
 
 		sectors = min(ca->mi.bucket_size -
 			      (physical & (ca->mi.bucket_size - 1)),
 			      length);
 
-		e = bkey_extent_init(&k.k);
-		e->k.p.inode	= dst->bi_inum;
+		e = bkey_extent_init(batch->keys.top);
+		e->k.p.inode	= inum;
 		e->k.p.offset	= logical + sectors;
 		e->k.p.snapshot	= U32_MAX;
 		e->k.size	= sectors;
@@ -228,20 +418,11 @@ static void link_data(struct bch_fs *c, struct bch_inode_unpacked *dst,
 					.dev = 0,
 					.gen = *bucket_gen(ca, b),
 				  });
+		bch2_keylist_push(&batch->keys);
 
-		ret = bch2_disk_reservation_get(c, &res, sectors, 1,
-						BCH_DISK_RESERVATION_NOFAIL);
-		if (ret)
-			die("error reserving space in new filesystem: %s",
-			    bch2_err_str(ret));
-
-		ret = bch2_btree_insert(c, BTREE_ID_extents, &e->k_i, &res, 0, 0);
-		if (ret)
-			die("btree insert error %s", bch2_err_str(ret));
+		if (++batch->nr == LINK_DATA_BATCH)
+			link_data_flush(c, batch);
 
-		bch2_disk_reservation_put(c, &res);
-
-		dst->bi_sectors	+= sectors;
 		logical		+= sectors;
 		physical	+= sectors;
 		length		-= sectors;
@@ -262,12 +443,19 @@ void copy_link(struct bch_fs *c, struct bch_inode_unpacked *dst,
 	write_data(c, dst, 0, buf, round_up(ret, block_bytes(c)));
 }
 
-static void copy_file(struct bch_fs *c, struct bch_inode_unpacked *dst,
-		      int src_fd, u64 src_size,
-		      char *src_path, struct copy_fs_state *s)
+static void copy_file(struct copy_ctx *ctx, struct link_data_batch *batch,
+		      struct copy_job *job)
 {
+	struct bch_fs *c = ctx->c;
+	struct copy_fs_state *s = ctx->s;
 	struct fiemap_iter iter;
 	struct fiemap_extent e;
+	struct closure cl;
+	int src_fd = job->fd;
+	u64 src_size = job->size;
+
+	closure_init_stack(&cl);
+	job->cl = &cl;
 
 	fiemap_for_each(src_fd, iter, e)
 		if (e.fe_flags & FIEMAP_EXTENT_UNKNOWN) {
@@ -283,13 +471,13 @@ static void copy_file(struct bch_fs *c, struct bch_inode_unpacked *dst,
 
 		if ((e.fe_logical	& (block_bytes(c) - 1)) ||
 		    (e.fe_length	& (block_bytes(c) - 1)))
-			die("Unaligned extent in %s - can't handle", src_path);
+			die("Unaligned extent in %s - can't handle", job->path);
 
 		if (BCH_MIGRATE_copy == s->type || (e.fe_flags & (FIEMAP_EXTENT_UNKNOWN|
 				  FIEMAP_EXTENT_ENCODED|
 				  FIEMAP_EXTENT_NOT_ALIGNED|
 				  FIEMAP_EXTENT_DATA_INLINE))) {
-			copy_data(c, dst, src_fd, e.fe_logical,
+			copy_data(ctx, job, e.fe_logical,
 				  e.fe_logical + min(src_size - e.fe_logical,
 				      e.fe_length));
 			continue;
@@ -300,26 +488,153 @@ static void copy_file(struct bch_fs *c, struct bch_inode_unpacked *dst,
 		 * with bcachefs's potentially larger superblock:
 		 */
 		if (e.fe_physical < 1 << 20) {
-			copy_data(c, dst, src_fd, e.fe_logical,
+			copy_data(ctx, job, e.fe_logical,
 				  e.fe_logical + min(src_size - e.fe_logical,
 				      e.fe_length));
 			continue;
 		}
 
 		if ((e.fe_physical	& (block_bytes(c) - 1)))
-			die("Unaligned extent in %s - can't handle", src_path);
+			die("Unaligned extent in %s - can't handle", job->path);
 
+		pthread_mutex_lock(&ctx->lock);
 		range_add(&s->extents, e.fe_physical, e.fe_length);
-		link_data(c, dst, e.fe_logical, e.fe_physical, e.fe_length);
+		pthread_mutex_unlock(&ctx->lock);
+
+		link_data(c, batch, job->inode.bi_inum,
+			  e.fe_logical, e.fe_physical, e.fe_length);
 	}
 	fiemap_iter_exit(&iter);
+
+	closure_sync(&cl);
+
+	if (job->error)
+		die("write error copying %s: %s", job->path, bch2_err_str(job->error));
 }
 
-static void copy_dir(struct copy_fs_state *s,
-		     struct bch_fs *c,
+static struct copy_job *copy_job_pop(struct copy_ctx *ctx)
+{
+	struct copy_job *job;
+
+	pthread_mutex_lock(&ctx->lock);
+	while (!ctx->jobs && !ctx->done)
+		pthread_cond_wait(&ctx->job_wait, &ctx->lock);
+
+	job = ctx->jobs;
+	if (job) {
+		ctx->jobs = job->next;
+		if (!ctx->jobs)
+			ctx->jobs_tail = &ctx->jobs;
+		ctx->nr_jobs--;
+		pthread_cond_broadcast(&ctx->job_wait);
+	}
+	pthread_mutex_unlock(&ctx->lock);
+	return job;
+}
+
+static void copy_job_push(struct copy_ctx *ctx, struct copy_job *job)
+{
+	pthread_mutex_lock(&ctx->lock);
+	while (ctx->nr_jobs >= ctx->max_jobs)
+		pthread_cond_wait(&ctx->job_wait, &ctx->lock);
+
+	job->next = NULL;
+	*ctx->jobs_tail = job;
+	ctx->jobs_tail = &job->next;
+	ctx->nr_jobs++;
+	pthread_cond_broadcast(&ctx->job_wait);
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+static int copy_worker(void *arg)
+{
+	struct copy_ctx *ctx = arg;
+	struct link_data_batch *batch = xmalloc(sizeof(*batch));
+	struct copy_job *job;
+
+	link_data_batch_init(batch);
+
+	while ((job = copy_job_pop(ctx))) {
+		copy_file(ctx, batch, job);
+
+		close(job->fd);
+		free(job->path);
+		free(job);
+	}
+
+	link_data_flush(ctx->c, batch);
+	free(batch);
+	return 0;
+}
+
+static void copy_ctx_init(struct copy_ctx *ctx, struct bch_fs *c,
+			  struct copy_fs_state *s)
+{
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->c		= c;
+	ctx->s		= s;
+	ctx->jobs_tail	= &ctx->jobs;
+
+	pthread_mutex_init(&ctx->lock, NULL);
+	pthread_cond_init(&ctx->job_wait, NULL);
+	pthread_cond_init(&ctx->buf_wait, NULL);
+
+	ctx->nr_workers	= clamp(get_nprocs(), 2, COPY_MAX_WORKERS);
+	ctx->max_jobs	= ctx->nr_workers * COPY_JOBS_PER_WORKER;
+	ctx->nr_bufs	= ctx->nr_workers * COPY_BUFS_PER_WORKER;
+	ctx->bufs	= xcalloc(ctx->nr_bufs, sizeof(ctx->bufs[0]));
+
+	for (unsigned i = 0; i < ctx->nr_bufs; i++) {
+		struct copy_buf *b = &ctx->bufs[i];
+
+		b->ctx	= ctx;
+		b->data	= aligned_alloc(PAGE_SIZE, WRITE_DATA_BUF);
+		if (!b->data)
+			die("error allocating copy buffers");
+
+		b->next	= ctx->free_bufs;
+		ctx->free_bufs = b;
+	}
+
+	for (unsigned i = 0; i < ctx->nr_workers; i++) {
+		struct task_struct *p = kthread_create(copy_worker, ctx, "bch-copy/%u", i);
+		if (IS_ERR(p))
+			die("error starting copy thread: %s", bch2_err_str(PTR_ERR(p)));
+
+		get_task_struct(p);
+		ctx->workers[i] = p;
+		wake_up_process(p);
+	}
+}
+
+/* Waits for all queued files to be copied: */
+static void copy_ctx_exit(struct copy_ctx *ctx)
+{
+	pthread_mutex_lock(&ctx->lock);
+	ctx->done = true;
+	pthread_cond_broadcast(&ctx->job_wait);
+	pthread_mutex_unlock(&ctx->lock);
+
+	for (unsigned i = 0; i < ctx->nr_workers; i++) {
+		kthread_stop(ctx->workers[i]);
+		put_task_struct(ctx->workers[i]);
+	}
+
+	for (unsigned i = 0; i < ctx->nr_bufs; i++)
+		free(ctx->bufs[i].data);
+	free(ctx->bufs);
+
+	pthread_cond_destroy(&ctx->buf_wait);
+	pthread_cond_destroy(&ctx->job_wait);
+	pthread_mutex_destroy(&ctx->lock);
+}
+
+static void copy_dir(struct copy_ctx *ctx,
 		     struct bch_inode_unpacked *dst,
 		     int src_fd, const char *src_path)
 {
+	struct copy_fs_state *s = ctx->s;
+	struct bch_fs *c = ctx->c;
 	DIR *dir = fdopendir(src_fd);
 	struct dirent *d;
 
@@ -369,17 +684,30 @@ static void copy_dir(struct copy_fs_state *s,
 		switch (mode_to_type(stat.st_mode)) {
 		case DT_DIR:
 			fd = xopen(d->d_name, O_RDONLY|O_NOATIME);
-			copy_dir(s, c, &inode, fd, child_path);
+			copy_dir(ctx, &inode, fd, child_path);
 			close(fd);
 			break;
 		case DT_REG:
 			inode.bi_size = stat.st_size;
-
-			fd = xopen(d->d_name, O_RDONLY|O_NOATIME);
-			copy_file(c, &inode, fd, stat.st_size,
-				  child_path, s);
-			close(fd);
-			break;
+			copy_times(c, &inode, &stat);
+			update_inode(c, &inode);
+
+			if (!stat.st_size)
+				goto next;
+
+			/*
+			 * The inode is written out before any data, so the
+			 * write path and create_link() only see it updated
+			 * transactionally from here on:
+			 */
+			struct copy_job *job = xmalloc(sizeof(*job));
+			memset(job, 0, sizeof(*job));
+			job->inode	= inode;
+			job->fd		= xopen(d->d_name, O_RDONLY|O_NOATIME);
+			job->size	= stat.st_size;
+			job->path	= child_path;
+			copy_job_push(ctx, job);
+			continue;
 		case DT_LNK:
 			inode.bi_size = stat.st_size;
 
@@ -412,6 +740,7 @@ static void reserve_old_fs_space(struct bch_fs *c,
 				 ranges *extents)
 {
 	struct bch_dev *ca = c->devs[0];
+	struct link_data_batch *batch = xmalloc(sizeof(*batch));
 	struct bch_inode_unpacked dst;
 	struct hole_iter iter;
 	struct range i;
@@ -419,13 +748,15 @@ static void reserve_old_fs_space(struct bch_fs *c,
 	dst = create_file(c, root_inode, "old_migrated_filesystem",
 			  0, 0, S_IFREG|0400, 0);
 	dst.bi_size = bucket_to_sector(ca, ca->mi.nbuckets) << 9;
+	update_inode(c, &dst);
 
 	ranges_sort_merge(extents);
 
+	link_data_batch_init(batch);
 	for_each_hole(iter, *extents, bucket_to_sector(ca, ca->mi.nbuckets) << 9, i)
-		link_data(c, &dst, i.start, i.start, i.end - i.start);
-
-	update_inode(c, &dst);
+		link_data(c, batch, dst.bi_inum, i.start, i.start, i.end - i.start);
+	link_data_flush(c, batch);
+	free(batch);
 }
 
 void copy_fs(struct bch_fs *c, int src_fd, const char *src_path,
@@ -448,7 +779,10 @@ void copy_fs(struct bch_fs *c, int src_fd, const char *src_path,
 
 
 	/* now, copy: */
-	copy_dir(s, c, &root_inode, src_fd, src_path);
+	struct copy_ctx ctx;
+	copy_ctx_init(&ctx, c, s);
+	copy_dir(&ctx, &root_inode, src_fd, src_path);
+	copy_ctx_exit(&ctx);
 
 	if (BCH_MIGRATE_migrate == s->type)
 		reserve_old_fs_space(c, &root_inode, &s->extents);
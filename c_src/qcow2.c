@@ -1,14 +1,32 @@
-
 #include <errno.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <zstd.h>
+
 #include "qcow2.h"
 #include "tools-util.h"
 
 #define QCOW_MAGIC		(('Q' << 24) | ('F' << 16) | ('I' << 8) | 0xfb)
-#define QCOW_VERSION		2
+#define QCOW_VERSION		3
 #define QCOW_OFLAG_COPIED	(1LL << 63)
+#define QCOW_OFLAG_COMPRESSED	(1LL << 62)
+
+#define QCOW_INCOMPAT_COMPRESSION	(1ULL << 3)
+#define QCOW_COMPRESSION_ZSTD		1
+#define QCOW_REFCOUNT_ORDER		4
+
+/*
+ * Data is read in chunks of up to QCOW2_CHUNK_MAX contiguous bytes by a pool of
+ * worker threads, which also skip zero blocks and compress the rest; chunks are
+ * then appended to the image in order by the thread calling
+ * qcow2_write_image(), so that reads, compression and writes of different
+ * chunks are in flight at the same time:
+ */
+#define QCOW2_CHUNK_MAX		(1U << 20)
+#define QCOW2_NR_WORKERS	4
+#define QCOW2_QUEUE_DEPTH	(QCOW2_NR_WORKERS * 2)
 
 struct qcow2_hdr {
 	u32			magic;
@@ -29,6 +47,17 @@ struct qcow2_hdr {
 
 	u32			nb_snapshots;
 	u64			snapshots_offset;
+
+	/* v3: */
+	u64			incompatible_features;
+	u64			compatible_features;
+	u64			autoclear_features;
+
+	u32			refcount_order;
+	u32			header_length;
+
+	u8			compression_type;
+	u8			pad[7];
 };
 
 struct qcow2_image {
@@ -39,23 +68,60 @@ struct qcow2_image {
 	u32			l1_index;
 	u64			*l2_table;
 	u64			offset;
+
+	/* Image data is appended sequentially, through a write buffer: */
+	void			*wbuf;
+	unsigned		wbuf_size;
+	unsigned		wbuf_used;
 };
 
+static void img_flush(struct qcow2_image *img)
+{
+	if (img->wbuf_used) {
+		xpwrite(img->fd, img->wbuf, img->wbuf_used,
+			img->offset - img->wbuf_used, "qcow2 data");
+		img->wbuf_used = 0;
+	}
+}
+
+static void *img_append(struct qcow2_image *img, unsigned len)
+{
+	if (img->wbuf_used + len > img->wbuf_size)
+		img_flush(img);
+
+	void *ret = img->wbuf + img->wbuf_used;
+	img->wbuf_used	+= len;
+	img->offset	+= len;
+	return ret;
+}
+
+static void img_write(struct qcow2_image *img, const void *data, unsigned len)
+{
+	memcpy(img_append(img, len), data, len);
+}
+
+/* Uncompressed clusters and tables must be cluster aligned: */
+static void img_align(struct qcow2_image *img)
+{
+	unsigned pad = round_up(img->offset, img->block_size) - img->offset;
+
+	memset(img_append(img, pad), 0, pad);
+}
+
 static void flush_l2(struct qcow2_image *img)
 {
 	if (img->l1_index != -1) {
+		img_align(img);
 		img->l1_table[img->l1_index] =
 			cpu_to_be64(img->offset|QCOW_OFLAG_COPIED);
-		xpwrite(img->fd, img->l2_table, img->block_size, img->offset,
-			"qcow2 l2 table");
-		img->offset += img->block_size;
+		img_write(img, img->l2_table, img->block_size);
 
 		memset(img->l2_table, 0, img->block_size);
 		img->l1_index = -1;
 	}
 }
 
-static void add_l2(struct qcow2_image *img, u64 src_blk, u64 dst_offset)
+static void add_l2(struct qcow2_image *img, u64 src_blk, u64 entry)
 {
 	unsigned l2_size = img->block_size / sizeof(u64);
 	u64 l1_index = src_blk / l2_size;
@@ -66,16 +132,189 @@ static void add_l2(struct qcow2_image *img, u64 src_blk, u64 dst_offset)
 		img->l1_index = l1_index;
 	}
 
-	img->l2_table[l2_index] = cpu_to_be64(dst_offset|QCOW_OFLAG_COPIED);
+	img->l2_table[l2_index] = cpu_to_be64(entry);
+}
+
+struct qcow2_chunk {
+	u64			src;
+	u64			len;
+	bool			done;
+
+	void			*buf;
+	void			*cbuf;
+	/*
+	 * Per block: 0 for zero blocks, block_size for blocks stored
+	 * uncompressed, otherwise the size of the compressed data in cbuf:
+	 */
+	u32			*clen;
+};
+
+struct qcow2_copy {
+	int			infd;
+	unsigned		block_size;
+	unsigned		chunk_max;
+	bool			compress;
+
+	pthread_mutex_t		lock;
+	pthread_cond_t		wait;
+	bool			done;
+	/* sequence numbers of chunks, indexes into ring modulo QCOW2_QUEUE_DEPTH: */
+	unsigned long		head;		/* next chunk to write out */
+	unsigned long		dispatched;	/* next chunk for a worker */
+	unsigned long		tail;		/* next free chunk */
+	struct qcow2_chunk	ring[QCOW2_QUEUE_DEPTH];
+};
+
+static bool block_is_zero(const void *p, unsigned len)
+{
+	return !*((u64 *) p) && !memcmp(p, p + sizeof(u64), len - sizeof(u64));
+}
+
+static void qcow2_chunk_process(struct qcow2_copy *copy, ZSTD_CCtx *cctx,
+				struct qcow2_chunk *c)
+{
+	unsigned bs = copy->block_size;
+
+	xpread(copy->infd, c->buf, c->len, c->src);
+
+	for (unsigned i = 0; i < c->len / bs; i++) {
+		void *b = c->buf + i * bs;
+
+		if (block_is_zero(b, bs)) {
+			c->clen[i] = 0;
+			continue;
+		}
+
+		c->clen[i] = bs;
+
+		if (cctx) {
+			/* Only worth it if it saves at least one sector: */
+			size_t r = ZSTD_compressCCtx(cctx, c->cbuf + i * bs, bs - 512,
+						     b, bs, ZSTD_CLEVEL_DEFAULT);
+			if (!ZSTD_isError(r))
+				c->clen[i] = r;
+		}
+	}
+}
+
+static void *qcow2_copy_worker(void *arg)
+{
+	struct qcow2_copy *copy = arg;
+	ZSTD_CCtx *cctx = NULL;
+
+	if (copy->compress) {
+		cctx = ZSTD_createCCtx();
+		if (!cctx)
+			die("error allocating zstd context");
+	}
+
+	pthread_mutex_lock(&copy->lock);
+	while (1) {
+		while (copy->dispatched == copy->tail && !copy->done)
+			pthread_cond_wait(&copy->wait, &copy->lock);
+
+		if (copy->dispatched == copy->tail)
+			break;
+
+		struct qcow2_chunk *c = &copy->ring[copy->dispatched++ % QCOW2_QUEUE_DEPTH];
+		pthread_mutex_unlock(&copy->lock);
+
+		qcow2_chunk_process(copy, cctx, c);
+
+		pthread_mutex_lock(&copy->lock);
+		c->done = true;
+		pthread_cond_broadcast(&copy->wait);
+	}
+	pthread_mutex_unlock(&copy->lock);
+
+	ZSTD_freeCCtx(cctx);
+	return NULL;
+}
+
+static void qcow2_chunk_write(struct qcow2_image *img, struct qcow2_chunk *c)
+{
+	unsigned bs = img->block_size;
+	unsigned block_bits = ilog2(bs);
+	unsigned csize_shift = 62 - (block_bits - 8);
+	u64 src_blk = c->src >> block_bits;
+
+	for (unsigned i = 0; i < c->len / bs; i++) {
+		unsigned clen = c->clen[i];
+
+		if (!clen)
+			continue;
+
+		if (clen == bs) {
+			img_align(img);
+
+			u64 dst_offset = img->offset;
+			img_write(img, c->buf + i * bs, bs);
+			add_l2(img, src_blk + i, dst_offset|QCOW_OFLAG_COPIED);
+		} else {
+			/*
+			 * Compressed clusters are byte aligned; the L2 entry
+			 * has the number of additional 512 byte sectors the
+			 * compressed data touches:
+			 */
+			u64 dst_offset = img->offset;
+			u64 nr_sectors = ((dst_offset + clen - 1) >> 9) - (dst_offset >> 9);
+
+			img_write(img, c->cbuf + i * bs, clen);
+			add_l2(img, src_blk + i,
+			       dst_offset|(nr_sectors << csize_shift)|QCOW_OFLAG_COMPRESSED);
+		}
+	}
+}
+
+static void qcow2_copy_queue(struct qcow2_copy *copy, struct qcow2_image *img,
+			     u64 src, u64 len, atomic64_t *progress)
+{
+	pthread_mutex_lock(&copy->lock);
+	while (copy->head != copy->tail &&
+	       (!len || copy->tail - copy->head == QCOW2_QUEUE_DEPTH)) {
+		struct qcow2_chunk *c = &copy->ring[copy->head % QCOW2_QUEUE_DEPTH];
+
+		if (!c->done) {
+			pthread_cond_wait(&copy->wait, &copy->lock);
+			continue;
+		}
+
+		/* Only we touch chunks between head and tail that are done: */
+		pthread_mutex_unlock(&copy->lock);
+		qcow2_chunk_write(img, c);
+		if (progress)
+			atomic64_add(c->len, progress);
+		pthread_mutex_lock(&copy->lock);
+
+		copy->head++;
+	}
+
+	if (len) {
+		struct qcow2_chunk *c = &copy->ring[copy->tail++ % QCOW2_QUEUE_DEPTH];
+
+		c->src	= src;
+		c->len	= len;
+		c->done	= false;
+		pthread_cond_broadcast(&copy->wait);
+	}
+	pthread_mutex_unlock(&copy->lock);
 }
 
 void qcow2_write_image(int infd, int outfd, ranges *data,
-		       unsigned block_size)
+		       unsigned block_size, bool compress, atomic64_t *progress)
 {
 	u64 image_size = get_size(infd);
 	unsigned l2_size = block_size / sizeof(u64);
 	unsigned l1_size = DIV_ROUND_UP(image_size, (u64) block_size * l2_size);
 	struct qcow2_hdr hdr = { 0 };
+	struct qcow2_copy copy = {
+		.infd		= infd,
+		.block_size	= block_size,
+		.chunk_max	= max(QCOW2_CHUNK_MAX, block_size),
+		.compress	= compress,
+		.lock		= PTHREAD_MUTEX_INITIALIZER,
+		.wait		= PTHREAD_COND_INITIALIZER,
+	};
 	struct qcow2_image img = {
 		.fd		= outfd,
 		.block_size	= block_size,
@@ -83,31 +322,55 @@ void qcow2_write_image(int infd, int outfd, ranges *data,
 		.l1_table	= xcalloc(l1_size, sizeof(u64)),
 		.l1_index	= -1,
 		.offset		= round_up(sizeof(hdr), block_size),
+		.wbuf		= xmalloc(copy.chunk_max),
+		.wbuf_size	= copy.chunk_max,
 	};
+	pthread_t workers[QCOW2_NR_WORKERS];
 	char *buf = xmalloc(block_size);
 	u64 src_offset, dst_offset;
+	unsigned i;
+	int ret;
 
 	assert(is_power_of_2(block_size));
 
 	ranges_roundup(data, block_size);
 	ranges_sort_merge(data);
 
+	for (i = 0; i < ARRAY_SIZE(copy.ring); i++) {
+		copy.ring[i].buf	= xmalloc(copy.chunk_max);
+		copy.ring[i].cbuf	= compress ? xmalloc(copy.chunk_max) : NULL;
+		copy.ring[i].clen	= xcalloc(copy.chunk_max / block_size, sizeof(u32));
+	}
+
+	for (i = 0; i < ARRAY_SIZE(workers); i++) {
+		ret = pthread_create(&workers[i], NULL, qcow2_copy_worker, &copy);
+		if (ret)
+			die("error creating qcow2 worker thread: %s", strerror(ret));
+	}
+
 	/* Write data: */
 	darray_for_each(*data, r)
 		for (src_offset = r->start;
 		     src_offset < r->end;
-		     src_offset += block_size) {
-			dst_offset = img.offset;
-			img.offset += img.block_size;
+		     src_offset += copy.chunk_max)
+			qcow2_copy_queue(&copy, &img, src_offset,
+					 min_t(u64, r->end - src_offset, copy.chunk_max),
+					 progress);
 
-			xpread(infd, buf, block_size, src_offset);
-			xpwrite(outfd, buf, block_size, dst_offset,
-				"qcow2 data");
+	/* Drain: */
+	qcow2_copy_queue(&copy, &img, 0, 0, progress);
 
-			add_l2(&img, src_offset / block_size, dst_offset);
-		}
+	pthread_mutex_lock(&copy.lock);
+	copy.done = true;
+	pthread_cond_broadcast(&copy.wait);
+	pthread_mutex_unlock(&copy.lock);
+
+	for (i = 0; i < ARRAY_SIZE(workers); i++)
+		pthread_join(workers[i], NULL);
 
 	flush_l2(&img);
+	img_align(&img);
+	img_flush(&img);
 
 	/* Write L1 table: */
 	dst_offset		= img.offset;
@@ -122,12 +385,25 @@ void qcow2_write_image(int infd, int outfd, ranges *data,
 	hdr.size		= cpu_to_be64(image_size);
 	hdr.l1_size		= cpu_to_be32(l1_size);
 	hdr.l1_table_offset	= cpu_to_be64(dst_offset);
+	hdr.refcount_order	= cpu_to_be32(QCOW_REFCOUNT_ORDER);
+	hdr.header_length	= cpu_to_be32(sizeof(hdr));
+
+	if (compress) {
+		hdr.incompatible_features = cpu_to_be64(QCOW_INCOMPAT_COMPRESSION);
+		hdr.compression_type	= QCOW_COMPRESSION_ZSTD;
+	}
 
 	memset(buf, 0, block_size);
 	memcpy(buf, &hdr, sizeof(hdr));
 	xpwrite(img.fd, buf, block_size, 0,
 		"qcow2 header");
 
+	for (i = 0; i < ARRAY_SIZE(copy.ring); i++) {
+		free(copy.ring[i].buf);
+		free(copy.ring[i].cbuf);
+		free(copy.ring[i].clen);
+	}
+	free(img.wbuf);
 	free(img.l2_table);
 	free(img.l1_table);
 	free(buf);
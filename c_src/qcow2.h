@@ -1,9 +1,10 @@
 #ifndef _QCOW2_H
 #define _QCOW2_H
 
+#include <linux/atomic.h>
 #include <linux/types.h>
 #include "tools-util.h"
 
-void qcow2_write_image(int, int, ranges *, unsigned);
+void qcow2_write_image(int, int, ranges *, unsigned, bool, atomic64_t *);
 
 #endif /* _QCOW2_H */
@@ -0,0 +1,118 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <linux/sysfs.h>
+
+#include "sysfs_client.h"
+#include "tools-util.h"
+
+static int sysfs_connect(pid_t pid)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int len = snprintf(addr.sun_path + 1, sizeof(addr.sun_path) - 1,
+			   SYSFS_SOCKET_FMT, pid);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		die("socket error: %m");
+
+	if (connect(fd, (struct sockaddr *) &addr,
+		    offsetof(struct sockaddr_un, sun_path) + 1 + len)) {
+		int ret = -errno;
+		close(fd);
+		return ret;
+	}
+
+	return fd;
+}
+
+/*
+ * Read @path from the sysfs tree of process @pid into @out: the contents of an
+ * attribute, or the entries of a directory (one per line, with a trailing '/'
+ * for subdirectories), in which case *@dir is set.
+ *
+ * Returns 0, -ECONNREFUSED if @pid isn't serving sysfs, or the error from the
+ * server.
+ */
+int sysfs_read(pid_t pid, const char *path, bool *dir, struct printbuf *out)
+{
+	int fd = sysfs_connect(pid);
+	if (fd < 0)
+		return fd;
+
+	char *req = mprintf("%s\n", path);
+	if (write(fd, req, strlen(req)) != strlen(req))
+		die("error writing to sysfs socket: %m");
+	free(req);
+	shutdown(fd, SHUT_WR);
+
+	struct printbuf buf = PRINTBUF;
+	while (1) {
+		bch2_printbuf_make_room(&buf, 4096);
+
+		ssize_t r = read(fd, buf.buf + buf.pos, printbuf_remaining(&buf));
+		if (r < 0)
+			die("error reading from sysfs socket: %m");
+		if (!r)
+			break;
+		buf.pos += r;
+	}
+	printbuf_nul_terminate(&buf);
+	close(fd);
+
+	char *body = strchr(buf.buf ?: "", '\n');
+	int ret = 0;
+
+	if (!body) {
+		ret = -EIO;
+	} else if (!strncmp(buf.buf, "dir\n", 4) ||
+		   !strncmp(buf.buf, "file\n", 5)) {
+		*dir = buf.buf[0] == 'd';
+		prt_str(out, body + 1);
+	} else if (sscanf(buf.buf, "error %i", &ret) == 1) {
+		ret = -ret;
+	} else {
+		ret = -EIO;
+	}
+
+	printbuf_exit(&buf);
+	return ret;
+}
+
+/* Processes serving sysfs, from the abstract sockets listed in /proc/net/unix: */
+darray_pid sysfs_instances(void)
+{
+	darray_pid ret = {};
+	FILE *f = fopen("/proc/net/unix", "r");
+	if (!f)
+		return ret;
+
+	const char *prefix = "@" SYSFS_SOCKET_PREFIX;
+	char *line = NULL;
+	size_t n = 0;
+
+	while (getline(&line, &n, f) >= 0) {
+		char *name = strrchr(line, ' ');
+		unsigned pid;
+
+		if (!name ||
+		    strncmp(name + 1, prefix, strlen(prefix)) ||
+		    sscanf(name + 1 + strlen(prefix), "%u", &pid) != 1)
+			continue;
+
+		/* Connected sockets show up under the same name: */
+		bool dup = false;
+		darray_for_each(ret, i)
+			dup |= *i == pid;
+		if (!dup)
+			darray_push(&ret, pid);
+	}
+
+	free(line);
+	fclose(f);
+	return ret;
+}
@@ -0,0 +1,19 @@
+#ifndef _SYSFS_CLIENT_H
+#define _SYSFS_CLIENT_H
+
+#include <sys/types.h>
+
+#include "libbcachefs/darray.h"
+#include "libbcachefs/printbuf.h"
+
+/*
+ * Client side of the sysfs socket served by userspace bcachefs processes -
+ * see include/linux/sysfs.h
+ */
+
+typedef DARRAY(pid_t) darray_pid;
+
+int sysfs_read(pid_t, const char *, bool *, struct printbuf *);
+darray_pid sysfs_instances(void);
+
+#endif /* _SYSFS_CLIENT_H */
@@ -60,6 +60,7 @@ void xpread(int fd, void *buf, size_t count, off_t offset)
 			die("read error: %m");
 		if (!r)
 			die("pread error: unexpected eof");
+		buf	+= r;
 		count	-= r;
 		offset	+= r;
 	}
@@ -432,6 +433,9 @@ static u32 crc32c_default(u32 crc, const void *buf, size_t size)
 
 #ifdef __x86_64__
 
+#include <immintrin.h>
+#include <asm/unaligned.h>
+
 #ifdef CONFIG_X86_64
 #define REX_PRE "0x48, "
 #else
@@ -467,17 +471,262 @@ static u32 crc32c_sse42(u32 crc, const void *buf, size_t size)
 	return crc;
 }
 
+/*
+ * crc32q has a latency of three cycles but a throughput of one per cycle, so
+ * for large buffers we run three independent streams over adjacent blocks and
+ * then combine them.
+ *
+ * Shifting a crc forward over n zero bits is multiplication by x^n mod P;
+ * with the reflected bit order, clmul(a, b) is a * b * x, and crc32q(0, v) is
+ * v * x^32 mod P, so crc32q(0, clmul(crc, x^(n - 33) mod P)) is crc * x^n mod P.
+ *
+ * Constants are computed once at startup, by crc32c_consts_init(), before any
+ * thread can be using them:
+ */
+#define CRC32C_POLY_REFLECTED	0x82F63B78U
+
+#define CRC32C_3WAY_LONG	8192
+#define CRC32C_3WAY_SHORT	256
+
+static struct {
+	u64	long_k1;	/* shift by 2 * CRC32C_3WAY_LONG bytes */
+	u64	long_k2;	/* shift by CRC32C_3WAY_LONG bytes */
+	u64	short_k1;
+	u64	short_k2;
+
+	/* Folding constants for the VPCLMULQDQ version, see crc32c_fold(): */
+	u64	fold_2048[2];
+	u64	fold_1536[2];
+	u64	fold_1024[2];
+	u64	fold_512[2];
+	u64	fold_384[2];
+	u64	fold_256[2];
+	u64	fold_128[2];
+} crc32c_consts;
+
+/* x^n mod P, reflected: */
+static u32 crc32c_xpow_mod(unsigned n)
+{
+	u32 r = 1U << 31;
+
+	while (n--)
+		r = (r >> 1) ^ ((r & 1) ? CRC32C_POLY_REFLECTED : 0);
+	return r;
+}
+
+/* As a 64 bit clmul operand: bit i is the coefficient of x^(63 - i) */
+static u64 crc32c_xpow_mod64(unsigned n)
+{
+	return (u64) crc32c_xpow_mod(n) << 32;
+}
+
+static void crc32c_fold_consts_init(u64 k[2], unsigned bits)
+{
+	k[0] = crc32c_xpow_mod64(bits + 63);
+	k[1] = crc32c_xpow_mod64(bits - 1);
+}
+
+__attribute__((constructor))
+static void crc32c_consts_init(void)
+{
+	crc32c_consts.long_k1	= crc32c_xpow_mod(CRC32C_3WAY_LONG * 2 * 8 - 33);
+	crc32c_consts.long_k2	= crc32c_xpow_mod(CRC32C_3WAY_LONG * 8 - 33);
+	crc32c_consts.short_k1	= crc32c_xpow_mod(CRC32C_3WAY_SHORT * 2 * 8 - 33);
+	crc32c_consts.short_k2	= crc32c_xpow_mod(CRC32C_3WAY_SHORT * 8 - 33);
+
+	crc32c_fold_consts_init(crc32c_consts.fold_2048, 2048);
+	crc32c_fold_consts_init(crc32c_consts.fold_1536, 1536);
+	crc32c_fold_consts_init(crc32c_consts.fold_1024, 1024);
+	crc32c_fold_consts_init(crc32c_consts.fold_512,	  512);
+	crc32c_fold_consts_init(crc32c_consts.fold_384,	  384);
+	crc32c_fold_consts_init(crc32c_consts.fold_256,	  256);
+	crc32c_fold_consts_init(crc32c_consts.fold_128,	  128);
+}
+
+#define CRC32C_3WAY_TARGET __attribute__((target("sse4.2,pclmul")))
+
+static inline CRC32C_3WAY_TARGET
+u32 crc32c_shift(u32 crc, u64 k)
+{
+	__m128i t = _mm_clmulepi64_si128(_mm_cvtsi32_si128(crc),
+					 _mm_cvtsi64_si128(k), 0x00);
+
+	return _mm_crc32_u64(0, _mm_cvtsi128_si64(t));
+}
+
+static inline CRC32C_3WAY_TARGET
+u32 crc32c_3way_block(u32 crc, const void *buf, size_t block, u64 k1, u64 k2)
+{
+	const u64 *a = buf, *b = buf + block, *c = buf + block * 2;
+	u64 crc_a = crc, crc_b = 0, crc_c = 0;
+
+	for (size_t i = 0; i < block / 8; i++) {
+		crc_a = _mm_crc32_u64(crc_a, get_unaligned(a + i));
+		crc_b = _mm_crc32_u64(crc_b, get_unaligned(b + i));
+		crc_c = _mm_crc32_u64(crc_c, get_unaligned(c + i));
+	}
+
+	return crc32c_shift(crc_a, k1) ^ crc32c_shift(crc_b, k2) ^ crc_c;
+}
+
+static CRC32C_3WAY_TARGET
+u32 crc32c_sse42_3way(u32 crc, const void *buf, size_t size)
+{
+	while (size >= CRC32C_3WAY_LONG * 3) {
+		crc = crc32c_3way_block(crc, buf, CRC32C_3WAY_LONG,
+					crc32c_consts.long_k1, crc32c_consts.long_k2);
+		buf	+= CRC32C_3WAY_LONG * 3;
+		size	-= CRC32C_3WAY_LONG * 3;
+	}
+
+	while (size >= CRC32C_3WAY_SHORT * 3) {
+		crc = crc32c_3way_block(crc, buf, CRC32C_3WAY_SHORT,
+					crc32c_consts.short_k1, crc32c_consts.short_k2);
+		buf	+= CRC32C_3WAY_SHORT * 3;
+		size	-= CRC32C_3WAY_SHORT * 3;
+	}
+
+	return crc32c_sse42(crc, buf, size);
+}
+
+/*
+ * VPCLMULQDQ: fold the input 256 bytes at a time in four 512 bit registers,
+ * the way the kernel's crc32 folding code does, then finish with crc32q.
+ *
+ * Folding a 128 bit lane X = H:L (H in the low 64 bits, i.e. the first 8
+ * bytes) forward by n bits is H * x^(n + 64) + L * x^n; with the extra x from
+ * clmul the constants are x^(n + 63) and x^(n - 1) mod P:
+ */
+#define CRC32C_VPCLMUL_TARGET \
+	__attribute__((target("sse4.2,pclmul,avx512f,avx512vl,avx512bw,vpclmulqdq")))
+
+#define CRC32C_VPCLMUL_MIN	1024
+
+static inline CRC32C_VPCLMUL_TARGET
+__m512i crc32c_fold_512(__m512i x, __m512i k, __m512i next)
+{
+	return _mm512_ternarylogic_epi64(next,
+			_mm512_clmulepi64_epi128(x, k, 0x00),
+			_mm512_clmulepi64_epi128(x, k, 0x11), 0x96);
+}
+
+static inline CRC32C_VPCLMUL_TARGET
+__m128i crc32c_fold(__m128i x, const u64 k[2], __m128i next)
+{
+	__m128i kv = _mm_set_epi64x(k[1], k[0]);
+
+	return _mm_xor_si128(next,
+		_mm_xor_si128(_mm_clmulepi64_si128(x, kv, 0x00),
+			      _mm_clmulepi64_si128(x, kv, 0x11)));
+}
+
+static inline CRC32C_VPCLMUL_TARGET
+__m512i crc32c_broadcast_k(const u64 k[2])
+{
+	return _mm512_broadcast_i32x4(_mm_set_epi64x(k[1], k[0]));
+}
+
+static CRC32C_VPCLMUL_TARGET
+u32 crc32c_vpclmul(u32 crc, const void *buf, size_t size)
+{
+	if (size < CRC32C_VPCLMUL_MIN)
+		return crc32c_sse42_3way(crc, buf, size);
+
+	const __m512i k2048 = crc32c_broadcast_k(crc32c_consts.fold_2048);
+
+	/* The initial crc is xored into the first 32 bits of input: */
+	__m512i x0 = _mm512_xor_si512(_mm512_loadu_si512(buf),
+				      _mm512_zextsi128_si512(_mm_cvtsi32_si128(crc)));
+	__m512i x1 = _mm512_loadu_si512(buf +  64);
+	__m512i x2 = _mm512_loadu_si512(buf + 128);
+	__m512i x3 = _mm512_loadu_si512(buf + 192);
+
+	buf	+= 256;
+	size	-= 256;
+
+	while (size >= 256) {
+		x0 = crc32c_fold_512(x0, k2048, _mm512_loadu_si512(buf));
+		x1 = crc32c_fold_512(x1, k2048, _mm512_loadu_si512(buf +  64));
+		x2 = crc32c_fold_512(x2, k2048, _mm512_loadu_si512(buf + 128));
+		x3 = crc32c_fold_512(x3, k2048, _mm512_loadu_si512(buf + 192));
+		buf	+= 256;
+		size	-= 256;
+	}
+
+	/* Four registers down to one: */
+	x0 = crc32c_fold_512(x0, crc32c_broadcast_k(crc32c_consts.fold_1536),
+		crc32c_fold_512(x1, crc32c_broadcast_k(crc32c_consts.fold_1024),
+			crc32c_fold_512(x2, crc32c_broadcast_k(crc32c_consts.fold_512), x3)));
+
+	/* Four lanes down to one: */
+	__m128i x = crc32c_fold(_mm512_extracti32x4_epi32(x0, 0), crc32c_consts.fold_384,
+		    crc32c_fold(_mm512_extracti32x4_epi32(x0, 1), crc32c_consts.fold_256,
+		    crc32c_fold(_mm512_extracti32x4_epi32(x0, 2), crc32c_consts.fold_128,
+				_mm512_extracti32x4_epi32(x0, 3))));
+
+	while (size >= 16) {
+		x = crc32c_fold(x, crc32c_consts.fold_128, _mm_loadu_si128(buf));
+		buf	+= 16;
+		size	-= 16;
+	}
+
+	/* x is now the remaining 16 bytes of input, with crc already applied: */
+	crc = _mm_crc32_u64(0, _mm_cvtsi128_si64(x));
+	crc = _mm_crc32_u64(crc, _mm_extract_epi64(x, 1));
+
+	return crc32c_sse42(crc, buf, size);
+}
+
 #endif
 
 static void *resolve_crc32c(void)
 {
 #ifdef __x86_64__
+	if (__builtin_cpu_supports("vpclmulqdq") &&
+	    __builtin_cpu_supports("avx512f") &&
+	    __builtin_cpu_supports("avx512vl") &&
+	    __builtin_cpu_supports("avx512bw") &&
+	    __builtin_cpu_supports("sse4.2"))
+		return crc32c_vpclmul;
+	if (__builtin_cpu_supports("sse4.2") &&
+	    __builtin_cpu_supports("pclmul"))
+		return crc32c_sse42_3way;
 	if (__builtin_cpu_supports("sse4.2"))
 		return crc32c_sse42;
 #endif
 	return crc32c_default;
 }
 
+const struct crc32c_impl crc32c_impls[] = {
+	{ "generic",	crc32c_default },
+#ifdef __x86_64__
+	{ "sse42",	crc32c_sse42 },
+	{ "sse42_3way",	crc32c_sse42_3way },
+	{ "vpclmul",	crc32c_vpclmul },
+#endif
+	{ NULL }
+};
+
+bool crc32c_impl_supported(const struct crc32c_impl *impl)
+{
+	__builtin_cpu_init();
+
+#ifdef __x86_64__
+	if (impl->fn == crc32c_vpclmul)
+		return __builtin_cpu_supports("vpclmulqdq") &&
+			__builtin_cpu_supports("avx512f") &&
+			__builtin_cpu_supports("avx512vl") &&
+			__builtin_cpu_supports("avx512bw") &&
+			__builtin_cpu_supports("sse4.2");
+	if (impl->fn == crc32c_sse42_3way)
+		return __builtin_cpu_supports("sse4.2") &&
+			__builtin_cpu_supports("pclmul");
+	if (impl->fn == crc32c_sse42)
+		return __builtin_cpu_supports("sse4.2");
+#endif
+	return true;
+}
+
 /*
  * ifunc is buggy and I don't know what breaks it (LTO?)
  */
@@ -487,7 +736,7 @@ static void *ifunc_resolve_crc32c(void)
 {
 	__builtin_cpu_init();
 
-	return resolve_crc32c
+	return resolve_crc32c();
 }
 
 u32 crc32c(u32, const void *, size_t)
@@ -761,3 +1010,84 @@ darray_str get_or_split_cmdline_devs(int argc, char *argv[])
 
 	return ret;
 }
+
+/* Length of the valid UTF-8 sequence at @p, or 0: */
+static unsigned utf8_char_len(const unsigned char *p)
+{
+	unsigned char min = 0x80, max = 0xbf;
+	unsigned len;
+
+	if (*p < 0x80)
+		return 1;
+	else if (*p < 0xc2)
+		return 0;
+	else if (*p < 0xe0)
+		len = 2;
+	else if (*p < 0xf0) {
+		len = 3;
+		/* no overlong encodings or surrogates: */
+		if (*p == 0xe0)
+			min = 0xa0;
+		if (*p == 0xed)
+			max = 0x9f;
+	} else if (*p < 0xf5) {
+		len = 4;
+		/* no overlong encodings, nothing past U+10FFFF: */
+		if (*p == 0xf0)
+			min = 0x90;
+		if (*p == 0xf4)
+			max = 0x8f;
+	} else
+		return 0;
+
+	/* Stops at the nul terminator, since that's not a continuation byte: */
+	for (unsigned i = 1; i < len; i++) {
+		if (p[i] < min || p[i] > max)
+			return 0;
+		min = 0x80;
+		max = 0xbf;
+	}
+
+	return len;
+}
+
+/*
+ * Print @str as a quoted, escaped JSON string: bytes that aren't valid UTF-8
+ * are replaced with U+FFFD, as they have no JSON representation
+ */
+void prt_json_str(struct printbuf *out, const char *str)
+{
+	prt_char(out, '"');
+
+	for (const unsigned char *p = (const unsigned char *) str; *p; p++) {
+		unsigned len;
+
+		switch (*p) {
+		case '"':
+			prt_str(out, "\\\"");
+			break;
+		case '\\':
+			prt_str(out, "\\\\");
+			break;
+		case '\n':
+			prt_str(out, "\\n");
+			break;
+		case '\t':
+			prt_str(out, "\\t");
+			break;
+		default:
+			len = utf8_char_len(p);
+
+			if (!len) {
+				prt_str(out, "\\ufffd");
+			} else if (*p < 0x20) {
+				prt_printf(out, "\\u%04x", *p);
+			} else {
+				prt_bytes(out, p, len);
+				p += len - 1;
+			}
+		}
+	}
+
+	prt_char(out, '"');
+}
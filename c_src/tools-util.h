@@ -178,6 +178,15 @@ char *strcmp_prefix(char *, const char *);
 #define crc32c bch_crc32c
 u32 crc32c(u32, const void *, size_t);
 
+/* All crc32c implementations, for benchmarking and testing: */
+struct crc32c_impl {
+	const char	*name;
+	u32		(*fn)(u32, const void *, size_t);
+};
+
+extern const struct crc32c_impl crc32c_impls[];
+bool crc32c_impl_supported(const struct crc32c_impl *);
+
 char *dev_to_name(dev_t);
 char *dev_to_path(dev_t);
 struct mntent *dev_to_mount(char *);
@@ -213,4 +222,6 @@ unsigned version_parse(char *);
 
 darray_str get_or_split_cmdline_devs(int argc, char *argv[]);
 
+void prt_json_str(struct printbuf *, const char *);
+
 #endif /* _TOOLS_UTIL_H */
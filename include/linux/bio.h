@@ -51,6 +51,8 @@
 #define bvec_iter_sectors(iter)	((iter).bi_size >> 9)
 #define bvec_iter_end_sector(iter) ((iter).bi_sector + bvec_iter_sectors((iter)))
 
+#define bio_dev(bio)		((bio)->bi_bdev->bd_dev)
+
 #define bio_sectors(bio)	bvec_iter_sectors((bio)->bi_iter)
 #define bio_end_sector(bio)	bvec_iter_end_sector((bio)->bi_iter)
 
@@ -211,6 +213,8 @@ static inline struct bio *bio_next_split(struct bio *bio, int sectors,
 }
 
 struct bio_set {
+	struct kmem_cache *bio_slab;
+	struct kmem_cache *bvec_slab;
 	unsigned int front_pad;
 	unsigned int back_pad;
 	mempool_t bio_pool;
@@ -65,6 +65,8 @@ struct block_device {
 	struct gendisk *	bd_disk;
 	struct gendisk		__bd_disk;
 	int			bd_fd;
+	/* io_uring registered file index, or -1: */
+	int			bd_fixed_file;
 
 	struct mutex		bd_holder_lock;
 };
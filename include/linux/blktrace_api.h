@@ -0,0 +1,47 @@
+#ifndef __TOOLS_LINUX_BLKTRACE_API_H
+#define __TOOLS_LINUX_BLKTRACE_API_H
+
+#include <linux/blk_types.h>
+
+/*
+ * As blktrace prints them: op, then F for FUA, S for sync, M for meta; callers
+ * here only have room for 6 bytes, so readahead isn't shown:
+ */
+static inline void blk_fill_rwbs(char *rwbs, unsigned int opf)
+{
+	int i = 0;
+
+	if (opf & REQ_PREFLUSH)
+		rwbs[i++] = 'F';
+
+	switch (opf & REQ_OP_MASK) {
+	case REQ_OP_WRITE:
+		rwbs[i++] = 'W';
+		break;
+	case REQ_OP_DISCARD:
+		rwbs[i++] = 'D';
+		break;
+	case REQ_OP_SECURE_ERASE:
+		rwbs[i++] = 'E';
+		break;
+	case REQ_OP_FLUSH:
+		rwbs[i++] = 'F';
+		break;
+	case REQ_OP_READ:
+		rwbs[i++] = 'R';
+		break;
+	default:
+		rwbs[i++] = 'N';
+	}
+
+	if (opf & REQ_FUA)
+		rwbs[i++] = 'F';
+	if (opf & REQ_SYNC)
+		rwbs[i++] = 'S';
+	if (opf & REQ_META)
+		rwbs[i++] = 'M';
+
+	rwbs[i] = '\0';
+}
+
+#endif /* __TOOLS_LINUX_BLKTRACE_API_H */
@@ -5,7 +5,18 @@
 #ifndef _LINUX_CRC64_H
 #define _LINUX_CRC64_H
 
+#include <linux/compiler.h>
 #include <linux/types.h>
 
 u64 __pure crc64_be(u64 crc, const void *p, size_t len);
+
+/* Userspace: the available implementations, for benchmarking and testing */
+struct crc64_impl {
+	const char	*name;
+	u64		(*fn)(u64, const void *, size_t);
+};
+
+extern const struct crc64_impl crc64_be_impls[];
+bool crc64_be_impl_supported(const struct crc64_impl *);
+
 #endif /* _LINUX_CRC64_H */
@@ -20,6 +20,7 @@
 #include <linux/bug.h>
 #include <linux/compiler.h>
 #include <linux/kernel.h>
+#include <linux/list.h>
 #include <linux/slab.h>
 #include <linux/sysfs.h>
 #include <linux/types.h>
@@ -47,6 +48,9 @@ struct kobj_attribute {
 };
 
 struct kobject {
+	const char		*name;
+	struct list_head	entry;
+	struct list_head	children;
 	struct kobject		*parent;
 	struct kset		*kset;
 	const struct kobj_type	*ktype;
@@ -57,25 +61,33 @@ struct kobject {
 	unsigned int state_add_uevent_sent:1;
 	unsigned int state_remove_uevent_sent:1;
 	unsigned int uevent_suppress:1;
+
+	/* Added with sysfs_create_file(), in addition to ktype->default_groups: */
+	const struct attribute	**attrs;
+	unsigned		nr_attrs;
+	/* ->show() calls in progress from the sysfs server: */
+	atomic_t		sysfs_active;
 };
 
 struct kset {
 	struct kobject		kobj;
 };
 
-#define kobject_add(...)	0
+__printf(3, 4)
+int kobject_add(struct kobject *, struct kobject *, const char *, ...);
+void kobject_del(struct kobject *);
 
 static inline void kobject_init(struct kobject *kobj, const struct kobj_type *ktype)
 {
 	memset(kobj, 0, sizeof(*kobj));
 
+	INIT_LIST_HEAD(&kobj->entry);
+	INIT_LIST_HEAD(&kobj->children);
 	atomic_set(&kobj->ref, 1);
 	kobj->ktype = ktype;
 	kobj->state_initialized = 1;
 }
 
-static inline void kobject_del(struct kobject *kobj);
-
 static inline void kobject_cleanup(struct kobject *kobj)
 {
 	const struct kobj_type *t = kobj->ktype;
@@ -90,26 +102,15 @@ static inline void kobject_cleanup(struct kobject *kobj)
 
 static inline void kobject_put(struct kobject *kobj)
 {
-	BUG_ON(!kobj);
+	if (!kobj)
+		return;
+
 	BUG_ON(!kobj->state_initialized);
 
 	if (atomic_dec_and_test(&kobj->ref))
 		kobject_cleanup(kobj);
 }
 
-static inline void kobject_del(struct kobject *kobj)
-{
-	if (!kobj)
-		return;
-
-	kobj->state_in_sysfs = 0;
-#if 0
-	kobj_kset_leave(kobj);
-#endif
-	kobject_put(kobj->parent);
-	kobj->parent = NULL;
-}
-
 static inline struct kobject *kobject_get(struct kobject *kobj)
 {
 	BUG_ON(!kobj);
@@ -106,6 +106,8 @@ struct task_struct {
 
 extern __thread struct task_struct *current;
 
+void current_task_init(void);
+
 #define __set_task_state(tsk, state_value)		\
 	do { (tsk)->state = (state_value); } while (0)
 #define set_task_state(tsk, state_value)		\
@@ -192,41 +192,26 @@ static inline void *kmemdup(const void *src, size_t len, gfp_t gfp)
 	return p;
 }
 
-struct kmem_cache {
-	size_t		    obj_size;
-};
+#define SLAB_HWCACHE_ALIGN	((__force slab_flags_t) (1U << 13))
+#define SLAB_RECLAIM_ACCOUNT	((__force slab_flags_t) (1U << 17))
+#define SLAB_ACCOUNT		((__force slab_flags_t) (1U << 26))
 
-static inline void *kmem_cache_alloc(struct kmem_cache *c, gfp_t gfp)
-{
-	return kmalloc(c->obj_size, gfp);
-}
-
-static inline void *kmem_cache_zalloc(struct kmem_cache *c, gfp_t gfp)
-{
-	return kzalloc(c->obj_size, gfp);
-}
-
-static inline void kmem_cache_free(struct kmem_cache *c, void *p)
-{
-	kfree(p);
-}
+struct kmem_cache;
 
-static inline void kmem_cache_destroy(struct kmem_cache *p)
-{
-	kfree(p);
-}
+void *kmem_cache_alloc(struct kmem_cache *, gfp_t);
+void kmem_cache_free(struct kmem_cache *, void *);
+void kmem_cache_destroy(struct kmem_cache *);
+struct kmem_cache *kmem_cache_create(const char *, unsigned int, unsigned int,
+				     slab_flags_t, void (*)(void *));
 
-static inline struct kmem_cache *kmem_cache_create(size_t obj_size)
+static inline void *kmem_cache_zalloc(struct kmem_cache *c, gfp_t gfp)
 {
-	struct kmem_cache *p = kmalloc(sizeof(*p), GFP_KERNEL);
-	if (!p)
-		return NULL;
-
-	p->obj_size = obj_size;
-	return p;
+	return kmem_cache_alloc(c, gfp|__GFP_ZERO);
 }
 
-#define KMEM_CACHE(_struct, _flags)	kmem_cache_create(sizeof(struct _struct))
+#define KMEM_CACHE(_struct, _flags)					\
+	kmem_cache_create(#_struct, sizeof(struct _struct),		\
+			  __alignof__(struct _struct), (_flags), NULL)
 
 #define PAGE_KERNEL		0
 #define PAGE_KERNEL_EXEC	1
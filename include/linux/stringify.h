@@ -0,0 +1,7 @@
+#ifndef __TOOLS_LINUX_STRINGIFY_H
+#define __TOOLS_LINUX_STRINGIFY_H
+
+#define __stringify_1(x...)	#x
+#define __stringify(x...)	__stringify_1(x)
+
+#endif /* __TOOLS_LINUX_STRINGIFY_H */
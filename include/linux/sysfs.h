@@ -19,10 +19,36 @@ struct sysfs_ops {
 	ssize_t	(*store)(struct kobject *, struct attribute *, const char *, size_t);
 };
 
+/*
+ * Userspace sysfs: kobjects that have been kobject_add()ed are served,
+ * read-only, on a unix socket in the abstract namespace named after the pid
+ * (see linux/sysfs.c).
+ *
+ * A request is a path relative to the root of the tree, terminated by a
+ * newline; the reply, terminated by the server closing the connection, is one
+ * of:
+ *   "dir\n"  followed by one line per entry, with a trailing '/' for
+ *            directories
+ *   "file\n" followed by the attribute's contents
+ *   "error <errno>\n"
+ */
+#define SYSFS_SOCKET_PREFIX	"bcachefs-sysfs."
+#define SYSFS_SOCKET_FMT	SYSFS_SOCKET_PREFIX "%u"
+
+/* Serve the tree; otherwise only done if $BCACHEFS_SYSFS is set: */
+void sysfs_server_enable(void);
+
+int sysfs_create_file(struct kobject *, const struct attribute *);
+void sysfs_remove_file(struct kobject *, const struct attribute *);
+
 static inline int sysfs_create_files(struct kobject *kobj,
 				    const struct attribute **attr)
 {
-	return 0;
+	int ret = 0;
+
+	for (; *attr && !ret; attr++)
+		ret = sysfs_create_file(kobj, *attr);
+	return ret;
 }
 
 static inline int sysfs_create_link(struct kobject *kobj,
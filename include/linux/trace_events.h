@@ -0,0 +1,118 @@
+#ifndef __TOOLS_LINUX_TRACE_EVENTS_H
+#define __TOOLS_LINUX_TRACE_EVENTS_H
+
+#include <linux/atomic.h>
+#include <linux/kernel.h>
+#include <linux/tracepoint.h>
+
+/*
+ * Trace buffers are shared memory, so that `bcachefs trace` can read them from
+ * another process: when $BCACHEFS_TRACE is set at startup, the process creates
+ * /dev/shm/bcachefs-trace.<pid>, laid out as:
+ *
+ *   struct trace_shm
+ *   struct trace_shm_event	events[nr_events]
+ *   u8				enabled[nr_events], written by the reader
+ *   struct trace_ring		rings[nr_rings], each followed by ring_size bytes
+ *
+ * Events are numbered in registration order; the event table has their names
+ * so that a reader built from different sources can still match them up.
+ *
+ * Each thread writes to a ring of its own, claimed on its first event, so
+ * recording takes no locks or atomics: the writer owns ->head and the reader
+ * owns ->tail. When a ring is full new events are dropped, and counted in
+ * ->lost, rather than overwriting ones the reader hasn't seen yet.
+ */
+
+#define TRACE_SHM_MAGIC		0x7274736663686362ULL	/* "bchcfstr" */
+#define TRACE_SHM_VERSION	1
+
+struct trace_entry {
+	u32			size;
+	u16			type;
+	u16			__pad;
+	u32			pid;
+	u32			__pad2;
+	u64			time;
+};
+
+/* Fills the rest of a ring when the next record doesn't fit before the end: */
+#define TRACE_ENTRY_PAD		U16_MAX
+
+struct trace_shm_event {
+	char			system[16];
+	char			name[48];
+	u32			entry_size;
+	u32			__pad;
+};
+
+struct trace_ring {
+	u32			pid;
+	u32			__pad;
+	u64			head;
+	u64			tail;
+	u64			lost;
+	u8			data[];
+};
+
+struct trace_shm {
+	u64			magic;
+	u32			version;
+	u32			pid;
+	u32			nr_events;
+	u32			nr_rings;
+	u64			ring_size;
+	u64			events_offset;
+	u64			enabled_offset;
+	u64			rings_offset;
+	u64			size;
+	/* events dropped because every ring was in use: */
+	atomic64_t		lost;
+};
+
+static inline struct trace_shm_event *trace_shm_events(struct trace_shm *shm)
+{
+	return (void *) shm + shm->events_offset;
+}
+
+static inline u8 *trace_shm_enabled(struct trace_shm *shm)
+{
+	return (void *) shm + shm->enabled_offset;
+}
+
+static inline struct trace_ring *trace_shm_ring(struct trace_shm *shm, unsigned i)
+{
+	return (void *) shm + shm->rings_offset +
+		(sizeof(struct trace_ring) + shm->ring_size) * i;
+}
+
+/* Recording, for <trace/define_trace.h>: */
+
+void *trace_event_reserve(struct tracepoint *, size_t);
+void trace_event_commit(struct trace_entry *);
+
+/* Printing: */
+
+struct trace_print_flags {
+	unsigned long		mask;
+	const char		*name;
+};
+
+__printf(2, 3) void trace_prt_printf(struct printbuf *, const char *, ...);
+const char *trace_print_flags(unsigned long, const char *,
+			      const struct trace_print_flags *);
+const char *trace_print_symbolic(unsigned long,
+				 const struct trace_print_flags *);
+
+/* Registered events, and the trace area of this process if there is one: */
+
+extern struct tracepoint *tracepoints;
+extern struct trace_shm *trace_shm;
+
+#define for_each_tracepoint(_tp)					\
+	for (struct tracepoint *_tp = tracepoints; _tp; _tp = _tp->next)
+
+struct tracepoint *tracepoint_find(const char *, const char *);
+bool trace_event_match(const char *, const char *, const char *);
+
+#endif /* __TOOLS_LINUX_TRACE_EVENTS_H */
@@ -1,12 +1,55 @@
 #ifndef __TOOLS_LINUX_TRACEPOINT_H
 #define __TOOLS_LINUX_TRACEPOINT_H
 
+#include <linux/compiler.h>
+#include <linux/types.h>
+
+#ifdef CONFIG_BCACHEFS_SDT
+#include <sys/sdt.h>
+#endif
+
+/*
+ * Userspace tracepoints: each event defined with TRACE_EVENT()/DEFINE_EVENT()
+ * gets a struct tracepoint, instantiated along with the code that records and
+ * prints it by <trace/define_trace.h> in the file that defines
+ * CREATE_TRACE_POINTS.
+ *
+ * A disabled tracepoint costs a load and a branch: ->enabled points at a
+ * shared zero byte until tracing is set up (see linux/tracepoint.c), and then
+ * at this event's byte in the shared memory area the trace reader flips.
+ */
+
+struct printbuf;
+
+typedef void (*trace_output_fn)(struct printbuf *, const void *);
+
+struct tracepoint {
+	const char		*system;
+	const char		*name;
+	const u8		*enabled;
+	unsigned		id;
+	unsigned		entry_size;
+	trace_output_fn		output;
+	struct tracepoint	*next;
+};
+
+extern const u8 tracepoint_off;
+
+void tracepoint_register(struct tracepoint *);
+
 #define PARAMS(args...) args
 
 #define TP_PROTO(args...)	args
 #define TP_ARGS(args...)	args
 #define TP_CONDITION(args...)	args
 
+#ifdef CONFIG_BCACHEFS_SDT
+#define __trace_sdt(name, args...)	STAP_PROBEV(bcachefs, name, ##args)
+#else
+#define __trace_sdt(name, args...)	do {} while (0)
+#endif
+
+/* Bare tracepoints, with no event attached, are still no-ops: */
 #define __DECLARE_TRACE(name, proto, args, cond, data_proto, data_args) \
 	static inline void trace_##name(proto)				\
 	{ }								\
@@ -33,6 +76,38 @@
 		return false;						\
 	}
 
+#define __DECLARE_EVENT(name, proto, args)				\
+	extern struct tracepoint __tracepoint_##name;			\
+	void __trace_##name(proto);					\
+									\
+	static inline bool						\
+	trace_##name##_enabled(void)					\
+	{								\
+		return unlikely(READ_ONCE(*__tracepoint_##name.enabled)); \
+	}								\
+	static inline void trace_##name(proto)				\
+	{								\
+		__trace_sdt(name, args);				\
+		if (trace_##name##_enabled())				\
+			__trace_##name(args);				\
+	}								\
+	static inline void trace_##name##_rcuidle(proto)		\
+	{								\
+		trace_##name(args);					\
+	}								\
+	static inline int						\
+	register_trace_##name(void (*probe)(void *, proto),		\
+			      void *data)				\
+	{								\
+		return -ENOSYS;						\
+	}								\
+	static inline int						\
+	unregister_trace_##name(void (*probe)(void *, proto),		\
+				void *data)				\
+	{								\
+		return -ENOSYS;						\
+	}
+
 #define DEFINE_TRACE_FN(name, reg, unreg)
 #define DEFINE_TRACE(name)
 #define EXPORT_TRACEPOINT_SYMBOL_GPL(name)
@@ -49,14 +124,22 @@
 			PARAMS(void *__data, proto),			\
 			PARAMS(__data, args))
 
+#endif /* __TOOLS_LINUX_TRACEPOINT_H */
+
+/*
+ * Outside the include guard: <trace/define_trace.h> redefines these, and
+ * undefines them when done so that the next trace header gets them back.
+ */
+#ifndef TRACE_EVENT
+
 #define DECLARE_EVENT_CLASS(name, proto, args, tstruct, assign, print)
 #define DEFINE_EVENT(template, name, proto, args)		\
-	DECLARE_TRACE(name, PARAMS(proto), PARAMS(args))
+	__DECLARE_EVENT(name, PARAMS(proto), PARAMS(args))
 #define DEFINE_EVENT_FN(template, name, proto, args, reg, unreg)\
-	DECLARE_TRACE(name, PARAMS(proto), PARAMS(args))
+	__DECLARE_EVENT(name, PARAMS(proto), PARAMS(args))
 #define DEFINE_EVENT_PRINT(template, name, proto, args, print)	\
-	DECLARE_TRACE(name, PARAMS(proto), PARAMS(args))
+	__DECLARE_EVENT(name, PARAMS(proto), PARAMS(args))
 #define TRACE_EVENT(name, proto, args, struct, assign, print)	\
-	DECLARE_TRACE(name, PARAMS(proto), PARAMS(args))
+	__DECLARE_EVENT(name, PARAMS(proto), PARAMS(args))
 
-#endif /* __TOOLS_LINUX_TRACEPOINT_H */
+#endif /* TRACE_EVENT */
@@ -26,6 +26,8 @@ struct work_struct {
 	atomic_long_t data;
 	struct list_head entry;
 	work_func_t func;
+	/* flush color it was queued with, while queued: */
+	unsigned color;
 };
 
 #define INIT_WORK(_work, _func)					\
@@ -0,0 +1,235 @@
+/*
+ * Instantiates the events of a trace header, in the one file that defines
+ * CREATE_TRACE_POINTS before including it; see <linux/tracepoint.h> for what
+ * everything else sees.
+ *
+ * The header is read once more for each of:
+ *  - struct trace_event_raw_<class>, the record: a struct trace_entry, then
+ *    the TP_STRUCT__entry() fields, then __string() contents
+ *  - struct trace_event_data_offsets_<class>: where each __string() goes
+ *  - trace_event_get_offsets_<class>(), trace_event_record_<class>() and
+ *    trace_event_output_<class>(), which size, record and print an event
+ *  - for each event, its struct tracepoint and __trace_<event>()
+ */
+
+#ifdef CREATE_TRACE_POINTS
+
+/* Prevent recursion: */
+#undef CREATE_TRACE_POINTS
+
+#include <linux/stringify.h>
+#include <linux/trace_events.h>
+
+/*
+ * Only libbcachefs/trace.h sets TRACE_INCLUDE_PATH, to where it lives in the
+ * kernel tree:
+ */
+#ifdef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE(file)	__stringify(libbcachefs/file.h)
+#else
+#define TRACE_INCLUDE(file)	__stringify(trace/events/file.h)
+#endif
+
+#ifndef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE	TRACE_SYSTEM
+#define UNDEF_TRACE_INCLUDE_FILE
+#endif
+
+#define TRACE_HEADER_MULTI_READ
+
+#undef DECLARE_EVENT_CLASS
+#undef DEFINE_EVENT
+#undef DEFINE_EVENT_FN
+#undef DEFINE_EVENT_PRINT
+#undef TRACE_EVENT
+
+#define TP_STRUCT__entry(args...)	args
+#define TP_fast_assign(args...)		args
+#define TP_printk(fmt, args...)		fmt, ##args
+
+#define __entry_str(field)						\
+	((char *) __entry->__data + __entry->__data_loc_##field)
+
+#define __get_str(field)		__entry_str(field)
+
+#define __assign_str(dst)						\
+do {									\
+	__entry->__data_loc_##dst = __data_offsets.dst;			\
+	strcpy(__entry_str(dst), __data_offsets.dst##_ptr_);		\
+} while (0)
+
+#define __print_flags(flag, delim, flag_array...)			\
+	trace_print_flags(flag, delim,					\
+		(const struct trace_print_flags[]) { flag_array, { -1, NULL } })
+
+#define __print_symbolic(value, symbol_array...)			\
+	trace_print_symbolic(value,					\
+		(const struct trace_print_flags[]) { symbol_array, { -1, NULL } })
+
+#define TRACE_EVENT(name, proto, args, tstruct, assign, print)		\
+	DECLARE_EVENT_CLASS(name, PARAMS(proto), PARAMS(args),		\
+			    PARAMS(tstruct), PARAMS(assign), PARAMS(print)) \
+	DEFINE_EVENT(name, name, PARAMS(proto), PARAMS(args))
+
+#define DEFINE_EVENT_FN(template, name, proto, args, reg, unreg)	\
+	DEFINE_EVENT(template, name, PARAMS(proto), PARAMS(args))
+
+/* Pass 1: record layout */
+
+#define __field(type, item)		type item;
+#define __array(type, item, len)	type item[len];
+#define __string(item, src)		u32 __data_loc_##item;
+
+#define DECLARE_EVENT_CLASS(name, proto, args, tstruct, assign, print)	\
+	struct trace_event_raw_##name {					\
+		struct trace_entry	ent;				\
+		tstruct							\
+		char			__data[];			\
+	};
+
+#define DEFINE_EVENT(template, name, proto, args)
+#define DEFINE_EVENT_PRINT(template, name, proto, args, print)
+
+#include TRACE_INCLUDE(TRACE_INCLUDE_FILE)
+
+/* Pass 2: where __string() fields go */
+
+#undef __field
+#undef __array
+#undef __string
+#undef DECLARE_EVENT_CLASS
+
+#define __field(type, item)
+#define __array(type, item, len)
+#define __string(item, src)		u32 item; const char *item##_ptr_;
+
+#define DECLARE_EVENT_CLASS(name, proto, args, tstruct, assign, print)	\
+	struct trace_event_data_offsets_##name {			\
+		tstruct							\
+	};
+
+#include TRACE_INCLUDE(TRACE_INCLUDE_FILE)
+
+/* Pass 3: sizing, recording and printing, per class */
+
+#undef __string
+#undef DECLARE_EVENT_CLASS
+
+#define __string(item, src)						\
+	__data_offsets->item##_ptr_	= (src) ?: "(null)";		\
+	__data_offsets->item		= __data_size;			\
+	__data_size += strlen(__data_offsets->item##_ptr_) + 1;
+
+#define DECLARE_EVENT_CLASS(name, proto, args, tstruct, assign, print)	\
+static inline size_t							\
+trace_event_get_offsets_##name(struct trace_event_data_offsets_##name *__data_offsets,\
+			       proto)					\
+{									\
+	size_t __data_size = 0;						\
+	tstruct								\
+	return __data_size;						\
+}									\
+									\
+static noinline void							\
+trace_event_record_##name(struct tracepoint *__tp, proto)		\
+{									\
+	struct trace_event_data_offsets_##name __data_offsets;		\
+	size_t __data_size =						\
+		trace_event_get_offsets_##name(&__data_offsets, args);	\
+	struct trace_event_raw_##name *__entry =			\
+		trace_event_reserve(__tp, sizeof(*__entry) + __data_size); \
+	if (!__entry)							\
+		return;							\
+									\
+	{ assign; }							\
+									\
+	trace_event_commit(&__entry->ent);				\
+}									\
+									\
+static void								\
+trace_event_output_##name(struct printbuf *out, const void *p)		\
+{									\
+	const struct trace_event_raw_##name *__entry = p;		\
+									\
+	trace_prt_printf(out, print);					\
+}
+
+#include TRACE_INCLUDE(TRACE_INCLUDE_FILE)
+
+/* Pass 4: the events */
+
+#undef DECLARE_EVENT_CLASS
+#undef DEFINE_EVENT
+#undef DEFINE_EVENT_PRINT
+
+#define DECLARE_EVENT_CLASS(name, proto, args, tstruct, assign, print)
+
+#define __DEFINE_EVENT(_template, _name, _proto, _args, _output)	\
+struct tracepoint __tracepoint_##_name = {				\
+	.system		= __stringify(TRACE_SYSTEM),			\
+	.name		= #_name,					\
+	.enabled	= &tracepoint_off,				\
+	.entry_size	= sizeof(struct trace_event_raw_##_template),	\
+	.output		= _output,					\
+};									\
+									\
+__attribute__((constructor(104)))					\
+static void __tracepoint_register_##_name(void)				\
+{									\
+	tracepoint_register(&__tracepoint_##_name);			\
+}									\
+									\
+void __trace_##_name(_proto)						\
+{									\
+	trace_event_record_##_template(&__tracepoint_##_name, _args);	\
+}
+
+#define DEFINE_EVENT(template, name, proto, args)			\
+	__DEFINE_EVENT(template, name, PARAMS(proto), PARAMS(args),	\
+		       trace_event_output_##template)
+
+#define DEFINE_EVENT_PRINT(template, name, proto, args, print)		\
+static void								\
+trace_event_output_##name(struct printbuf *out, const void *p)		\
+{									\
+	const struct trace_event_raw_##template *__entry = p;		\
+									\
+	trace_prt_printf(out, print);					\
+}									\
+									\
+	__DEFINE_EVENT(template, name, PARAMS(proto), PARAMS(args),	\
+		       trace_event_output_##name)
+
+#include TRACE_INCLUDE(TRACE_INCLUDE_FILE)
+
+#undef __field
+#undef __array
+#undef __string
+#undef __entry_str
+#undef __get_str
+#undef __assign_str
+#undef __print_flags
+#undef __print_symbolic
+#undef TP_STRUCT__entry
+#undef TP_fast_assign
+#undef TP_printk
+
+#undef DECLARE_EVENT_CLASS
+#undef DEFINE_EVENT
+#undef DEFINE_EVENT_FN
+#undef DEFINE_EVENT_PRINT
+#undef TRACE_EVENT
+
+#undef TRACE_HEADER_MULTI_READ
+
+#ifdef UNDEF_TRACE_INCLUDE_FILE
+#undef TRACE_INCLUDE_FILE
+#undef UNDEF_TRACE_INCLUDE_FILE
+#endif
+
+#undef TRACE_INCLUDE
+
+/* We may be processing more files */
+#define CREATE_TRACE_POINTS
+
+#endif /* CREATE_TRACE_POINTS */
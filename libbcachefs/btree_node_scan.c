@@ -15,10 +15,51 @@
 #include <linux/min_heap.h>
 #include <linux/sort.h>
 
+/*
+ * Devices are scanned with large sequential reads of runs of possible btree
+ * node locations, several in flight at a time; large devices are split up
+ * between multiple workers:
+ */
+#define BTREE_NODE_SCAN_READ_SECTORS		((BIO_MAX_VECS * PAGE_SIZE) >> 9)
+#define BTREE_NODE_SCAN_READS_IN_FLIGHT		4
+#define BTREE_NODE_SCAN_WORKERS_PER_DEV		4
+#define BTREE_NODE_SCAN_MIN_BUCKETS_PER_WORKER	(1U << 16)
+
+struct find_btree_nodes_dev {
+	struct bch_dev		*ca;
+	u64			sectors_total;
+	atomic64_t		sectors_done;
+	atomic_long_t		last_print;
+	u64			start_time;
+};
+
 struct find_btree_nodes_worker {
 	struct closure		*cl;
 	struct find_btree_nodes	*f;
+	struct find_btree_nodes_dev *d;
 	struct bch_dev		*ca;
+	u64			bucket_start;
+	u64			bucket_end;
+};
+
+/* Position of a possible btree node: */
+struct btree_node_scan_iter {
+	u64			bucket;
+	unsigned		bucket_offset;
+};
+
+struct find_btree_nodes_read {
+	struct bio		*bio;
+	void			*buf;
+	struct completion	done;
+	u64			submit_time;
+
+	struct btree_node_scan_iter start;
+	unsigned		nr_nodes;
+	u64			sector;
+	u64			sectors;
+	/* sectors of the device this read accounts for, for progress: */
+	u64			sectors_scanned;
 };
 
 static void found_btree_node_to_text(struct printbuf *out, struct bch_fs *c, const struct found_btree_node *n)
@@ -157,27 +198,11 @@ static const struct min_heap_callbacks found_btree_node_heap_cbs = {
 	.swp = found_btree_node_swap,
 };
 
-static void try_read_btree_node(struct find_btree_nodes *f, struct bch_dev *ca,
-				struct bio *bio, struct btree_node *bn, u64 offset)
+static void try_found_btree_node(struct find_btree_nodes *f, struct bch_dev *ca,
+				 struct btree_node *bn, u64 offset)
 {
 	struct bch_fs *c = container_of(f, struct bch_fs, found_btree_nodes);
 
-	bio_reset(bio, ca->disk_sb.bdev, REQ_OP_READ);
-	bio->bi_iter.bi_sector	= offset;
-	bch2_bio_map(bio, bn, PAGE_SIZE);
-
-	u64 submit_time = local_clock();
-	submit_bio_wait(bio);
-
-	bch2_account_io_completion(ca, BCH_MEMBER_ERROR_read, submit_time, !bio->bi_status);
-
-	if (bio->bi_status) {
-		bch_err_dev_ratelimited(ca,
-				"IO error in try_read_btree_node() at %llu: %s",
-				offset, bch2_blk_status_to_str(bio->bi_status));
-		return;
-	}
-
 	if (le64_to_cpu(bn->magic) != bset_magic(c))
 		return;
 
@@ -231,45 +256,214 @@ unlock:
 	}
 }
 
+static void try_read_btree_node(struct find_btree_nodes *f, struct bch_dev *ca,
+				struct bio *bio, struct btree_node *bn, u64 offset)
+{
+	bio_reset(bio, ca->disk_sb.bdev, REQ_OP_READ);
+	bio->bi_iter.bi_sector	= offset;
+	bch2_bio_map(bio, bn, PAGE_SIZE);
+
+	u64 submit_time = local_clock();
+	submit_bio_wait(bio);
+
+	bch2_account_io_completion(ca, BCH_MEMBER_ERROR_read, submit_time, !bio->bi_status);
+
+	if (bio->bi_status) {
+		bch_err_dev_ratelimited(ca,
+				"IO error in try_read_btree_node() at %llu: %s",
+				offset, bch2_blk_status_to_str(bio->bi_status));
+		return;
+	}
+
+	try_found_btree_node(f, ca, bn, offset);
+}
+
+static inline u64 btree_node_scan_sector(struct bch_dev *ca, struct btree_node_scan_iter *iter)
+{
+	return iter->bucket * ca->mi.bucket_size + iter->bucket_offset;
+}
+
+static inline void btree_node_scan_advance(struct bch_fs *c, struct bch_dev *ca,
+					   struct btree_node_scan_iter *iter)
+{
+	iter->bucket_offset += btree_sectors(c);
+	if (iter->bucket_offset + btree_sectors(c) > ca->mi.bucket_size) {
+		iter->bucket++;
+		iter->bucket_offset = 0;
+	}
+}
+
+static inline bool btree_node_scan_want(struct bch_fs *c, struct bch_dev *ca,
+					struct btree_node_scan_iter *iter)
+{
+	return !(c->sb.version_upgrade_complete >= bcachefs_metadata_version_mi_btree_bitmap &&
+		 !bch2_dev_btree_bitmap_marked_sectors(ca, btree_node_scan_sector(ca, iter),
+						       btree_sectors(c)));
+}
+
+/*
+ * Build the next read: a run of consecutive possible btree node locations we
+ * want to look at, up to BTREE_NODE_SCAN_READ_SECTORS:
+ */
+static bool btree_node_scan_next_read(struct find_btree_nodes_worker *w,
+				      struct btree_node_scan_iter *iter,
+				      struct find_btree_nodes_read *r)
+{
+	struct bch_fs *c = container_of(w->f, struct bch_fs, found_btree_nodes);
+	struct bch_dev *ca = w->ca;
+	u64 scan_start = btree_node_scan_sector(ca, iter);
+
+	while (iter->bucket < w->bucket_end &&
+	       !btree_node_scan_want(c, ca, iter))
+		btree_node_scan_advance(c, ca, iter);
+
+	if (iter->bucket >= w->bucket_end)
+		return false;
+
+	r->start	= *iter;
+	r->sector	= btree_node_scan_sector(ca, iter);
+	r->nr_nodes	= 0;
+
+	do {
+		r->sectors = btree_node_scan_sector(ca, iter) + btree_sectors(c) - r->sector;
+		r->nr_nodes++;
+		btree_node_scan_advance(c, ca, iter);
+	} while (iter->bucket < w->bucket_end &&
+		 btree_node_scan_sector(ca, iter) + btree_sectors(c) - r->sector <=
+		 BTREE_NODE_SCAN_READ_SECTORS &&
+		 btree_node_scan_want(c, ca, iter));
+
+	r->sectors_scanned = btree_node_scan_sector(ca, iter) - scan_start;
+	return true;
+}
+
+static void btree_node_scan_read_endio(struct bio *bio)
+{
+	struct find_btree_nodes_read *r = bio->bi_private;
+
+	complete(&r->done);
+}
+
+static void btree_node_scan_read_submit(struct find_btree_nodes_worker *w,
+					struct find_btree_nodes_read *r)
+{
+	struct bio *bio = r->bio;
+
+	bio_reset(bio, w->ca->disk_sb.bdev, REQ_OP_READ);
+	bio->bi_iter.bi_sector	= r->sector;
+	bio->bi_end_io		= btree_node_scan_read_endio;
+	bio->bi_private		= r;
+	bch2_bio_map(bio, r->buf, r->sectors << 9);
+
+	reinit_completion(&r->done);
+	r->submit_time = local_clock();
+	submit_bio(bio);
+}
+
+static void btree_node_scan_read_done(struct find_btree_nodes_worker *w,
+				      struct find_btree_nodes_read *r)
+{
+	struct bch_fs *c = container_of(w->f, struct bch_fs, found_btree_nodes);
+	struct bch_dev *ca = w->ca;
+	struct btree_node_scan_iter iter = r->start;
+	bool io_error = r->bio->bi_status != 0;
+
+	bch2_account_io_completion(ca, BCH_MEMBER_ERROR_read, r->submit_time, !io_error);
+
+	if (io_error)
+		bch_err_dev_ratelimited(ca,
+				"IO error scanning for btree nodes at %llu-%llu: %s, retrying nodes individually",
+				r->sector, r->sector + r->sectors,
+				bch2_blk_status_to_str(r->bio->bi_status));
+
+	for (unsigned i = 0; i < r->nr_nodes; i++) {
+		u64 sector = btree_node_scan_sector(ca, &iter);
+		void *bn = r->buf + ((sector - r->sector) << 9);
+
+		if (!io_error)
+			try_found_btree_node(w->f, ca, bn, sector);
+		else
+			try_read_btree_node(w->f, ca, r->bio, bn, sector);
+
+		btree_node_scan_advance(c, ca, &iter);
+	}
+}
+
+static void btree_node_scan_progress(struct find_btree_nodes_worker *w, u64 sectors)
+{
+	struct find_btree_nodes_dev *d = w->d;
+	u64 done = atomic64_add_return(sectors, &d->sectors_done);
+	unsigned long last_print = atomic_long_read(&d->last_print);
+
+	if (time_after(jiffies, last_print + HZ * 30) &&
+	    atomic_long_try_cmpxchg(&d->last_print, &last_print, jiffies)) {
+		u64 elapsed = max_t(u64, local_clock() - d->start_time, 1);
+
+		bch_info(w->ca, "%s: %2u%% done, %llu MiB/sec, %zu nodes found",
+			 "read_btree_nodes_worker",
+			 (unsigned) div64_u64(done * 100, max_t(u64, d->sectors_total, 1)),
+			 div64_u64((done >> 11) * NSEC_PER_SEC, elapsed),
+			 READ_ONCE(w->f->nodes.nr));
+	}
+}
+
 static int read_btree_nodes_worker(void *p)
 {
 	struct find_btree_nodes_worker *w = p;
 	struct bch_fs *c = container_of(w->f, struct bch_fs, found_btree_nodes);
 	struct bch_dev *ca = w->ca;
-	void *buf = (void *) __get_free_page(GFP_KERNEL);
-	struct bio *bio = bio_alloc(NULL, 1, 0, GFP_KERNEL);
-	unsigned long last_print = jiffies;
-
-	if (!buf || !bio) {
-		bch_err(c, "read_btree_nodes_worker: error allocating bio/buf");
-		w->f->ret = -ENOMEM;
-		goto err;
+	struct find_btree_nodes_read reads[BTREE_NODE_SCAN_READS_IN_FLIGHT] = {};
+	struct btree_node_scan_iter iter = { .bucket = w->bucket_start };
+	unsigned i, front = 0, nr = 0;
+
+	for (i = 0; i < ARRAY_SIZE(reads); i++) {
+		reads[i].buf = kvmalloc(BTREE_NODE_SCAN_READ_SECTORS << 9, GFP_KERNEL);
+		reads[i].bio = bio_alloc(NULL, BIO_MAX_VECS, 0, GFP_KERNEL);
+		init_completion(&reads[i].done);
+
+		if (!reads[i].buf || !reads[i].bio) {
+			bch_err(c, "read_btree_nodes_worker: error allocating bio/buf");
+			w->f->ret = -ENOMEM;
+			goto err;
+		}
 	}
 
-	for (u64 bucket = ca->mi.first_bucket; bucket < ca->mi.nbuckets; bucket++)
-		for (unsigned bucket_offset = 0;
-		     bucket_offset + btree_sectors(c) <= ca->mi.bucket_size;
-		     bucket_offset += btree_sectors(c)) {
-			if (time_after(jiffies, last_print + HZ * 30)) {
-				u64 cur_sector = bucket * ca->mi.bucket_size + bucket_offset;
-				u64 end_sector = ca->mi.nbuckets * ca->mi.bucket_size;
-
-				bch_info(ca, "%s: %2u%% done", __func__,
-					 (unsigned) div64_u64(cur_sector * 100, end_sector));
-				last_print = jiffies;
-			}
+	if (btree_sectors(c) > ca->mi.bucket_size)
+		goto err;
 
-			u64 sector = bucket * ca->mi.bucket_size + bucket_offset;
+	while (1) {
+		while (nr < ARRAY_SIZE(reads)) {
+			struct find_btree_nodes_read *r = &reads[(front + nr) % ARRAY_SIZE(reads)];
 
-			if (c->sb.version_upgrade_complete >= bcachefs_metadata_version_mi_btree_bitmap &&
-			    !bch2_dev_btree_bitmap_marked_sectors(ca, sector, btree_sectors(c)))
-				continue;
+			if (!btree_node_scan_next_read(w, &iter, r))
+				break;
 
-			try_read_btree_node(w->f, ca, bio, buf, sector);
+			btree_node_scan_read_submit(w, r);
+			nr++;
 		}
+
+		if (!nr)
+			break;
+
+		struct find_btree_nodes_read *r = &reads[front];
+
+		wait_for_completion(&r->done);
+		btree_node_scan_read_done(w, r);
+		btree_node_scan_progress(w, r->sectors_scanned);
+
+		front = (front + 1) % ARRAY_SIZE(reads);
+		nr--;
+	}
+
+	/* Account for unwanted locations at the end of our range: */
+	btree_node_scan_progress(w, w->bucket_end * ca->mi.bucket_size -
+				 btree_node_scan_sector(ca, &iter));
 err:
-	bio_put(bio);
-	free_page((unsigned long) buf);
+	for (i = 0; i < ARRAY_SIZE(reads); i++) {
+		if (reads[i].bio)
+			bio_put(reads[i].bio);
+		kvfree(reads[i].buf);
+	}
 	percpu_ref_put(&ca->io_ref);
 	closure_put(w->cl);
 	kfree(w);
@@ -279,41 +473,64 @@ err:
 static int read_btree_nodes(struct find_btree_nodes *f)
 {
 	struct bch_fs *c = container_of(f, struct bch_fs, found_btree_nodes);
+	struct find_btree_nodes_dev *devs;
 	struct closure cl;
 	int ret = 0;
 
 	closure_init_stack(&cl);
 
+	devs = kcalloc(c->sb.nr_devices, sizeof(*devs), GFP_KERNEL);
+	if (!devs)
+		return -ENOMEM;
+
 	for_each_online_member(c, ca) {
 		if (!(ca->mi.data_allowed & BIT(BCH_DATA_btree)))
 			continue;
 
-		struct find_btree_nodes_worker *w = kmalloc(sizeof(*w), GFP_KERNEL);
-		if (!w) {
-			percpu_ref_put(&ca->io_ref);
-			ret = -ENOMEM;
-			goto err;
-		}
+		struct find_btree_nodes_dev *d = &devs[ca->dev_idx];
+		u64 nr_buckets = ca->mi.nbuckets - ca->mi.first_bucket;
+		unsigned nr_workers = clamp_t(u64,
+				DIV_ROUND_UP(nr_buckets, BTREE_NODE_SCAN_MIN_BUCKETS_PER_WORKER),
+				1, BTREE_NODE_SCAN_WORKERS_PER_DEV);
+
+		d->ca			= ca;
+		d->sectors_total	= nr_buckets * ca->mi.bucket_size;
+		d->start_time		= local_clock();
+		atomic_long_set(&d->last_print, jiffies);
+
+		for (unsigned i = 0; i < nr_workers; i++) {
+			struct find_btree_nodes_worker *w = kmalloc(sizeof(*w), GFP_KERNEL);
+			if (!w) {
+				percpu_ref_put(&ca->io_ref);
+				ret = -ENOMEM;
+				goto err;
+			}
 
-		w->cl		= &cl;
-		w->f		= f;
-		w->ca		= ca;
+			w->cl		= &cl;
+			w->f		= f;
+			w->d		= d;
+			w->ca		= ca;
+			w->bucket_start	= ca->mi.first_bucket + div_u64(nr_buckets * i, nr_workers);
+			w->bucket_end	= ca->mi.first_bucket + div_u64(nr_buckets * (i + 1), nr_workers);
+
+			struct task_struct *t = kthread_create(read_btree_nodes_worker, w,
+						"read_btree_nodes/%s/%u", ca->name, i);
+			ret = PTR_ERR_OR_ZERO(t);
+			if (ret) {
+				percpu_ref_put(&ca->io_ref);
+				kfree(w);
+				bch_err_msg(c, ret, "starting kthread");
+				goto err;
+			}
 
-		struct task_struct *t = kthread_create(read_btree_nodes_worker, w, "read_btree_nodes/%s", ca->name);
-		ret = PTR_ERR_OR_ZERO(t);
-		if (ret) {
-			percpu_ref_put(&ca->io_ref);
-			kfree(w);
-			bch_err_msg(c, ret, "starting kthread");
-			break;
+			closure_get(&cl);
+			percpu_ref_get(&ca->io_ref);
+			wake_up_process(t);
 		}
-
-		closure_get(&cl);
-		percpu_ref_get(&ca->io_ref);
-		wake_up_process(t);
 	}
 err:
 	closure_sync(&cl);
+	kfree(devs);
 	return f->ret ?: ret;
 }
 
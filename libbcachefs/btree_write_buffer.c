@@ -853,6 +853,19 @@ int bch2_btree_write_buffer_resize(struct bch_fs *c, size_t new_size)
 		wb_keys_resize(&wb->inc, new_size);
 }
 
+void bch2_btree_write_buffer_to_text(struct printbuf *out, struct bch_fs *c)
+{
+	struct btree_write_buffer *wb = &c->btree_write_buffer;
+
+	printbuf_tabstop_push(out, 24);
+
+	prt_printf(out, "incoming:\t%zu/%zu\n", wb->inc.keys.nr, wb->inc.keys.size);
+	prt_printf(out, "incoming pin:\t%llu\n", READ_ONCE(wb->inc.pin.seq));
+	prt_printf(out, "flushing:\t%zu/%zu\n", wb->flushing.keys.nr, wb->flushing.keys.size);
+	prt_printf(out, "flushing pin:\t%llu\n", READ_ONCE(wb->flushing.pin.seq));
+	prt_printf(out, "accounting:\t%zu\n", wb->accounting.nr);
+}
+
 void bch2_fs_btree_write_buffer_exit(struct bch_fs *c)
 {
 	struct btree_write_buffer *wb = &c->btree_write_buffer;
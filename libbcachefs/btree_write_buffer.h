@@ -100,6 +100,7 @@ void bch2_journal_keys_to_write_buffer_start(struct bch_fs *, struct journal_key
 int bch2_journal_keys_to_write_buffer_end(struct bch_fs *, struct journal_keys_to_wb *);
 
 int bch2_btree_write_buffer_resize(struct bch_fs *, size_t);
+void bch2_btree_write_buffer_to_text(struct printbuf *, struct bch_fs *);
 void bch2_fs_btree_write_buffer_exit(struct bch_fs *);
 int bch2_fs_btree_write_buffer_init(struct bch_fs *);
 
@@ -22,6 +22,7 @@
 
 #include <linux/bsearch.h>
 #include <linux/dcache.h> /* struct qstr */
+#include <linux/kthread.h>
 
 static bool inode_points_to_dirent(struct bch_inode_unpacked *inode,
 				   struct bkey_s_c_dirent d)
@@ -160,6 +161,29 @@ err:
 	return ret;
 }
 
+/* The inode key at exactly @snapshot, not the version visible from it: */
+static int lookup_inode_exact(struct btree_trans *trans, u64 inode_nr, u32 snapshot,
+			      struct bch_inode_unpacked *inode)
+{
+	struct btree_iter iter;
+	struct bkey_s_c k;
+	int ret;
+
+	k = bch2_bkey_get_iter(trans, &iter, BTREE_ID_inodes,
+			       SPOS(0, inode_nr, snapshot),
+			       BTREE_ITER_all_snapshots);
+	ret = bkey_err(k);
+	if (ret)
+		goto err;
+
+	ret = bkey_is_inode(k.k)
+		? bch2_inode_unpack(k, inode)
+		: -BCH_ERR_ENOENT_inode;
+err:
+	bch2_trans_iter_exit(trans, &iter);
+	return ret;
+}
+
 static int lookup_dirent_in_snapshot(struct btree_trans *trans,
 			   struct bch_hash_info hash_info,
 			   subvol_inum dir, struct qstr *name,
@@ -1040,6 +1064,193 @@ static struct bkey_s_c_dirent inode_get_dirent(struct btree_trans *trans,
 	return dirent_get_by_pos(trans, iter, SPOS(inode->bi_dir, inode->bi_dir_offset, *snapshot));
 }
 
+/*
+ * Sharding fsck passes by inode number:
+ *
+ * The passes that walk a btree one inode at a time (check_inodes,
+ * check_extents, check_dirents, check_xattrs) keep no state across inodes, so
+ * with opts.fsck_threads > 1 we split the btree into ranges of whole inodes,
+ * each checked by its own thread with its own transaction and walkers.
+ * Split points come from leaf node boundaries, so that each range gets
+ * roughly the same number of keys.
+ *
+ * Errors are reported as usual, through the shared fsck_err state; a thread
+ * that fails is reported with its range, and the pass returns the first
+ * error. Not for online fsck, see below.
+ */
+
+struct fsck_shard {
+	struct closure		*cl;
+	struct bch_fs		*c;
+	fsck_range_fn		fn;
+	struct bpos		start;
+	struct bpos		end;
+	int			ret;
+};
+
+static int fsck_shard_run(struct fsck_shard *s)
+{
+	return bch2_trans_run(s->c, s->fn(trans, s->start, s->end));
+}
+
+static int fsck_shard_thread(void *arg)
+{
+	struct fsck_shard *s = arg;
+
+	s->ret = fsck_shard_run(s);
+	closure_put(s->cl);
+	return 0;
+}
+
+/* The inodes btree is indexed by offset, the others by inode: */
+static inline u64 fsck_pos_inum(enum btree_id btree, struct bpos p)
+{
+	return btree == BTREE_ID_inodes ? p.offset : p.inode;
+}
+
+static inline struct bpos fsck_inum_pos(enum btree_id btree, u64 inum)
+{
+	return btree == BTREE_ID_inodes ? POS(0, inum) : POS(inum, 0);
+}
+
+/* Where each leaf node ends, from the pointers in level 1 nodes: */
+static int fsck_leaf_boundaries(struct btree_trans *trans, enum btree_id btree,
+				u64 start, darray_u64 *leaves)
+{
+	return __for_each_btree_node(trans, iter, btree, fsck_inum_pos(btree, start),
+				     0, 1, 0, b, ({
+		struct btree_node_iter node_iter;
+		struct bkey unpacked;
+		struct bkey_s_c k;
+		int ret2 = 0;
+
+		/* Skip what we already have if we're rerun after a restart: */
+		for_each_btree_node_key_unpack(b, k, &node_iter, &unpacked) {
+			u64 inum = fsck_pos_inum(btree, k.k->p);
+
+			if (inum < U64_MAX &&
+			    (!leaves->nr || inum + 1 > darray_last(*leaves)))
+				ret2 = darray_push(leaves, inum + 1);
+			if (ret2)
+				break;
+		}
+		ret2;
+	}));
+}
+
+/* Up to @nr_shards - 1 split points, ascending and all > @start: */
+int bch2_fsck_shard_boundaries(struct btree_trans *trans, enum btree_id btree,
+			       u64 start, unsigned nr_shards, darray_u64 *ret)
+{
+	darray_u64 leaves = {};
+
+	int ret2 = fsck_leaf_boundaries(trans, btree, start, &leaves);
+	if (ret2 || !leaves.nr)
+		goto err;
+
+	for (unsigned i = 1; i < nr_shards; i++) {
+		u64 inum = leaves.data[div_u64((u64) leaves.nr * i, nr_shards)];
+
+		if (inum > (ret->nr ? darray_last(*ret) : start)) {
+			ret2 = darray_push(ret, inum);
+			if (ret2)
+				goto err;
+		}
+	}
+err:
+	darray_exit(&leaves);
+	return ret2;
+}
+
+/*
+ * Online fsck only talks to the user from the thread that started it
+ * (c->stdio_filter); and when asking, threads would wait on the user with
+ * btree locks held, and questions would come in no sensible order:
+ */
+static bool fsck_can_shard(struct bch_fs *c)
+{
+	return c->opts.fsck_threads > 1 &&
+		!c->stdio_filter &&
+		c->opts.fix_errors != FSCK_FIX_ask;
+}
+
+/*
+ * Run @fn over @btree from inode @start to the end, split into ranges of whole
+ * inodes across opts.fsck_threads threads:
+ */
+int bch2_fsck_sharded(struct bch_fs *c, enum btree_id btree, u64 start,
+		      fsck_range_fn fn)
+{
+	unsigned nr_threads = c->opts.fsck_threads;
+	struct fsck_shard *shards = NULL;
+	darray_u64 boundaries = {};
+	struct closure cl;
+	int ret = 0;
+
+	if (!fsck_can_shard(c))
+		goto single;
+
+	ret = bch2_trans_run(c, bch2_fsck_shard_boundaries(trans, btree, start,
+							   nr_threads, &boundaries));
+	if (ret || !boundaries.nr)
+		goto single;
+
+	unsigned nr_shards = boundaries.nr + 1;
+
+	shards = kcalloc(nr_shards, sizeof(*shards), GFP_KERNEL);
+	if (!shards)
+		goto single;
+
+	closure_init_stack(&cl);
+
+	struct printbuf buf = PRINTBUF;
+	bch2_btree_id_to_text(&buf, btree);
+	bch_verbose(c, "checking %s with %u threads", buf.buf, nr_shards);
+	printbuf_exit(&buf);
+
+	for (unsigned i = 0; i < nr_shards; i++) {
+		struct fsck_shard *s = &shards[i];
+
+		s->cl		= &cl;
+		s->c		= c;
+		s->fn		= fn;
+		s->start	= fsck_inum_pos(btree, i ? boundaries.data[i - 1] : start);
+		s->end		= i < boundaries.nr
+			? bpos_predecessor(fsck_inum_pos(btree, boundaries.data[i]))
+			: SPOS_MAX;
+
+		struct task_struct *t = kthread_create(fsck_shard_thread, s,
+					"bch-fsck/%s/%u", c->name, i);
+		if (IS_ERR(t)) {
+			/* Do it ourselves: */
+			s->ret = fsck_shard_run(s);
+			continue;
+		}
+
+		closure_get(&cl);
+		wake_up_process(t);
+	}
+
+	closure_sync(&cl);
+
+	for (unsigned i = 0; i < nr_shards; i++) {
+		struct fsck_shard *s = &shards[i];
+
+		if (s->ret && !ret)
+			ret = s->ret;
+		bch_err_msg(c, s->ret, "checking inodes %llu-%llu",
+			    fsck_pos_inum(btree, s->start),
+			    fsck_pos_inum(btree, s->end));
+	}
+
+	kfree(shards);
+	darray_exit(&boundaries);
+	return ret;
+single:
+	darray_exit(&boundaries);
+	return bch2_trans_run(c, fn(trans, fsck_inum_pos(btree, start), SPOS_MAX));
+}
+
 static int check_inode_deleted_list(struct btree_trans *trans, struct bpos p)
 {
 	struct btree_iter iter;
@@ -1321,21 +1532,26 @@ err_noprint:
 	return ret;
 }
 
-int bch2_check_inodes(struct bch_fs *c)
+static int check_inodes_range(struct btree_trans *trans, struct bpos start, struct bpos end)
 {
 	struct bch_inode_unpacked snapshot_root = {};
 	struct snapshots_seen s;
 
 	snapshots_seen_init(&s);
 
-	int ret = bch2_trans_run(c,
-		for_each_btree_key_commit(trans, iter, BTREE_ID_inodes,
-				POS_MIN,
+	int ret = for_each_btree_key_max_commit(trans, iter, BTREE_ID_inodes,
+				start, end,
 				BTREE_ITER_prefetch|BTREE_ITER_all_snapshots, k,
 				NULL, NULL, BCH_TRANS_COMMIT_no_enospc,
-			check_inode(trans, &iter, k, &snapshot_root, &s)));
+			check_inode(trans, &iter, k, &snapshot_root, &s));
 
 	snapshots_seen_exit(&s);
+	return ret;
+}
+
+int bch2_check_inodes(struct bch_fs *c)
+{
+	int ret = bch2_fsck_sharded(c, BTREE_ID_inodes, 0, check_inodes_range);
 	bch_err_fn(c, ret);
 	return ret;
 }
@@ -1893,8 +2109,9 @@ fsck_err:
  * Walk extents: verify that extents have a corresponding S_ISREG inode, and
  * that i_size an i_sectors are consistent
  */
-int bch2_check_extents(struct bch_fs *c)
+static int check_extents_range(struct btree_trans *trans, struct bpos start, struct bpos end)
 {
+	struct bch_fs *c = trans->c;
 	struct inode_walker w = inode_walker_init();
 	struct snapshots_seen s;
 	struct extent_ends extent_ends;
@@ -1903,21 +2120,26 @@ int bch2_check_extents(struct bch_fs *c)
 	snapshots_seen_init(&s);
 	extent_ends_init(&extent_ends);
 
-	int ret = bch2_trans_run(c,
-		for_each_btree_key(trans, iter, BTREE_ID_extents,
-				POS(BCACHEFS_ROOT_INO, 0),
+	int ret = for_each_btree_key_max(trans, iter, BTREE_ID_extents,
+				start, end,
 				BTREE_ITER_prefetch|BTREE_ITER_all_snapshots, k, ({
 			bch2_disk_reservation_put(c, &res);
 			check_extent(trans, &iter, k, &w, &s, &extent_ends, &res) ?:
 			check_extent_overbig(trans, &iter, k);
 		})) ?:
-		check_i_sectors_notnested(trans, &w));
+		check_i_sectors_notnested(trans, &w);
 
 	bch2_disk_reservation_put(c, &res);
 	extent_ends_exit(&extent_ends);
 	inode_walker_exit(&w);
 	snapshots_seen_exit(&s);
+	return ret;
+}
 
+int bch2_check_extents(struct bch_fs *c)
+{
+	int ret = bch2_fsck_sharded(c, BTREE_ID_extents, BCACHEFS_ROOT_INO,
+				    check_extents_range);
 	bch_err_fn(c, ret);
 	return ret;
 }
@@ -1963,6 +2185,22 @@ static int check_subdir_count_notnested(struct btree_trans *trans, struct inode_
 				continue;
 		}
 
+		/*
+		 * When sharded, other threads may have updated this inode since
+		 * we cached it (fixing its dirent backpointer): re-read the key
+		 * this entry came from, and skip it if it's since been deleted:
+		 */
+		if (fsck_can_shard(c)) {
+			ret = lookup_inode_exact(trans, w->last_pos.inode,
+						 i->inode.bi_snapshot, &i->inode);
+			if (bch2_err_matches(ret, ENOENT)) {
+				ret = 0;
+				continue;
+			}
+			if (ret)
+				break;
+		}
+
 		if (fsck_err_on(i->inode.bi_nlink != i->count,
 				trans, inode_dir_wrong_nlink,
 				"directory %llu:%u with wrong i_nlink: got %u, should be %llu",
@@ -2435,7 +2673,7 @@ fsck_err:
  * Walk dirents: verify that they all have a corresponding S_ISDIR inode,
  * validate d_type
  */
-int bch2_check_dirents(struct bch_fs *c)
+static int check_dirents_range(struct btree_trans *trans, struct bpos start, struct bpos end)
 {
 	struct inode_walker dir = inode_walker_init();
 	struct inode_walker target = inode_walker_init();
@@ -2444,16 +2682,22 @@ int bch2_check_dirents(struct bch_fs *c)
 
 	snapshots_seen_init(&s);
 
-	int ret = bch2_trans_run(c,
-		for_each_btree_key(trans, iter, BTREE_ID_dirents,
-				POS(BCACHEFS_ROOT_INO, 0),
+	int ret = for_each_btree_key_max(trans, iter, BTREE_ID_dirents,
+				start, end,
 				BTREE_ITER_prefetch|BTREE_ITER_all_snapshots, k,
 			check_dirent(trans, &iter, k, &hash_info, &dir, &target, &s)) ?:
-		check_subdir_count_notnested(trans, &dir));
+		check_subdir_count_notnested(trans, &dir);
 
 	snapshots_seen_exit(&s);
 	inode_walker_exit(&dir);
 	inode_walker_exit(&target);
+	return ret;
+}
+
+int bch2_check_dirents(struct bch_fs *c)
+{
+	int ret = bch2_fsck_sharded(c, BTREE_ID_dirents, BCACHEFS_ROOT_INO,
+				    check_dirents_range);
 	bch_err_fn(c, ret);
 	return ret;
 }
@@ -2497,22 +2741,27 @@ static int check_xattr(struct btree_trans *trans, struct btree_iter *iter,
 /*
  * Walk xattrs: verify that they all have a corresponding inode
  */
-int bch2_check_xattrs(struct bch_fs *c)
+static int check_xattrs_range(struct btree_trans *trans, struct bpos start, struct bpos end)
 {
 	struct inode_walker inode = inode_walker_init();
 	struct bch_hash_info hash_info;
-	int ret = 0;
 
-	ret = bch2_trans_run(c,
-		for_each_btree_key_commit(trans, iter, BTREE_ID_xattrs,
-			POS(BCACHEFS_ROOT_INO, 0),
+	int ret = for_each_btree_key_max_commit(trans, iter, BTREE_ID_xattrs,
+			start, end,
 			BTREE_ITER_prefetch|BTREE_ITER_all_snapshots,
 			k,
 			NULL, NULL,
 			BCH_TRANS_COMMIT_no_enospc,
-		check_xattr(trans, &iter, k, &hash_info, &inode)));
+		check_xattr(trans, &iter, k, &hash_info, &inode));
 
 	inode_walker_exit(&inode);
+	return ret;
+}
+
+int bch2_check_xattrs(struct bch_fs *c)
+{
+	int ret = bch2_fsck_sharded(c, BTREE_ID_xattrs, BCACHEFS_ROOT_INO,
+				    check_xattrs_range);
 	bch_err_fn(c, ret);
 	return ret;
 }
@@ -10,6 +10,12 @@ int bch2_fsck_update_backpointers(struct btree_trans *,
 				  struct bch_hash_info *,
 				  struct bkey_i *);
 
+typedef int (*fsck_range_fn)(struct btree_trans *, struct bpos, struct bpos);
+
+int bch2_fsck_shard_boundaries(struct btree_trans *, enum btree_id,
+			       u64, unsigned, darray_u64 *);
+int bch2_fsck_sharded(struct bch_fs *, enum btree_id, u64, fsck_range_fn);
+
 int bch2_check_inodes(struct bch_fs *);
 int bch2_check_extents(struct bch_fs *);
 int bch2_check_indirect_extents(struct bch_fs *);
@@ -48,17 +48,23 @@ void bch2_journal_pos_from_member_info_resume(struct bch_fs *c)
 	mutex_unlock(&c->sb_lock);
 }
 
-void bch2_journal_ptrs_to_text(struct printbuf *out, struct bch_fs *c,
-			       struct journal_replay *j)
+void bch2_journal_ptrs_raw_to_text(struct printbuf *out,
+				   struct journal_ptr *ptrs, unsigned nr)
 {
-	darray_for_each(j->ptrs, i) {
-		if (i != j->ptrs.data)
+	for (struct journal_ptr *i = ptrs; i < ptrs + nr; i++) {
+		if (i != ptrs)
 			prt_printf(out, " ");
 		prt_printf(out, "%u:%u:%u (sector %llu)",
 			   i->dev, i->bucket, i->bucket_offset, i->sector);
 	}
 }
 
+void bch2_journal_ptrs_to_text(struct printbuf *out, struct bch_fs *c,
+			       struct journal_replay *j)
+{
+	bch2_journal_ptrs_raw_to_text(out, j->ptrs.data, j->ptrs.nr);
+}
+
 static void bch2_journal_replay_to_text(struct printbuf *out, struct bch_fs *c,
 					struct journal_replay *j)
 {
@@ -74,16 +80,6 @@ static void bch2_journal_replay_to_text(struct printbuf *out, struct bch_fs *c,
 	}
 }
 
-static struct nonce journal_nonce(const struct jset *jset)
-{
-	return (struct nonce) {{
-		[0] = 0,
-		[1] = ((__le32 *) &jset->seq)[0],
-		[2] = ((__le32 *) &jset->seq)[1],
-		[3] = BCH_NONCE_JOURNAL,
-	}};
-}
-
 static bool jset_csum_good(struct bch_fs *c, struct jset *j, struct bch_csum *csum)
 {
 	if (!bch2_checksum_type_valid(c, JSET_CSUM_TYPE(j))) {
@@ -1007,15 +1003,88 @@ static int journal_read_buf_realloc(struct journal_read_buf *b,
 	return 0;
 }
 
+/*
+ * Journal buckets are read ahead of the bucket being processed, a whole bucket
+ * (up to JOURNAL_ENTRY_SIZE_MAX) per read, so that checksumming and validating
+ * one bucket overlaps with reading the next ones:
+ */
+#define JOURNAL_READ_IN_FLIGHT		(32U << 20)
+#define JOURNAL_READ_BUCKETS_MAX	16
+
+struct journal_bucket_read {
+	struct journal_read_buf	buf;
+	struct bio		*bio;
+	unsigned		sectors;
+	u64			submit_time;
+	struct completion	done;
+};
+
+static void journal_bucket_read_endio(struct bio *bio)
+{
+	struct journal_bucket_read *r = bio->bi_private;
+
+	complete(&r->done);
+}
+
+static int journal_bucket_read_submit(struct bch_dev *ca,
+				      struct journal_bucket_read *r,
+				      unsigned bucket)
+{
+	struct journal_device *ja = &ca->journal;
+
+	r->sectors = min_t(unsigned, ca->mi.bucket_size, r->buf.size >> 9);
+
+	unsigned nr_bvecs = buf_pages(r->buf.data, r->sectors << 9);
+
+	r->bio = bio_kmalloc(nr_bvecs, GFP_KERNEL);
+	if (!r->bio)
+		return -BCH_ERR_ENOMEM_journal_read_bucket;
+	bio_init(r->bio, ca->disk_sb.bdev, r->bio->bi_inline_vecs, nr_bvecs, REQ_OP_READ);
+
+	r->bio->bi_iter.bi_sector	= bucket_to_sector(ca, ja->buckets[bucket]);
+	r->bio->bi_end_io		= journal_bucket_read_endio;
+	r->bio->bi_private		= r;
+	bch2_bio_map(r->bio, r->buf.data, r->sectors << 9);
+
+	init_completion(&r->done);
+	r->submit_time = local_clock();
+	submit_bio(r->bio);
+	return 0;
+}
+
+/* Returns the number of sectors read, or 0 on error: */
+static unsigned journal_bucket_read_wait(struct bch_dev *ca,
+					 struct journal_bucket_read *r)
+{
+	wait_for_completion(&r->done);
+
+	int ret = blk_status_to_errno(r->bio->bi_status);
+	kfree(r->bio);
+	r->bio = NULL;
+
+	if (!ret && bch2_meta_read_fault("journal"))
+		ret = -BCH_ERR_EIO_fault_injected;
+
+	bch2_account_io_completion(ca, BCH_MEMBER_ERROR_read,
+				   r->submit_time, !ret);
+
+	return !ret ? r->sectors : 0;
+}
+
+/*
+ * @buf has the first @sectors_read sectors of the bucket, if any: the rest of
+ * the bucket is read synchronously as needed.
+ */
 static int journal_read_bucket(struct bch_dev *ca,
 			       struct journal_read_buf *buf,
 			       struct journal_list *jlist,
-			       unsigned bucket)
+			       unsigned bucket,
+			       unsigned sectors_read)
 {
 	struct bch_fs *c = ca->fs;
 	struct journal_device *ja = &ca->journal;
-	struct jset *j = NULL;
-	unsigned sectors, sectors_read = 0;
+	struct jset *j = buf->data;
+	unsigned sectors;
 	u64 offset = bucket_to_sector(ca, ja->buckets[bucket]),
 	    end = offset + ca->mi.bucket_size;
 	bool saw_bad = false, csum_good;
@@ -1172,23 +1241,61 @@ static CLOSURE_CALLBACK(bch2_journal_read_device)
 	struct bch_fs *c = ca->fs;
 	struct journal_list *jlist =
 		container_of(cl->parent, struct journal_list, cl);
-	struct journal_read_buf buf = { NULL, 0 };
-	unsigned i;
+	struct journal_bucket_read *reads = NULL;
+	unsigned i, nr_reads = 0;
 	int ret = 0;
 
 	if (!ja->nr)
 		goto out;
 
-	ret = journal_read_buf_realloc(&buf, PAGE_SIZE);
-	if (ret)
+	size_t buf_size = min_t(size_t, ca->mi.bucket_size << 9,
+				JOURNAL_ENTRY_SIZE_MAX);
+	unsigned want = clamp_t(unsigned, JOURNAL_READ_IN_FLIGHT / buf_size,
+				2, JOURNAL_READ_BUCKETS_MAX);
+	want = min(want, ja->nr);
+
+	reads = kcalloc(want, sizeof(*reads), GFP_KERNEL);
+	if (!reads) {
+		ret = -BCH_ERR_ENOMEM_journal_read_bucket;
+		goto err;
+	}
+
+	/* Fewer reads in flight is fine, if we can't allocate buffers: */
+	for (nr_reads = 0; nr_reads < want; nr_reads++) {
+		ret = journal_read_buf_realloc(&reads[nr_reads].buf, buf_size);
+		if (ret)
+			break;
+	}
+
+	if (!nr_reads)
 		goto err;
+	ret = 0;
 
-	pr_debug("%u journal buckets", ja->nr);
+	pr_debug("%u journal buckets, %u reads in flight", ja->nr, nr_reads);
+
+	for (i = 0; i < nr_reads; i++) {
+		ret = journal_bucket_read_submit(ca, &reads[i], i);
+		if (ret)
+			goto err;
+	}
 
 	for (i = 0; i < ja->nr; i++) {
-		ret = journal_read_bucket(ca, &buf, jlist, i);
+		struct journal_bucket_read *r = &reads[i % nr_reads];
+
+		/*
+		 * On a read error, journal_read_bucket() retries the read
+		 * synchronously and reports the error:
+		 */
+		ret = journal_read_bucket(ca, &r->buf, jlist, i,
+					  journal_bucket_read_wait(ca, r));
 		if (ret)
 			goto err;
+
+		if (i + nr_reads < ja->nr) {
+			ret = journal_bucket_read_submit(ca, r, i + nr_reads);
+			if (ret)
+				goto err;
+		}
 	}
 
 	/*
@@ -1200,7 +1307,14 @@ static CLOSURE_CALLBACK(bch2_journal_read_device)
 		ja->dirty_idx = (ja->cur_idx + 1) % ja->nr;
 out:
 	bch_verbose(c, "journal read done on device %s, ret %i", ca->name, ret);
-	kvfree(buf.data);
+	for (i = 0; i < nr_reads; i++) {
+		if (reads[i].bio) {
+			wait_for_completion(&reads[i].done);
+			kfree(reads[i].bio);
+		}
+		kvfree(reads[i].buf.data);
+	}
+	kfree(reads);
 	percpu_ref_put(&ca->io_ref);
 	closure_return(cl);
 	return;
@@ -2,6 +2,7 @@
 #ifndef _BCACHEFS_JOURNAL_IO_H
 #define _BCACHEFS_JOURNAL_IO_H
 
+#include "checksum.h"
 #include "darray.h"
 
 void bch2_journal_pos_from_member_info_set(struct bch_fs *);
@@ -29,6 +30,16 @@ struct journal_replay {
 	struct jset		j;
 };
 
+static inline struct nonce journal_nonce(const struct jset *jset)
+{
+	return (struct nonce) {{
+		[0] = 0,
+		[1] = ((__le32 *) &jset->seq)[0],
+		[2] = ((__le32 *) &jset->seq)[1],
+		[3] = BCH_NONCE_JOURNAL,
+	}};
+}
+
 static inline bool journal_replay_ignore(struct journal_replay *i)
 {
 	return !i || i->ignore_blacklisted || i->ignore_not_dirty;
@@ -67,6 +78,7 @@ int bch2_journal_entry_validate(struct bch_fs *, struct jset *,
 void bch2_journal_entry_to_text(struct printbuf *, struct bch_fs *,
 				struct jset_entry *);
 
+void bch2_journal_ptrs_raw_to_text(struct printbuf *, struct journal_ptr *, unsigned);
 void bch2_journal_ptrs_to_text(struct printbuf *, struct bch_fs *,
 			       struct journal_replay *);
 
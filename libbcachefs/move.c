@@ -128,13 +128,20 @@ static void move_write(struct moving_io *io)
 {
 	struct moving_context *ctxt = io->write.ctxt;
 
-	if (ctxt->stats) {
-		if (io->write.rbio.bio.bi_status)
-			atomic64_add(io->write.rbio.bvec_iter.bi_size >> 9,
-				     &ctxt->stats->sectors_error_uncorrected);
-		else if (io->write.rbio.saw_error)
-			atomic64_add(io->write.rbio.bvec_iter.bi_size >> 9,
-				     &ctxt->stats->sectors_error_corrected);
+	if (ctxt->stats &&
+	    (io->write.rbio.bio.bi_status || io->write.rbio.saw_error)) {
+		struct bch_move_stats *stats = ctxt->stats;
+		u64 sectors = io->write.rbio.bvec_iter.bi_size >> 9;
+		bool corrected = !io->write.rbio.bio.bi_status;
+
+		atomic64_add(sectors, corrected
+			     ? &stats->sectors_error_corrected
+			     : &stats->sectors_error_uncorrected);
+
+		if (stats->read_error)
+			stats->read_error(stats, bkey_i_to_s_c(io->write.k.k),
+					  io->write.data_opts.read_dev,
+					  sectors, corrected);
 	}
 
 	if (unlikely(io->write.rbio.ret ||
@@ -1187,7 +1194,10 @@ int bch2_data_job(struct bch_fs *c,
 	if (op.op >= BCH_DATA_OP_NR)
 		return -EINVAL;
 
+	/* @stats must be zeroed or initialized; keep the caller's hook: */
+	typeof(stats->read_error) read_error = stats->read_error;
 	bch2_move_stats_init(stats, bch2_data_ops_strs[op.op]);
+	stats->read_error = read_error;
 
 	switch (op.op) {
 	case BCH_DATA_OP_scrub:
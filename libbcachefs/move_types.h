@@ -3,6 +3,7 @@
 #define _BCACHEFS_MOVE_TYPES_H
 
 #include "bbpos_types.h"
+#include "bkey_types.h"
 #include "bcachefs_ioctl.h"
 
 struct bch_move_stats {
@@ -28,6 +29,10 @@ struct bch_move_stats {
 	atomic64_t		sectors_raced;
 	atomic64_t		sectors_error_corrected;
 	atomic64_t		sectors_error_uncorrected;
+
+	/* Optional, called for each extent that was read with an error: */
+	void			(*read_error)(struct bch_move_stats *, struct bkey_s_c,
+					      int dev, u64 sectors, bool corrected);
 };
 
 struct move_bucket_key {
@@ -356,6 +356,12 @@ enum fsck_err_opts {
 	  OPT_UINT(20, 70),						\
 	  BCH2_NO_SB_OPT,		50,				\
 	  NULL,		"Maximum percentage of system ram fsck is allowed to pin")\
+	x(fsck_threads,			u8,				\
+	  OPT_FS|OPT_MOUNT,						\
+	  OPT_UINT(1, 64),						\
+	  BCH2_NO_SB_OPT,		1,				\
+	  NULL,		"Number of threads for the fsck passes that check\n"\
+			"each inode's keys")				\
 	x(fix_errors,			u8,				\
 	  OPT_FS|OPT_MOUNT,						\
 	  OPT_FN(bch2_opt_fix_errors),					\
@@ -18,6 +18,7 @@
 #include "btree_key_cache.h"
 #include "btree_update.h"
 #include "btree_update_interior.h"
+#include "btree_write_buffer.h"
 #include "btree_gc.h"
 #include "buckets.h"
 #include "clock.h"
@@ -162,16 +163,21 @@ read_attribute(io_latency_read);
 read_attribute(io_latency_write);
 read_attribute(io_latency_stats_read);
 read_attribute(io_latency_stats_write);
+read_attribute(io_stats_raw);
 read_attribute(congested);
 
 read_attribute(btree_write_stats);
+read_attribute(time_stats_raw);
+read_attribute(counters_raw);
 
 read_attribute(btree_cache_size);
 read_attribute(compression_stats);
 read_attribute(journal_debug);
+read_attribute(journal_pins);
 read_attribute(btree_cache);
 read_attribute(btree_key_cache);
 read_attribute(btree_reserve_cache);
+read_attribute(btree_write_buffer);
 read_attribute(open_buckets);
 read_attribute(open_buckets_partial);
 read_attribute(nocow_lock_table);
@@ -296,6 +302,26 @@ static void bch2_gc_gens_pos_to_text(struct printbuf *out, struct bch_fs *c)
 	prt_printf(out, "\n");
 }
 
+/* For tools (bcachefs fs top): one line per time stat, preceded by its name */
+static void bch2_fs_time_stats_raw_to_text(struct printbuf *out, struct bch_fs *c)
+{
+#define x(name)								\
+	prt_str(out, #name " ");					\
+	bch2_time_stats_raw_to_text(out, &c->times[BCH_TIME_##name]);
+	BCH_TIME_STATS()
+#undef x
+}
+
+/* Like BCH_IOCTL_QUERY_COUNTERS: stable counter id, then value */
+static void bch2_fs_counters_raw_to_text(struct printbuf *out, struct bch_fs *c)
+{
+#define x(t, n, ...)							\
+	prt_printf(out, "%u %llu\n", BCH_COUNTER_STABLE_##t,		\
+		   percpu_u64_get(&c->counters[BCH_COUNTER_##t]));
+	BCH_PERSISTENT_COUNTERS()
+#undef x
+}
+
 static void bch2_fs_usage_base_to_text(struct printbuf *out, struct bch_fs *c)
 {
 	struct bch_fs_usage_base b = {};
@@ -341,6 +367,9 @@ SHOW(bch2_fs)
 	if (attr == &sysfs_journal_debug)
 		bch2_journal_debug_to_text(out, &c->journal);
 
+	if (attr == &sysfs_journal_pins)
+		bch2_journal_pins_to_text(out, &c->journal);
+
 	if (attr == &sysfs_btree_cache)
 		bch2_btree_cache_to_text(out, &c->btree_cache);
 
@@ -350,6 +379,9 @@ SHOW(bch2_fs)
 	if (attr == &sysfs_btree_reserve_cache)
 		bch2_btree_reserve_cache_to_text(out, c);
 
+	if (attr == &sysfs_btree_write_buffer)
+		bch2_btree_write_buffer_to_text(out, c);
+
 	if (attr == &sysfs_open_buckets)
 		bch2_open_buckets_to_text(out, c, NULL);
 
@@ -388,6 +420,12 @@ SHOW(bch2_fs)
 	if (attr == &sysfs_usage_base)
 		bch2_fs_usage_base_to_text(out, c);
 
+	if (attr == &sysfs_time_stats_raw)
+		bch2_fs_time_stats_raw_to_text(out, c);
+
+	if (attr == &sysfs_counters_raw)
+		bch2_fs_counters_raw_to_text(out, c);
+
 	return 0;
 }
 
@@ -460,7 +498,7 @@ STORE(bch2_fs)
 		if (threads_str &&
 		    !(ret = kstrtouint(threads_str, 10, &threads)) &&
 		    !(ret = bch2_strtoull_h(nr_str, &nr)))
-			ret = bch2_btree_perf_test(c, test, nr, threads);
+			ret = bch2_btree_perf_test(c, test, nr, threads, NULL);
 		kfree(tmp);
 
 		if (ret)
@@ -554,9 +592,11 @@ SYSFS_OPS(bch2_fs_internal);
 struct attribute *bch2_fs_internal_files[] = {
 	&sysfs_flags,
 	&sysfs_journal_debug,
+	&sysfs_journal_pins,
 	&sysfs_btree_cache,
 	&sysfs_btree_key_cache,
 	&sysfs_btree_reserve_cache,
+	&sysfs_btree_write_buffer,
 	&sysfs_new_stripes,
 	&sysfs_open_buckets,
 	&sysfs_open_buckets_partial,
@@ -590,6 +630,8 @@ struct attribute *bch2_fs_internal_files[] = {
 	&sysfs_disk_groups,
 	&sysfs_alloc_debug,
 	&sysfs_usage_base,
+	&sysfs_time_stats_raw,
+	&sysfs_counters_raw,
 	NULL
 };
 
@@ -763,6 +805,20 @@ static const char * const bch2_rw[] = {
 	NULL
 };
 
+/* For tools: per direction, bytes done then bch2_time_stats_raw_to_text() */
+static void dev_io_stats_raw_to_text(struct printbuf *out, struct bch_dev *ca)
+{
+	for (unsigned rw = 0; rw < 2; rw++) {
+		u64 sectors = 0;
+
+		for (unsigned i = 1; i < BCH_DATA_NR; i++)
+			sectors += percpu_u64_get(&ca->io_done->sectors[rw][i]);
+
+		prt_printf(out, "%s %llu ", bch2_rw[rw], sectors << 9);
+		bch2_time_stats_raw_to_text(out, &ca->io_latency[rw].stats);
+	}
+}
+
 static void dev_io_done_to_text(struct printbuf *out, struct bch_dev *ca)
 {
 	int rw, i;
@@ -813,6 +869,9 @@ SHOW(bch2_dev)
 	if (attr == &sysfs_io_latency_stats_write)
 		bch2_time_stats_to_text(out, &ca->io_latency[WRITE].stats);
 
+	if (attr == &sysfs_io_stats_raw)
+		dev_io_stats_raw_to_text(out, ca);
+
 	sysfs_printf(congested,			"%u%%",
 		     clamp(atomic_read(&ca->congested), 0, CONGESTED_MAX)
 		     * 100 / CONGESTED_MAX);
@@ -877,6 +936,7 @@ struct attribute *bch2_dev_files[] = {
 	&sysfs_io_latency_write,
 	&sysfs_io_latency_stats_read,
 	&sysfs_io_latency_stats_write,
+	&sysfs_io_stats_raw,
 	&sysfs_congested,
 
 	/* debug: */
@@ -3,6 +3,7 @@
 
 #include "bcachefs.h"
 #include "btree_update.h"
+#include "fsck.h"
 #include "journal_reclaim.h"
 #include "snapshot.h"
 #include "tests.h"
@@ -526,6 +527,109 @@ static int test_snapshots(struct bch_fs *c, u64 nr)
 	return ret;
 }
 
+/* fsck sharding */
+
+#define FSCK_SHARD_TEST_KEYS_PER_INODE	8
+
+static atomic64_t fsck_shard_test_keys;
+
+/* Ranges must hold whole inodes: every inode has offsets 0-7 */
+static int fsck_shard_test_range(struct btree_trans *trans,
+				 struct bpos start, struct bpos end)
+{
+	struct bpos last = POS_MIN;
+	u64 nr = 0;
+
+	int ret = for_each_btree_key_max(trans, iter, BTREE_ID_xattrs, start, end,
+					 BTREE_ITER_all_snapshots, k, ({
+		if (!nr || k.k->p.inode != last.inode) {
+			BUG_ON(nr && last.offset != FSCK_SHARD_TEST_KEYS_PER_INODE - 1);
+			BUG_ON(k.k->p.offset);
+		} else {
+			BUG_ON(k.k->p.offset != last.offset + 1);
+		}
+
+		last = k.k->p;
+		nr++;
+		0;
+	}));
+
+	BUG_ON(nr && last.offset != FSCK_SHARD_TEST_KEYS_PER_INODE - 1);
+	atomic64_add(nr, &fsck_shard_test_keys);
+	return ret;
+}
+
+static int delete_fsck_shard_test_keys(struct bch_fs *c)
+{
+	return bch2_btree_delete_range(c, BTREE_ID_xattrs,
+				       SPOS(0, 0, U32_MAX), SPOS_MAX,
+				       0, NULL);
+}
+
+/* Run with enough keys for several leaf nodes, e.g. -n 100k: */
+static int test_fsck_shards(struct bch_fs *c, u64 nr)
+{
+	u64 nr_inodes = max_t(u64, nr / FSCK_SHARD_TEST_KEYS_PER_INODE, 1);
+	unsigned nr_shards = 4, nr_leaves = 0;
+	unsigned fsck_threads = c->opts.fsck_threads;
+	darray_u64 boundaries = {};
+	int ret;
+
+	ret = delete_fsck_shard_test_keys(c);
+	if (ret)
+		return ret;
+
+	pr_info("inserting test keys");
+
+	for (u64 inum = 1; inum <= nr_inodes; inum++)
+		for (u64 i = 0; i < FSCK_SHARD_TEST_KEYS_PER_INODE; i++) {
+			struct bkey_i_cookie ck;
+
+			bkey_cookie_init(&ck.k_i);
+			ck.k.p = SPOS(inum, i, U32_MAX);
+
+			ret = bch2_btree_insert(c, BTREE_ID_xattrs, &ck.k_i, NULL, 0, 0);
+			bch_err_msg(c, ret, "insert error");
+			if (ret)
+				goto err;
+		}
+
+	ret = bch2_trans_run(c,
+		__for_each_btree_node(trans, iter, BTREE_ID_xattrs, POS_MIN,
+				      0, 0, 0, b, ({
+			nr_leaves++;
+			0;
+		})) ?:
+		bch2_fsck_shard_boundaries(trans, BTREE_ID_xattrs, 0,
+					   nr_shards, &boundaries));
+	bch_err_msg(c, ret, "error getting shard boundaries");
+	if (ret)
+		goto err;
+
+	pr_info("%u leaves, %zu boundaries", nr_leaves, boundaries.nr);
+
+	BUG_ON(nr_leaves > 1 && !boundaries.nr);
+	BUG_ON(boundaries.nr >= nr_shards);
+	darray_for_each(boundaries, i)
+		BUG_ON(*i <= (i > boundaries.data ? i[-1] : 0));
+
+	pr_info("checking sharded ranges");
+
+	atomic64_set(&fsck_shard_test_keys, 0);
+	c->opts.fsck_threads = nr_shards;
+	ret = bch2_fsck_sharded(c, BTREE_ID_xattrs, 0, fsck_shard_test_range);
+	c->opts.fsck_threads = fsck_threads;
+	bch_err_msg(c, ret, "error running sharded ranges");
+	if (ret)
+		goto err;
+
+	BUG_ON(atomic64_read(&fsck_shard_test_keys) !=
+	       nr_inodes * FSCK_SHARD_TEST_KEYS_PER_INODE);
+err:
+	darray_exit(&boundaries);
+	return delete_fsck_shard_test_keys(c) ?: ret;
+}
+
 /* perf tests */
 
 static u64 test_rand(void)
@@ -536,12 +640,27 @@ static u64 test_rand(void)
 	return v;
 }
 
-static int rand_insert(struct bch_fs *c, u64 nr)
+/*
+ * Latency of each operation, for the caller of bch2_btree_perf_test(): that's
+ * the time since the previous one, so that it includes any transaction
+ * restarts and commit done by btree iteration macros
+ */
+static inline void perf_test_op_done(struct bch2_time_stats *stats, u64 *start)
+{
+	if (stats) {
+		u64 now = local_clock();
+
+		__bch2_time_stats_update(stats, *start, now);
+		*start = now;
+	}
+}
+
+static int rand_insert(struct bch_fs *c, u64 nr, struct bch2_time_stats *stats)
 {
 	struct btree_trans *trans = bch2_trans_get(c);
 	struct bkey_i_cookie k;
 	int ret = 0;
-	u64 i;
+	u64 i, start = local_clock();
 
 	for (i = 0; i < nr; i++) {
 		bkey_cookie_init(&k.k_i);
@@ -552,19 +671,20 @@ static int rand_insert(struct bch_fs *c, u64 nr)
 			bch2_btree_insert_trans(trans, BTREE_ID_xattrs, &k.k_i, 0));
 		if (ret)
 			break;
+		perf_test_op_done(stats, &start);
 	}
 
 	bch2_trans_put(trans);
 	return ret;
 }
 
-static int rand_insert_multi(struct bch_fs *c, u64 nr)
+static int rand_insert_multi(struct bch_fs *c, u64 nr, struct bch2_time_stats *stats)
 {
 	struct btree_trans *trans = bch2_trans_get(c);
 	struct bkey_i_cookie k[8];
 	int ret = 0;
 	unsigned j;
-	u64 i;
+	u64 i, start = local_clock();
 
 	for (i = 0; i < nr; i += ARRAY_SIZE(k)) {
 		for (j = 0; j < ARRAY_SIZE(k); j++) {
@@ -584,19 +704,20 @@ static int rand_insert_multi(struct bch_fs *c, u64 nr)
 			bch2_btree_insert_trans(trans, BTREE_ID_xattrs, &k[7].k_i, 0));
 		if (ret)
 			break;
+		perf_test_op_done(stats, &start);
 	}
 
 	bch2_trans_put(trans);
 	return ret;
 }
 
-static int rand_lookup(struct bch_fs *c, u64 nr)
+static int rand_lookup(struct bch_fs *c, u64 nr, struct bch2_time_stats *stats)
 {
 	struct btree_trans *trans = bch2_trans_get(c);
 	struct btree_iter iter;
 	struct bkey_s_c k;
 	int ret = 0;
-	u64 i;
+	u64 i, start = local_clock();
 
 	bch2_trans_iter_init(trans, &iter, BTREE_ID_xattrs,
 			     SPOS(0, 0, U32_MAX), 0);
@@ -608,6 +729,7 @@ static int rand_lookup(struct bch_fs *c, u64 nr)
 		ret = bkey_err(k);
 		if (ret)
 			break;
+		perf_test_op_done(stats, &start);
 	}
 
 	bch2_trans_iter_exit(trans, &iter);
@@ -640,13 +762,13 @@ static int rand_mixed_trans(struct btree_trans *trans,
 	return ret;
 }
 
-static int rand_mixed(struct bch_fs *c, u64 nr)
+static int rand_mixed(struct bch_fs *c, u64 nr, struct bch2_time_stats *stats)
 {
 	struct btree_trans *trans = bch2_trans_get(c);
 	struct btree_iter iter;
 	struct bkey_i_cookie cookie;
 	int ret = 0;
-	u64 i, rand;
+	u64 i, rand, start = local_clock();
 
 	bch2_trans_iter_init(trans, &iter, BTREE_ID_xattrs,
 			     SPOS(0, 0, U32_MAX), 0);
@@ -657,6 +779,7 @@ static int rand_mixed(struct bch_fs *c, u64 nr)
 			rand_mixed_trans(trans, &iter, &cookie, i, rand));
 		if (ret)
 			break;
+		perf_test_op_done(stats, &start);
 	}
 
 	bch2_trans_iter_exit(trans, &iter);
@@ -686,11 +809,11 @@ err:
 	return ret;
 }
 
-static int rand_delete(struct bch_fs *c, u64 nr)
+static int rand_delete(struct bch_fs *c, u64 nr, struct bch2_time_stats *stats)
 {
 	struct btree_trans *trans = bch2_trans_get(c);
 	int ret = 0;
-	u64 i;
+	u64 i, start = local_clock();
 
 	for (i = 0; i < nr; i++) {
 		struct bpos pos = SPOS(0, test_rand(), U32_MAX);
@@ -699,15 +822,17 @@ static int rand_delete(struct bch_fs *c, u64 nr)
 			__do_delete(trans, pos));
 		if (ret)
 			break;
+		perf_test_op_done(stats, &start);
 	}
 
 	bch2_trans_put(trans);
 	return ret;
 }
 
-static int seq_insert(struct bch_fs *c, u64 nr)
+static int seq_insert(struct bch_fs *c, u64 nr, struct bch2_time_stats *stats)
 {
 	struct bkey_i_cookie insert;
+	u64 start = local_clock();
 
 	bkey_cookie_init(&insert.k_i);
 
@@ -718,22 +843,29 @@ static int seq_insert(struct bch_fs *c, u64 nr)
 					NULL, NULL, 0, ({
 			if (iter.pos.offset >= nr)
 				break;
+			perf_test_op_done(stats, &start);
 			insert.k.p = iter.pos;
 			bch2_trans_update(trans, &iter, &insert.k_i, 0);
 		})));
 }
 
-static int seq_lookup(struct bch_fs *c, u64 nr)
+static int seq_lookup(struct bch_fs *c, u64 nr, struct bch2_time_stats *stats)
 {
+	u64 start = local_clock();
+
 	return bch2_trans_run(c,
 		for_each_btree_key_max(trans, iter, BTREE_ID_xattrs,
 				  SPOS(0, 0, U32_MAX), POS(0, U64_MAX),
-				  0, k,
-		0));
+				  0, k, ({
+			perf_test_op_done(stats, &start);
+			0;
+		})));
 }
 
-static int seq_overwrite(struct bch_fs *c, u64 nr)
+static int seq_overwrite(struct bch_fs *c, u64 nr, struct bch2_time_stats *stats)
 {
+	u64 start = local_clock();
+
 	return bch2_trans_run(c,
 		for_each_btree_key_commit(trans, iter, BTREE_ID_xattrs,
 					SPOS(0, 0, U32_MAX),
@@ -741,12 +873,14 @@ static int seq_overwrite(struct bch_fs *c, u64 nr)
 					NULL, NULL, 0, ({
 			struct bkey_i_cookie u;
 
+			perf_test_op_done(stats, &start);
 			bkey_reassemble(&u.k_i, k);
 			bch2_trans_update(trans, &iter, &u.k_i, 0);
 		})));
 }
 
-static int seq_delete(struct bch_fs *c, u64 nr)
+/* a single range delete, so there's no per operation latency: */
+static int seq_delete(struct bch_fs *c, u64 nr, struct bch2_time_stats *stats)
 {
 	return bch2_btree_delete_range(c, BTREE_ID_xattrs,
 				      SPOS(0, 0, U32_MAX),
@@ -754,13 +888,17 @@ static int seq_delete(struct bch_fs *c, u64 nr)
 				      0, NULL);
 }
 
-typedef int (*perf_test_fn)(struct bch_fs *, u64);
+typedef int (*unit_test_fn)(struct bch_fs *, u64);
+typedef int (*perf_test_fn)(struct bch_fs *, u64, struct bch2_time_stats *);
 
 struct test_job {
 	struct bch_fs			*c;
+	const char			*name;
 	u64				nr;
 	unsigned			nr_threads;
 	perf_test_fn			fn;
+	unit_test_fn			unit_fn;
+	struct bch2_time_stats		*stats;
 
 	atomic_t			ready;
 	wait_queue_head_t		ready_wait;
@@ -785,9 +923,11 @@ static int btree_perf_test_thread(void *data)
 		wait_event(j->ready_wait, !atomic_read(&j->ready));
 	}
 
-	ret = j->fn(j->c, div64_u64(j->nr, j->nr_threads));
+	ret = j->fn
+		? j->fn(j->c, div64_u64(j->nr, j->nr_threads), j->stats)
+		: j->unit_fn(j->c, div64_u64(j->nr, j->nr_threads));
 	if (ret) {
-		bch_err(j->c, "%ps: error %s", j->fn, bch2_err_str(ret));
+		bch_err(j->c, "%s: error %s", j->name, bch2_err_str(ret));
 		j->ret = ret;
 	}
 
@@ -799,10 +939,21 @@ static int btree_perf_test_thread(void *data)
 	return 0;
 }
 
+/*
+ * @stats, if not NULL, gets the latency of each operation of the perf tests;
+ * unit tests don't update it
+ */
 int bch2_btree_perf_test(struct bch_fs *c, const char *testname,
-			 u64 nr, unsigned nr_threads)
+			 u64 nr, unsigned nr_threads,
+			 struct bch2_time_stats *stats)
 {
-	struct test_job j = { .c = c, .nr = nr, .nr_threads = nr_threads };
+	struct test_job j = {
+		.c		= c,
+		.name		= testname,
+		.nr		= nr,
+		.nr_threads	= nr_threads,
+		.stats		= stats,
+	};
 	char name_buf[20];
 	struct printbuf nr_buf = PRINTBUF;
 	struct printbuf per_sec_buf = PRINTBUF;
@@ -822,6 +973,8 @@ int bch2_btree_perf_test(struct bch_fs *c, const char *testname,
 
 #define perf_test(_test)				\
 	if (!strcmp(testname, #_test)) j.fn = _test
+#define unit_test(_test)				\
+	if (!strcmp(testname, #_test)) j.unit_fn = _test
 
 	perf_test(rand_insert);
 	perf_test(rand_insert_multi);
@@ -835,24 +988,26 @@ int bch2_btree_perf_test(struct bch_fs *c, const char *testname,
 	perf_test(seq_delete);
 
 	/* a unit test, not a perf test: */
-	perf_test(test_delete);
-	perf_test(test_delete_written);
-	perf_test(test_iterate);
-	perf_test(test_iterate_extents);
-	perf_test(test_iterate_slots);
-	perf_test(test_iterate_slots_extents);
-	perf_test(test_peek_end);
-	perf_test(test_peek_end_extents);
-
-	perf_test(test_extent_overwrite_front);
-	perf_test(test_extent_overwrite_back);
-	perf_test(test_extent_overwrite_middle);
-	perf_test(test_extent_overwrite_all);
-	perf_test(test_extent_create_overlapping);
-
-	perf_test(test_snapshots);
-
-	if (!j.fn) {
+	unit_test(test_delete);
+	unit_test(test_delete_written);
+	unit_test(test_iterate);
+	unit_test(test_iterate_extents);
+	unit_test(test_iterate_slots);
+	unit_test(test_iterate_slots_extents);
+	unit_test(test_peek_end);
+	unit_test(test_peek_end_extents);
+
+	unit_test(test_extent_overwrite_front);
+	unit_test(test_extent_overwrite_back);
+	unit_test(test_extent_overwrite_middle);
+	unit_test(test_extent_overwrite_all);
+	unit_test(test_extent_create_overlapping);
+
+	unit_test(test_snapshots);
+
+	unit_test(test_fsck_shards);
+
+	if (!j.fn && !j.unit_fn) {
 		pr_err("unknown test %s", testname);
 		return -EINVAL;
 	}
@@ -3,10 +3,12 @@
 #define _BCACHEFS_TEST_H
 
 struct bch_fs;
+struct bch2_time_stats;
 
 #ifdef CONFIG_BCACHEFS_TESTS
 
-int bch2_btree_perf_test(struct bch_fs *, const char *, u64, unsigned);
+int bch2_btree_perf_test(struct bch_fs *, const char *, u64, unsigned,
+			 struct bch2_time_stats *);
 
 #else
 
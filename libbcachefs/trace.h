@@ -223,6 +223,7 @@ TRACE_EVENT(accounting_mem_insert,
 		  __get_str(acc))
 );
 
+#ifndef NO_BCACHEFS_FS
 /* fs.c: */
 TRACE_EVENT(bch2_sync_fs,
 	TP_PROTO(struct super_block *sb, int wait),
@@ -272,6 +273,7 @@ TRACE_EVENT(bch2_fsync,
 		  (unsigned long) __entry->ino,
 		  (unsigned long) __entry->parent, __entry->datasync)
 );
+#endif /* NO_BCACHEFS_FS */
 
 /* super-io.c: */
 TRACE_EVENT(write_super,
@@ -379,12 +379,8 @@ static inline void pr_name_and_units(struct printbuf *out, const char *name, u64
 
 #define TABSTOP_SIZE 12
 
-void bch2_time_stats_to_text(struct printbuf *out, struct bch2_time_stats *stats)
+static void time_stats_flush_buffers(struct bch2_time_stats *stats)
 {
-	struct quantiles *quantiles = time_stats_to_quantiles(stats);
-	s64 f_mean = 0, d_mean = 0;
-	u64 f_stddev = 0, d_stddev = 0;
-
 	if (stats->buffer) {
 		int cpu;
 
@@ -393,6 +389,15 @@ void bch2_time_stats_to_text(struct printbuf *out, struct bch2_time_stats *stats
 			__bch2_time_stats_clear_buffer(stats, per_cpu_ptr(stats->buffer, cpu));
 		spin_unlock_irq(&stats->lock);
 	}
+}
+
+void bch2_time_stats_to_text(struct printbuf *out, struct bch2_time_stats *stats)
+{
+	struct quantiles *quantiles = time_stats_to_quantiles(stats);
+	s64 f_mean = 0, d_mean = 0;
+	u64 f_stddev = 0, d_stddev = 0;
+
+	time_stats_flush_buffers(stats);
 
 	/*
 	 * avoid divide by zero
@@ -485,6 +490,34 @@ void bch2_time_stats_to_text(struct printbuf *out, struct bch2_time_stats *stats
 	}
 }
 
+/*
+ * For tools: one line of count, total, min and max duration in nanoseconds,
+ * then the quantiles in ascending order if we have them
+ */
+void bch2_time_stats_raw_to_text(struct printbuf *out, struct bch2_time_stats *stats)
+{
+	struct quantiles *quantiles = time_stats_to_quantiles(stats);
+
+	time_stats_flush_buffers(stats);
+
+	prt_printf(out, "%llu %llu %llu %llu",
+		   stats->duration_stats.n,
+		   stats->total_duration,
+		   stats->min_duration,
+		   stats->max_duration);
+
+	if (quantiles) {
+		u64 last_q = 0;
+
+		eytzinger0_for_each(j, NR_QUANTILES) {
+			u64 q = max(quantiles->entries[j].m, last_q);
+			prt_printf(out, " %llu", q);
+			last_q = q;
+		}
+	}
+	prt_newline(out);
+}
+
 /* ratelimit: */
 
 /**
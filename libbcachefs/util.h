@@ -228,6 +228,7 @@ static inline void prt_bdevname(struct printbuf *out, struct block_device *bdev)
 }
 
 void bch2_time_stats_to_text(struct printbuf *, struct bch2_time_stats *);
+void bch2_time_stats_raw_to_text(struct printbuf *, struct bch2_time_stats *);
 
 #define ewma_add(ewma, val, weight)					\
 ({									\
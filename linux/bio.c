@@ -179,13 +179,26 @@ void bio_advance(struct bio *bio, unsigned bytes)
 	bio_advance_iter(bio, &bio->bi_iter, bytes);
 }
 
+/*
+ * Only full size bvec arrays come from the mempool - smaller ones are
+ * kmalloc'd, see bvec_alloc():
+ */
+static void bvec_free(mempool_t *pool, struct bio_vec *bv, unsigned short nr_vecs)
+{
+	BUG_ON(nr_vecs > BIO_MAX_VECS);
+
+	if (nr_vecs == BIO_MAX_VECS)
+		mempool_free(bv, pool);
+	else if (nr_vecs > BIO_INLINE_VECS)
+		kfree(bv);
+}
+
 static void bio_free(struct bio *bio)
 {
 	struct bio_set *bs = bio->bi_pool;
 
 	if (bs) {
-		if (bio->bi_max_vecs > BIO_INLINE_VECS)
-			mempool_free(bio->bi_io_vec, &bs->bvec_pool);
+		bvec_free(&bs->bvec_pool, bio->bi_io_vec, bio->bi_max_vecs);
 
 		mempool_free((void *) bio - bs->front_pad, &bs->bio_pool);
 	} else {
@@ -384,6 +397,9 @@ void bioset_exit(struct bio_set *bs)
 {
 	mempool_exit(&bs->bio_pool);
 	mempool_exit(&bs->bvec_pool);
+	kmem_cache_destroy(bs->bio_slab);
+	kmem_cache_destroy(bs->bvec_slab);
+	bs->bio_slab = bs->bvec_slab = NULL;
 }
 
 int bioset_init(struct bio_set *bs,
@@ -399,10 +415,19 @@ int bioset_init(struct bio_set *bs,
 	else
 		bs->back_pad = 0;
 
-	ret   = mempool_init_kmalloc_pool(&bs->bio_pool, pool_size, bs->front_pad +
-					  sizeof(struct bio) + bs->back_pad) ?:
-		mempool_init_kmalloc_pool(&bs->bvec_pool, pool_size,
-					  sizeof(struct bio_vec) * BIO_MAX_VECS);
+	bs->bio_slab  = kmem_cache_create("bio", bs->front_pad +
+					  sizeof(struct bio) + bs->back_pad,
+					  __alignof__(struct bio), 0, NULL);
+	bs->bvec_slab = kmem_cache_create("biovec",
+					  sizeof(struct bio_vec) * BIO_MAX_VECS,
+					  __alignof__(struct bio_vec), 0, NULL);
+	if (!bs->bio_slab || !bs->bvec_slab) {
+		bioset_exit(bs);
+		return -ENOMEM;
+	}
+
+	ret   = mempool_init_slab_pool(&bs->bio_pool, pool_size, bs->bio_slab) ?:
+		mempool_init_slab_pool(&bs->bvec_pool, pool_size, bs->bvec_slab);
 	if (ret)
 		bioset_exit(bs);
 	return ret;
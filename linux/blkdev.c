@@ -3,12 +3,15 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/uio.h>
 #include <unistd.h>
 
 #include <libaio.h>
+#include <linux/io_uring.h>
 
 #ifdef CONFIG_VALGRIND
 #include <valgrind/memcheck.h>
@@ -27,6 +30,14 @@ struct fops {
 	void (*cleanup)(void);
 	void (*read)(struct bio *bio, struct iovec * iov, unsigned i);
 	void (*write)(struct bio *bio, struct iovec * iov, unsigned i);
+	/*
+	 * Optional: if set, handles REQ_OP_FLUSH, and read/write handle
+	 * REQ_PREFLUSH themselves instead of generic_make_request() doing a
+	 * synchronous fdatasync():
+	 */
+	void (*flush)(struct bio *bio);
+	void (*bdev_open)(struct block_device *bdev);
+	void (*bdev_close)(struct block_device *bdev);
 };
 
 static struct fops *fops;
@@ -41,7 +52,7 @@ void generic_make_request(struct bio *bio)
 	ssize_t ret;
 	unsigned i;
 
-	if (bio->bi_opf & REQ_PREFLUSH) {
+	if ((bio->bi_opf & REQ_PREFLUSH) && !fops->flush) {
 		ret = fdatasync(bio->bi_bdev->bd_fd);
 		if (ret) {
 			fprintf(stderr, "fsync error: %m\n");
@@ -82,6 +93,11 @@ void generic_make_request(struct bio *bio)
 		fops->write(bio, iov, i);
 		break;
 	case REQ_OP_FLUSH:
+		if (fops->flush) {
+			fops->flush(bio);
+			break;
+		}
+
 		ret = fsync(bio->bi_bdev->bd_fd);
 		if (ret)
 			die("fsync error: %m");
@@ -166,6 +182,9 @@ void bdev_fput(struct file *file)
 {
 	struct block_device *bdev = file_bdev(file);
 
+	if (fops->bdev_close)
+		fops->bdev_close(bdev);
+
 	fdatasync(bdev->bd_fd);
 	close(bdev->bd_fd);
 	free(bdev);
@@ -202,6 +221,7 @@ struct file *bdev_file_open_by_path(const char *path, blk_mode_t mode,
 
 	bdev->bd_dev		= xfstat(fd).st_rdev;
 	bdev->bd_fd		= fd;
+	bdev->bd_fixed_file	= -1;
 	bdev->bd_holder		= holder;
 	bdev->bd_disk		= &bdev->__bd_disk;
 	bdev->bd_disk->bdi	= &bdev->bd_disk->__bdi;
@@ -210,6 +230,9 @@ struct file *bdev_file_open_by_path(const char *path, blk_mode_t mode,
 
 	mutex_init(&bdev->bd_holder_lock);
 
+	if (fops->bdev_open)
+		fops->bdev_open(bdev);
+
 	struct file *file = calloc(sizeof(*file), 1);
 	file->f_inode = bdev->bd_inode;
 
@@ -393,15 +416,502 @@ static void aio_write(struct bio *bio, struct iovec * iov, unsigned i)
 	aio_op(bio, iov, i, IO_CMD_PWRITEV);
 }
 
+/*
+ * io_uring backend, driven with raw syscalls so we don't pick up a liburing
+ * dependency:
+ *
+ * Any thread may queue SQEs (under uring.sq_lock) and then enter the kernel to
+ * submit everything pending in the SQ ring, so concurrent submitters get
+ * batched into a single io_uring_enter(). A single completion thread reaps
+ * CQEs in batches.
+ *
+ * REQ_PREFLUSH and REQ_FUA are implemented with linked fdatasync SQEs, so
+ * they're ordered by the kernel and don't block the submitter. The bdev fds
+ * are registered as fixed files when the kernel supports it.
+ *
+ * running_requests counts SQEs in flight; submitters are throttled to
+ * URING_ENTRIES of them so the completion queue (2 * URING_ENTRIES) can't
+ * overflow, and the submission queue always has room. The completion thread
+ * can't wait on itself for slots, so IO submitted from bio_endio() callbacks
+ * is deferred and queued by the completion thread when slots are available.
+ */
+
+#define URING_ENTRIES		256
+#define URING_FIXED_FILES	64
+
+/* Set in user_data for the read/write CQE of a request, vs. linked fsyncs: */
+#define URING_TAG_RW		1UL
+
+struct uring_ring {
+	unsigned		*head;
+	unsigned		*tail;
+	unsigned		mask;
+	unsigned		entries;
+	void			*map;
+	size_t			map_size;
+};
+
+static struct {
+	int			fd;
+	struct uring_ring	sq;
+	struct uring_ring	cq;
+	unsigned		*sq_array;
+	struct io_uring_sqe	*sqes;
+	size_t			sqes_size;
+	struct io_uring_cqe	*cqes;
+
+	struct mutex		sq_lock;
+	bool			fixed_files;
+	struct block_device	*files[URING_FIXED_FILES];
+} uring;
+
+struct uring_req {
+	struct list_head	list;
+	struct bio		*bio;
+	u8			opcode;
+	unsigned		nr_sqes;
+	unsigned		cqes_pending;
+	blk_status_t		status;
+	unsigned		nr_iov;
+	struct iovec		iov[];
+};
+
+static DECLARE_WAIT_QUEUE_HEAD(uring_events_completed);
+static struct task_struct *uring_task = NULL;
+/* Only touched by the completion thread: */
+static LIST_HEAD(uring_deferred);
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit,
+			      unsigned min_complete, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode,
+				 void *arg, unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static int uring_map_ring(struct uring_ring *r, size_t size, off_t offset,
+			  unsigned head, unsigned tail,
+			  unsigned mask, unsigned entries)
+{
+	r->map_size	= size;
+	r->map		= mmap(NULL, size, PROT_READ|PROT_WRITE,
+			       MAP_SHARED|MAP_POPULATE, uring.fd, offset);
+	if (r->map == MAP_FAILED)
+		return -errno;
+
+	r->head		= r->map + head;
+	r->tail		= r->map + tail;
+	r->mask		= *(unsigned *) (r->map + mask);
+	r->entries	= *(unsigned *) (r->map + entries);
+	return 0;
+}
+
+static void uring_unmap(void)
+{
+	if (uring.sqes && uring.sqes != MAP_FAILED)
+		munmap(uring.sqes, uring.sqes_size);
+	if (uring.cq.map && uring.cq.map != MAP_FAILED)
+		munmap(uring.cq.map, uring.cq.map_size);
+	if (uring.sq.map && uring.sq.map != MAP_FAILED)
+		munmap(uring.sq.map, uring.sq.map_size);
+}
+
+/* Returns 0 once everything queued up to @tail has been consumed: */
+static int __uring_submit(unsigned tail)
+{
+	unsigned head;
+
+	while ((int) (tail - (head = smp_load_acquire(uring.sq.head))) > 0) {
+		int ret = sys_io_uring_enter(uring.fd, tail - head, 0, 0);
+
+		if (ret < 0 && errno != EINTR)
+			return -errno;
+	}
+
+	return 0;
+}
+
+static void uring_submit(unsigned tail)
+{
+	int ret;
+
+	wait_event(uring_events_completed,
+		   (ret = __uring_submit(tail)) != -EAGAIN && ret != -EBUSY);
+
+	if (ret)
+		die("io_uring_enter() submit error: %s", strerror(-ret));
+}
+
+static bool uring_get_slots(unsigned nr)
+{
+	int v = atomic_read(&running_requests);
+
+	do {
+		if (v + nr > URING_ENTRIES)
+			return false;
+	} while (!atomic_try_cmpxchg(&running_requests, &v, v + nr));
+
+	return true;
+}
+
+/*
+ * Must hold uring.sq_lock; returns the SQ tail to queue @nr SQEs at.
+ *
+ * SQEs hold their submission slots until they complete, so with everyone
+ * throttled in uring_op() there's always room:
+ */
+static unsigned uring_sq_reserve(unsigned nr)
+{
+	unsigned tail = *uring.sq.tail;
+
+	BUG_ON(tail + nr - smp_load_acquire(uring.sq.head) > uring.sq.entries);
+	return tail;
+}
+
+/* Must hold uring.sq_lock: */
+static struct io_uring_sqe *uring_get_sqe(unsigned *tail,
+					  struct block_device *bdev, u8 opcode)
+{
+	unsigned idx = *tail & uring.sq.mask;
+	struct io_uring_sqe *sqe = &uring.sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+
+	if (bdev && bdev->bd_fixed_file >= 0) {
+		sqe->fd		= bdev->bd_fixed_file;
+		sqe->flags	|= IOSQE_FIXED_FILE;
+	} else {
+		sqe->fd		= bdev ? bdev->bd_fd : -1;
+	}
+
+	uring.sq_array[idx] = idx;
+	(*tail)++;
+	return sqe;
+}
+
+static void uring_fsync_sqe(unsigned *tail, struct bio *bio,
+			    struct uring_req *req, unsigned fsync_flags)
+{
+	struct io_uring_sqe *sqe =
+		uring_get_sqe(tail, bio->bi_bdev, IORING_OP_FSYNC);
+
+	sqe->fsync_flags	= fsync_flags;
+	sqe->user_data		= (unsigned long) req;
+}
+
+/* Queue the SQEs for @req, which must hold its submission slots: */
+static unsigned uring_queue_req(struct uring_req *req)
+{
+	struct bio *bio	= req->bio;
+	bool flush	= req->opcode == IORING_OP_FSYNC;
+	bool preflush	= !flush && (bio->bi_opf & REQ_PREFLUSH);
+	bool fua	= req->opcode == IORING_OP_WRITEV && (bio->bi_opf & REQ_FUA);
+	struct io_uring_sqe *sqe;
+	unsigned tail;
+
+	mutex_lock(&uring.sq_lock);
+	tail = uring_sq_reserve(req->nr_sqes);
+
+	if (preflush) {
+		uring_fsync_sqe(&tail, bio, req, IORING_FSYNC_DATASYNC);
+		uring.sqes[(tail - 1) & uring.sq.mask].flags |= IOSQE_IO_LINK;
+	}
+
+	if (!flush) {
+		sqe = uring_get_sqe(&tail, bio->bi_bdev, req->opcode);
+		sqe->addr	= (unsigned long) req->iov;
+		sqe->len	= req->nr_iov;
+		sqe->off	= bio->bi_iter.bi_sector << 9;
+		sqe->user_data	= (unsigned long) req|URING_TAG_RW;
+		if (fua)
+			sqe->flags |= IOSQE_IO_LINK;
+	}
+
+	if (flush || fua)
+		uring_fsync_sqe(&tail, bio, req, fua ? IORING_FSYNC_DATASYNC : 0);
+
+	smp_store_release(uring.sq.tail, tail);
+	mutex_unlock(&uring.sq_lock);
+
+	return tail;
+}
+
+static void uring_op(struct bio *bio, struct iovec *iov, unsigned nr_iov,
+		     u8 opcode)
+{
+	bool flush	= opcode == IORING_OP_FSYNC;
+	bool preflush	= !flush && (bio->bi_opf & REQ_PREFLUSH);
+	bool fua	= opcode == IORING_OP_WRITEV && (bio->bi_opf & REQ_FUA);
+	struct uring_req *req = xmalloc(sizeof(*req) + sizeof(*iov) * nr_iov);
+
+	req->bio		= bio;
+	req->opcode		= opcode;
+	req->nr_sqes		= 1 + preflush + fua;
+	req->cqes_pending	= req->nr_sqes;
+	req->status		= BLK_STS_OK;
+	req->nr_iov		= nr_iov;
+	memcpy(req->iov, iov, sizeof(*iov) * nr_iov);
+
+	if (current == uring_task) {
+		list_add_tail(&req->list, &uring_deferred);
+		return;
+	}
+
+	wait_event(uring_events_completed, uring_get_slots(req->nr_sqes));
+	uring_submit(uring_queue_req(req));
+}
+
+/*
+ * Queue IO submitted from bio_endio() callbacks, in order, as slots become
+ * available; the completion thread submits it when it next enters the kernel:
+ */
+static void uring_queue_deferred(void)
+{
+	struct uring_req *req, *n;
+
+	list_for_each_entry_safe(req, n, &uring_deferred, list) {
+		if (!uring_get_slots(req->nr_sqes))
+			break;
+
+		list_del(&req->list);
+		uring_queue_req(req);
+	}
+}
+
+static void uring_read(struct bio *bio, struct iovec *iov, unsigned i)
+{
+	uring_op(bio, iov, i, IORING_OP_READV);
+}
+
+static void uring_write(struct bio *bio, struct iovec *iov, unsigned i)
+{
+	uring_op(bio, iov, i, IORING_OP_WRITEV);
+}
+
+static void uring_flush(struct bio *bio)
+{
+	uring_op(bio, NULL, 0, IORING_OP_FSYNC);
+}
+
+static int uring_completion_thread(void *arg)
+{
+	bool stop = false;
+
+	while (!stop) {
+		struct uring_req *done[URING_ENTRIES * 2];
+		unsigned head, tail, nr_cqes = 0, nr_done = 0;
+		/* Also submits whatever uring_queue_deferred() queued: */
+		unsigned to_submit = smp_load_acquire(uring.sq.tail) -
+			smp_load_acquire(uring.sq.head);
+		int ret = sys_io_uring_enter(uring.fd, to_submit, 1,
+					     IORING_ENTER_GETEVENTS);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		/* Out of resources for submitting: reap, and try again */
+		if (ret < 0 && errno != EAGAIN && errno != EBUSY)
+			die("io_uring_enter() error: %m");
+
+		head = *uring.cq.head;
+		tail = smp_load_acquire(uring.cq.tail);
+
+		for (; head != tail && nr_done < ARRAY_SIZE(done); head++) {
+			struct io_uring_cqe *cqe = &uring.cqes[head & uring.cq.mask];
+			unsigned long data = cqe->user_data;
+			struct uring_req *req = (void *) (data & ~URING_TAG_RW);
+
+			/* This should only happen during blkdev_cleanup() */
+			if (!req) {
+				stop = true;
+				continue;
+			}
+
+			nr_cqes++;
+
+			if (cqe->res < 0 ||
+			    ((data & URING_TAG_RW) &&
+			     cqe->res != req->bio->bi_iter.bi_size))
+				req->status = BLK_STS_IOERR;
+
+			if (!--req->cqes_pending)
+				done[nr_done++] = req;
+		}
+
+		/*
+		 * Release the CQ entries and submission slots before calling
+		 * bio_endio(), since endio callbacks may submit more IO:
+		 */
+		smp_store_release(uring.cq.head, head);
+
+		if (nr_cqes) {
+			atomic_sub(nr_cqes, &running_requests);
+			wake_up(&uring_events_completed);
+		}
+
+		for (unsigned i = 0; i < nr_done; i++) {
+			struct uring_req *req = done[i];
+
+			if (req->status)
+				req->bio->bi_status = req->status;
+			bio_endio(req->bio);
+			free(req);
+		}
+
+		uring_queue_deferred();
+
+		BUG_ON(stop && atomic_read(&running_requests) != 0);
+		BUG_ON(stop && !list_empty(&uring_deferred));
+	}
+
+	return 0;
+}
+
+static void uring_bdev_open(struct block_device *bdev)
+{
+	if (!uring.fixed_files)
+		return;
+
+	mutex_lock(&uring.sq_lock);
+	for (unsigned i = 0; i < URING_FIXED_FILES; i++)
+		if (!uring.files[i]) {
+			struct io_uring_files_update up = {
+				.offset	= i,
+				.fds	= (unsigned long) &bdev->bd_fd,
+			};
+
+			if (sys_io_uring_register(uring.fd, IORING_REGISTER_FILES_UPDATE,
+						  &up, 1) == 1) {
+				uring.files[i]		= bdev;
+				bdev->bd_fixed_file	= i;
+			}
+			break;
+		}
+	mutex_unlock(&uring.sq_lock);
+}
+
+static void uring_bdev_close(struct block_device *bdev)
+{
+	int i = bdev->bd_fixed_file, fd = -1;
+
+	if (i < 0)
+		return;
+
+	struct io_uring_files_update up = {
+		.offset	= i,
+		.fds	= (unsigned long) &fd,
+	};
+
+	mutex_lock(&uring.sq_lock);
+	/* The registered file holds a reference, and would keep the device open: */
+	if (sys_io_uring_register(uring.fd, IORING_REGISTER_FILES_UPDATE, &up, 1) != 1)
+		die("io_uring file unregister error: %m");
+
+	uring.files[i]		= NULL;
+	bdev->bd_fixed_file	= -1;
+	mutex_unlock(&uring.sq_lock);
+}
+
+static void uring_init(void)
+{
+	struct io_uring_params p = {};
+	struct task_struct *t;
+	int ret;
+
+	uring.fd = sys_io_uring_setup(URING_ENTRIES, &p);
+	if (uring.fd < 0) {
+		/* ENOSYS, or disabled by sysctl or seccomp: */
+		io_fallback();
+		return;
+	}
+
+	ret =   uring_map_ring(&uring.sq,
+			       p.sq_off.array + p.sq_entries * sizeof(unsigned),
+			       IORING_OFF_SQ_RING,
+			       p.sq_off.head, p.sq_off.tail,
+			       p.sq_off.ring_mask, p.sq_off.ring_entries) ?:
+		uring_map_ring(&uring.cq,
+			       p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe),
+			       IORING_OFF_CQ_RING,
+			       p.cq_off.head, p.cq_off.tail,
+			       p.cq_off.ring_mask, p.cq_off.ring_entries);
+	if (!ret) {
+		uring.sqes_size	= p.sq_entries * sizeof(struct io_uring_sqe);
+		uring.sqes	= mmap(NULL, uring.sqes_size, PROT_READ|PROT_WRITE,
+				       MAP_SHARED|MAP_POPULATE, uring.fd, IORING_OFF_SQES);
+		if (uring.sqes == MAP_FAILED)
+			ret = -errno;
+	}
+
+	if (ret) {
+		uring_unmap();
+		close(uring.fd);
+		io_fallback();
+		return;
+	}
+
+	uring.sq_array	= uring.sq.map + p.sq_off.array;
+	uring.cqes	= uring.cq.map + p.cq_off.cqes;
+	mutex_init(&uring.sq_lock);
+
+	/* Sparse fixed file table, filled in as block devices are opened: */
+	int fds[URING_FIXED_FILES];
+	memset(fds, -1, sizeof(fds));
+	uring.fixed_files = !sys_io_uring_register(uring.fd, IORING_REGISTER_FILES,
+						   fds, URING_FIXED_FILES);
+
+	t = kthread_run(uring_completion_thread, NULL, "uring_completion");
+	BUG_ON(IS_ERR(t));
+
+	uring_task = t;
+}
+
+static void uring_cleanup(void)
+{
+	struct task_struct *p = NULL;
+	unsigned tail;
+	int ret;
+
+	swap(uring_task, p);
+	get_task_struct(p);
+
+	/* Wake up the completion thread with a NOP; NULL user_data signals stop: */
+	mutex_lock(&uring.sq_lock);
+	tail = uring_sq_reserve(1);
+	uring_get_sqe(&tail, NULL, IORING_OP_NOP)->user_data = 0;
+	smp_store_release(uring.sq.tail, tail);
+	mutex_unlock(&uring.sq_lock);
+
+	uring_submit(tail);
+
+	ret = kthread_stop(p);
+	BUG_ON(ret);
+
+	put_task_struct(p);
 
-/* not implemented */
-static void uring_init(void) {
-	io_fallback();
+	uring_unmap();
+	close(uring.fd);
 }
 
 struct fops fops_list[] = {
 	{
 		.init		= uring_init,
+		.cleanup	= uring_cleanup,
+		.read		= uring_read,
+		.write		= uring_write,
+		.flush		= uring_flush,
+		.bdev_open	= uring_bdev_open,
+		.bdev_close	= uring_bdev_close,
 	}, {
 		.init		= aio_init,
 		.cleanup	= aio_cleanup,
@@ -26,21 +26,19 @@
  *   Author: Coly Li <colyli@suse.de>
  */
 
+#include <linux/compiler.h>
+#include <linux/crc64.h>
 #include <linux/module.h>
 #include <linux/types.h>
+#include <asm/unaligned.h>
 #include "crc64table.h"
 
 MODULE_DESCRIPTION("CRC64 calculations");
 MODULE_LICENSE("GPL v2");
 
-/**
- * crc64_be - Calculate bitwise big-endian ECMA-182 CRC64
- * @crc: seed value for computation. 0 or (u64)~0 for a new CRC calculation,
-	or the previous crc64 value if computing incrementally.
- * @p: pointer to buffer over which CRC64 is run
- * @len: length of buffer @p
- */
-u64 __pure crc64_be(u64 crc, const void *p, size_t len)
+#define CRC64_ECMA182_POLY	0x42F0E1EBA9EA3693ULL
+
+static u64 crc64_be_generic(u64 crc, const void *p, size_t len)
 {
 	size_t i, t;
 
@@ -53,4 +51,237 @@ u64 __pure crc64_be(u64 crc, const void *p, size_t len)
 
 	return crc;
 }
+
+/*
+ * Slice-by-8: crc64table_slice[n][b] is the crc of byte b followed by n zero
+ * bytes, so eight input bytes can be folded in with eight independent lookups:
+ */
+static u64 ____cacheline_aligned crc64table_slice[8][256];
+
+static void crc64_slice_tables_init(void)
+{
+	for (unsigned i = 0; i < 256; i++) {
+		crc64table_slice[0][i] = crc64table[i];
+
+		for (unsigned n = 1; n < 8; n++) {
+			u64 c = crc64table_slice[n - 1][i];
+
+			crc64table_slice[n][i] = crc64table[c >> 56] ^ (c << 8);
+		}
+	}
+}
+
+static u64 crc64_be_slice8(u64 crc, const void *p, size_t len)
+{
+	const u64 (*t)[256] = crc64table_slice;
+
+	while (len >= 8) {
+		crc ^= get_unaligned_be64(p);
+		crc =	t[7][(crc >> 56)       ] ^ t[6][(crc >> 48) & 0xff] ^
+			t[5][(crc >> 40) & 0xff] ^ t[4][(crc >> 32) & 0xff] ^
+			t[3][(crc >> 24) & 0xff] ^ t[2][(crc >> 16) & 0xff] ^
+			t[1][(crc >>  8) & 0xff] ^ t[0][(crc      ) & 0xff];
+		p	+= 8;
+		len	-= 8;
+	}
+
+	return crc64_be_generic(crc, p, len);
+}
+
+#ifdef __x86_64__
+
+#include <immintrin.h>
+
+/*
+ * Carry-less multiplication folding, following Intel's "Fast CRC Computation
+ * for Generic Polynomials Using PCLMULQDQ Instruction", for a non-reflected
+ * crc: input is loaded byte reversed, so that each 128 bit lane is the
+ * polynomial of those bytes with the first byte in the high bits.
+ *
+ * Folding constants are x^n mod P, computed at init time:
+ */
+static struct {
+	u64	fold_512[2];	/* x^(512+64), x^512 */
+	u64	fold_384[2];
+	u64	fold_256[2];
+	u64	fold_128[2];
+	u64	mu;		/* floor(x^128 / P), without the x^64 term */
+} crc64_pclmul_consts;
+
+/* x^n mod P */
+static u64 crc64_xpow_mod(unsigned n)
+{
+	u64 r = 1;
+
+	while (n--)
+		r = (r << 1) ^ ((r >> 63) ? CRC64_ECMA182_POLY : 0);
+	return r;
+}
+
+static void crc64_pclmul_init(void)
+{
+	u64 mu = 0, rem = 1;
+
+	crc64_pclmul_consts.fold_512[0] = crc64_xpow_mod(512 + 64);
+	crc64_pclmul_consts.fold_512[1] = crc64_xpow_mod(512);
+	crc64_pclmul_consts.fold_384[0] = crc64_xpow_mod(384 + 64);
+	crc64_pclmul_consts.fold_384[1] = crc64_xpow_mod(384);
+	crc64_pclmul_consts.fold_256[0] = crc64_xpow_mod(256 + 64);
+	crc64_pclmul_consts.fold_256[1] = crc64_xpow_mod(256);
+	crc64_pclmul_consts.fold_128[0] = crc64_xpow_mod(128 + 64);
+	crc64_pclmul_consts.fold_128[1] = crc64_xpow_mod(128);
+
+	/*
+	 * Long division of x^128 by P, one quotient bit at a time: rem holds
+	 * the running remainder of x^(64+i), starting from x^64 mod P:
+	 */
+	rem = CRC64_ECMA182_POLY;
+	for (int i = 63; i >= 0; i--) {
+		bool bit = rem >> 63;
+
+		mu |= (u64) bit << i;
+		rem = (rem << 1) ^ (bit ? CRC64_ECMA182_POLY : 0);
+	}
+	crc64_pclmul_consts.mu = mu;
+}
+
+#define PCLMUL_TARGET __attribute__((target("pclmul,ssse3,sse4.1")))
+
+static inline PCLMUL_TARGET __m128i crc64_fold(__m128i x, __m128i k, __m128i next)
+{
+	/* k: high lane x^(n+64) mod P, low lane x^n mod P */
+	return _mm_xor_si128(next,
+		_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x11),
+			      _mm_clmulepi64_si128(x, k, 0x00)));
+}
+
+static inline PCLMUL_TARGET __m128i crc64_load(const void *p, __m128i bswap)
+{
+	return _mm_shuffle_epi8(_mm_loadu_si128(p), bswap);
+}
+
+static PCLMUL_TARGET u64 crc64_be_pclmul(u64 crc, const void *p, size_t len)
+{
+	if (len < 128)
+		return crc64_be_slice8(crc, p, len);
+
+	const __m128i bswap	= _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+					       8, 9, 10, 11, 12, 13, 14, 15);
+	const __m128i k512	= _mm_set_epi64x(crc64_pclmul_consts.fold_512[0],
+						 crc64_pclmul_consts.fold_512[1]);
+	const __m128i k384	= _mm_set_epi64x(crc64_pclmul_consts.fold_384[0],
+						 crc64_pclmul_consts.fold_384[1]);
+	const __m128i k256	= _mm_set_epi64x(crc64_pclmul_consts.fold_256[0],
+						 crc64_pclmul_consts.fold_256[1]);
+	const __m128i k128	= _mm_set_epi64x(crc64_pclmul_consts.fold_128[0],
+						 crc64_pclmul_consts.fold_128[1]);
+
+	/* The initial crc is xored into the first 64 bits of input: */
+	__m128i x0 = _mm_xor_si128(crc64_load(p +  0, bswap), _mm_set_epi64x(crc, 0));
+	__m128i x1 = crc64_load(p + 16, bswap);
+	__m128i x2 = crc64_load(p + 32, bswap);
+	__m128i x3 = crc64_load(p + 48, bswap);
+
+	p	+= 64;
+	len	-= 64;
+
+	/* Four independent lanes, 64 bytes per iteration: */
+	while (len >= 64) {
+		x0 = crc64_fold(x0, k512, crc64_load(p +  0, bswap));
+		x1 = crc64_fold(x1, k512, crc64_load(p + 16, bswap));
+		x2 = crc64_fold(x2, k512, crc64_load(p + 32, bswap));
+		x3 = crc64_fold(x3, k512, crc64_load(p + 48, bswap));
+		p	+= 64;
+		len	-= 64;
+	}
+
+	x0 = crc64_fold(x0, k384, crc64_fold(x1, k256, crc64_fold(x2, k128, x3)));
+
+	while (len >= 16) {
+		x0 = crc64_fold(x0, k128, crc64_load(p, bswap));
+		p	+= 16;
+		len	-= 16;
+	}
+
+	/*
+	 * crc = x0 * x^64 mod P: fold the high half down to get a 128 bit
+	 * value congruent to it, then Barrett reduce that:
+	 */
+	u64 hi = _mm_extract_epi64(x0, 1);
+	u64 lo = _mm_cvtsi128_si64(x0);
+	__m128i t = _mm_clmulepi64_si128(_mm_cvtsi64_si128(hi), k128, 0x00);
+
+	hi = _mm_extract_epi64(t, 1) ^ lo;
+	lo = _mm_cvtsi128_si64(t);
+
+	/* q = floor(hi * x^64 / P), crc = lo ^ low 64 bits of (q * P): */
+	__m128i q = _mm_clmulepi64_si128(_mm_cvtsi64_si128(hi),
+					 _mm_cvtsi64_si128(crc64_pclmul_consts.mu), 0x00);
+	u64 qv = _mm_extract_epi64(q, 1) ^ hi;
+	__m128i qp = _mm_clmulepi64_si128(_mm_cvtsi64_si128(qv),
+					  _mm_cvtsi64_si128(CRC64_ECMA182_POLY), 0x00);
+
+	crc = lo ^ _mm_cvtsi128_si64(qp);
+
+	return crc64_be_slice8(crc, p, len);
+}
+
+#endif
+
+const struct crc64_impl crc64_be_impls[] = {
+	{ "generic",	crc64_be_generic },
+	{ "slice8",	crc64_be_slice8 },
+#ifdef __x86_64__
+	{ "pclmul",	crc64_be_pclmul },
+#endif
+	{ NULL }
+};
+
+bool crc64_be_impl_supported(const struct crc64_impl *impl)
+{
+#ifdef __x86_64__
+	if (impl->fn == crc64_be_pclmul)
+		return __builtin_cpu_supports("pclmul") &&
+			__builtin_cpu_supports("sse4.1");
+#endif
+	return true;
+}
+
+static void *resolve_crc64_be(void)
+{
+	crc64_slice_tables_init();
+#ifdef __x86_64__
+	crc64_pclmul_init();
+
+	if (__builtin_cpu_supports("pclmul") &&
+	    __builtin_cpu_supports("sse4.1"))
+		return crc64_be_pclmul;
+#endif
+	return crc64_be_slice8;
+}
+
+static u64 (*real_crc64_be)(u64, const void *, size_t);
+
+__attribute__((constructor(110)))
+static void crc64_init(void)
+{
+	__builtin_cpu_init();
+
+	real_crc64_be = resolve_crc64_be();
+}
+
+/**
+ * crc64_be - Calculate bitwise big-endian ECMA-182 CRC64
+ * @crc: seed value for computation. 0 or (u64)~0 for a new CRC calculation,
+	or the previous crc64 value if computing incrementally.
+ * @p: pointer to buffer over which CRC64 is run
+ * @len: length of buffer @p
+ */
+u64 __pure crc64_be(u64 crc, const void *p, size_t len)
+{
+	if (unlikely(!real_crc64_be))
+		return crc64_be_generic(crc, p, len);
+
+	return real_crc64_be(crc, p, len);
+}
 EXPORT_SYMBOL_GPL(crc64_be);
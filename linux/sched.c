@@ -1,4 +1,5 @@
 
+#include <pthread.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/mman.h>
@@ -101,8 +102,7 @@ out:
 	return timeout < 0 ? 0 : timeout;
 }
 
-__attribute__((constructor(101)))
-static void sched_init(void)
+static struct task_struct *alloc_current_task(void)
 {
 	struct task_struct *p = malloc(sizeof(*p));
 
@@ -112,7 +112,45 @@ static void sched_init(void)
 	atomic_set(&p->usage, 1);
 	init_completion(&p->exited);
 
-	current = p;
+	return p;
+}
+
+static pthread_key_t current_task_key;
+
+static void current_task_exit(void *data)
+{
+	struct task_struct *p = data;
+
+	if (atomic_dec_and_test(&p->usage))
+		free(p);
+
+	current = NULL;
+	rcu_unregister_thread();
+}
+
+/*
+ * Threads created by libraries we call into (e.g. libfuse's worker threads)
+ * don't go through kthread_create(): this gives the calling thread a
+ * task_struct, if it doesn't have one yet, so it can call into bcachefs code.
+ * It's freed when the thread exits.
+ */
+void current_task_init(void)
+{
+	if (likely(current))
+		return;
+
+	current = alloc_current_task();
+	pthread_setspecific(current_task_key, current);
+	rcu_register_thread();
+}
+
+__attribute__((constructor(101)))
+static void sched_init(void)
+{
+	current = alloc_current_task();
+
+	int ret = pthread_key_create(&current_task_key, current_task_exit);
+	BUG_ON(ret);
 
 	rcu_init();
 	rcu_register_thread();
@@ -6,6 +6,7 @@
 #include <linux/list.h>
 #include <linux/mm.h>
 #include <linux/mutex.h>
+#include <linux/seq_buf.h>
 #include <linux/shrinker.h>
 
 #include "tools-util.h"
@@ -25,7 +26,16 @@ void shrinker_free(struct shrinker *s)
 
 struct shrinker *shrinker_alloc(unsigned int flags, const char *fmt, ...)
 {
-	return calloc(sizeof(struct shrinker), 1);
+	struct shrinker *s = calloc(sizeof(struct shrinker), 1);
+	va_list args;
+
+	if (s) {
+		va_start(args, fmt);
+		vsnprintf(s->name, sizeof(s->name), fmt, args);
+		va_end(args);
+	}
+
+	return s;
 }
 
 int shrinker_register(struct shrinker *shrinker)
@@ -36,6 +46,22 @@ int shrinker_register(struct shrinker *shrinker)
 	return 0;
 }
 
+void shrinkers_to_text(struct seq_buf *out)
+{
+	struct shrinker *shrinker;
+
+	mutex_lock(&shrinker_lock);
+	list_for_each_entry(shrinker, &shrinker_list, list) {
+		struct shrink_control sc = { .gfp_mask	= GFP_KERNEL, };
+
+		seq_buf_printf(out, "%s objects: %lu\n", shrinker->name,
+			       shrinker->count_objects(shrinker, &sc));
+		if (shrinker->to_text)
+			shrinker->to_text(out, shrinker);
+	}
+	mutex_unlock(&shrinker_lock);
+}
+
 static void run_shrinkers_allocation_failed(gfp_t gfp_mask)
 {
 	struct shrinker *shrinker;
@@ -0,0 +1,477 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * A small slab allocator for kmem_cache, in place of plain malloc:
+ *
+ * Objects are carved out of naturally aligned slabs, so the slab an object
+ * belongs to is found by masking its address. Each thread has a magazine of
+ * free objects per cache, so the common alloc and free paths don't take any
+ * locks; magazines are refilled from and flushed to the slabs in batches,
+ * under the cache lock.
+ *
+ * Empty slabs are kept around up to a limit, and otherwise freed by the
+ * cache's shrinker.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+
+#include <linux/cache.h>
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/log2.h>
+#include <linux/mutex.h>
+#include <linux/seq_buf.h>
+#include <linux/shrinker.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#define SLAB_SIZE_MIN		(64 << 10)
+#define SLAB_SIZE_MAX		(1 << 20)
+#define SLAB_OBJS_MIN		8
+
+/* Objects per thread per cache; refills and flushes move half of that: */
+#define MAGAZINE_SIZE		64
+
+struct slab {
+	struct list_head	list;
+	void			*freelist;
+	unsigned		nr_inuse;
+	/* objects past here have never been allocated: */
+	unsigned		nr_carved;
+};
+
+struct kmem_magazine {
+	struct list_head	list;
+	struct kmem_cache	*cache;
+	unsigned		nr;
+	u64			nr_allocs;
+	u64			nr_frees;
+	void			*objs[MAGAZINE_SIZE];
+};
+
+struct kmem_cache {
+	char			name[32];
+	unsigned		obj_size;
+	unsigned		size;
+	unsigned		offset;
+	/*
+	 * Free objects are linked through a pointer at fp_offset: that's past
+	 * the end of the object if there's a constructor, so as to not
+	 * clobber constructed state:
+	 */
+	unsigned		fp_offset;
+	void			(*ctor)(void *);
+
+	/* 0 if objects are too big for slabs, and come from kmalloc: */
+	size_t			slab_size;
+	unsigned		objs_per_slab;
+
+	struct mutex		lock;
+	struct list_head	slabs_partial;
+	struct list_head	slabs_full;
+	struct list_head	slabs_empty;
+	struct list_head	magazines;
+	pthread_key_t		magazine_key;
+
+	unsigned long		nr_slabs;
+	unsigned long		nr_slabs_empty;
+	unsigned long		nr_objs_inuse;
+	u64			nr_allocs;
+	u64			nr_frees;
+	u64			nr_refills;
+	u64			nr_flushes;
+	u64			nr_slabs_shrunk;
+
+	struct shrinker		*shrinker;
+};
+
+static inline struct slab *obj_to_slab(struct kmem_cache *c, void *obj)
+{
+	return (void *) ((unsigned long) obj & ~(c->slab_size - 1));
+}
+
+static inline void *slab_obj(struct kmem_cache *c, struct slab *s, unsigned i)
+{
+	return (void *) s + c->offset + i * c->size;
+}
+
+static struct slab *slab_alloc(struct kmem_cache *c, gfp_t gfp)
+{
+	struct slab *s;
+	unsigned i;
+
+	for (i = 0; i < 10; i++) {
+		s = aligned_alloc(c->slab_size, c->slab_size);
+		if (s)
+			break;
+
+		run_shrinkers(gfp, true);
+	}
+
+	if (!s)
+		return NULL;
+
+	s->freelist	= NULL;
+	s->nr_inuse	= 0;
+	s->nr_carved	= 0;
+	return s;
+}
+
+static void slab_free(struct kmem_cache *c, struct slab *s)
+{
+	list_del(&s->list);
+	free(s);
+	c->nr_slabs--;
+}
+
+static void *slab_get_obj(struct kmem_cache *c, struct slab *s)
+{
+	void *obj;
+
+	if (s->freelist) {
+		obj = s->freelist;
+		s->freelist = *((void **) (obj + c->fp_offset));
+	} else {
+		obj = slab_obj(c, s, s->nr_carved++);
+		if (c->ctor)
+			c->ctor(obj);
+	}
+
+	s->nr_inuse++;
+	return obj;
+}
+
+static void slab_put_obj(struct kmem_cache *c, struct slab *s, void *obj)
+{
+	*((void **) (obj + c->fp_offset)) = s->freelist;
+	s->freelist = obj;
+
+	if (s->nr_inuse-- == c->objs_per_slab) {
+		list_move(&s->list, &c->slabs_partial);
+	} else if (!s->nr_inuse) {
+		list_move(&s->list, &c->slabs_empty);
+		c->nr_slabs_empty++;
+	}
+}
+
+/* Keep some empty slabs around; the shrinker frees the rest: */
+static unsigned long slabs_empty_max(struct kmem_cache *c)
+{
+	return max(2UL, c->nr_slabs / 8);
+}
+
+static void trim_empty_slabs(struct kmem_cache *c, unsigned long keep)
+{
+	while (c->nr_slabs_empty > keep) {
+		slab_free(c, list_last_entry(&c->slabs_empty, struct slab, list));
+		c->nr_slabs_empty--;
+		c->nr_slabs_shrunk++;
+	}
+}
+
+static void magazine_refill(struct kmem_cache *c, struct kmem_magazine *m,
+			    gfp_t gfp)
+{
+	mutex_lock(&c->lock);
+	c->nr_refills++;
+
+	while (m->nr < MAGAZINE_SIZE / 2) {
+		struct slab *s;
+
+		if (!list_empty(&c->slabs_partial)) {
+			s = list_first_entry(&c->slabs_partial, struct slab, list);
+		} else if (!list_empty(&c->slabs_empty)) {
+			s = list_first_entry(&c->slabs_empty, struct slab, list);
+			list_move(&s->list, &c->slabs_partial);
+			c->nr_slabs_empty--;
+		} else {
+			/* Don't allocate a new slab if we already have some: */
+			if (m->nr)
+				break;
+
+			/*
+			 * Not under c->lock: slab_alloc() may run shrinkers,
+			 * including our own:
+			 */
+			mutex_unlock(&c->lock);
+			s = slab_alloc(c, gfp);
+			mutex_lock(&c->lock);
+			if (!s)
+				break;
+
+			c->nr_slabs++;
+			list_add(&s->list, &c->slabs_partial);
+		}
+
+		while (m->nr < MAGAZINE_SIZE / 2 && s->nr_inuse < c->objs_per_slab)
+			m->objs[m->nr++] = slab_get_obj(c, s);
+
+		if (s->nr_inuse == c->objs_per_slab)
+			list_move(&s->list, &c->slabs_full);
+	}
+
+	c->nr_objs_inuse += m->nr;
+	mutex_unlock(&c->lock);
+}
+
+static void magazine_flush(struct kmem_cache *c, struct kmem_magazine *m,
+			   unsigned nr)
+{
+	mutex_lock(&c->lock);
+	c->nr_flushes++;
+	c->nr_objs_inuse -= nr;
+
+	while (nr--) {
+		void *obj = m->objs[--m->nr];
+
+		slab_put_obj(c, obj_to_slab(c, obj), obj);
+	}
+
+	trim_empty_slabs(c, slabs_empty_max(c));
+	mutex_unlock(&c->lock);
+}
+
+static void magazine_exit(struct kmem_cache *c, struct kmem_magazine *m)
+{
+	magazine_flush(c, m, m->nr);
+
+	mutex_lock(&c->lock);
+	c->nr_allocs	+= m->nr_allocs;
+	c->nr_frees	+= m->nr_frees;
+	list_del(&m->list);
+	mutex_unlock(&c->lock);
+
+	free(m);
+}
+
+/* pthread key destructor, on thread exit: */
+static void magazine_destructor(void *p)
+{
+	struct kmem_magazine *m = p;
+
+	magazine_exit(m->cache, m);
+}
+
+static struct kmem_magazine *magazine_get(struct kmem_cache *c)
+{
+	struct kmem_magazine *m = pthread_getspecific(c->magazine_key);
+
+	if (likely(m))
+		return m;
+
+	m = calloc(1, sizeof(*m));
+	if (!m)
+		return NULL;
+
+	m->cache = c;
+
+	mutex_lock(&c->lock);
+	list_add(&m->list, &c->magazines);
+	mutex_unlock(&c->lock);
+
+	pthread_setspecific(c->magazine_key, m);
+	return m;
+}
+
+void *kmem_cache_alloc(struct kmem_cache *c, gfp_t gfp)
+{
+	struct kmem_magazine *m;
+	void *p;
+
+	if (!c->slab_size)
+		return kmalloc(c->obj_size, gfp);
+
+	m = magazine_get(c);
+	if (unlikely(!m))
+		return NULL;
+
+	if (unlikely(!m->nr))
+		magazine_refill(c, m, gfp);
+	if (unlikely(!m->nr))
+		return NULL;
+
+	p = m->objs[--m->nr];
+	m->nr_allocs++;
+
+	if (gfp & __GFP_ZERO)
+		memset(p, 0, c->obj_size);
+	return p;
+}
+
+void kmem_cache_free(struct kmem_cache *c, void *p)
+{
+	struct kmem_magazine *m;
+
+	if (!p)
+		return;
+
+	if (!c->slab_size) {
+		kfree(p);
+		return;
+	}
+
+	m = magazine_get(c);
+	if (unlikely(!m)) {
+		mutex_lock(&c->lock);
+		c->nr_objs_inuse--;
+		slab_put_obj(c, obj_to_slab(c, p), p);
+		mutex_unlock(&c->lock);
+		return;
+	}
+
+	if (unlikely(m->nr == MAGAZINE_SIZE))
+		magazine_flush(c, m, MAGAZINE_SIZE / 2);
+
+	m->objs[m->nr++] = p;
+	m->nr_frees++;
+}
+
+static unsigned long kmem_cache_shrinker_count(struct shrinker *shrink,
+					       struct shrink_control *sc)
+{
+	struct kmem_cache *c = shrink->private_data;
+
+	return READ_ONCE(c->nr_slabs_empty) * c->objs_per_slab;
+}
+
+static unsigned long kmem_cache_shrinker_scan(struct shrinker *shrink,
+					      struct shrink_control *sc)
+{
+	struct kmem_cache *c = shrink->private_data;
+	unsigned long nr_slabs = DIV_ROUND_UP(sc->nr_to_scan, c->objs_per_slab);
+	unsigned long freed;
+
+	mutex_lock(&c->lock);
+	freed = min(nr_slabs, c->nr_slabs_empty);
+	trim_empty_slabs(c, c->nr_slabs_empty - freed);
+	mutex_unlock(&c->lock);
+
+	return freed * c->objs_per_slab;
+}
+
+static void kmem_cache_shrinker_to_text(struct seq_buf *out,
+					struct shrinker *shrink)
+{
+	struct kmem_cache *c = shrink->private_data;
+	struct kmem_magazine *m;
+	u64 nr_allocs, nr_frees;
+
+	mutex_lock(&c->lock);
+	nr_allocs	= c->nr_allocs;
+	nr_frees	= c->nr_frees;
+	list_for_each_entry(m, &c->magazines, list) {
+		/* racy, but these are just statistics: */
+		nr_allocs	+= READ_ONCE(m->nr_allocs);
+		nr_frees	+= READ_ONCE(m->nr_frees);
+	}
+
+	seq_buf_printf(out, "object size:\t%u (%u)\n",	c->obj_size, c->size);
+	seq_buf_printf(out, "slab size:\t%zu (%u objects)\n",
+		       c->slab_size, c->objs_per_slab);
+	seq_buf_printf(out, "slabs:\t\t%lu\n",		c->nr_slabs);
+	seq_buf_printf(out, "slabs empty:\t%lu\n",	c->nr_slabs_empty);
+	seq_buf_printf(out, "slabs shrunk:\t%llu\n",	c->nr_slabs_shrunk);
+	seq_buf_printf(out, "objects in use:\t%lu\n",	c->nr_objs_inuse);
+	seq_buf_printf(out, "allocs:\t\t%llu\n",	nr_allocs);
+	seq_buf_printf(out, "frees:\t\t%llu\n",		nr_frees);
+	seq_buf_printf(out, "refills:\t%llu\n",		c->nr_refills);
+	seq_buf_printf(out, "flushes:\t%llu\n",		c->nr_flushes);
+	mutex_unlock(&c->lock);
+}
+
+struct kmem_cache *kmem_cache_create(const char *name, unsigned int size,
+				     unsigned int align, slab_flags_t flags,
+				     void (*ctor)(void *))
+{
+	struct kmem_cache *c = kzalloc(sizeof(*c), GFP_KERNEL);
+	if (!c)
+		return NULL;
+
+	strscpy(c->name, name, sizeof(c->name));
+	c->obj_size	= size;
+	c->ctor		= ctor;
+
+	align = max_t(unsigned, align, ARCH_SLAB_MINALIGN);
+	if (flags & SLAB_HWCACHE_ALIGN)
+		align = max_t(unsigned, align, L1_CACHE_BYTES);
+	align = roundup_pow_of_two(align);
+
+	c->fp_offset	= ctor ? round_up(size, sizeof(void *)) : 0;
+	c->size		= round_up(max_t(unsigned, size, c->fp_offset + sizeof(void *)), align);
+	c->offset	= round_up(sizeof(struct slab), align);
+	c->slab_size	= roundup_pow_of_two(max_t(size_t, SLAB_SIZE_MIN,
+						   c->offset + c->size * SLAB_OBJS_MIN));
+	if (c->slab_size > SLAB_SIZE_MAX) {
+		c->slab_size = 0;
+		return c;
+	}
+
+	c->objs_per_slab = (c->slab_size - c->offset) / c->size;
+
+	mutex_init(&c->lock);
+	INIT_LIST_HEAD(&c->slabs_partial);
+	INIT_LIST_HEAD(&c->slabs_full);
+	INIT_LIST_HEAD(&c->slabs_empty);
+	INIT_LIST_HEAD(&c->magazines);
+
+	if (pthread_key_create(&c->magazine_key, magazine_destructor))
+		goto err;
+
+	c->shrinker = shrinker_alloc(0, "kmem_cache-%s", c->name);
+	if (!c->shrinker)
+		goto err_key;
+
+	c->shrinker->count_objects	= kmem_cache_shrinker_count;
+	c->shrinker->scan_objects	= kmem_cache_shrinker_scan;
+	c->shrinker->to_text		= kmem_cache_shrinker_to_text;
+	c->shrinker->private_data	= c;
+	shrinker_register(c->shrinker);
+
+	return c;
+err_key:
+	pthread_key_delete(c->magazine_key);
+err:
+	kfree(c);
+	return NULL;
+}
+
+void kmem_cache_destroy(struct kmem_cache *c)
+{
+	struct kmem_magazine *m, *n;
+	struct slab *s, *n2;
+
+	if (!c)
+		return;
+
+	if (!c->slab_size) {
+		kfree(c);
+		return;
+	}
+
+	shrinker_free(c->shrinker);
+
+	/*
+	 * All objects must have been freed, but they may still be in other
+	 * threads' magazines:
+	 */
+	pthread_key_delete(c->magazine_key);
+	list_for_each_entry_safe(m, n, &c->magazines, list) {
+		if (m->nr)
+			magazine_flush(c, m, m->nr);
+		list_del(&m->list);
+		free(m);
+	}
+
+	if (c->nr_objs_inuse)
+		fprintf(stderr, "kmem_cache %s: %lu objects still in use at destroy\n",
+			c->name, c->nr_objs_inuse);
+
+	list_for_each_entry_safe(s, n2, &c->slabs_empty, list)
+		slab_free(c, s);
+	list_for_each_entry_safe(s, n2, &c->slabs_partial, list)
+		slab_free(c, s);
+	list_for_each_entry_safe(s, n2, &c->slabs_full, list)
+		slab_free(c, s);
+
+	kfree(c);
+}
@@ -0,0 +1,382 @@
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <linux/kobject.h>
+#include <linux/kthread.h>
+#include <linux/mutex.h>
+#include <linux/page.h>
+#include <linux/sysfs.h>
+#include <linux/wait.h>
+
+/*
+ * Userspace sysfs: the kobject tree, and a thread serving it read-only to
+ * `bcachefs sysfs` - see <linux/sysfs.h> for the protocol.
+ *
+ * The tree is always built, but only served by long running commands that ask
+ * for it with sysfs_server_enable(), or if $BCACHEFS_SYSFS is set.
+ *
+ * sysfs_lock protects the tree. It's not held across ->show(), which may take
+ * locks held around kobject_del(): instead the server takes a reference on the
+ * kobject, and kobject_del() waits for ->show() calls in progress, as kernfs
+ * active references ensure in the kernel.
+ */
+
+static LIST_HEAD(sysfs_root);
+static DEFINE_MUTEX(sysfs_lock);
+static DECLARE_WAIT_QUEUE_HEAD(sysfs_show_wait);
+static bool sysfs_server_enabled;
+static bool sysfs_server_started;
+
+static void sysfs_server_start(void);
+
+/*
+ * vsnprintf doesn't know %pU, the only kernel format extension used for
+ * kobject names:
+ */
+static char *kobject_name_vargs(const char *fmt, va_list args)
+{
+	char *name;
+
+	if (!strcmp(fmt, "%pU")) {
+		const u8 *uuid = va_arg(args, const u8 *);
+		char *p = name = malloc(37);
+
+		for (unsigned i = 0; i < 16; i++)
+			p += sprintf(p, "%s%02x",
+				     i == 4 || i == 6 || i == 8 || i == 10 ? "-" : "",
+				     uuid[i]);
+		return name;
+	}
+
+	return vasprintf(&name, fmt, args) < 0 ? NULL : name;
+}
+
+int kobject_add(struct kobject *kobj, struct kobject *parent, const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	kobj->name = kobject_name_vargs(fmt, args);
+	va_end(args);
+
+	if (!kobj->name)
+		return -ENOMEM;
+
+	kobj->parent = parent ? kobject_get(parent) : NULL;
+
+	mutex_lock(&sysfs_lock);
+	list_add_tail(&kobj->entry, parent ? &parent->children : &sysfs_root);
+	kobj->state_in_sysfs = 1;
+
+	bool start_server = sysfs_server_enabled && !sysfs_server_started;
+	sysfs_server_started |= start_server;
+	mutex_unlock(&sysfs_lock);
+
+	if (start_server)
+		sysfs_server_start();
+	return 0;
+}
+
+void sysfs_server_enable(void)
+{
+	mutex_lock(&sysfs_lock);
+	sysfs_server_enabled = true;
+
+	bool start_server = !sysfs_server_started && !list_empty(&sysfs_root);
+	sysfs_server_started |= start_server;
+	mutex_unlock(&sysfs_lock);
+
+	if (start_server)
+		sysfs_server_start();
+}
+
+__attribute__((constructor))
+static void sysfs_server_enable_env(void)
+{
+	sysfs_server_enabled = getenv("BCACHEFS_SYSFS") != NULL;
+}
+
+void kobject_del(struct kobject *kobj)
+{
+	if (!kobj)
+		return;
+
+	mutex_lock(&sysfs_lock);
+	list_del_init(&kobj->entry);
+	kobj->state_in_sysfs = 0;
+	mutex_unlock(&sysfs_lock);
+
+	/* Unreachable now, so no new ->show() calls can start: */
+	wait_event(sysfs_show_wait, !atomic_read(&kobj->sysfs_active));
+
+	free((void *) kobj->name);
+	free(kobj->attrs);
+	kobj->name	= NULL;
+	kobj->attrs	= NULL;
+	kobj->nr_attrs	= 0;
+
+	kobject_put(kobj->parent);
+	kobj->parent = NULL;
+}
+
+int sysfs_create_file(struct kobject *kobj, const struct attribute *attr)
+{
+	int ret = 0;
+
+	mutex_lock(&sysfs_lock);
+	const struct attribute **attrs =
+		realloc(kobj->attrs, sizeof(attrs[0]) * (kobj->nr_attrs + 1));
+	if (attrs) {
+		attrs[kobj->nr_attrs++] = attr;
+		kobj->attrs = attrs;
+	} else {
+		ret = -ENOMEM;
+	}
+	mutex_unlock(&sysfs_lock);
+
+	return ret;
+}
+
+void sysfs_remove_file(struct kobject *kobj, const struct attribute *attr)
+{
+	mutex_lock(&sysfs_lock);
+	for (unsigned i = 0; i < kobj->nr_attrs; i++)
+		if (kobj->attrs[i] == attr) {
+			memmove(&kobj->attrs[i], &kobj->attrs[i + 1],
+				sizeof(kobj->attrs[0]) * (kobj->nr_attrs - i - 1));
+			kobj->nr_attrs--;
+			break;
+		}
+	mutex_unlock(&sysfs_lock);
+}
+
+/* Server: */
+
+#define for_each_kobject_attr(_kobj, _attr, _fn)			\
+do {									\
+	const struct attribute_group **_g = (_kobj)->ktype		\
+		? (_kobj)->ktype->default_groups : NULL;		\
+									\
+	for (; _g && *_g; _g++)						\
+		for (struct attribute **_a = (*_g)->attrs; *_a; _a++) {	\
+			_attr = *_a;					\
+			_fn;						\
+		}							\
+									\
+	for (unsigned _i = 0; _i < (_kobj)->nr_attrs; _i++) {		\
+		_attr = (_kobj)->attrs[_i];				\
+		_fn;							\
+	}								\
+} while (0)
+
+static struct kobject *sysfs_child(struct list_head *children, const char *name)
+{
+	struct kobject *k;
+
+	list_for_each_entry(k, children, entry)
+		if (!strcmp(k->name, name))
+			return k;
+	return NULL;
+}
+
+static const struct attribute *sysfs_attr(struct kobject *kobj, const char *name)
+{
+	const struct attribute *attr;
+
+	for_each_kobject_attr(kobj, attr,
+		if (!strcmp(attr->name, name))
+			return attr);
+	return NULL;
+}
+
+static int sysfs_show(FILE *f, struct kobject *kobj, const struct attribute *attr)
+{
+	if (!(attr->mode & 0444) ||
+	    !kobj->ktype->sysfs_ops ||
+	    !kobj->ktype->sysfs_ops->show)
+		return -EACCES;
+
+	char *buf = calloc(1, PAGE_SIZE);
+	if (!buf)
+		return -ENOMEM;
+
+	ssize_t ret = kobj->ktype->sysfs_ops->show(kobj, (struct attribute *) attr, buf);
+	if (ret >= 0) {
+		fputs("file\n", f);
+		fwrite(buf, 1, ret, f);
+	}
+
+	free(buf);
+	return ret < 0 ? ret : 0;
+}
+
+/*
+ * Called with sysfs_lock held: lists a directory, or returns the attribute to
+ * show in @attrp, with a reference on its kobject:
+ */
+static int sysfs_request(FILE *f, char *path, struct kobject **kobjp,
+			 const struct attribute **attrp)
+{
+	struct list_head *dir = &sysfs_root;
+	struct kobject *kobj = NULL;
+	char *name;
+
+	while ((name = strsep(&path, "/"))) {
+		if (!*name)
+			continue;
+
+		struct kobject *child = sysfs_child(dir, name);
+		if (child) {
+			kobj = child;
+			dir = &kobj->children;
+			continue;
+		}
+
+		const struct attribute *attr = kobj && (!path || !*path)
+			? sysfs_attr(kobj, name)
+			: NULL;
+		if (!attr)
+			return -ENOENT;
+
+		*kobjp = kobject_get(kobj);
+		*attrp = attr;
+		atomic_inc(&kobj->sysfs_active);
+		return 0;
+	}
+
+	fputs("dir\n", f);
+
+	struct kobject *k;
+	list_for_each_entry(k, dir, entry)
+		fprintf(f, "%s/\n", k->name);
+
+	if (kobj) {
+		const struct attribute *attr;
+
+		for_each_kobject_attr(kobj, attr,
+			if (attr->mode & 0444)
+				fprintf(f, "%s\n", attr->name));
+	}
+
+	return 0;
+}
+
+static void sysfs_serve(int fd)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) ||
+	    (cred.uid && cred.uid != geteuid()))
+		return;
+
+	/* Don't let a stuck client wedge the server: */
+	struct timeval tv = { .tv_sec = 1 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	char path[PATH_MAX];
+	size_t bytes = 0;
+
+	while (bytes < sizeof(path) - 1) {
+		ssize_t r = read(fd, path + bytes, sizeof(path) - 1 - bytes);
+		if (r <= 0)
+			break;
+		bytes += r;
+		if (memchr(path, '\n', bytes))
+			break;
+	}
+	path[bytes] = '\0';
+
+	char *nl = strchr(path, '\n');
+	if (!nl)
+		return;
+	*nl = '\0';
+
+	char *reply = NULL;
+	size_t reply_len = 0;
+	FILE *f = open_memstream(&reply, &reply_len);
+	if (!f)
+		return;
+
+	struct kobject *kobj = NULL;
+	const struct attribute *attr = NULL;
+
+	mutex_lock(&sysfs_lock);
+	int ret = sysfs_request(f, path, &kobj, &attr);
+	mutex_unlock(&sysfs_lock);
+
+	if (attr) {
+		ret = sysfs_show(f, kobj, attr);
+
+		/* Before the put, which may end up in kobject_del(): */
+		if (atomic_dec_and_test(&kobj->sysfs_active))
+			wake_up_all(&sysfs_show_wait);
+		kobject_put(kobj);
+	}
+
+	/* sysfs_request() doesn't output anything on error: */
+	if (ret)
+		fprintf(f, "error %i\n", -ret);
+	fclose(f);
+
+	for (char *p = reply, *end = reply + reply_len; p < end;) {
+		ssize_t r = write(fd, p, end - p);
+		if (r <= 0)
+			break;
+		p += r;
+	}
+
+	free(reply);
+}
+
+static int sysfs_server_thread(void *arg)
+{
+	int sock = (long) arg;
+
+	while (1) {
+		int fd = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			fprintf(stderr, "sysfs: accept error: %m\n");
+			break;
+		}
+
+		sysfs_serve(fd);
+		close(fd);
+	}
+
+	close(sock);
+	return 0;
+}
+
+/*
+ * Failing to start the server isn't worth reporting: the filesystem works
+ * without it, and `bcachefs sysfs` just won't list us:
+ */
+static void sysfs_server_start(void)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	/* Abstract namespace: leading nul, and nothing to clean up on exit */
+	int len = snprintf(addr.sun_path + 1, sizeof(addr.sun_path) - 1,
+			   SYSFS_SOCKET_FMT, getpid());
+
+	int sock = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		return;
+
+	if (bind(sock, (struct sockaddr *) &addr,
+		 offsetof(struct sockaddr_un, sun_path) + 1 + len) ||
+	    listen(sock, 8) ||
+	    IS_ERR(kthread_run(sysfs_server_thread, (void *) (long) sock, "bch-sysfs")))
+		close(sock);
+}
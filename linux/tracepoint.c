@@ -0,0 +1,333 @@
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <linux/jiffies.h>
+#include <linux/log2.h>
+#include <linux/trace_events.h>
+
+#include "tools-util.h"
+
+/*
+ * Userspace tracing backend: events register themselves at startup (see
+ * <trace/define_trace.h>), then if $BCACHEFS_TRACE is set we create the shared
+ * memory trace area described in <linux/trace_events.h>, enable the events it
+ * lists and point every tracepoint's enabled flag into it.
+ *
+ * Environment:
+ *   BCACHEFS_TRACE	comma separated list of events to enable at startup,
+ *			as globs matched against "name" or "system:name" - may
+ *			be empty, to leave it all to `bcachefs trace`
+ *   BCACHEFS_TRACE_BUF	size of each thread's ring, default 1M
+ *   BCACHEFS_TRACE_SHM	name of the shared memory object; set by `bcachefs
+ *			trace` when it starts the command itself, and then owned
+ *			(unlinked) by it
+ */
+
+#define TRACE_RINGS		128
+#define TRACE_RING_SIZE		(1U << 20)
+
+/* Thread couldn't get a ring: */
+#define TRACE_RING_NONE		((struct trace_ring *) 1)
+
+const u8 tracepoint_off;
+
+struct tracepoint *tracepoints;
+static struct tracepoint **tracepoints_tail = &tracepoints;
+static unsigned nr_tracepoints;
+
+struct trace_shm *trace_shm;
+static char trace_shm_name[64];
+static bool trace_shm_owned;
+
+static pthread_key_t trace_ring_key;
+static __thread struct trace_ring *trace_ring;
+static __thread u64 trace_ring_next;
+static __thread u32 trace_tid;
+
+void tracepoint_register(struct tracepoint *tp)
+{
+	tp->id = nr_tracepoints++;
+
+	*tracepoints_tail = tp;
+	tracepoints_tail = &tp->next;
+}
+
+struct tracepoint *tracepoint_find(const char *system, const char *name)
+{
+	for_each_tracepoint(tp)
+		if (!strcmp(tp->system, system) &&
+		    !strcmp(tp->name, name))
+			return tp;
+	return NULL;
+}
+
+bool trace_event_match(const char *system, const char *name, const char *patterns)
+{
+	char *p = strdup(patterns), *s = p, *pattern;
+	bool ret = false;
+
+	while (!ret && (pattern = strsep(&s, ","))) {
+		char *n = strchr(pattern, ':');
+
+		if (n) {
+			*n++ = '\0';
+			ret = !fnmatch(pattern, system, 0) && !fnmatch(n, name, 0);
+		} else {
+			ret = *pattern && !fnmatch(pattern, name, 0);
+		}
+	}
+
+	free(p);
+	return ret;
+}
+
+/* Recording: */
+
+/* sched_clock() is CLOCK_MONOTONIC_COARSE, too coarse to order events by: */
+static inline u64 trace_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64) ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static void trace_ring_release(void *p)
+{
+	struct trace_ring *ring = p;
+
+	smp_store_release(&ring->pid, 0);
+}
+
+static noinline struct trace_ring *trace_ring_get(void)
+{
+	u32 tid = gettid();
+
+	for (unsigned i = 0; i < trace_shm->nr_rings; i++) {
+		struct trace_ring *ring = trace_shm_ring(trace_shm, i);
+
+		if (!READ_ONCE(ring->pid) &&
+		    !cmpxchg(&ring->pid, 0, tid)) {
+			trace_tid = tid;
+			pthread_setspecific(trace_ring_key, ring);
+			return ring;
+		}
+	}
+
+	return TRACE_RING_NONE;
+}
+
+void *trace_event_reserve(struct tracepoint *tp, size_t size)
+{
+	if (unlikely(!trace_ring))
+		trace_ring = trace_ring_get();
+
+	struct trace_ring *ring = trace_ring;
+	if (unlikely(ring == TRACE_RING_NONE)) {
+		atomic64_inc(&trace_shm->lost);
+		return NULL;
+	}
+
+	u64 ring_size	= trace_shm->ring_size;
+	u64 head	= ring->head;
+	u64 offset	= head & (ring_size - 1);
+	u64 pad		= 0;
+
+	size = round_up(size, 8);
+	if (offset + size > ring_size)
+		pad = ring_size - offset;
+
+	if (head + pad + size - smp_load_acquire(&ring->tail) > ring_size) {
+		WRITE_ONCE(ring->lost, ring->lost + 1);
+		return NULL;
+	}
+
+	if (pad) {
+		struct trace_entry *e = (void *) ring->data + offset;
+
+		e->size	= pad;
+		e->type	= TRACE_ENTRY_PAD;
+		offset	= 0;
+	}
+
+	struct trace_entry *e = (void *) ring->data + offset;
+
+	e->size	= size;
+	e->type	= tp->id;
+	e->pid	= trace_tid;
+	e->time	= trace_clock();
+
+	trace_ring_next = head + pad + size;
+	return e;
+}
+
+void trace_event_commit(struct trace_entry *e)
+{
+	smp_store_release(&trace_ring->head, trace_ring_next);
+}
+
+/* Printing: */
+
+/*
+ * Kernel format strings use %p extensions (%pS and friends) that vsnprintf
+ * doesn't know, and would print as a trailing character; strip them:
+ */
+void trace_prt_printf(struct printbuf *out, const char *fmt, ...)
+{
+	char *f = strdup(fmt), *d = f;
+	const char *s = fmt;
+
+	while (*s) {
+		if (*s != '%') {
+			*d++ = *s++;
+			continue;
+		}
+
+		*d++ = *s++;
+		while (*s && strchr("-+ #0123456789.*hlzjtL", *s))
+			*d++ = *s++;
+		if (!*s)
+			break;
+		if ((*d++ = *s++) == 'p')
+			while (isalnum(*s))
+				s++;
+	}
+	*d = '\0';
+
+	va_list args;
+	va_start(args, fmt);
+	prt_vprintf(out, f, args);
+	va_end(args);
+
+	free(f);
+}
+
+static __thread char trace_print_bufs[4][128];
+static __thread unsigned trace_print_idx;
+
+const char *trace_print_flags(unsigned long flags, const char *delim,
+			      const struct trace_print_flags *f)
+{
+	char *buf = trace_print_bufs[trace_print_idx++ & 3];
+	size_t size = sizeof(trace_print_bufs[0]), n = 0;
+
+	*buf = '\0';
+	for (; f->name; f++)
+		if (f->mask && (flags & f->mask) == f->mask) {
+			n += scnprintf(buf + n, size - n, "%s%s", n ? delim : "", f->name);
+			flags &= ~f->mask;
+		}
+
+	if (flags)
+		scnprintf(buf + n, size - n, "%s0x%lx", n ? delim : "", flags);
+	return buf;
+}
+
+const char *trace_print_symbolic(unsigned long v,
+				 const struct trace_print_flags *f)
+{
+	char *buf = trace_print_bufs[trace_print_idx++ & 3];
+
+	for (; f->name; f++)
+		if (f->mask == v)
+			return f->name;
+
+	scnprintf(buf, sizeof(trace_print_bufs[0]), "0x%lx", v);
+	return buf;
+}
+
+/* Setup: */
+
+__attribute__((constructor(105)))
+static void trace_init(void)
+{
+	const char *events = getenv("BCACHEFS_TRACE");
+	const char *bufsize = getenv("BCACHEFS_TRACE_BUF");
+	const char *name = getenv("BCACHEFS_TRACE_SHM");
+	u64 ring_size = TRACE_RING_SIZE;
+
+	if (!events)
+		return;
+
+	if (bufsize && bch2_strtoull_h(bufsize, &ring_size))
+		die("invalid BCACHEFS_TRACE_BUF %s", bufsize);
+	ring_size = roundup_pow_of_two(clamp_t(u64, ring_size, PAGE_SIZE, 1ULL << 30));
+
+	if (name) {
+		strscpy(trace_shm_name, name, sizeof(trace_shm_name));
+	} else {
+		snprintf(trace_shm_name, sizeof(trace_shm_name),
+			 "/bcachefs-trace.%u", getpid());
+		trace_shm_owned = true;
+	}
+
+	u64 events_offset	= round_up(sizeof(struct trace_shm), 64);
+	u64 enabled_offset	= events_offset +
+		sizeof(struct trace_shm_event) * nr_tracepoints;
+	u64 rings_offset	= round_up(enabled_offset + nr_tracepoints, PAGE_SIZE);
+	u64 size		= rings_offset +
+		(sizeof(struct trace_ring) + ring_size) * TRACE_RINGS;
+
+	/*
+	 * The name has our pid, or that of the `bcachefs trace` that started
+	 * us: if it exists, it was left by a process that crashed and had the
+	 * same pid:
+	 */
+	shm_unlink(trace_shm_name);
+
+	int fd = shm_open(trace_shm_name, O_RDWR|O_CREAT|O_EXCL, 0600);
+	if (fd < 0)
+		die("error creating trace buffer %s: %m", trace_shm_name);
+
+	if (ftruncate(fd, size))
+		die("error sizing trace buffer %s: %m", trace_shm_name);
+
+	struct trace_shm *shm = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (shm == MAP_FAILED)
+		die("error mapping trace buffer %s: %m", trace_shm_name);
+	close(fd);
+
+	int ret = pthread_key_create(&trace_ring_key, trace_ring_release);
+	BUG_ON(ret);
+
+	shm->version		= TRACE_SHM_VERSION;
+	shm->pid		= getpid();
+	shm->nr_events		= nr_tracepoints;
+	shm->nr_rings		= TRACE_RINGS;
+	shm->ring_size		= ring_size;
+	shm->events_offset	= events_offset;
+	shm->enabled_offset	= enabled_offset;
+	shm->rings_offset	= rings_offset;
+	shm->size		= size;
+
+	struct trace_shm_event *e = trace_shm_events(shm);
+	u8 *enabled = trace_shm_enabled(shm);
+
+	for_each_tracepoint(tp) {
+		strscpy(e[tp->id].system, tp->system, sizeof(e->system));
+		strscpy(e[tp->id].name, tp->name, sizeof(e->name));
+		e[tp->id].entry_size = tp->entry_size;
+
+		enabled[tp->id] = trace_event_match(tp->system, tp->name, events);
+		tp->enabled = &enabled[tp->id];
+	}
+
+	trace_shm = shm;
+	smp_store_release(&shm->magic, TRACE_SHM_MAGIC);
+}
+
+__attribute__((destructor(105)))
+static void trace_exit(void)
+{
+	if (trace_shm && trace_shm_owned)
+		shm_unlink(trace_shm_name);
+}
+
+#define CREATE_TRACE_POINTS
+#include <trace/events/lock.h>
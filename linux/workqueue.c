@@ -1,20 +1,53 @@
 #include <pthread.h>
+#include <sched.h>
+#include <sys/sysinfo.h>
 
 #include <linux/kthread.h>
 #include <linux/slab.h>
 #include <linux/workqueue.h>
 
-static pthread_mutex_t	wq_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t	work_finished = PTHREAD_COND_INITIALIZER;
-static LIST_HEAD(wq_list);
+/*
+ * Each workqueue has its own lock and a pool of worker threads, created on
+ * demand up to max_active (so ordered workqueues still run one item at a
+ * time).
+ *
+ * work->data holds the pending bit, and a pointer to the workqueue the work
+ * was last queued on while it's pending or running - that's the lock that
+ * protects work->entry, and where flush and cancel look for it.
+ *
+ * flush_workqueue() only waits for work queued before it was called, as in
+ * the kernel: work is queued with the workqueue's current flush color, and a
+ * flush switches to the other color and waits for the old one to drain.
+ */
+
+struct worker {
+	struct list_head	list;
+	struct workqueue_struct	*wq;
+	struct task_struct	*task;
+	struct work_struct	*current_work;
+	unsigned		current_color;
+	/* work queued while this worker was running it, to run next: */
+	struct list_head	scheduled;
+	bool			idle;
+};
 
 struct workqueue_struct {
-	struct list_head	list;
+	pthread_mutex_t		lock;
+	pthread_cond_t		work_finished;
+	unsigned		flags;
 
-	struct work_struct	*current_work;
 	struct list_head	pending_work;
 
-	struct task_struct	*worker;
+	/* queued or running work, by flush color: */
+	unsigned		nr_in_flight[2];
+	unsigned		work_color;
+	bool			flushing;
+
+	struct list_head	workers;
+	unsigned		nr_workers;
+	unsigned		nr_idle;
+	unsigned		max_workers;
+
 	char			name[24];
 };
 
@@ -22,39 +55,146 @@ enum {
 	WORK_PENDING_BIT,
 };
 
+#define WORK_PENDING		(1UL << WORK_PENDING_BIT)
+
+static inline struct workqueue_struct *work_wq(unsigned long data)
+{
+	return (void *) (data & ~WORK_PENDING);
+}
+
 static bool work_pending(struct work_struct *work)
 {
 	return test_bit(WORK_PENDING_BIT, work_data_bits(work));
 }
 
-static void clear_work_pending(struct work_struct *work)
+/* Set the pending bit, and record the workqueue the work is going on: */
+static bool set_work_pending(struct work_struct *work,
+			     struct workqueue_struct *wq)
 {
-	clear_bit(WORK_PENDING_BIT, work_data_bits(work));
+	long data = atomic_long_read(&work->data);
+
+	do {
+		if (data & WORK_PENDING)
+			return false;
+	} while (!atomic_long_try_cmpxchg(&work->data, &data,
+					  (unsigned long) wq|WORK_PENDING));
+
+	return true;
 }
 
-static bool set_work_pending(struct work_struct *work)
+static struct worker *find_worker_executing_work(struct workqueue_struct *wq,
+						 struct work_struct *work)
 {
-	return !test_and_set_bit(WORK_PENDING_BIT, work_data_bits(work));
+	struct worker *worker;
+
+	list_for_each_entry(worker, &wq->workers, list)
+		if (worker->current_work == work)
+			return worker;
+
+	return NULL;
+}
+
+static bool work_running(struct workqueue_struct *wq, struct work_struct *work)
+{
+	return find_worker_executing_work(wq, work) != NULL;
+}
+
+static void work_done(struct workqueue_struct *wq, unsigned color)
+{
+	BUG_ON(!wq->nr_in_flight[color]);
+	if (!--wq->nr_in_flight[color])
+		pthread_cond_broadcast(&wq->work_finished);
 }
 
-static void __queue_work(struct workqueue_struct *wq,
+/* Called from a work item running on @wq: */
+static bool is_chained_work(struct workqueue_struct *wq)
+{
+	struct worker *worker;
+
+	list_for_each_entry(worker, &wq->workers, list)
+		if (worker->task == current)
+			return true;
+
+	return false;
+}
+
+static int worker_thread(void *arg);
+
+static struct worker *create_worker(struct workqueue_struct *wq)
+{
+	struct worker *worker = kzalloc(sizeof(*worker), GFP_KERNEL);
+	if (!worker)
+		return NULL;
+
+	worker->wq	= wq;
+	INIT_LIST_HEAD(&worker->scheduled);
+	worker->task	= kthread_create(worker_thread, worker, "%s", wq->name);
+	if (IS_ERR(worker->task)) {
+		kfree(worker);
+		return NULL;
+	}
+
+	list_add_tail(&worker->list, &wq->workers);
+	wq->nr_workers++;
+
+	wake_up_process(worker->task);
+	return worker;
+}
+
+static void wake_worker(struct workqueue_struct *wq)
+{
+	struct worker *worker;
+
+	if (wq->nr_idle) {
+		list_for_each_entry(worker, &wq->workers, list)
+			if (worker->idle) {
+				worker->idle = false;
+				wq->nr_idle--;
+				wake_up_process(worker->task);
+				return;
+			}
+		BUG();
+	}
+
+	/*
+	 * No idle workers: start another one if we're under max_active,
+	 * otherwise the work runs when a busy worker gets to it:
+	 */
+	if (wq->nr_workers < wq->max_workers)
+		create_worker(wq);
+}
+
+static bool __queue_work(struct workqueue_struct *wq,
 			 struct work_struct *work)
 {
 	BUG_ON(!work_pending(work));
+	BUG_ON(work_wq(atomic_long_read(&work->data)) != wq);
 	BUG_ON(!list_empty(&work->entry));
 
+	/* While draining, only work items on @wq may queue more work: */
+	if (unlikely(wq->flags & __WQ_DRAINING) &&
+	    WARN_ON_ONCE(!is_chained_work(wq))) {
+		atomic_long_set(&work->data,
+				work_running(wq, work) ? (unsigned long) wq : 0);
+		return false;
+	}
+
+	work->color = wq->work_color;
+	wq->nr_in_flight[work->color]++;
+
 	list_add_tail(&work->entry, &wq->pending_work);
-	wake_up_process(wq->worker);
+	wake_worker(wq);
+	return true;
 }
 
 bool queue_work(struct workqueue_struct *wq, struct work_struct *work)
 {
 	bool ret;
 
-	pthread_mutex_lock(&wq_lock);
-	if ((ret = set_work_pending(work)))
+	pthread_mutex_lock(&wq->lock);
+	ret = set_work_pending(work, wq) &&
 		__queue_work(wq, work);
-	pthread_mutex_unlock(&wq_lock);
+	pthread_mutex_unlock(&wq->lock);
 
 	return ret;
 }
@@ -63,10 +203,11 @@ void delayed_work_timer_fn(struct timer_list *timer)
 {
 	struct delayed_work *dwork =
 		container_of(timer, struct delayed_work, timer);
+	struct workqueue_struct *wq = dwork->wq;
 
-	pthread_mutex_lock(&wq_lock);
-	__queue_work(dwork->wq, &dwork->work);
-	pthread_mutex_unlock(&wq_lock);
+	pthread_mutex_lock(&wq->lock);
+	__queue_work(wq, &dwork->work);
+	pthread_mutex_unlock(&wq->lock);
 }
 
 static void __queue_delayed_work(struct workqueue_struct *wq,
@@ -80,10 +221,11 @@ static void __queue_delayed_work(struct workqueue_struct *wq,
 	BUG_ON(timer_pending(timer));
 	BUG_ON(!list_empty(&work->entry));
 
+	dwork->wq = wq;
+
 	if (!delay) {
 		__queue_work(wq, &dwork->work);
 	} else {
-		dwork->wq = wq;
 		timer->expires = jiffies + delay;
 		add_timer(timer);
 	}
@@ -96,22 +238,61 @@ bool queue_delayed_work(struct workqueue_struct *wq,
 	struct work_struct *work = &dwork->work;
 	bool ret;
 
-	pthread_mutex_lock(&wq_lock);
-	if ((ret = set_work_pending(work)))
+	pthread_mutex_lock(&wq->lock);
+	if ((ret = set_work_pending(work, wq)))
 		__queue_delayed_work(wq, dwork, delay);
-	pthread_mutex_unlock(&wq_lock);
+	pthread_mutex_unlock(&wq->lock);
 
 	return ret;
 }
 
-static bool grab_pending(struct work_struct *work, bool is_dwork)
+/*
+ * Steal the pending bit from a work item, taking it off its workqueue or
+ * cancelling its timer if it was queued: returns true if it was queued.
+ *
+ * On return the work is pending but not queued anywhere, and if it has a
+ * workqueue (*wqp), that workqueue is locked.
+ */
+static bool grab_pending(struct work_struct *work, bool is_dwork,
+			 struct workqueue_struct **wqp)
 {
+	struct workqueue_struct *wq;
+	long data;
 retry:
-	if (set_work_pending(work)) {
+	data = atomic_long_read(&work->data);
+	wq = work_wq(data);
+
+	if (!(data & WORK_PENDING)) {
+		if (!atomic_long_try_cmpxchg(&work->data, &data, data|WORK_PENDING))
+			goto retry;
+
 		BUG_ON(!list_empty(&work->entry));
+
+		/* Not pending, but may still be running on @wq: */
+		if (wq)
+			pthread_mutex_lock(&wq->lock);
+		*wqp = wq;
 		return false;
 	}
 
+	if (!wq) {
+		/*
+		 * Another thread is in the middle of cancelling it, and it
+		 * was idle - it'll release the pending bit without taking a
+		 * lock we could wait on:
+		 */
+		sched_yield();
+		goto retry;
+	}
+
+	pthread_mutex_lock(&wq->lock);
+	if (atomic_long_read(&work->data) != data) {
+		pthread_mutex_unlock(&wq->lock);
+		goto retry;
+	}
+
+	*wqp = wq;
+
 	if (is_dwork) {
 		struct delayed_work *dwork = to_delayed_work(work);
 
@@ -123,48 +304,65 @@ retry:
 
 	if (!list_empty(&work->entry)) {
 		list_del_init(&work->entry);
+		work_done(wq, work->color);
 		return true;
 	}
 
+	/* The timer fired, and is waiting on wq->lock to queue the work: */
 	BUG_ON(!is_dwork);
 
-	pthread_mutex_unlock(&wq_lock);
+	pthread_mutex_unlock(&wq->lock);
 	flush_timers();
-	pthread_mutex_lock(&wq_lock);
 	goto retry;
 }
 
-static bool work_running(struct work_struct *work)
+/*
+ * Drop the pending bit, and the workqueue pointer unless the work is still
+ * running there (the worker clears it when it's done):
+ */
+static void release_pending(struct workqueue_struct *wq,
+			    struct work_struct *work)
 {
-	struct workqueue_struct *wq;
-
-	list_for_each_entry(wq, &wq_list, list)
-		if (wq->current_work == work)
-			return true;
+	atomic_long_set(&work->data,
+			wq && work_running(wq, work) ? (unsigned long) wq : 0);
 
-	return false;
+	if (wq) {
+		pthread_cond_broadcast(&wq->work_finished);
+		pthread_mutex_unlock(&wq->lock);
+	}
 }
 
 bool flush_work(struct work_struct *work)
 {
+	struct workqueue_struct *wq;
 	bool ret = false;
 
-	pthread_mutex_lock(&wq_lock);
-	while (work_pending(work) || work_running(work)) {
-		pthread_cond_wait(&work_finished, &wq_lock);
+	while ((wq = work_wq(atomic_long_read(&work->data)))) {
+		pthread_mutex_lock(&wq->lock);
+		if (work_wq(atomic_long_read(&work->data)) != wq) {
+			pthread_mutex_unlock(&wq->lock);
+			continue;
+		}
+
+		if (!work_pending(work) && !work_running(wq, work)) {
+			pthread_mutex_unlock(&wq->lock);
+			break;
+		}
+
+		pthread_cond_wait(&wq->work_finished, &wq->lock);
+		pthread_mutex_unlock(&wq->lock);
 		ret = true;
 	}
-	pthread_mutex_unlock(&wq_lock);
 
 	return ret;
 }
 
-static bool __flush_work(struct work_struct *work)
+static bool __flush_work(struct workqueue_struct *wq, struct work_struct *work)
 {
 	bool ret = false;
 
-	while (work_running(work)) {
-		pthread_cond_wait(&work_finished, &wq_lock);
+	while (wq && work_running(wq, work)) {
+		pthread_cond_wait(&wq->work_finished, &wq->lock);
 		ret = true;
 	}
 
@@ -173,14 +371,13 @@ static bool __flush_work(struct work_struct *work)
 
 bool cancel_work_sync(struct work_struct *work)
 {
+	struct workqueue_struct *wq;
 	bool ret;
 
-	pthread_mutex_lock(&wq_lock);
-	ret = grab_pending(work, false);
+	ret = grab_pending(work, false, &wq);
 
-	__flush_work(work);
-	clear_work_pending(work);
-	pthread_mutex_unlock(&wq_lock);
+	__flush_work(wq, work);
+	release_pending(wq, work);
 
 	return ret;
 }
@@ -190,13 +387,20 @@ bool mod_delayed_work(struct workqueue_struct *wq,
 		      unsigned long delay)
 {
 	struct work_struct *work = &dwork->work;
+	struct workqueue_struct *old_wq;
 	bool ret;
 
-	pthread_mutex_lock(&wq_lock);
-	ret = grab_pending(work, true);
+	ret = grab_pending(work, true, &old_wq);
 
+	if (old_wq != wq) {
+		if (old_wq)
+			pthread_mutex_unlock(&old_wq->lock);
+		pthread_mutex_lock(&wq->lock);
+	}
+
+	atomic_long_set(&work->data, (unsigned long) wq|WORK_PENDING);
 	__queue_delayed_work(wq, dwork, delay);
-	pthread_mutex_unlock(&wq_lock);
+	pthread_mutex_unlock(&wq->lock);
 
 	return ret;
 }
@@ -204,13 +408,11 @@ bool mod_delayed_work(struct workqueue_struct *wq,
 bool cancel_delayed_work(struct delayed_work *dwork)
 {
 	struct work_struct *work = &dwork->work;
+	struct workqueue_struct *wq;
 	bool ret;
 
-	pthread_mutex_lock(&wq_lock);
-	ret = grab_pending(work, true);
-
-	clear_work_pending(&dwork->work);
-	pthread_mutex_unlock(&wq_lock);
+	ret = grab_pending(work, true, &wq);
+	release_pending(wq, work);
 
 	return ret;
 }
@@ -218,65 +420,151 @@ bool cancel_delayed_work(struct delayed_work *dwork)
 bool cancel_delayed_work_sync(struct delayed_work *dwork)
 {
 	struct work_struct *work = &dwork->work;
+	struct workqueue_struct *wq;
 	bool ret;
 
-	pthread_mutex_lock(&wq_lock);
-	ret = grab_pending(work, true);
+	ret = grab_pending(work, true, &wq);
 
-	__flush_work(work);
-	clear_work_pending(work);
-	pthread_mutex_unlock(&wq_lock);
+	__flush_work(wq, work);
+	release_pending(wq, work);
 
 	return ret;
 }
 
+static void __flush_workqueue(struct workqueue_struct *wq)
+{
+	unsigned color;
+
+	/*
+	 * Work queued while another flush is in progress has the color that
+	 * flush switched to; we can't switch back until it's drained:
+	 */
+	while (wq->flushing)
+		pthread_cond_wait(&wq->work_finished, &wq->lock);
+
+	wq->flushing	= true;
+	color		= wq->work_color;
+	wq->work_color	^= 1;
+
+	while (wq->nr_in_flight[color])
+		pthread_cond_wait(&wq->work_finished, &wq->lock);
+
+	wq->flushing	= false;
+	pthread_cond_broadcast(&wq->work_finished);
+}
+
+void flush_workqueue(struct workqueue_struct *wq)
+{
+	pthread_mutex_lock(&wq->lock);
+	__flush_workqueue(wq);
+	pthread_mutex_unlock(&wq->lock);
+}
+
+/*
+ * Wait for the workqueue to be empty; meanwhile, only work items running on it
+ * may queue more work:
+ */
+void drain_workqueue(struct workqueue_struct *wq)
+{
+	pthread_mutex_lock(&wq->lock);
+	wq->flags |= __WQ_DRAINING;
+
+	do {
+		__flush_workqueue(wq);
+	} while (wq->nr_in_flight[0] || wq->nr_in_flight[1]);
+
+	wq->flags &= ~__WQ_DRAINING;
+	pthread_mutex_unlock(&wq->lock);
+}
+
 static int worker_thread(void *arg)
 {
-	struct workqueue_struct *wq = arg;
+	struct worker *worker = arg;
+	struct workqueue_struct *wq = worker->wq;
 	struct work_struct *work;
+	struct worker *collision;
 
-	pthread_mutex_lock(&wq_lock);
+	pthread_mutex_lock(&wq->lock);
 	while (1) {
 		__set_current_state(TASK_INTERRUPTIBLE);
-		work = list_first_entry_or_null(&wq->pending_work,
+		work = list_first_entry_or_null(&worker->scheduled,
+				struct work_struct, entry) ?:
+			list_first_entry_or_null(&wq->pending_work,
 				struct work_struct, entry);
-		wq->current_work = work;
 
 		if (kthread_should_stop()) {
-			BUG_ON(wq->current_work);
+			BUG_ON(work);
 			break;
 		}
 
 		if (!work) {
-			pthread_mutex_unlock(&wq_lock);
+			if (!worker->idle) {
+				worker->idle = true;
+				wq->nr_idle++;
+			}
+
+			pthread_mutex_unlock(&wq->lock);
 			schedule();
-			pthread_mutex_lock(&wq_lock);
+			pthread_mutex_lock(&wq->lock);
 			continue;
 		}
 
+		if (worker->idle) {
+			worker->idle = false;
+			wq->nr_idle--;
+		}
+
+		__set_current_state(TASK_RUNNING);
+
 		BUG_ON(!work_pending(work));
+
+		/*
+		 * Work items aren't reentrant: if it's still running on
+		 * another worker, hand it to that worker to run next:
+		 */
+		collision = find_worker_executing_work(wq, work);
+		if (collision) {
+			list_move_tail(&work->entry, &collision->scheduled);
+			continue;
+		}
+
 		list_del_init(&work->entry);
-		clear_work_pending(work);
+		clear_bit(WORK_PENDING_BIT, work_data_bits(work));
+		worker->current_work = work;
+		worker->current_color = work->color;
 
-		pthread_mutex_unlock(&wq_lock);
+		pthread_mutex_unlock(&wq->lock);
 		work->func(work);
-		pthread_mutex_lock(&wq_lock);
+		pthread_mutex_lock(&wq->lock);
+
+		worker->current_work = NULL;
+		work_done(wq, worker->current_color);
+
+		/* Unless it was requeued, it's no longer on this workqueue: */
+		long data = (unsigned long) wq;
+		atomic_long_try_cmpxchg(&work->data, &data, 0);
 
-		pthread_cond_broadcast(&work_finished);
+		pthread_cond_broadcast(&wq->work_finished);
 	}
-	pthread_mutex_unlock(&wq_lock);
+	pthread_mutex_unlock(&wq->lock);
 
 	return 0;
 }
 
 void destroy_workqueue(struct workqueue_struct *wq)
 {
-	kthread_stop(wq->worker);
+	struct worker *worker, *n;
 
-	pthread_mutex_lock(&wq_lock);
-	list_del(&wq->list);
-	pthread_mutex_unlock(&wq_lock);
+	drain_workqueue(wq);
 
+	/* Idle workers don't touch wq->workers, and no new ones get started: */
+	list_for_each_entry_safe(worker, n, &wq->workers, list) {
+		kthread_stop(worker->task);
+		kfree(worker);
+	}
+
+	pthread_cond_destroy(&wq->work_finished);
+	pthread_mutex_destroy(&wq->lock);
 	kfree(wq);
 }
 
@@ -292,23 +580,38 @@ struct workqueue_struct *alloc_workqueue(const char *fmt,
 	if (!wq)
 		return NULL;
 
-	INIT_LIST_HEAD(&wq->list);
+	pthread_mutex_init(&wq->lock, NULL);
+	pthread_cond_init(&wq->work_finished, NULL);
+	wq->flags = flags;
 	INIT_LIST_HEAD(&wq->pending_work);
+	INIT_LIST_HEAD(&wq->workers);
 
 	va_start(args, max_active);
 	vsnprintf(wq->name, sizeof(wq->name), fmt, args);
 	va_end(args);
 
-	wq->worker = kthread_run(worker_thread, wq, "%s", wq->name);
-	if (IS_ERR(wq->worker)) {
+	/*
+	 * max_active is per cpu for bound workqueues in the kernel; we have
+	 * no cpu affinity, so it's a limit on the worker pool, which we also
+	 * cap at a small multiple of the number of cpus:
+	 */
+	if (!max_active)
+		max_active = WQ_DFL_ACTIVE;
+	if (flags & __WQ_ORDERED)
+		max_active = 1;
+
+	wq->max_workers = clamp_t(int, max_active, 1,
+				  get_nprocs() * WQ_MAX_UNBOUND_PER_CPU);
+
+	pthread_mutex_lock(&wq->lock);
+	struct worker *worker = create_worker(wq);
+	pthread_mutex_unlock(&wq->lock);
+
+	if (!worker) {
 		kfree(wq);
 		return NULL;
 	}
 
-	pthread_mutex_lock(&wq_lock);
-	list_add(&wq->list, &wq_list);
-	pthread_mutex_unlock(&wq_lock);
-
 	return wq;
 }
 
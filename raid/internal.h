@@ -43,7 +43,7 @@
 #endif
 #endif
 
-/* Enables SSE2, SSSE3, AVX2 only if the assembler supports it */
+/* Enables SSE2, SSSE3, AVX2, AVX512BW, GFNI only if the assembler supports it */
 #if HAVE_SSE2
 #define CONFIG_SSE2 1
 #endif
@@ -53,6 +53,12 @@
 #if HAVE_AVX2
 #define CONFIG_AVX2 1
 #endif
+#if HAVE_AVX512BW
+#define CONFIG_AVX512BW 1
+#endif
+#if HAVE_GFNI
+#define CONFIG_GFNI 1
+#endif
 
 #else /* if HAVE_CONFIG_H is not defined */
 
@@ -72,6 +78,8 @@
 #define CONFIG_SSE2 1
 #define CONFIG_SSSE3 1
 #define CONFIG_AVX2 1
+#define CONFIG_AVX512BW 1
+#define CONFIG_GFNI 1
 #endif
 #endif
 
@@ -140,6 +148,7 @@ void raid_gen2_int64(int nd, size_t size, void **vv);
 void raid_gen2_sse2(int nd, size_t size, void **vv);
 void raid_gen2_avx2(int nd, size_t size, void **vv);
 void raid_gen2_sse2ext(int nd, size_t size, void **vv);
+void raid_gen2_gfni(int nd, size_t size, void **vv);
 void raid_genz_int32(int nd, size_t size, void **vv);
 void raid_genz_int64(int nd, size_t size, void **vv);
 void raid_genz_sse2(int nd, size_t size, void **vv);
@@ -161,6 +170,14 @@ void raid_gen6_int8(int nd, size_t size, void **vv);
 void raid_gen6_ssse3(int nd, size_t size, void **vv);
 void raid_gen6_ssse3ext(int nd, size_t size, void **vv);
 void raid_gen6_avx2ext(int nd, size_t size, void **vv);
+void raid_gen3_avx512bw(int nd, size_t size, void **vv);
+void raid_gen4_avx512bw(int nd, size_t size, void **vv);
+void raid_gen5_avx512bw(int nd, size_t size, void **vv);
+void raid_gen6_avx512bw(int nd, size_t size, void **vv);
+void raid_gen3_gfni(int nd, size_t size, void **vv);
+void raid_gen4_gfni(int nd, size_t size, void **vv);
+void raid_gen5_gfni(int nd, size_t size, void **vv);
+void raid_gen6_gfni(int nd, size_t size, void **vv);
 void raid_rec1_int8(int nr, int *id, int *ip, int nd, size_t size, void **vv);
 void raid_rec2_int8(int nr, int *id, int *ip, int nd, size_t size, void **vv);
 void raid_recX_int8(int nr, int *id, int *ip, int nd, size_t size, void **vv);
@@ -170,6 +187,8 @@ void raid_recX_ssse3(int nr, int *id, int *ip, int nd, size_t size, void **vv);
 void raid_rec1_avx2(int nr, int *id, int *ip, int nd, size_t size, void **vv);
 void raid_rec2_avx2(int nr, int *id, int *ip, int nd, size_t size, void **vv);
 void raid_recX_avx2(int nr, int *id, int *ip, int nd, size_t size, void **vv);
+void raid_recX_avx512bw(int nr, int *id, int *ip, int nd, size_t size, void **vv);
+void raid_recX_gfni(int nr, int *id, int *ip, int nd, size_t size, void **vv);
 
 /*
  * Internal naming.
@@ -207,6 +226,7 @@ extern const uint8_t raid_gfvandermonde[3][256] __aligned(256);
 extern const uint8_t raid_gfcauchy[6][256] __aligned(256);
 extern const uint8_t raid_gfcauchypshufb[251][4][2][16] __aligned(256);
 extern const uint8_t raid_gfmulpshufb[256][2][16] __aligned(256);
+extern const uint64_t raid_gfmulgf2p8[256] __aligned(256);
 extern const uint8_t (*raid_gfgen)[256];
 #define gfmul raid_gfmul
 #define gfexp raid_gfexp
@@ -215,6 +235,7 @@ extern const uint8_t (*raid_gfgen)[256];
 #define gfcauchy raid_gfcauchy
 #define gfgenpshufb raid_gfcauchypshufb
 #define gfmulpshufb raid_gfmulpshufb
+#define gfmulgf2p8 raid_gfmulgf2p8
 #define gfgen raid_gfgen
 
 /*
@@ -268,6 +289,20 @@ static __always_inline void raid_avx_end(void)
 	asm volatile ("vzeroupper" : : : "memory");
 }
 #endif
+
+#if defined(CONFIG_AVX512BW) || defined(CONFIG_GFNI)
+static __always_inline void raid_avx512_begin(void)
+{
+	raid_sse_begin();
+}
+
+static __always_inline void raid_avx512_end(void)
+{
+	/* the AVX-512 code uses only zmm0-zmm15 and k1, so */
+	/* vzeroupper in raid_avx_end() clears all the upper state */
+	raid_avx_end();
+}
+#endif
 #endif /* CONFIG_X86 */
 
 #endif
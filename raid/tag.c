@@ -74,6 +74,21 @@ static struct raid_func {
 	{ "avx2e", raid_gen5_avx2ext },
 	{ "avx2e", raid_gen6_avx2ext },
 #endif
+#ifdef CONFIG_AVX512BW
+	{ "avx512bw", raid_gen3_avx512bw },
+	{ "avx512bw", raid_gen4_avx512bw },
+	{ "avx512bw", raid_gen5_avx512bw },
+	{ "avx512bw", raid_gen6_avx512bw },
+	{ "avx512bw", raid_recX_avx512bw },
+#endif
+#ifdef CONFIG_GFNI
+	{ "gfni", raid_gen2_gfni },
+	{ "gfni", raid_gen3_gfni },
+	{ "gfni", raid_gen4_gfni },
+	{ "gfni", raid_gen5_gfni },
+	{ "gfni", raid_gen6_gfni },
+	{ "gfni", raid_recX_gfni },
+#endif
 #endif
 	{ 0, 0 }
 };
@@ -145,7 +145,7 @@ int raid_test_sort(void)
 
 int raid_test_rec(int mode, int nd, size_t size)
 {
-	void (*f[RAID_PARITY_MAX][4])(
+	void (*f[RAID_PARITY_MAX][8])(
 		int nr, int *id, int *ip, int nd, size_t size, void **vbuf);
 	void *v_alloc;
 	void **v;
@@ -232,6 +232,16 @@ int raid_test_rec(int mode, int nd, size_t size)
 			if (raid_cpu_has_avx2())
 				f[i][nf[i]++] = raid_recX_avx2;
 #endif
+#endif
+#ifdef CONFIG_X86_64
+#ifdef CONFIG_AVX512BW
+			if (raid_cpu_has_avx512bw())
+				f[i][nf[i]++] = raid_recX_avx512bw;
+#endif
+#ifdef CONFIG_GFNI
+			if (raid_cpu_has_gfni())
+				f[i][nf[i]++] = raid_recX_gfni;
+#endif
 #endif
 		}
 	}
@@ -365,6 +375,13 @@ int raid_test_par(int mode, int nd, size_t size)
 		f[nf++] = raid_gen2_avx2;
 	}
 #endif
+
+#ifdef CONFIG_X86_64
+#ifdef CONFIG_GFNI
+	if (raid_cpu_has_gfni())
+		f[nf++] = raid_gen2_gfni;
+#endif
+#endif
 #endif /* CONFIG_X86 */
 
 	if (mode == RAID_MODE_CAUCHY) {
@@ -399,6 +416,26 @@ int raid_test_par(int mode, int nd, size_t size)
 		}
 #endif
 #endif
+
+#ifdef CONFIG_X86_64
+#ifdef CONFIG_AVX512BW
+		if (raid_cpu_has_avx512bw()) {
+			f[nf++] = raid_gen3_avx512bw;
+			f[nf++] = raid_gen4_avx512bw;
+			f[nf++] = raid_gen5_avx512bw;
+			f[nf++] = raid_gen6_avx512bw;
+		}
+#endif
+
+#ifdef CONFIG_GFNI
+		if (raid_cpu_has_gfni()) {
+			f[nf++] = raid_gen3_gfni;
+			f[nf++] = raid_gen4_gfni;
+			f[nf++] = raid_gen5_gfni;
+			f[nf++] = raid_gen6_gfni;
+		}
+#endif
+#endif
 #endif /* CONFIG_X86 */
 	} else {
 		f[nf++] = raid_genz_int32;
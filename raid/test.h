@@ -64,5 +64,22 @@ int raid_test_rec(unsigned mode, int nd, size_t size);
  */
 int raid_test_par(unsigned mode, int nd, size_t size);
 
+/**
+ * Names of the implementations in use.
+ *
+ * These return the instruction set of the functions selected by
+ * raid_init() and raid_mode(), like "avx2" or "gfni".
+ */
+const char *raid_gen1_tag(void);
+const char *raid_gen2_tag(void);
+const char *raid_genz_tag(void);
+const char *raid_gen3_tag(void);
+const char *raid_gen4_tag(void);
+const char *raid_gen5_tag(void);
+const char *raid_gen6_tag(void);
+const char *raid_rec1_tag(void);
+const char *raid_rec2_tag(void);
+const char *raid_recX_tag(void);
+
 #endif
 
@@ -2450,3 +2450,482 @@ void raid_recX_avx2(int nr, int *id, int *ip, int nd, size_t size, void **vv)
 }
 #endif
 
+
+#if defined(CONFIG_X86_64) && defined(CONFIG_GFNI)
+/*
+ * GEN2 (RAID6 with powers of 2) GFNI implementation
+ *
+ * The by two multiplication is a single GF2P8AFFINEQB.
+ */
+void raid_gen2_gfni(int nd, size_t size, void **vv)
+{
+	uint8_t **v = (uint8_t **)vv;
+	uint8_t *p;
+	uint8_t *q;
+	int d, l;
+	size_t i;
+
+	l = nd - 1;
+	p = v[nd];
+	q = v[nd + 1];
+
+	raid_avx512_begin();
+
+	asm volatile ("vpbroadcastq %0,%%zmm7" : : "m" (gfmulgf2p8[2]));
+
+	for (i = 0; i < size; i += 64) {
+		asm volatile ("vmovdqa64 %0,%%zmm0" : : "m" (v[l][i]));
+		asm volatile ("vmovdqa64 %zmm0,%zmm1");
+		for (d = l - 1; d >= 0; --d) {
+			asm volatile ("vgf2p8affineqb $0,%zmm7,%zmm1,%zmm1");
+
+			asm volatile ("vmovdqa64 %0,%%zmm2" : : "m" (v[d][i]));
+			asm volatile ("vpxorq %zmm2,%zmm0,%zmm0");
+			asm volatile ("vpxorq %zmm2,%zmm1,%zmm1");
+		}
+		asm volatile ("vmovntdq %%zmm0,%0" : "=m" (p[i]));
+		asm volatile ("vmovntdq %%zmm1,%0" : "=m" (q[i]));
+	}
+
+	raid_avx512_end();
+}
+#endif
+
+#if defined(CONFIG_X86_64) && defined(CONFIG_AVX512BW)
+/*
+ * GEN3/4/5/6 (triple to hexa parity with Cauchy matrix) AVX-512BW implementation
+ *
+ * Same algorithm of the AVX2 ones, but on 64 bytes at a time.
+ * The number of parities is always a constant, so the blocks of the
+ * unused ones are removed by the compiler.
+ *
+ * Note that it uses 16 registers, meaning that x64 is required.
+ */
+static __always_inline void raid_genN_avx512bw(int np, int nd, size_t size, void **vv)
+{
+	uint8_t **v = (uint8_t **)vv;
+	uint8_t *p;
+	uint8_t *q;
+	uint8_t *r;
+	uint8_t *s;
+	uint8_t *t;
+	uint8_t *u;
+	int d, l;
+	size_t i;
+
+	l = nd - 1;
+	p = v[nd];
+	q = v[nd + 1];
+	r = v[nd + 2];
+	s = np > 3 ? v[nd + 3] : 0;
+	t = np > 4 ? v[nd + 4] : 0;
+	u = np > 5 ? v[nd + 5] : 0;
+
+	/* special case with only one data disk */
+	if (l == 0) {
+		for (i = 0; i < (size_t)np; ++i)
+			memcpy(v[1 + i], v[0], size);
+		return;
+	}
+
+	raid_avx512_begin();
+
+	/* generic case with at least two data disks */
+	asm volatile ("vbroadcasti32x4 %0,%%zmm14" : : "m" (gfconst16.poly[0]));
+	asm volatile ("vbroadcasti32x4 %0,%%zmm15" : : "m" (gfconst16.low4[0]));
+
+	for (i = 0; i < size; i += 64) {
+		/* last disk without the by two multiplication */
+		asm volatile ("vmovdqa64 %0,%%zmm10" : : "m" (v[l][i]));
+
+		asm volatile ("vmovdqa64 %zmm10,%zmm0");
+		asm volatile ("vmovdqa64 %zmm10,%zmm1");
+
+		asm volatile ("vpsrlw  $4,%zmm10,%zmm11");
+		asm volatile ("vpandq  %zmm15,%zmm10,%zmm10");
+		asm volatile ("vpandq  %zmm15,%zmm11,%zmm11");
+
+		asm volatile ("vbroadcasti32x4 %0,%%zmm2" : : "m" (gfgenpshufb[l][0][0][0]));
+		asm volatile ("vbroadcasti32x4 %0,%%zmm13" : : "m" (gfgenpshufb[l][0][1][0]));
+		asm volatile ("vpshufb %zmm10,%zmm2,%zmm2");
+		asm volatile ("vpshufb %zmm11,%zmm13,%zmm13");
+		asm volatile ("vpxorq  %zmm13,%zmm2,%zmm2");
+
+		if (np > 3) {
+			asm volatile ("vbroadcasti32x4 %0,%%zmm3" : : "m" (gfgenpshufb[l][1][0][0]));
+			asm volatile ("vbroadcasti32x4 %0,%%zmm13" : : "m" (gfgenpshufb[l][1][1][0]));
+			asm volatile ("vpshufb %zmm10,%zmm3,%zmm3");
+			asm volatile ("vpshufb %zmm11,%zmm13,%zmm13");
+			asm volatile ("vpxorq  %zmm13,%zmm3,%zmm3");
+		}
+
+		if (np > 4) {
+			asm volatile ("vbroadcasti32x4 %0,%%zmm4" : : "m" (gfgenpshufb[l][2][0][0]));
+			asm volatile ("vbroadcasti32x4 %0,%%zmm13" : : "m" (gfgenpshufb[l][2][1][0]));
+			asm volatile ("vpshufb %zmm10,%zmm4,%zmm4");
+			asm volatile ("vpshufb %zmm11,%zmm13,%zmm13");
+			asm volatile ("vpxorq  %zmm13,%zmm4,%zmm4");
+		}
+
+		if (np > 5) {
+			asm volatile ("vbroadcasti32x4 %0,%%zmm5" : : "m" (gfgenpshufb[l][3][0][0]));
+			asm volatile ("vbroadcasti32x4 %0,%%zmm13" : : "m" (gfgenpshufb[l][3][1][0]));
+			asm volatile ("vpshufb %zmm10,%zmm5,%zmm5");
+			asm volatile ("vpshufb %zmm11,%zmm13,%zmm13");
+			asm volatile ("vpxorq  %zmm13,%zmm5,%zmm5");
+		}
+
+		/* intermediate disks */
+		for (d = l - 1; d > 0; --d) {
+			asm volatile ("vmovdqa64 %0,%%zmm10" : : "m" (v[d][i]));
+
+			/* there is no vpcmpgtb to a vector register, so */
+			/* get the mask of the high bits through k1 */
+			asm volatile ("vpmovb2m %zmm1,%k1");
+			asm volatile ("vpmovm2b %k1,%zmm11");
+			asm volatile ("vpaddb %zmm1,%zmm1,%zmm1");
+			asm volatile ("vpandq %zmm14,%zmm11,%zmm11");
+			asm volatile ("vpxorq %zmm11,%zmm1,%zmm1");
+
+			asm volatile ("vpxorq %zmm10,%zmm0,%zmm0");
+			asm volatile ("vpxorq %zmm10,%zmm1,%zmm1");
+
+			asm volatile ("vpsrlw  $4,%zmm10,%zmm11");
+			asm volatile ("vpandq  %zmm15,%zmm10,%zmm10");
+			asm volatile ("vpandq  %zmm15,%zmm11,%zmm11");
+
+			/* vpternlogq with 0x96 is a three way xor */
+			asm volatile ("vbroadcasti32x4 %0,%%zmm12" : : "m" (gfgenpshufb[d][0][0][0]));
+			asm volatile ("vbroadcasti32x4 %0,%%zmm13" : : "m" (gfgenpshufb[d][0][1][0]));
+			asm volatile ("vpshufb %zmm10,%zmm12,%zmm12");
+			asm volatile ("vpshufb %zmm11,%zmm13,%zmm13");
+			asm volatile ("vpternlogq $0x96,%zmm13,%zmm12,%zmm2");
+
+			if (np > 3) {
+				asm volatile ("vbroadcasti32x4 %0,%%zmm12" : : "m" (gfgenpshufb[d][1][0][0]));
+				asm volatile ("vbroadcasti32x4 %0,%%zmm13" : : "m" (gfgenpshufb[d][1][1][0]));
+				asm volatile ("vpshufb %zmm10,%zmm12,%zmm12");
+				asm volatile ("vpshufb %zmm11,%zmm13,%zmm13");
+				asm volatile ("vpternlogq $0x96,%zmm13,%zmm12,%zmm3");
+			}
+
+			if (np > 4) {
+				asm volatile ("vbroadcasti32x4 %0,%%zmm12" : : "m" (gfgenpshufb[d][2][0][0]));
+				asm volatile ("vbroadcasti32x4 %0,%%zmm13" : : "m" (gfgenpshufb[d][2][1][0]));
+				asm volatile ("vpshufb %zmm10,%zmm12,%zmm12");
+				asm volatile ("vpshufb %zmm11,%zmm13,%zmm13");
+				asm volatile ("vpternlogq $0x96,%zmm13,%zmm12,%zmm4");
+			}
+
+			if (np > 5) {
+				asm volatile ("vbroadcasti32x4 %0,%%zmm12" : : "m" (gfgenpshufb[d][3][0][0]));
+				asm volatile ("vbroadcasti32x4 %0,%%zmm13" : : "m" (gfgenpshufb[d][3][1][0]));
+				asm volatile ("vpshufb %zmm10,%zmm12,%zmm12");
+				asm volatile ("vpshufb %zmm11,%zmm13,%zmm13");
+				asm volatile ("vpternlogq $0x96,%zmm13,%zmm12,%zmm5");
+			}
+		}
+
+		/* first disk with all coefficients at 1 */
+		asm volatile ("vmovdqa64 %0,%%zmm10" : : "m" (v[0][i]));
+
+		asm volatile ("vpmovb2m %zmm1,%k1");
+		asm volatile ("vpmovm2b %k1,%zmm11");
+		asm volatile ("vpaddb %zmm1,%zmm1,%zmm1");
+		asm volatile ("vpandq %zmm14,%zmm11,%zmm11");
+		asm volatile ("vpxorq %zmm11,%zmm1,%zmm1");
+
+		asm volatile ("vpxorq %zmm10,%zmm0,%zmm0");
+		asm volatile ("vpxorq %zmm10,%zmm1,%zmm1");
+		asm volatile ("vpxorq %zmm10,%zmm2,%zmm2");
+		if (np > 3)
+			asm volatile ("vpxorq %zmm10,%zmm3,%zmm3");
+		if (np > 4)
+			asm volatile ("vpxorq %zmm10,%zmm4,%zmm4");
+		if (np > 5)
+			asm volatile ("vpxorq %zmm10,%zmm5,%zmm5");
+
+		asm volatile ("vmovntdq %%zmm0,%0" : "=m" (p[i]));
+		asm volatile ("vmovntdq %%zmm1,%0" : "=m" (q[i]));
+		asm volatile ("vmovntdq %%zmm2,%0" : "=m" (r[i]));
+		if (np > 3)
+			asm volatile ("vmovntdq %%zmm3,%0" : "=m" (s[i]));
+		if (np > 4)
+			asm volatile ("vmovntdq %%zmm4,%0" : "=m" (t[i]));
+		if (np > 5)
+			asm volatile ("vmovntdq %%zmm5,%0" : "=m" (u[i]));
+	}
+
+	raid_avx512_end();
+}
+
+void raid_gen3_avx512bw(int nd, size_t size, void **vv)
+{
+	raid_genN_avx512bw(3, nd, size, vv);
+}
+
+void raid_gen4_avx512bw(int nd, size_t size, void **vv)
+{
+	raid_genN_avx512bw(4, nd, size, vv);
+}
+
+void raid_gen5_avx512bw(int nd, size_t size, void **vv)
+{
+	raid_genN_avx512bw(5, nd, size, vv);
+}
+
+void raid_gen6_avx512bw(int nd, size_t size, void **vv)
+{
+	raid_genN_avx512bw(6, nd, size, vv);
+}
+#endif
+
+#if defined(CONFIG_X86_64) && defined(CONFIG_GFNI)
+/*
+ * GEN3/4/5/6 (triple to hexa parity with Cauchy matrix) GFNI implementation
+ *
+ * GF2P8AFFINEQB multiplies 64 bytes for any coefficient in a single
+ * instruction, using the matrices in gfmulgf2p8[], so all the parities
+ * are computed in the same way, without the by two multiplication trick.
+ *
+ * Note that it uses 16 registers, meaning that x64 is required.
+ */
+static __always_inline void raid_genN_gfni(int np, int nd, size_t size, void **vv)
+{
+	uint8_t **v = (uint8_t **)vv;
+	uint8_t *p;
+	uint8_t *q;
+	uint8_t *r;
+	uint8_t *s;
+	uint8_t *t;
+	uint8_t *u;
+	int d;
+	size_t i;
+
+	p = v[nd];
+	q = v[nd + 1];
+	r = v[nd + 2];
+	s = np > 3 ? v[nd + 3] : 0;
+	t = np > 4 ? v[nd + 4] : 0;
+	u = np > 5 ? v[nd + 5] : 0;
+
+	raid_avx512_begin();
+
+	for (i = 0; i < size; i += 64) {
+		/* first disk with all coefficients at 1 */
+		asm volatile ("vmovdqa64 %0,%%zmm0" : : "m" (v[0][i]));
+
+		asm volatile ("vmovdqa64 %zmm0,%zmm1");
+		asm volatile ("vmovdqa64 %zmm0,%zmm2");
+		if (np > 3)
+			asm volatile ("vmovdqa64 %zmm0,%zmm3");
+		if (np > 4)
+			asm volatile ("vmovdqa64 %zmm0,%zmm4");
+		if (np > 5)
+			asm volatile ("vmovdqa64 %zmm0,%zmm5");
+
+		/* other disks */
+		for (d = 1; d < nd; ++d) {
+			asm volatile ("vmovdqa64 %0,%%zmm10" : : "m" (v[d][i]));
+
+			asm volatile ("vpxorq %zmm10,%zmm0,%zmm0");
+
+			asm volatile ("vpbroadcastq %0,%%zmm11" : : "m" (gfmulgf2p8[gfcauchy[1][d]]));
+			asm volatile ("vgf2p8affineqb $0,%zmm11,%zmm10,%zmm11");
+			asm volatile ("vpxorq %zmm11,%zmm1,%zmm1");
+
+			asm volatile ("vpbroadcastq %0,%%zmm12" : : "m" (gfmulgf2p8[gfcauchy[2][d]]));
+			asm volatile ("vgf2p8affineqb $0,%zmm12,%zmm10,%zmm12");
+			asm volatile ("vpxorq %zmm12,%zmm2,%zmm2");
+
+			if (np > 3) {
+				asm volatile ("vpbroadcastq %0,%%zmm13" : : "m" (gfmulgf2p8[gfcauchy[3][d]]));
+				asm volatile ("vgf2p8affineqb $0,%zmm13,%zmm10,%zmm13");
+				asm volatile ("vpxorq %zmm13,%zmm3,%zmm3");
+			}
+
+			if (np > 4) {
+				asm volatile ("vpbroadcastq %0,%%zmm14" : : "m" (gfmulgf2p8[gfcauchy[4][d]]));
+				asm volatile ("vgf2p8affineqb $0,%zmm14,%zmm10,%zmm14");
+				asm volatile ("vpxorq %zmm14,%zmm4,%zmm4");
+			}
+
+			if (np > 5) {
+				asm volatile ("vpbroadcastq %0,%%zmm15" : : "m" (gfmulgf2p8[gfcauchy[5][d]]));
+				asm volatile ("vgf2p8affineqb $0,%zmm15,%zmm10,%zmm15");
+				asm volatile ("vpxorq %zmm15,%zmm5,%zmm5");
+			}
+		}
+
+		asm volatile ("vmovntdq %%zmm0,%0" : "=m" (p[i]));
+		asm volatile ("vmovntdq %%zmm1,%0" : "=m" (q[i]));
+		asm volatile ("vmovntdq %%zmm2,%0" : "=m" (r[i]));
+		if (np > 3)
+			asm volatile ("vmovntdq %%zmm3,%0" : "=m" (s[i]));
+		if (np > 4)
+			asm volatile ("vmovntdq %%zmm4,%0" : "=m" (t[i]));
+		if (np > 5)
+			asm volatile ("vmovntdq %%zmm5,%0" : "=m" (u[i]));
+	}
+
+	raid_avx512_end();
+}
+
+void raid_gen3_gfni(int nd, size_t size, void **vv)
+{
+	raid_genN_gfni(3, nd, size, vv);
+}
+
+void raid_gen4_gfni(int nd, size_t size, void **vv)
+{
+	raid_genN_gfni(4, nd, size, vv);
+}
+
+void raid_gen5_gfni(int nd, size_t size, void **vv)
+{
+	raid_genN_gfni(5, nd, size, vv);
+}
+
+void raid_gen6_gfni(int nd, size_t size, void **vv)
+{
+	raid_genN_gfni(6, nd, size, vv);
+}
+#endif
+
+#if defined(CONFIG_X86_64) && defined(CONFIG_AVX512BW)
+/*
+ * RAID recovering AVX-512BW implementation
+ */
+void raid_recX_avx512bw(int nr, int *id, int *ip, int nd, size_t size, void **vv)
+{
+	uint8_t **v = (uint8_t **)vv;
+	int N = nr;
+	uint8_t *p[RAID_PARITY_MAX];
+	uint8_t *pa[RAID_PARITY_MAX];
+	uint8_t G[RAID_PARITY_MAX * RAID_PARITY_MAX];
+	uint8_t V[RAID_PARITY_MAX * RAID_PARITY_MAX];
+	uint8_t buffer[RAID_PARITY_MAX*64+64];
+	uint8_t *pd = __align_ptr(buffer, 64);
+	size_t i;
+	int j, k;
+
+	/* setup the coefficients matrix */
+	for (j = 0; j < N; ++j)
+		for (k = 0; k < N; ++k)
+			G[j * N + k] = A(ip[j], id[k]);
+
+	/* invert it to solve the system of linear equations */
+	raid_invert(G, V, N);
+
+	/* compute delta parity */
+	raid_delta_gen(N, id, ip, nd, size, vv);
+
+	for (j = 0; j < N; ++j) {
+		p[j] = v[nd + ip[j]];
+		pa[j] = v[id[j]];
+	}
+
+	raid_avx512_begin();
+
+	asm volatile ("vbroadcasti32x4 %0,%%zmm7" : : "m" (gfconst16.low4[0]));
+
+	for (i = 0; i < size; i += 64) {
+		/* delta */
+		for (j = 0; j < N; ++j) {
+			asm volatile ("vmovdqa64 %0,%%zmm0" : : "m" (p[j][i]));
+			asm volatile ("vpxorq    %0,%%zmm0,%%zmm0" : : "m" (pa[j][i]));
+			asm volatile ("vmovdqa64 %%zmm0,%0" : "=m" (pd[j*64]));
+		}
+
+		/* reconstruct */
+		for (j = 0; j < N; ++j) {
+			asm volatile ("vpxorq %zmm0,%zmm0,%zmm0");
+
+			for (k = 0; k < N; ++k) {
+				uint8_t m = V[j * N + k];
+
+				asm volatile ("vbroadcasti32x4 %0,%%zmm2" : : "m" (gfmulpshufb[m][0][0]));
+				asm volatile ("vbroadcasti32x4 %0,%%zmm3" : : "m" (gfmulpshufb[m][1][0]));
+				asm volatile ("vmovdqa64 %0,%%zmm4" : : "m" (pd[k*64]));
+				asm volatile ("vpsrlw  $4,%zmm4,%zmm5");
+				asm volatile ("vpandq  %zmm7,%zmm4,%zmm4");
+				asm volatile ("vpandq  %zmm7,%zmm5,%zmm5");
+				asm volatile ("vpshufb %zmm4,%zmm2,%zmm2");
+				asm volatile ("vpshufb %zmm5,%zmm3,%zmm3");
+				asm volatile ("vpternlogq $0x96,%zmm3,%zmm2,%zmm0");
+			}
+
+			asm volatile ("vmovdqa64 %%zmm0,%0" : "=m" (pa[j][i]));
+		}
+	}
+
+	raid_avx512_end();
+}
+#endif
+
+#if defined(CONFIG_X86_64) && defined(CONFIG_GFNI)
+/*
+ * RAID recovering GFNI implementation
+ */
+void raid_recX_gfni(int nr, int *id, int *ip, int nd, size_t size, void **vv)
+{
+	uint8_t **v = (uint8_t **)vv;
+	int N = nr;
+	uint8_t *p[RAID_PARITY_MAX];
+	uint8_t *pa[RAID_PARITY_MAX];
+	uint8_t G[RAID_PARITY_MAX * RAID_PARITY_MAX];
+	uint8_t V[RAID_PARITY_MAX * RAID_PARITY_MAX];
+	uint64_t M[RAID_PARITY_MAX * RAID_PARITY_MAX];
+	uint8_t buffer[RAID_PARITY_MAX*64+64];
+	uint8_t *pd = __align_ptr(buffer, 64);
+	size_t i;
+	int j, k;
+
+	/* setup the coefficients matrix */
+	for (j = 0; j < N; ++j)
+		for (k = 0; k < N; ++k)
+			G[j * N + k] = A(ip[j], id[k]);
+
+	/* invert it to solve the system of linear equations */
+	raid_invert(G, V, N);
+
+	/* get the GF2P8AFFINEQB matrices of the inverted one */
+	for (j = 0; j < N * N; ++j)
+		M[j] = gfmulgf2p8[V[j]];
+
+	/* compute delta parity */
+	raid_delta_gen(N, id, ip, nd, size, vv);
+
+	for (j = 0; j < N; ++j) {
+		p[j] = v[nd + ip[j]];
+		pa[j] = v[id[j]];
+	}
+
+	raid_avx512_begin();
+
+	for (i = 0; i < size; i += 64) {
+		/* delta */
+		for (j = 0; j < N; ++j) {
+			asm volatile ("vmovdqa64 %0,%%zmm0" : : "m" (p[j][i]));
+			asm volatile ("vpxorq    %0,%%zmm0,%%zmm0" : : "m" (pa[j][i]));
+			asm volatile ("vmovdqa64 %%zmm0,%0" : "=m" (pd[j*64]));
+		}
+
+		/* reconstruct */
+		for (j = 0; j < N; ++j) {
+			asm volatile ("vpxorq %zmm0,%zmm0,%zmm0");
+
+			for (k = 0; k < N; ++k) {
+				asm volatile ("vpbroadcastq %0,%%zmm2" : : "m" (M[j * N + k]));
+				asm volatile ("vmovdqa64 %0,%%zmm4" : : "m" (pd[k*64]));
+				asm volatile ("vgf2p8affineqb $0,%zmm2,%zmm4,%zmm4");
+				asm volatile ("vpxorq %zmm4,%zmm0,%zmm0");
+			}
+
+			asm volatile ("vmovdqa64 %%zmm0,%0" : "=m" (pa[j][i]));
+		}
+	}
+
+	raid_avx512_end();
+}
+#endif
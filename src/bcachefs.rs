@@ -1,4 +1,5 @@
 mod commands;
+mod device_scan;
 mod key;
 mod logging;
 mod wrappers;
@@ -43,6 +44,7 @@ fn handle_c_command(mut argv: Vec<String>, symlink_cmd: Option<&str>) -> i32 {
                 c::bcachefs_usage();
                 0
             }
+            "bench" => c::bench_cmds(argc, argv),
             "data" => c::data_cmds(argc, argv),
             "device" => c::device_cmds(argc, argv),
             "dump" => c::cmd_dump(argc, argv),
@@ -60,7 +62,9 @@ fn handle_c_command(mut argv: Vec<String>, symlink_cmd: Option<&str>) -> i32 {
             "set-passphrase" => c::cmd_set_passphrase(argc, argv),
             "set-file-option" => c::cmd_setattr(argc, argv),
             "show-super" => c::cmd_show_super(argc, argv),
+            "sysfs" => c::cmd_sysfs(argc, argv),
             "recover-super" => c::cmd_recover_super(argc, argv),
+            "trace" => c::cmd_trace(argc, argv),
             "unlock" => c::cmd_unlock(argc, argv),
             "version" => c::cmd_version(argc, argv),
 
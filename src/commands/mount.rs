@@ -14,6 +14,7 @@ use log::{debug, error, info};
 use uuid::Uuid;
 
 use crate::{
+    device_scan::{self, BlockDev},
     key::{KeyHandle, Passphrase, UnlockPolicy},
     logging,
 };
@@ -170,11 +171,13 @@ fn udev_bcachefs_info() -> anyhow::Result<HashMap<String, Vec<String>>> {
     Ok(info)
 }
 
-fn get_super_blocks(uuid: Uuid, devices: &[String]) -> Vec<(PathBuf, bch_sb_handle)> {
+fn read_super_blocks(
+    uuid: Uuid,
+    devices: impl Iterator<Item = String>,
+) -> Vec<(PathBuf, bch_sb_handle)> {
     devices
-        .iter()
         .filter_map(|dev| {
-            read_super_silent(PathBuf::from(dev))
+            read_super_silent(PathBuf::from(&dev))
                 .ok()
                 .map(|sb| (PathBuf::from(dev), sb))
         })
@@ -182,7 +185,20 @@ fn get_super_blocks(uuid: Uuid, devices: &[String]) -> Vec<(PathBuf, bch_sb_hand
         .collect::<Vec<_>>()
 }
 
-fn get_all_block_devnodes() -> anyhow::Result<Vec<String>> {
+fn get_super_blocks(uuid: Uuid, devices: &[String]) -> Vec<(PathBuf, bch_sb_handle)> {
+    let probed = device_scan::probe_devices(devices);
+
+    read_super_blocks(
+        uuid,
+        devices
+            .iter()
+            .zip(probed)
+            .filter(|(_, dev_uuid)| *dev_uuid == Some(uuid))
+            .map(|(dev, _)| dev.clone()),
+    )
+}
+
+fn get_all_block_devnodes() -> anyhow::Result<Vec<BlockDev>> {
     let mut udev = udev::Enumerator::new()?;
     udev.match_subsystem("block")?;
 
@@ -190,7 +206,13 @@ fn get_all_block_devnodes() -> anyhow::Result<Vec<String>> {
         .scan_devices()?
         .filter_map(|dev| {
             if dev.is_initialized() {
-                dev.devnode().map(|dn| dn.to_string_lossy().into_owned())
+                dev.devnode().map(|dn| BlockDev {
+                    devnode: dn.to_string_lossy().into_owned(),
+                    devnum:  dev.devnum(),
+                    diskseq: dev
+                        .property_value("DISKSEQ")
+                        .and_then(|s| s.to_str()?.parse().ok()),
+                })
             } else {
                 None
             }
@@ -199,22 +221,52 @@ fn get_all_block_devnodes() -> anyhow::Result<Vec<String>> {
     Ok(devices)
 }
 
+fn scan_super_blocks(uuid: Uuid, devices: &[BlockDev]) -> Vec<(PathBuf, bch_sb_handle)> {
+    let scan = |use_cache| {
+        let probed = device_scan::scan_devices(devices, use_cache);
+
+        read_super_blocks(
+            uuid,
+            devices
+                .iter()
+                .zip(probed)
+                .filter(|(_, dev_uuid)| *dev_uuid == Some(uuid))
+                .map(|(dev, _)| dev.devnode.clone()),
+        )
+    };
+
+    let sbs = scan(true);
+
+    // The cache doesn't know about devices formatted in place since the last
+    // scan; if we didn't find every member, check everything again:
+    let complete = sbs
+        .first()
+        .is_some_and(|(_, sb)| sbs.len() >= sb.sb().number_of_devices() as usize);
+
+    if complete {
+        return sbs;
+    }
+
+    for (_, mut sb) in sbs {
+        unsafe {
+            bch_bindgen::sb_io::bch2_free_super(&mut sb);
+        }
+    }
+
+    debug!("didn't find all devices with cached scan results, rescanning");
+    scan(false)
+}
+
 fn get_devices_by_uuid(
     udev_bcachefs: &HashMap<String, Vec<String>>,
     uuid: Uuid,
 ) -> anyhow::Result<Vec<(PathBuf, bch_sb_handle)>> {
-    let devices = {
-        if !udev_bcachefs.is_empty() {
-            let uuid_string = uuid.hyphenated().to_string();
-            if let Some(devices) = udev_bcachefs.get(&uuid_string) {
-                devices.clone()
-            } else {
-                Vec::new()
-            }
-        } else {
-            get_all_block_devnodes()?
-        }
-    };
+    if udev_bcachefs.is_empty() {
+        return Ok(scan_super_blocks(uuid, &get_all_block_devnodes()?));
+    }
+
+    let uuid_string = uuid.hyphenated().to_string();
+    let devices = udev_bcachefs.get(&uuid_string).cloned().unwrap_or_default();
 
     Ok(get_super_blocks(uuid, &devices))
 }
@@ -0,0 +1,367 @@
+//! Finding bcachefs devices by probing block devices for a superblock, for
+//! when udev can't tell us.
+//!
+//! Probing reads only the superblock layout sector and the start of the
+//! superblock (or of the backups, if the primary is damaged), enough to check
+//! the magic and get the filesystem UUID; callers do the full (and much more
+//! expensive) read only for devices that match. Devices are probed in
+//! parallel, and results are cached in /run by device number and disk
+//! sequence number, which the kernel changes whenever a device number is
+//! reused or the media changes.
+
+use std::{
+    collections::HashMap,
+    fs::{self, File},
+    os::unix::fs::FileExt,
+    path::Path,
+    sync::atomic::{AtomicUsize, Ordering},
+    thread,
+};
+
+use log::debug;
+use uuid::Uuid;
+
+const SECTOR_SIZE: u64 = 512;
+const BCH_SB_SECTOR: u64 = 8;
+const BCH_SB_LAYOUT_SECTOR: u64 = 7;
+
+const BCACHE_MAGIC: Uuid = Uuid::from_u128(0xc68573f6_4e1a_45ca_8265_f57f48ba6d81);
+const BCHFS_MAGIC: Uuid = Uuid::from_u128(0xc68573f6_66ce_90a9_d96a_60cf803df7ef);
+
+// Offsets in struct bch_sb_layout and struct bch_sb:
+const LAYOUT_MAGIC: usize = 0;
+const LAYOUT_NR_SUPERBLOCKS: usize = 18;
+const LAYOUT_SB_OFFSET: usize = 24;
+const SB_MAGIC: usize = 24;
+const SB_USER_UUID: usize = 56;
+
+const PROBE_THREADS_MAX: usize = 32;
+
+const CACHE_PATH: &str = "/run/bcachefs/devices";
+
+#[derive(Clone, Debug)]
+pub struct BlockDev {
+    pub devnode: String,
+    pub devnum:  Option<libc::dev_t>,
+    pub diskseq: Option<u64>,
+}
+
+impl BlockDev {
+    fn cache_key(&self) -> Option<(libc::dev_t, u64)> {
+        Some((self.devnum?, self.diskseq?))
+    }
+}
+
+fn uuid_at(buf: &[u8], offset: usize) -> Option<Uuid> {
+    Some(Uuid::from_bytes(
+        buf.get(offset..offset + 16)?.try_into().ok()?,
+    ))
+}
+
+fn is_bcachefs_magic(uuid: Option<Uuid>) -> bool {
+    uuid == Some(BCHFS_MAGIC) || uuid == Some(BCACHE_MAGIC)
+}
+
+/// Returns the user visible UUID of the filesystem on `path`, if it has a
+/// bcachefs superblock.
+pub fn probe(path: impl AsRef<Path>) -> Option<Uuid> {
+    probe_dev(&File::open(path).ok()?)
+}
+
+fn probe_dev(dev: &impl FileExt) -> Option<Uuid> {
+    // The layout sector, and the start of the superblock if it's at the
+    // default location - which it is unless a superblock offset was given
+    // when formatting:
+    let mut buf = [0u8; 2 * SECTOR_SIZE as usize];
+    dev.read_exact_at(&mut buf, BCH_SB_LAYOUT_SECTOR * SECTOR_SIZE)
+        .ok()?;
+
+    let (layout, default_sb) = buf.split_at(SECTOR_SIZE as usize);
+
+    // Like bch2_read_super(), fall back to the backup superblocks in the
+    // layout if the primary is damaged:
+    let offsets: Vec<u64> = if is_bcachefs_magic(uuid_at(layout, LAYOUT_MAGIC)) {
+        layout[LAYOUT_SB_OFFSET..]
+            .chunks_exact(8)
+            .take(layout[LAYOUT_NR_SUPERBLOCKS] as usize)
+            .map(|o| u64::from_le_bytes(o.try_into().unwrap()))
+            .collect()
+    } else {
+        vec![BCH_SB_SECTOR]
+    };
+
+    let mut sb_buf = [0u8; SECTOR_SIZE as usize];
+    offsets.into_iter().find_map(|offset| {
+        let sb = if offset == BCH_SB_SECTOR {
+            default_sb
+        } else {
+            dev.read_exact_at(&mut sb_buf, offset.checked_mul(SECTOR_SIZE)?)
+                .ok()?;
+            &sb_buf
+        };
+
+        is_bcachefs_magic(uuid_at(sb, SB_MAGIC))
+            .then(|| uuid_at(sb, SB_USER_UUID))
+            .flatten()
+    })
+}
+
+fn probe_parallel(devs: &[&str]) -> Vec<Option<Uuid>> {
+    let next = AtomicUsize::new(0);
+    // Probing is almost all waiting on IO, so we want more threads than CPUs:
+    let nr_threads = devs.len().min(PROBE_THREADS_MAX);
+
+    let mut ret = vec![None; devs.len()];
+    thread::scope(|s| {
+        let threads: Vec<_> = (0..nr_threads)
+            .map(|_| {
+                s.spawn(|| {
+                    let mut found = Vec::new();
+                    loop {
+                        let i = next.fetch_add(1, Ordering::Relaxed);
+                        let Some(dev) = devs.get(i) else { break };
+
+                        found.push((i, probe(dev)));
+                    }
+                    found
+                })
+            })
+            .collect();
+
+        for t in threads {
+            for (i, uuid) in t.join().unwrap() {
+                ret[i] = uuid;
+            }
+        }
+    });
+
+    ret
+}
+
+type ProbeCache = HashMap<(libc::dev_t, u64), Option<Uuid>>;
+
+fn cache_parse(s: &str) -> ProbeCache {
+    let parse = |l: &str| {
+        let mut f = l.split_whitespace();
+        let (major, minor) = f.next()?.split_once(':')?;
+        let devnum = libc::makedev(major.parse().ok()?, minor.parse().ok()?);
+        let diskseq = f.next()?.parse().ok()?;
+        let uuid = match f.next()? {
+            "-" => None,
+            u => Some(Uuid::parse_str(u).ok()?),
+        };
+        Some(((devnum, diskseq), uuid))
+    };
+
+    s.lines().filter_map(parse).collect()
+}
+
+fn cache_to_string(cache: &ProbeCache) -> String {
+    let mut s = String::new();
+    for ((devnum, diskseq), uuid) in cache {
+        s.push_str(&format!(
+            "{}:{} {} {}\n",
+            libc::major(*devnum),
+            libc::minor(*devnum),
+            diskseq,
+            uuid.map_or("-".to_string(), |u| u.to_string())
+        ));
+    }
+    s
+}
+
+fn cache_read() -> ProbeCache {
+    fs::read_to_string(CACHE_PATH).map_or_else(|_| ProbeCache::new(), |s| cache_parse(&s))
+}
+
+fn cache_write(cache: &ProbeCache) -> std::io::Result<()> {
+    let path = Path::new(CACHE_PATH);
+    // Concurrent scans each write their own file; the last rename wins:
+    let tmp = path.with_extension(format!("tmp.{}", std::process::id()));
+
+    fs::create_dir_all(path.parent().unwrap())?;
+
+    let ret = fs::write(&tmp, cache_to_string(cache)).and_then(|_| fs::rename(&tmp, path));
+    if ret.is_err() {
+        let _ = fs::remove_file(&tmp);
+    }
+    ret
+}
+
+/// Probes `devs` for bcachefs superblocks, returning the filesystem UUID of
+/// each.
+pub fn probe_devices(devs: &[String]) -> Vec<Option<Uuid>> {
+    probe_parallel(&devs.iter().map(String::as_str).collect::<Vec<_>>())
+}
+
+/// Like [`probe_devices`], for a scan of every block device on the system:
+/// with `use_cache`, results from the last scan are used for devices that
+/// haven't changed since. A device newly formatted in place won't be seen, so
+/// callers that come up short should retry without.
+pub fn scan_devices(devs: &[BlockDev], use_cache: bool) -> Vec<Option<Uuid>> {
+    let mut cache = if use_cache {
+        cache_read()
+    } else {
+        ProbeCache::new()
+    };
+
+    let mut ret = vec![None; devs.len()];
+    let mut to_probe = Vec::new();
+
+    for (i, dev) in devs.iter().enumerate() {
+        match dev.cache_key().and_then(|k| cache.get(&k)) {
+            Some(uuid) => ret[i] = *uuid,
+            None => to_probe.push(i),
+        }
+    }
+
+    debug!(
+        "probing {} of {} block devices for bcachefs superblocks",
+        to_probe.len(),
+        devs.len()
+    );
+
+    let probed = probe_parallel(
+        &to_probe
+            .iter()
+            .map(|&i| devs[i].devnode.as_str())
+            .collect::<Vec<_>>(),
+    );
+
+    for (i, uuid) in to_probe.into_iter().zip(probed) {
+        ret[i] = uuid;
+    }
+
+    // Only keep entries for devices that still exist:
+    cache.clear();
+    for (dev, uuid) in devs.iter().zip(&ret) {
+        if let Some(k) = dev.cache_key() {
+            cache.insert(k, *uuid);
+        }
+    }
+
+    if let Err(e) = cache_write(&cache) {
+        debug!("error writing {}: {}", CACHE_PATH, e);
+    }
+
+    ret
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    const USER_UUID: Uuid = Uuid::from_u128(0x0123_4567_89ab_cdef_fedc_ba98_7654_3210);
+
+    /// An in-memory device:
+    struct Image(Vec<u8>);
+
+    impl FileExt for Image {
+        fn read_at(&self, buf: &mut [u8], offset: u64) -> std::io::Result<usize> {
+            let src = self.0.get(offset as usize..).unwrap_or_default();
+            let n = buf.len().min(src.len());
+            buf[..n].copy_from_slice(&src[..n]);
+            Ok(n)
+        }
+
+        fn write_at(&self, _buf: &[u8], _offset: u64) -> std::io::Result<usize> {
+            unimplemented!()
+        }
+    }
+
+    /// An image with just a superblock layout and the start of a superblock at
+    /// each of `sb_offsets`, as `bcachefs format` would write them:
+    fn image_with_backups(sb_offsets: &[u64]) -> Image {
+        let mut buf = vec![0u8; 32 * SECTOR_SIZE as usize];
+
+        let layout = (BCH_SB_LAYOUT_SECTOR * SECTOR_SIZE) as usize;
+        buf[layout + LAYOUT_MAGIC..][..16].copy_from_slice(BCHFS_MAGIC.as_bytes());
+        buf[layout + LAYOUT_NR_SUPERBLOCKS] = sb_offsets.len() as u8;
+
+        for (i, offset) in sb_offsets.iter().enumerate() {
+            buf[layout + LAYOUT_SB_OFFSET + i * 8..][..8].copy_from_slice(&offset.to_le_bytes());
+
+            let sb = (offset * SECTOR_SIZE) as usize;
+            buf[sb + SB_MAGIC..][..16].copy_from_slice(BCHFS_MAGIC.as_bytes());
+            buf[sb + SB_USER_UUID..][..16].copy_from_slice(USER_UUID.as_bytes());
+        }
+        Image(buf)
+    }
+
+    fn image(sb_offset: u64) -> Image {
+        image_with_backups(&[sb_offset])
+    }
+
+    #[test]
+    fn magic_bytes() {
+        assert_eq!(
+            BCHFS_MAGIC.as_bytes(),
+            &[
+                0xc6, 0x85, 0x73, 0xf6, 0x66, 0xce, 0x90, 0xa9, 0xd9, 0x6a, 0x60, 0xcf, 0x80, 0x3d,
+                0xf7, 0xef,
+            ]
+        );
+    }
+
+    #[test]
+    fn probe_default_offset() {
+        assert_eq!(probe_dev(&image(BCH_SB_SECTOR)), Some(USER_UUID));
+    }
+
+    #[test]
+    fn probe_moved_offset() {
+        assert_eq!(probe_dev(&image(16)), Some(USER_UUID));
+    }
+
+    #[test]
+    fn probe_damaged_primary() {
+        let mut img = image_with_backups(&[BCH_SB_SECTOR, 24]);
+        let primary = (BCH_SB_SECTOR * SECTOR_SIZE) as usize;
+        img.0[primary..][..SECTOR_SIZE as usize].fill(0);
+        assert_eq!(probe_dev(&img), Some(USER_UUID));
+
+        // No intact superblock left:
+        img.0[(24 * SECTOR_SIZE) as usize..].fill(0);
+        assert_eq!(probe_dev(&img), None);
+    }
+
+    #[test]
+    fn probe_not_bcachefs() {
+        assert_eq!(probe_dev(&Image(vec![0; 32 * SECTOR_SIZE as usize])), None);
+    }
+
+    #[test]
+    fn probe_too_short() {
+        let mut img = image(BCH_SB_SECTOR);
+        img.0.truncate(4 * SECTOR_SIZE as usize);
+        assert_eq!(probe_dev(&img), None);
+
+        // Layout readable, superblock past the end of the device:
+        let mut img = image(16);
+        img.0.truncate(16 * SECTOR_SIZE as usize);
+        assert_eq!(probe_dev(&img), None);
+    }
+
+    #[test]
+    fn cache_roundtrip() {
+        let cache = ProbeCache::from([
+            ((libc::makedev(8, 0), 1), Some(USER_UUID)),
+            ((libc::makedev(259, 3), 42), None),
+        ]);
+
+        assert_eq!(cache_parse(&cache_to_string(&cache)), cache);
+    }
+
+    #[test]
+    fn cache_parse_skips_malformed() {
+        let cache = cache_parse(
+            "8:0 1 -\n\
+             garbage\n\
+             8:1 x -\n\
+             8:2 2 not-a-uuid\n\
+             8:3\n",
+        );
+
+        assert_eq!(cache, ProbeCache::from([((libc::makedev(8, 0), 1), None)]));
+    }
+}
@@ -0,0 +1,160 @@
+//! `bcachefs fusemount` directory listing: readdirplus on a populated
+//! directory must return every entry, with the attributes stat() returns on
+//! the source tree.
+//!
+//! These format an image and mount it with FUSE, so they only run with
+//! `cargo test --features fuse -- --ignored`.
+
+#![cfg(feature = "fuse")]
+
+use std::{
+    collections::BTreeMap,
+    fs::{self, File},
+    os::unix::fs::{MetadataExt, PermissionsExt},
+    path::{Path, PathBuf},
+    process::{Child, Command, Stdio},
+    thread,
+    time::Duration,
+};
+
+fn bcachefs(args: &[&str]) {
+    let out = Command::new(env!("CARGO_BIN_EXE_bcachefs"))
+        .args(args)
+        .output()
+        .expect("error running bcachefs");
+
+    assert!(
+        out.status.success(),
+        "bcachefs {:?} failed:\n{}",
+        args,
+        String::from_utf8_lossy(&out.stderr)
+    );
+}
+
+fn test_path(name: &str) -> PathBuf {
+    std::env::temp_dir().join(format!("bcachefs-test-{}-{}", name, std::process::id()))
+}
+
+fn is_mounted(dir: &Path) -> bool {
+    let dir = dir.to_str().unwrap();
+
+    fs::read_to_string("/proc/self/mounts")
+        .unwrap()
+        .lines()
+        .any(|l| l.split(' ').nth(1) == Some(dir))
+}
+
+struct Mount {
+    src:   PathBuf,
+    img:   PathBuf,
+    dir:   PathBuf,
+    child: Option<Child>,
+}
+
+impl Mount {
+    /// Formats an image from the directory `populate` fills in, and mounts it
+    fn new(name: &str, populate: impl FnOnce(&Path)) -> Self {
+        let mut m = Mount {
+            src:   test_path(&format!("{}-src", name)),
+            img:   test_path(&format!("{}.img", name)),
+            dir:   test_path(&format!("{}-mnt", name)),
+            child: None,
+        };
+
+        fs::create_dir(&m.src).unwrap();
+        fs::create_dir(&m.dir).unwrap();
+        populate(&m.src);
+
+        File::create(&m.img).unwrap().set_len(1 << 30).unwrap();
+        bcachefs(&[
+            "format",
+            "-q",
+            "--source",
+            m.src.to_str().unwrap(),
+            m.img.to_str().unwrap(),
+        ]);
+
+        m.child = Some(
+            Command::new(env!("CARGO_BIN_EXE_bcachefs"))
+                .args([
+                    "fusemount",
+                    m.img.to_str().unwrap(),
+                    m.dir.to_str().unwrap(),
+                ])
+                .stdout(Stdio::null())
+                .spawn()
+                .expect("error running bcachefs fusemount"),
+        );
+
+        for _ in 0..100 {
+            if is_mounted(&m.dir) {
+                return m;
+            }
+            if let Some(status) = m.child.as_mut().unwrap().try_wait().unwrap() {
+                panic!("bcachefs fusemount exited: {}", status);
+            }
+            thread::sleep(Duration::from_millis(100));
+        }
+        panic!("timed out waiting for {:?} to be mounted", m.dir);
+    }
+}
+
+impl Drop for Mount {
+    fn drop(&mut self) {
+        if let Some(mut child) = self.child.take() {
+            let _ = Command::new("fusermount3")
+                .arg("-u")
+                .arg(&self.dir)
+                .status();
+            let _ = child.kill();
+            let _ = child.wait();
+        }
+        let _ = fs::remove_dir(&self.dir);
+        let _ = fs::remove_file(&self.img);
+        let _ = fs::remove_dir_all(&self.src);
+    }
+}
+
+/// (mode, size, nlink) of each entry in a directory, by name; directory
+/// sizes and link counts are filesystem specific, so they're left out
+fn list(dir: &Path) -> BTreeMap<String, (u32, u64, u64)> {
+    fs::read_dir(dir)
+        .unwrap()
+        .filter(|e| e.as_ref().unwrap().file_name() != "lost+found")
+        .map(|e| {
+            let e = e.unwrap();
+            let m = e.metadata().unwrap();
+
+            (
+                e.file_name().into_string().unwrap(),
+                if m.is_dir() {
+                    (m.mode(), 0, 0)
+                } else {
+                    (m.mode(), m.size(), m.nlink())
+                },
+            )
+        })
+        .collect()
+}
+
+#[test]
+#[ignore = "formats and mounts a filesystem image"]
+fn readdirplus_lists_populated_dir() {
+    let m = Mount::new("fusemount-readdirplus", |src| {
+        // Enough entries that listing takes more than one readdirplus reply:
+        for i in 0..500 {
+            fs::write(src.join(format!("file-{:04}", i)), vec![b'x'; i]).unwrap();
+        }
+        fs::create_dir(src.join("subdir")).unwrap();
+        fs::write(src.join("subdir/inner"), b"inner").unwrap();
+
+        let exe = src.join("exe");
+        fs::write(&exe, b"#!/bin/sh\n").unwrap();
+        fs::set_permissions(&exe, fs::Permissions::from_mode(0o755)).unwrap();
+    });
+
+    let expected = list(&m.src);
+    assert_eq!(expected.len(), 502);
+    assert_eq!(list(&m.dir), expected);
+    assert_eq!(list(&m.dir.join("subdir")), list(&m.src.join("subdir")));
+}
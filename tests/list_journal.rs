@@ -0,0 +1,119 @@
+//! `bcachefs list_journal` output modes, on a freshly formatted image: JSON
+//! output must be valid JSON, and streaming mode must print the same entries
+//! as reading the journal in first.
+//!
+//! These format a (sparse) image, so they only run with
+//! `cargo test -- --ignored`.
+
+use std::{collections::BTreeSet, fs::File, path::PathBuf, process::Command};
+
+use serde_json::Value;
+
+fn bcachefs(args: &[&str]) -> Vec<u8> {
+    let out = Command::new(env!("CARGO_BIN_EXE_bcachefs"))
+        .args(args)
+        .output()
+        .expect("error running bcachefs");
+
+    assert!(
+        out.status.success(),
+        "bcachefs {:?} failed:\n{}",
+        args,
+        String::from_utf8_lossy(&out.stderr)
+    );
+    out.stdout
+}
+
+struct Image(PathBuf);
+
+impl Image {
+    fn new(name: &str) -> Self {
+        let path =
+            std::env::temp_dir().join(format!("bcachefs-test-{}-{}.img", name, std::process::id()));
+
+        File::create(&path).unwrap().set_len(1 << 30).unwrap();
+        bcachefs(&["format", "-q", path.to_str().unwrap()]);
+        Image(path)
+    }
+
+    fn list_journal(&self, args: &[&str]) -> Vec<Value> {
+        let mut a = vec!["list_journal", "-j"];
+        a.extend_from_slice(args);
+        a.push(self.0.to_str().unwrap());
+
+        let out = String::from_utf8(bcachefs(&a)).expect("JSON output isn't UTF-8");
+
+        // Opening the filesystem may log to stdout too:
+        out.lines()
+            .filter(|l| l.starts_with('{'))
+            .map(|l| {
+                serde_json::from_str(l).unwrap_or_else(|e| panic!("invalid JSON: {}: {}", e, l))
+            })
+            .collect()
+    }
+}
+
+impl Drop for Image {
+    fn drop(&mut self) {
+        let _ = std::fs::remove_file(&self.0);
+    }
+}
+
+fn seqs(entries: &[Value]) -> BTreeSet<u64> {
+    entries
+        .iter()
+        .map(|e| {
+            e["seq"]
+                .as_u64()
+                .unwrap_or_else(|| panic!("journal entry without seq: {}", e))
+        })
+        .collect()
+}
+
+#[test]
+#[ignore = "formats a filesystem image"]
+fn json_entries_well_formed() {
+    let img = Image::new("list-journal-json");
+
+    for args in [&[][..], &["-s"], &["-a"], &["-a", "-s"]] {
+        let entries = img.list_journal(args);
+        assert!(!entries.is_empty(), "no journal entries with {:?}", args);
+
+        for e in &entries {
+            let seq = e["seq"].as_u64();
+            assert!(
+                e["last_seq"].as_u64().is_some_and(|l| Some(l) <= seq),
+                "{}",
+                e
+            );
+            assert!(e["flush"].is_boolean(), "{}", e);
+            assert!(e["ptrs"].as_array().is_some_and(|p| !p.is_empty()), "{}", e);
+
+            let jset_entries = e["entries"]
+                .as_array()
+                .unwrap_or_else(|| panic!("journal entry without entries: {}", e));
+            for i in jset_entries {
+                assert!(i["type"].is_string(), "{}", i);
+                assert!(i["text"].is_string(), "{}", i);
+            }
+        }
+    }
+}
+
+#[test]
+#[ignore = "formats a filesystem image"]
+fn stream_matches_read() {
+    let img = Image::new("list-journal-stream");
+
+    let dirty = seqs(&img.list_journal(&[]));
+    assert_eq!(dirty, seqs(&img.list_journal(&["-s"])));
+
+    // -a includes entries older than last_seq:
+    let all = seqs(&img.list_journal(&["-a", "-s"]));
+    assert!(all.is_superset(&dirty));
+
+    let newest = *dirty.last().unwrap();
+    for args in [&["-n", "1"][..], &["-n", "1", "-s"]] {
+        assert_eq!(seqs(&img.list_journal(args)), BTreeSet::from([newest]));
+    }
+}